@@ -0,0 +1,212 @@
+// Compares the CPU cost of sending a file over TLS the way SSLServer does by default (reading it into userspace and
+// encrypting it with OpenSSL) against sending it with sendfile after the kernel has taken over encryption.
+// Usage: bench_ktls [megabytes]
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+	constexpr size_t CHUNK_SIZE = 1 << 18;
+
+	struct Result {
+		size_t bytes = 0;
+		double cpuSeconds = 0;
+		double wallSeconds = 0;
+		bool offloaded = false;
+	};
+
+	double getThreadCPUTime() {
+		timespec spec {};
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &spec);
+		return double(spec.tv_sec) + double(spec.tv_nsec) / 1e9;
+	}
+
+	void check(bool condition, const char *what) {
+		if (!condition) {
+			ERR_print_errors_fp(stderr);
+			throw std::runtime_error(what);
+		}
+	}
+
+	/** Makes a throwaway self-signed certificate. */
+	std::pair<EVP_PKEY *, X509 *> makeCertificate() {
+		EVP_PKEY *key = EVP_EC_gen("P-256");
+		check(key != nullptr, "Couldn't generate key");
+		X509 *x509 = X509_new();
+		check(x509 != nullptr, "Couldn't create certificate");
+		ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+		X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+		X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+		X509_set_pubkey(x509, key);
+		X509_NAME *name = X509_get_subject_name(x509);
+		X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char *>("localhost"), -1, -1, 0);
+		X509_set_issuer_name(x509, name);
+		check(X509_sign(x509, key, EVP_sha256()) != 0, "Couldn't sign certificate");
+		return {key, x509};
+	}
+
+	/** Returns a connected pair of TCP sockets. The kernel only does TLS on TCP sockets, so a socketpair won't do. */
+	std::pair<int, int> connectLoopback() {
+		const int listener = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in address {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t length = sizeof(address);
+		check(bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0, "bind failed");
+		check(listen(listener, 1) == 0, "listen failed");
+		check(getsockname(listener, reinterpret_cast<sockaddr *>(&address), &length) == 0, "getsockname failed");
+		const int client = socket(AF_INET, SOCK_STREAM, 0);
+		check(connect(client, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0, "connect failed");
+		const int server = accept(listener, nullptr, nullptr);
+		check(server != -1, "accept failed");
+		close(listener);
+		return {server, client};
+	}
+
+	Result run(EVP_PKEY *key, X509 *x509, int file, size_t size, bool kernel) {
+		std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)> server_context(SSL_CTX_new(TLS_server_method()), SSL_CTX_free);
+		std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)> client_context(SSL_CTX_new(TLS_client_method()), SSL_CTX_free);
+		check(server_context && client_context, "Couldn't create contexts");
+		check(SSL_CTX_use_certificate(server_context.get(), x509) == 1, "Couldn't use certificate");
+		check(SSL_CTX_use_PrivateKey(server_context.get(), key) == 1, "Couldn't use key");
+		// Both modes use the same cipher so that only the place the encryption happens differs.
+		SSL_CTX_set_ciphersuites(server_context.get(), "TLS_AES_128_GCM_SHA256");
+		if (kernel) {
+			SSL_CTX_set_options(server_context.get(), SSL_OP_ENABLE_KTLS);
+		}
+
+		auto [server_socket, client_socket] = connectLoopback();
+
+		std::thread client_thread([&, client_socket = client_socket] {
+			SSL *ssl = SSL_new(client_context.get());
+			SSL_set_fd(ssl, client_socket);
+			if (SSL_connect(ssl) == 1) {
+				std::vector<char> buffer(CHUNK_SIZE);
+				size_t received = 0;
+				while (received < size) {
+					const int count = SSL_read(ssl, buffer.data(), int(buffer.size()));
+					if (count <= 0) {
+						break;
+					}
+					received += size_t(count);
+				}
+			}
+			SSL_free(ssl);
+			close(client_socket);
+		});
+
+		Result result;
+		SSL *ssl = SSL_new(server_context.get());
+		SSL_set_fd(ssl, server_socket);
+
+		if (SSL_accept(ssl) == 1) {
+			result.offloaded = BIO_get_ktls_send(SSL_get_wbio(ssl));
+
+			if (kernel && !result.offloaded) {
+				// Let the client finish by sending nothing and closing.
+				SSL_free(ssl);
+				close(server_socket);
+				client_thread.join();
+				return result;
+			}
+
+			const double cpu_start = getThreadCPUTime();
+			const auto wall_start = std::chrono::steady_clock::now();
+
+			if (kernel) {
+				off_t offset = 0;
+				while (size_t(offset) < size) {
+					const ssize_t sent = sendfile(server_socket, file, &offset, size - size_t(offset));
+					if (sent <= 0) {
+						break;
+					}
+				}
+				result.bytes = size_t(offset);
+			} else {
+				std::vector<char> buffer(CHUNK_SIZE);
+				while (result.bytes < size) {
+					const ssize_t count = pread(file, buffer.data(), std::min(buffer.size(), size - result.bytes), off_t(result.bytes));
+					if (count <= 0 || SSL_write(ssl, buffer.data(), int(count)) <= 0) {
+						break;
+					}
+					result.bytes += size_t(count);
+				}
+			}
+
+			result.cpuSeconds = getThreadCPUTime() - cpu_start;
+			result.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+		}
+
+		client_thread.join();
+		SSL_free(ssl);
+		close(server_socket);
+		return result;
+	}
+
+	void report(const char *name, const Result &result) {
+		std::cout << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(1)
+		          << std::setw(10) << result.bytes / result.cpuSeconds / 1e6 << " MB/s per core"
+		          << std::setw(10) << result.bytes / result.wallSeconds / 1e6 << " MB/s wall\n";
+	}
+}
+
+int main(int argc, char **argv) {
+	const size_t size = (1 < argc? std::stoul(argv[1]) : 1024) << 20;
+
+	char path[] = "/tmp/bench_ktls.XXXXXX";
+	const int file = mkstemp(path);
+	if (file == -1) {
+		std::cerr << "Couldn't create a temporary file\n";
+		return EXIT_FAILURE;
+	}
+	unlink(path);
+
+	const std::string block(1 << 20, 'x');
+	for (size_t written = 0; written < size; written += block.size()) {
+		if (write(file, block.data(), block.size()) != ssize_t(block.size())) {
+			std::cerr << "Couldn't fill the temporary file\n";
+			return EXIT_FAILURE;
+		}
+	}
+
+	try {
+		auto [key, x509] = makeCertificate();
+
+		report("userspace", run(key, x509, file, size, false));
+
+		const Result kernel = run(key, x509, file, size, true);
+		if (kernel.offloaded) {
+			report("kernel", kernel);
+		} else {
+			std::cout << "kernel: unavailable (is the tls module loaded?)\n";
+		}
+
+		X509_free(x509);
+		EVP_PKEY_free(key);
+	} catch (const std::exception &err) {
+		std::cerr << err.what() << '\n';
+		return EXIT_FAILURE;
+	}
+
+	close(file);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,65 @@
+// Compares unmasking WebSocket payloads in place with applyMask against the byte-by-byte loop it replaced.
+// Usage: bench_mask [megabytes]
+
+#include "util/Mask.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+namespace {
+	/** The previous unmasking loop, which appended each byte to the message as it went. */
+	void legacyUnmask(std::string &packet, std::string_view payload, uint32_t mask) {
+		uint32_t mask_offset = 0;
+		packet.reserve(payload.size());
+		for (uint64_t i = 0; i < payload.size(); ++i) {
+			packet += char(payload[i] ^ uint8_t(mask >> (8 * (3 - mask_offset))));
+			mask_offset = (mask_offset + 1) % 4;
+		}
+	}
+
+	template <typename Fn>
+	double measure(Fn &&fn) {
+		const auto start = std::chrono::steady_clock::now();
+		fn();
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	void report(const char *name, size_t frame_size, size_t total, double seconds) {
+		std::cout << std::left << std::setw(10) << name << std::right << std::setw(10) << frame_size << " B frames"
+		          << std::setw(12) << std::fixed << std::setprecision(2) << total / seconds / 1e9 << " GB/s\n";
+	}
+}
+
+int main(int argc, char **argv) {
+	const size_t total = (1 < argc? std::stoul(argv[1]) : 256) << 20;
+	const uint32_t mask = 0x37fa213d;
+
+	for (const size_t frame_size: {size_t(125), size_t(64) << 10, size_t(4) << 20}) {
+		const std::string payload(frame_size, 'x');
+		const size_t frames = total / frame_size;
+
+		std::string packet;
+		report("legacy", frame_size, frames * frame_size, measure([&] {
+			for (size_t i = 0; i < frames; ++i) {
+				packet.clear();
+				legacyUnmask(packet, payload, mask);
+			}
+		}));
+
+		packet = payload;
+		report("applyMask", frame_size, frames * frame_size, measure([&] {
+			for (size_t i = 0; i < frames; ++i) {
+				Algiz::applyMask(packet.data(), packet.size(), mask);
+			}
+		}));
+
+		if (packet.empty()) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
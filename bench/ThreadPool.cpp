@@ -0,0 +1,191 @@
+// Compares the work-stealing ThreadPool against the mutex-and-condition-variable pool it replaced.
+// Usage: bench_threadpool [threads] [jobs]
+
+#include "threading/MTQueue.h"
+#include "threading/ThreadPool.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+	/** The previous ThreadPool implementation, kept here verbatim for comparison. */
+	class LegacyThreadPool {
+		public:
+			using Function = std::function<void(LegacyThreadPool &, size_t)>;
+
+			LegacyThreadPool(size_t size_): size(size_) { pool.reserve(size); }
+			~LegacyThreadPool() { join(); }
+
+			void start() {
+				if (joining || active.exchange(true)) {
+					return;
+				}
+
+				for (size_t thread_index = 0; thread_index < size; ++thread_index) {
+					pool.emplace_back([this, thread_index] {
+						size_t last_jobs_done = jobsDone.load();
+						while (active) {
+							{
+								std::unique_lock lock(workMutex);
+								workCV.wait(lock, [this, &last_jobs_done] {
+									return joining.load() || newJobReady.load() || last_jobs_done < jobsDone;
+								});
+							}
+							if (joining) {
+								break;
+							}
+							if (auto job = workQueue.tryTake()) {
+								newJobReady = false;
+								(*job)(*this, thread_index);
+								last_jobs_done = ++jobsDone;
+								workCV.notify_one();
+							} else {
+								last_jobs_done = jobsDone;
+							}
+						}
+					});
+				}
+			}
+
+			void join() {
+				if (active.exchange(false) && !joining.exchange(true)) {
+					workQueue.clear();
+					workCV.notify_all();
+					for (std::thread &thread: pool) {
+						thread.join();
+					}
+					pool.clear();
+					joining = false;
+				}
+			}
+
+			bool add(const Function &function) {
+				if (active) {
+					workQueue.push(function);
+					newJobReady = true;
+					workCV.notify_one();
+					return true;
+				}
+
+				return false;
+			}
+
+		private:
+			const size_t size;
+			Algiz::MTQueue<Function> workQueue;
+			std::condition_variable workCV;
+			std::mutex workMutex;
+			std::vector<std::thread> pool;
+			std::atomic_bool active = false;
+			std::atomic_bool joining = false;
+			std::atomic_bool newJobReady = false;
+			std::atomic_size_t jobsDone = 0;
+	};
+
+	/** Counts finished jobs and lets the benchmark thread wait for a target. */
+	struct Latch {
+		std::atomic_size_t done = 0;
+
+		void arrive() {
+			++done;
+			done.notify_one();
+		}
+
+		void wait(size_t target) {
+			for (size_t seen = done.load(); seen < target; seen = done.load()) {
+				done.wait(seen);
+			}
+		}
+	};
+
+	/** A little work per job so the numbers aren't purely queue overhead. */
+	void spin(size_t iterations) {
+		volatile size_t sink = 0;
+		for (size_t i = 0; i < iterations; ++i) {
+			sink = sink + i;
+		}
+	}
+
+	template <typename Fn>
+	double measure(Fn &&fn) {
+		const auto start = std::chrono::steady_clock::now();
+		fn();
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	void report(const char *pool_name, const char *scenario, size_t jobs, double seconds) {
+		std::cout << std::left << std::setw(14) << pool_name << std::setw(10) << scenario << std::right
+		          << std::setw(12) << std::fixed << std::setprecision(1) << jobs / seconds / 1000. << " kjobs/s  ("
+		          << std::setprecision(3) << seconds * 1000. << " ms)\n";
+	}
+
+	/** Every job is submitted from the benchmark thread. */
+	template <typename Pool>
+	double runExternal(size_t threads, size_t jobs, size_t work) {
+		Pool pool(threads);
+		pool.start();
+		Latch latch;
+		const double seconds = measure([&] {
+			for (size_t i = 0; i < jobs; ++i) {
+				pool.add([&latch, work](auto &, size_t) {
+					spin(work);
+					latch.arrive();
+				});
+			}
+			latch.wait(jobs);
+		});
+		pool.join();
+		return seconds;
+	}
+
+	/** One job per thread is submitted from outside, and each of those submits the rest from inside the pool. */
+	template <typename Pool>
+	double runNested(size_t threads, size_t jobs, size_t work) {
+		Pool pool(threads);
+		pool.start();
+		Latch latch;
+		const size_t per_root = jobs / threads;
+		const double seconds = measure([&] {
+			for (size_t root = 0; root < threads; ++root) {
+				pool.add([&latch, per_root, work](auto &inner, size_t) {
+					for (size_t i = 0; i < per_root; ++i) {
+						inner.add([&latch, work](auto &, size_t) {
+							spin(work);
+							latch.arrive();
+						});
+					}
+				});
+			}
+			latch.wait(per_root * threads);
+		});
+		pool.join();
+		return seconds;
+	}
+}
+
+int main(int argc, char **argv) {
+	const size_t threads = 1 < argc? std::stoul(argv[1]) : std::max(1u, std::thread::hardware_concurrency());
+	const size_t jobs = 2 < argc? std::stoul(argv[2]) : 200'000;
+
+	std::cout << threads << " threads, " << jobs << " jobs\n";
+
+	for (const size_t work: {0, 1000}) {
+		std::cout << "\n" << work << " iterations of work per job\n";
+		report("legacy", "external", jobs, runExternal<LegacyThreadPool>(threads, jobs, work));
+		report("stealing", "external", jobs, runExternal<Algiz::ThreadPool>(threads, jobs, work));
+		report("legacy", "nested", jobs, runNested<LegacyThreadPool>(threads, jobs, work));
+		report("stealing", "nested", jobs, runNested<Algiz::ThreadPool>(threads, jobs, work));
+	}
+
+	return EXIT_SUCCESS;
+}
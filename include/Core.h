@@ -3,6 +3,7 @@
 #include <memory>
 #include <vector>
 
+#include "EventLoop.h"
 #include "nlohmann/json.hpp"
 
 namespace Algiz {
@@ -10,19 +11,25 @@ namespace Algiz {
 	class SSLServer;
 
 	constexpr size_t DEFAULT_THREAD_COUNT = 8;
+	constexpr size_t DEFAULT_IDLE_TIMEOUT = 30;
 
 	class Core {
 		public:
 			Core() = default;
+			~Core();
 
 			void run(nlohmann::json &);
 
+			/** Runs periodic background work, such as rotating TLS session ticket keys. Started by run(). */
+			EventLoop & getEventLoop() { return eventLoop; }
+
 			const auto & getServers() const { return servers; }
 
 			std::shared_ptr<SSLServer> getSSLServer() const;
 
 		private:
 			std::vector<ApplicationServer *> servers;
+			EventLoop eventLoop;
 	};
 
 }
@@ -1,41 +1,57 @@
 #pragma once
 
+#include "util/TimingWheel.h"
+
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <functional>
-#include <map>
+#include <limits>
 #include <mutex>
 #include <thread>
 
 namespace Algiz {
+	/** Runs actions at scheduled times on a dedicated thread. Actions are kept in a timing wheel, so scheduling and
+	 *  cancelling take constant time no matter how many actions are waiting. */
 	class EventLoop {
 		public:
 			using Action = std::move_only_function<void()>;
+			using Handle = TimingWheel::Handle;
+
+			/** Actions run within about this long after the time they were scheduled for. */
+			static constexpr std::chrono::milliseconds RESOLUTION{10};
 
 			EventLoop();
 
 			void start();
 			void stop();
-			/** Returns whether the action was scheduled. Scheduling fails if the loop is stopping or not running. */
-			bool schedule(std::chrono::system_clock::time_point, Action);
+			bool isRunning() const { return running; }
+			/** Returns a handle that can be used to cancel the action, or an empty handle if the loop is stopping or not
+			 *  running. */
+			Handle schedule(std::chrono::system_clock::time_point, Action);
+			/** Returns false if the action already ran or was cancelled. */
+			bool cancel(Handle);
 
 			template <typename D>
-			bool delay(D duration, Action action) {
+			Handle delay(D duration, Action action) {
 				return schedule(std::chrono::system_clock::now() + duration, std::move(action));
 			}
 
 		private:
 			std::thread thread;
-			std::multimap<std::chrono::system_clock::time_point, Action> actions;
-			std::mutex actionsMutex;
+			TimingWheel wheel;
+			/** Guards the wheel. */
+			std::mutex mutex;
 			std::condition_variable cv;
-			std::mutex cvMutex;
+			std::chrono::steady_clock::time_point epoch;
 			std::atomic_bool stopping = false;
 			bool running = false;
+			/** The tick the loop is sleeping until, or UINT64_MAX if it's waiting for something to be scheduled. Guarded
+			 *  by the mutex. */
+			uint64_t wakeTick = std::numeric_limits<uint64_t>::max();
 
+			/** Returns the number of ticks between the loop's epoch and a point in time, rounded up. */
+			uint64_t getTick(std::chrono::steady_clock::time_point) const;
 			void loop();
-			void awaitNewAction();
-			void awaitNextAction(std::chrono::system_clock::time_point);
 	};
 }
@@ -1,66 +1,116 @@
 #pragma once
 
-#include <iostream>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
 #include <mutex>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 namespace Algiz {
-	struct Logger {
-		std::mutex mutex;
-
-		template <typename T>
-		Logger & operator<<(const T &object) {
-			std::cerr << object;
-			return *this;
-		}
-
-		Logger & operator<<(std::ostream & (*fn)(std::ostream &)) {
-			fn(std::cerr);
-			return *this;
-		}
-
-		Logger & operator<<(std::ostream & (*fn)(std::ios &)) {
-			fn(std::cerr);
-			return *this;
-		}
-
-		Logger & operator<<(std::ostream & (*fn)(std::ios_base &)) {
-			fn(std::cerr);
-			return *this;
-		}
-
-		static std::string getTimestamp();
+	class SPSCRing;
+
+	enum class LogLevel: uint8_t {Info, Warn, Error, Spam, Success, Raw};
+
+	/** An asynchronous logger. Each thread queues its messages in a lock-free ring of its own, and a background thread
+	 *  drains the rings and writes everything out in batches. Logging never blocks: if a thread's ring is full, the
+	 *  message is dropped and counted instead. */
+	class Logger {
+		public:
+			/** The sink that writes to standard error. */
+			static constexpr size_t CONSOLE = 0;
+			/** The number of bytes of messages each thread can have queued at once. */
+			static constexpr size_t RING_SIZE = 1 << 18;
+
+			Logger();
+			Logger(const Logger &) = delete;
+			Logger(Logger &&) = delete;
+
+			~Logger();
+
+			Logger & operator=(const Logger &) = delete;
+			Logger & operator=(Logger &&) = delete;
+
+			/** Returns an empty stream for formatting a message on the current thread. */
+			static std::ostringstream & getStream();
+			/** Queues the contents of a stream from getStream() for the console and empties the stream. */
+			void submit(LogLevel, std::ostringstream &);
+			/** Queues a line for a sink. Raw lines are written as they are, followed by a newline. */
+			void write(size_t sink, LogLevel, std::string_view);
+			/** Opens a file sink that's appended to. If max_bytes is nonzero, the file is rotated before a write would take
+			 *  it past that size, and up to `keep` old files are kept (path.1 being the newest). Returns the sink's ID.
+			 *  Throws std::runtime_error if the file can't be opened. */
+			size_t openFile(const std::filesystem::path &, size_t max_bytes = 0, size_t keep = 5);
+			/** Closes a file sink once everything already queued for it has been written. */
+			void closeFile(size_t sink);
+			/** Waits until everything queued before the call has been written. Don't call this on a worker thread. */
+			void flush();
+			[[nodiscard]] size_t getDropped() const { return dropped; }
+
+			static std::string getTimestamp();
+
+		private:
+			struct Sink {
+				int descriptor = -1;
+				std::filesystem::path path;
+				size_t maxBytes = 0;
+				size_t keep = 0;
+				size_t size = 0;
+				bool closing = false;
+			};
+
+			std::vector<std::shared_ptr<SPSCRing>> rings;
+			std::mutex ringsMutex;
+			/** Only touched by the drain thread, apart from additions and closeFile's flag. Lock sinksMutex before
+			 *  using. */
+			std::vector<std::unique_ptr<Sink>> sinks;
+			std::mutex sinksMutex;
+
+			std::thread thread;
+			std::mutex wakeMutex;
+			std::condition_variable wakeCV;
+			std::condition_variable flushCV;
+			std::atomic_bool sleeping = false;
+			std::atomic_bool stopping = false;
+			uint64_t flushRequested = 0;
+			uint64_t flushCompleted = 0;
+
+			std::atomic_size_t dropped = 0;
+			size_t droppedReported = 0;
+
+			/** Records popped by the drain thread, along with their timestamps. Kept between passes for their capacity. */
+			std::vector<std::string> records;
+			std::vector<std::array<char, 8>> timestamps;
+			/** The drain thread's cached timestamp for the current second. */
+			int64_t cachedSecond = -1;
+			std::array<char, 8> cachedTimestamp{};
+
+			SPSCRing & getRing();
+			void loop();
+			/** Writes out up to a batch of records from each ring. Returns the number of records written and sets
+			 *  `exhausted` if every ring was emptied. */
+			size_t drain(bool &exhausted);
+			/** Formats a time as HH:MM:SS, calling strftime at most once per second. */
+			const std::array<char, 8> & formatTimestamp(int64_t second);
+			void rotate(Sink &);
 	};
 
 	extern Logger log;
 }
 
-#define INFO(message) \
-	do { std::unique_lock lock(Algiz::log.mutex); \
-	     ::Algiz::log << "\e[2m[\e[1m" << ::Algiz::Logger::getTimestamp() \
-	                  << "\e[22;2m]\e[22m (\e[22;1;34mi\e[22;39m)\e[2m ::\e[22m " \
-	                  << message << std::endl; } while (false)
-
-#define WARN(message) \
-	do { std::unique_lock lock(Algiz::log.mutex); \
-	     ::Algiz::log << "\e[2m[\e[1m" << ::Algiz::Logger::getTimestamp() \
-	                  << "\e[22;2m]\e[22m (\e[22;1;33m!\e[22;39m)\e[2m ::\e[22m " \
-	                  << message << std::endl; } while (false)
-
-#define ERROR(message) \
-	do { std::unique_lock lock(Algiz::log.mutex); \
-	     ::Algiz::log << "\e[2m[\e[1m" << ::Algiz::Logger::getTimestamp() \
-	                  << "\e[22;2m]\e[22m (\e[22;1;31m!\e[22;39m)\e[2m ::\e[22m " \
-	                  << message << std::endl; } while (false)
-
-#define SPAM(message) \
-	do { std::unique_lock lock(Algiz::log.mutex); \
-	     ::Algiz::log << "\e[2m[\e[1m" << ::Algiz::Logger::getTimestamp() \
-	                  << "\e[22;2m]\e[22m (\e[22;1;35m_\e[22;39m)\e[2m :: " \
-	                  << message << "\e[22m" << std::endl; } while (false)
-
-#define SUCCESS(message) \
-	do { std::unique_lock lock(Algiz::log.mutex); \
-	     ::Algiz::log << "\e[2m[\e[1m" << ::Algiz::Logger::getTimestamp() \
-	                  << "\e[22;2m]\e[22m (\e[22;1;32m🗸\e[22;39m)\e[2m :: " \
-	                  << message << "\e[22m" << std::endl; } while (false)
+#define ALGIZ_LOG(level, message) \
+	do { auto &algiz_log_stream_ = ::Algiz::Logger::getStream(); \
+	     algiz_log_stream_ << message; \
+	     ::Algiz::log.submit(level, algiz_log_stream_); } while (false)
+
+#define INFO(message)    ALGIZ_LOG(::Algiz::LogLevel::Info,    message)
+#define WARN(message)    ALGIZ_LOG(::Algiz::LogLevel::Warn,    message)
+#define ERROR(message)   ALGIZ_LOG(::Algiz::LogLevel::Error,   message)
+#define SPAM(message)    ALGIZ_LOG(::Algiz::LogLevel::Spam,    message)
+#define SUCCESS(message) ALGIZ_LOG(::Algiz::LogLevel::Success, message)
@@ -4,4 +4,6 @@
 
 namespace Algiz {
 	constexpr size_t POST_MAX = 1 << 24;
+	/** The maximum size of a request line plus headers. */
+	constexpr size_t HEAD_MAX = 1 << 16;
 }
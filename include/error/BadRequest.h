@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+namespace Algiz {
+	struct BadRequest: std::runtime_error {
+		explicit BadRequest(const std::string &message): std::runtime_error(message) {}
+	};
+}
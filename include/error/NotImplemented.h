@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+namespace Algiz {
+	struct NotImplemented: std::runtime_error {
+		explicit NotImplemented(const std::string &message): std::runtime_error(message) {}
+	};
+}
@@ -4,15 +4,20 @@
 #include <cstdint>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <unordered_set>
 
 #include "http/Request.h"
+#include "http/WebSocketDeflate.h"
 #include "net/GenericClient.h"
+#include "net/Server.h"
 #include "util/StringVector.h"
 
 namespace Algiz::HTTP {
+	class Response;
 	class Server;
 
 	enum class WebSocketMessageType {Invalid, Binary, Text};
@@ -23,14 +28,67 @@ namespace Algiz::HTTP {
 
 		private:
 			bool awaitingWebSocketHeader = true;
-			bool lastFin = false;
+			/** The current frame's masking key in wire order. */
 			uint32_t webSocketMask = 0;
-			uint32_t maskOffset = 0;
-			uint64_t remainingBytesInPacket = 0;
+			/** The position within the masking key of the current frame's next byte. */
+			size_t maskOffset = 0;
+			/** The number of payload bytes of the current frame that haven't been read yet. */
+			uint64_t frameRemaining = 0;
+			uint8_t frameOpcode = 0;
+			bool frameFin = false;
+			bool inControlFrame = false;
+			/** Set between the first and last frames of a fragmented message. */
+			bool assemblingMessage = false;
+			/** The message being assembled. It's sized for each frame as the frame's header arrives. */
 			std::string packet;
+			/** Whether the message being assembled was compressed with permessage-deflate. */
+			bool packetCompressed = false;
+			/** The decompressed form of the last compressed message. */
+			std::string inflatedPacket;
+			/** Keeps messages compressed with the shared deflate context going out in the order they were compressed. */
+			std::mutex deflateMutex;
+			/** The payload of the current control frame, which may arrive between the fragments of a message. */
+			std::string controlPacket;
+			/** WebSocket frames that arrived along with the handshake. */
 			std::string leftoverMessage;
+			/** Set while the current request is being handled on the server's handler pool. */
+			bool busy = false;
+			/** Input that arrived while busy. It's handled once the current request is done. */
+			std::string deferredInput;
+			/** Fires if a request head takes too long to arrive. */
+			Algiz::Server::TimerHandle headerTimer;
+			Algiz::Server::TimerHandle pingTimer;
+			/** Set when a ping is sent and cleared when anything at all comes back. */
+			bool awaitingPong = false;
+			/** The opcode of the WebSocket message being assembled. */
+			uint8_t packetOpcode = 0;
 
 			void handleRequest();
+			/** Hands the current request to the server's handler pool if it has one. Returns false if the request should be
+			 *  handled right away instead. */
+			bool offloadRequest();
+			/** Called on the connection's worker thread once the handler pool is done with a request. */
+			void finishOffloadedRequest();
+			void startHeaderTimer();
+			void cancelHeaderTimer();
+			/** Drops a client that's been sending its request head for too long, e.g. one byte at a time. */
+			void onHeaderTimeout();
+			void schedulePing();
+			/** Pings a WebSocket client, or drops it if it didn't respond to the previous ping. */
+			void ping();
+			/** Passes a complete WebSocket message to the handlers. */
+			void deliverPacket(std::string_view);
+			/** Parses and removes a WebSocket frame header from the input buffer. Returns false if the header is
+			 *  incomplete or invalid; in the latter case, the connection is closed. */
+			bool readFrameHeader(evbuffer *);
+			/** Acts on a frame whose payload has been read. Returns false if the connection is closing. */
+			bool finishFrame();
+			/** Decides whether the connection should stay open after the request that was just parsed. */
+			void updateKeepAlive();
+			/** Sends a single unfragmented frame. The first byte holds the opcode and the RSV bits. */
+			void sendFrame(uint8_t first_byte, std::string_view payload);
+
+			[[nodiscard]] auto lockDeflate() { return std::unique_lock(deflateMutex); }
 
 		public:
 			Request request {*this};
@@ -38,11 +96,25 @@ namespace Algiz::HTTP {
 			bool isWebSocket = false;
 			StringVector webSocketPath;
 			size_t maxWebSocketPacketLength = 1 << 24;
+			/** Set during the handshake if the client and server agreed on permessage-deflate. */
+			std::unique_ptr<WebSocketDeflate> webSocketDeflate;
+			/** Whether the connection will be kept open after the current response. */
 			bool keepAlive = true;
+			/** Whether the current request was made with HTTP/1.0, which needs persistence to be spelled out. */
+			bool legacyVersion = false;
+			/** The number of requests received on this connection so far. */
+			size_t requestCount = 0;
+			/** Set while a HEAD request is being handled. Responses sent through send(Response) lose their bodies and
+			 *  streams are dropped. */
+			bool headersOnly = false;
+			/** The status code and body size of the response to the current request, for access logs. Set by
+			 *  send(Response), sendHead and noteResponse. */
+			int responseStatus = 0;
+			size_t responseBytes = 0;
 
 			Client() = delete;
 			Client(HTTP::Server &server_, int id_, std::string_view ip_):
-				GenericClient(id_, ip_, true, 8192), server(server_) {}
+				GenericClient(id_, ip_, false), server(server_) {}
 			Client(const Client &) = delete;
 			Client(Client &&) = delete;
 
@@ -53,14 +125,39 @@ namespace Algiz::HTTP {
 
 			void send(std::string_view);
 			void send(const std::string &);
+			/** Sends a response with a Connection header that matches whether the connection will be kept alive. */
+			void send(Response);
+			/** Sets a response's Connection header according to whether the connection will be kept alive. */
+			Response & prepare(Response &) const;
+			/** Prepares a response and sends only its status line and headers, e.g. before sending its body as a file. */
+			void sendHead(Response &);
+			/** Records the status and body size of a response that was sent without going through send(Response) or
+			 *  sendHead. */
+			void noteResponse(int status, size_t bytes);
+			/** Writes the headers that vary between requests (Date and Connection) and the blank line that ends the head.
+			 *  Completes a head produced by Response::staticHead. */
+			void writeDynamicHeaders(evbuffer *) const;
+			/** Streams an incrementally generated response. See Algiz::Server::stream. */
+			void stream(Algiz::Server::Producer);
+			/** Called once a response has been sent. Closes the connection unless it's being kept alive. */
 			void close();
 			void handleInput(std::string_view) override;
+			void handleBuffer(evbuffer *) override;
 			void sendWebSocket(std::string_view, bool is_binary = false, uint8_t opcode_override = 255);
 			void closeWebSocket();
+			/** Starts pinging the client periodically once it has switched to WebSockets. */
+			void startPinging();
 			void onMaxLineSizeExceeded() override;
 			void removeSelf();
 			std::string getID() const;
 
+			/** Server frames aren't masked, so their headers are at most this long. */
+			static constexpr size_t MAX_FRAME_HEADER_SIZE = 10;
+
+			/** Writes the header of an unfragmented server frame and returns its size. The first byte holds the opcode
+			 *  and the RSV bits. */
+			static size_t encodeFrameHeader(uint8_t (&header)[MAX_FRAME_HEADER_SIZE], uint8_t first_byte, size_t payload_size);
+
 			static std::unordered_set<std::string> supportedMethods;
 	};
 }
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace Algiz::HTTP {
+	/** Stores a request's headers as offsets into a single buffer, which holds the raw request head. Header names are
+	 *  lowercased in place, so no per-header strings are allocated. Lookups are linear, which beats a tree for the
+	 *  dozen or so headers a typical request has. */
+	class HeaderMap {
+		public:
+			using Header = std::pair<std::string_view, std::string_view>;
+
+		private:
+			struct Entry {
+				uint32_t nameOffset = 0;
+				uint32_t nameLength = 0;
+				uint32_t valueOffset = 0;
+				uint32_t valueLength = 0;
+				/** Whether the value lives in `merged` rather than in `raw`. */
+				bool isMerged = false;
+			};
+
+			/** The raw bytes of the request head. */
+			std::string raw;
+			/** Values of headers that appeared more than once, joined with spaces. */
+			std::string merged;
+			std::vector<Entry> entries;
+
+			Header resolve(const Entry &) const;
+
+		public:
+			class const_iterator {
+				private:
+					const HeaderMap *map = nullptr;
+					size_t index = 0;
+					Header current;
+
+					void load() {
+						if (index < map->entries.size()) {
+							current = map->resolve(map->entries[index]);
+						}
+					}
+
+				public:
+					using iterator_category = std::forward_iterator_tag;
+					using value_type = Header;
+					using difference_type = std::ptrdiff_t;
+					using pointer = const value_type *;
+					using reference = const value_type &;
+
+					const_iterator() = default;
+					const_iterator(const HeaderMap &map_, size_t index_): map(&map_), index(index_) { load(); }
+
+					reference operator*() const { return current; }
+					pointer operator->() const { return &current; }
+					const_iterator & operator++() { ++index; load(); return *this; }
+					const_iterator operator++(int) { auto copy = *this; ++*this; return copy; }
+					bool operator==(const const_iterator &other) const { return index == other.index; }
+			};
+
+			/** Appends bytes of the request head to the buffer and returns the offset at which they start. */
+			size_t append(std::string_view);
+			[[nodiscard]] std::string_view getRaw() const { return raw; }
+
+			/** Registers a header whose name and value are already in the buffer. The name is lowercased in place. If the
+			 *  header is already present, the new value is appended to the old one with a space in between. */
+			void add(size_t name_offset, size_t name_length, size_t value_offset, size_t value_length);
+			/** Copies a header into the buffer and registers it. */
+			void add(std::string_view name, std::string_view value);
+
+			/** Expects a lowercase name. */
+			[[nodiscard]] const_iterator find(std::string_view name) const;
+			/** Expects a lowercase name. */
+			[[nodiscard]] bool contains(std::string_view name) const { return find(name) != end(); }
+			/** Expects a lowercase name. Throws std::out_of_range if the header is missing. */
+			[[nodiscard]] std::string_view at(std::string_view name) const;
+			/** Expects a lowercase name. Returns an empty view if the header is missing. */
+			[[nodiscard]] std::string_view get(std::string_view name) const;
+
+			[[nodiscard]] const_iterator begin() const { return {*this, 0}; }
+			[[nodiscard]] const_iterator end() const { return {*this, entries.size()}; }
+			[[nodiscard]] size_t size() const { return entries.size(); }
+			[[nodiscard]] bool empty() const { return entries.empty(); }
+
+			/** Forgets all headers but keeps the buffers' capacity for the next request. */
+			void clear();
+	};
+}
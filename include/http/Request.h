@@ -1,13 +1,18 @@
 #pragma once
 
+#include <ctime>
 #include <format>
 #include <map>
 #include <string>
 #include <tuple>
 #include <vector>
 
+#include "http/HeaderMap.h"
+
 namespace Algiz::HTTP {
 	enum class AuthenticationResult {Invalid, Missing, Malformed, BadUsername, BadPassword, Success};
+	/** The outcome of evaluating a request's conditional headers. NotModified calls for a 304 and Failed for a 412. */
+	enum class PreconditionResult {Passed, NotModified, Failed};
 
 	class Client;
 
@@ -19,6 +24,15 @@ namespace Algiz::HTTP {
 
 			size_t contentLength = 0;
 			size_t lengthRemaining = 0;
+			/** The offset in the head buffer at which the line currently being read starts. */
+			size_t lineStart = 0;
+			bool hasContentLength = false;
+			/** Chunked bodies aren't supported, so a request with a Transfer-Encoding header is refused instead of being
+			 *  framed by its Content-Length, which a proxy in front of the server might disagree with. */
+			bool hasTransferEncoding = false;
+
+			/** Parses a complete line of the request head. Returns true if the line was the blank line that ends it. */
+			bool parseLine(size_t offset, size_t length);
 
 			void parseRange(std::string_view);
 
@@ -33,14 +47,12 @@ namespace Algiz::HTTP {
 
 		public:
 			enum class Method {Invalid, GET, HEAD, PUT, POST};
-			enum class HandleResult {Continue, DisableLineMode, Done};
-
 			Method method = Method::Invalid;
 			std::string path;
 			std::string version;
 			std::string content;
 			std::string charset;
-			std::map<std::string, std::string> headers;
+			HeaderMap headers;
 			std::map<std::string, std::string> parameters;
 			std::map<std::string, std::string> postParameters;
 			std::vector<std::tuple<size_t, size_t>> ranges;
@@ -48,13 +60,38 @@ namespace Algiz::HTTP {
 
 			Request() = delete;
 			Request(HTTP::Client &client_): client(client_) {}
-
-			HandleResult handleLine(std::string_view);
+			Request(const Request &) = default;
+			Request(Request &&) = default;
+
+			/** Takes everything but the client from another request for the same client. */
+			Request & operator=(Request &&);
+
+			/** Consumes as much of the given bytes as belongs to the current request and returns how many were consumed.
+			 *  Sets `done` once the request is complete. Bytes after the end of the request are left for the next one. */
+			size_t feed(std::string_view, bool &done);
+			/** Returns whether part of a request head has arrived but not all of it. */
+			[[nodiscard]] bool isReadingHead() const { return mode != Mode::Content && !headers.getRaw().empty(); }
+			/** HEAD requests go through the GET handlers. Handlers can use this to skip generating a body. */
+			[[nodiscard]] bool isHead() const { return method == Method::HEAD; }
 			bool valid(size_t total_size);
 			bool hackRanges();
 			AuthenticationResult checkAuthentication(std::string_view username, std::string_view password) const;
-			std::string_view getHeader(const std::string &name) const;
+			/** Expects a lowercase name. */
+			std::string_view getHeader(std::string_view name) const;
+			/** Returns the quality value the client's Accept-Encoding header gives a content coding, or 0 if the coding
+			 *  isn't acceptable. Without an Accept-Encoding header, only identity is acceptable. */
+			double getEncodingQuality(std::string_view coding) const;
+			/** Evaluates If-Match, If-Unmodified-Since, If-None-Match and If-Modified-Since against the current state of
+			 *  the selected representation, in the order RFC 9110 section 13.2.2 prescribes. */
+			PreconditionResult evaluatePreconditions(std::string_view etag, time_t modified) const;
+			/** Returns whether a Range header should be honored given the request's If-Range header, if any. */
+			bool ifRangeMatches(std::string_view etag, time_t modified) const;
+			/** Returns whether an If-Match or If-None-Match field value matches an entity tag. Weak comparison ignores
+			 *  W/ prefixes, while strong comparison never matches weak tags. */
+			static bool matchesETag(std::string_view field, std::string_view etag, bool weak);
 			std::string pathWithParameters() const;
+			/** Clears everything parsed so far so the next request on a persistent connection starts fresh. */
+			void reset();
 	};
 }
 
@@ -4,12 +4,20 @@
 #include <string>
 #include <variant>
 
+#include <event2/buffer.h>
+
 namespace Algiz::HTTP {
 	class Response {
 		private:
-			static std::map<int, std::string> codeDescriptions;
-
-			static std::string generate500();
+			/** Calls `append` with each piece of the status line and headers in order. If `complete` is false, the Date
+			 *  and Connection headers and the blank line that ends the head are left out. */
+			template <typename Fn>
+			void emitHead(Fn &&append, bool complete = true) const;
+			/** Returns whether the status code has a known status line. Responses with other codes are replaced by
+			 *  generate500() when they're written. */
+			bool hasValidCode() const;
+			/** Returns the complete response that's sent in place of one with an unknown status code. */
+			static Response generate500();
 
 		public:
 			int code;
@@ -18,6 +26,9 @@ namespace Algiz::HTTP {
 			std::string charset;
 			std::map<std::string, std::string> headers;
 			bool noContentType = false;
+			/** Leaves out the Content-Length header that would otherwise describe the content, e.g. for a HEAD response
+			 *  whose length isn't known without generating the body. */
+			bool noContentLength = false;
 
 			Response(int code, std::string content, std::string_view mime = "text/html");
 			Response(int code, std::string_view content, std::string_view mime = "text/html");
@@ -29,6 +40,7 @@ namespace Algiz::HTTP {
 			Response & setHeader(const std::string &header, std::string value);
 			Response & setClose(bool = true);
 			Response & setNoContentType(bool = true);
+			Response & setNoContentLength(bool = true);
 			Response & setAcceptRanges(bool = true);
 			Response & setLastModified(time_t);
 
@@ -37,7 +49,19 @@ namespace Algiz::HTTP {
 			std::string & operator[](const std::string &);
 			const std::string & operator[](const std::string &) const;
 
+			/** Appends the status line and headers to an evbuffer in a single reservation. */
+			void writeHead(evbuffer *) const;
+			/** Appends the whole response to an evbuffer. Large string bodies are handed to the evbuffer by reference
+			 *  instead of being copied, so the head and body go out as separate chains. */
+			void serialize(evbuffer *) &&;
+
 			operator std::string() const;
 			[[nodiscard]] std::string noContent() const;
+			/** Returns the status line and every header except Date and Connection, without the blank line that ends the
+			 *  head. Meant for responses that are cached and sent many times; see HTTP::Client::writeDynamicHeaders. */
+			[[nodiscard]] std::string staticHead() const;
+
+			/** Returns the full status line (including the CRLF) for a status code, or an empty view for unknown codes. */
+			static std::string_view getStatusLine(int code);
 	};
 }
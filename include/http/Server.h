@@ -2,19 +2,26 @@
 
 #include "ApplicationServer.h"
 #include "http/Request.h"
+#include "http/WebSocketDeflate.h"
 #include "net/Server.h"
 #include "nlohmann/json.hpp"
 #include "plugins/PluginHost.h"
+#include "threading/ThreadPool.h"
 #include "util/FS.h"
 #include "util/StringVector.h"
 #include "util/WeakCompare.h"
 #include "wahtwo/Watcher.h"
 
+#include <array>
+#include <chrono>
 #include <filesystem>
 #include <functional>
 #include <map>
 #include <optional>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 namespace Algiz::HTTP {
 	class Client;
@@ -59,6 +66,17 @@ namespace Algiz::HTTP {
 					message(message) {}
 			};
 
+			/** Describes a request that has been handled. */
+			struct AccessArgs {
+				Server &server;
+				Client &client;
+				const Request &request;
+				/** When the request was fully received. */
+				std::chrono::system_clock::time_point received;
+				/** How long the handlers took. */
+				std::chrono::steady_clock::duration elapsed;
+			};
+
 			using MessageHandler = PreFn<WebSocketMessageArgs &>;
 			using MessageHandlerPtr = std::shared_ptr<MessageHandler>;
 			using WeakMessageHandlerPtr = std::weak_ptr<MessageHandler>;
@@ -71,17 +89,40 @@ namespace Algiz::HTTP {
 			using CloseHandlerPtr = std::shared_ptr<CloseHandler>;
 			using WeakCloseHandlerPtr = std::weak_ptr<CloseHandler>;
 
+			using AccessHandler = std::function<void(const AccessArgs &)>;
+			using AccessHandlerPtr = std::shared_ptr<AccessHandler>;
+			using WeakAccessHandlerPtr = std::weak_ptr<AccessHandler>;
+
+			using Subscribers = std::vector<Algiz::Server::Recipient>;
+
+			using FileChangeHandler = std::function<void(const std::filesystem::path &)>;
+			using FileChangeHandlerPtr = std::shared_ptr<FileChangeHandler>;
+			using WeakFileChangeHandlerPtr = std::weak_ptr<FileChangeHandler>;
+
 		private:
+			/** Handlers for each WebSocket client. Lock webSocketHandlersMutex before using. */
 			std::map<int, std::list<WeakMessageHandlerPtr>> webSocketMessageHandlers;
 			std::map<int, std::list<WeakCloseHandlerPtr>> webSocketCloseHandlers;
+			std::mutex webSocketHandlersMutex;
 			std::optional<Wahtwo::Watcher> watcher;
 			std::thread watcherThread;
 			std::mutex configsMutex;
+			std::mutex fileChangeHandlersMutex;
+			/** Each topic's subscribers. A list is replaced rather than modified whenever it changes, so publishers can
+			 *  use it without holding the lock. Lock topicsMutex before using. */
+			std::unordered_map<std::string, std::shared_ptr<const Subscribers>> topics;
+			/** The topics each client is subscribed to. Lock topicsMutex before using. */
+			std::unordered_map<int, std::unordered_set<std::string>> topicsByClient;
+			std::mutex topicsMutex;
 			bool dying = false;
 
 			[[nodiscard]] static std::filesystem::path getWebRoot(const std::string &);
 			[[nodiscard]] static bool validatePath(const std::string_view &);
 			[[nodiscard]] static std::vector<std::string> getParts(std::string_view);
+			[[nodiscard]] static bool isWebSocketUpgrade(const Request &);
+			/** Expects topicsMutex to be locked. Doesn't touch topicsByClient. Returns false if the client wasn't
+			 *  subscribed to the topic. */
+			bool removeSubscriber(int client_id, const std::string &topic);
 
 		public:
 			std::shared_ptr<Algiz::Server> server;
@@ -90,7 +131,31 @@ namespace Algiz::HTTP {
 			std::list<WeakPrePtr<HandlerArgs &>> getHandlers;
 			std::list<WeakPrePtr<HandlerArgs &>> postHandlers;
 			std::list<WeakConnectionHandlerPtr> webSocketConnectionHandlers;
+			/** Called after each request has been handled, on the thread that handled it. Like the other handler lists,
+			 *  this should only be changed while plugins are being loaded or unloaded, which holds lockHandlers(). */
+			std::list<WeakAccessHandlerPtr> accessHandlers;
 			std::map<std::filesystem::path, nlohmann::json> configs;
+			/** Called from the watcher thread whenever something under the web root is modified.
+			 *  Lock fileChangeHandlersMutex before using. */
+			std::list<WeakFileChangeHandlerPtr> fileChangeHandlers;
+			/** The number of requests a client can make on one connection before it's closed. 0 means no limit. */
+			size_t maxRequestsPerConnection = 100;
+			/** The number of seconds a client has to finish sending a request head once it has started. 0 means no limit. */
+			size_t headerTimeout = 10;
+			/** The number of seconds between pings to WebSocket clients. A client that doesn't send anything between two
+			 *  pings is dropped. 0 disables pinging. */
+			size_t webSocketPingInterval = 30;
+			/** Whether and how permessage-deflate is offered to WebSocket clients. Set with the "webSocketDeflate" option,
+			 *  which is either a boolean or an object with the same fields as the Config. */
+			WebSocketDeflate::Config webSocketDeflate;
+			/** If present, GET, HEAD and POST handlers run on this pool instead of on the connection's worker thread, so a
+			 *  slow handler doesn't hold up the worker's other connections. Set with the "handlerThreads" option. */
+			std::unique_ptr<ThreadPool> handlerPool;
+			/** The default output backlog, in bytes, that a topic subscriber is allowed before its backpressure policy
+			 *  applies. */
+			static constexpr size_t DEFAULT_SUBSCRIBER_LIMIT = 1 << 22;
+			/** How long requests take to handle, indexed by Request::Method. */
+			std::array<Histogram *, 5> requestHistograms{};
 
 			Server() = delete;
 			Server(const Server &) = delete;
@@ -104,9 +169,15 @@ namespace Algiz::HTTP {
 
 			void run() override;
 			void stop() override;
-			void handleGET(Client &, const Request &);
-			void handlePOST(Client &, const Request &);
+			/** The request is moved into the handler arguments and moved back once the handlers are done. */
+			void handleGET(Client &, Request &);
+			/** The request is moved into the handler arguments and moved back once the handlers are done. */
+			void handlePOST(Client &, Request &);
+			/** Returns whether a request should be handled on the handler pool. WebSocket handshakes never are, because
+			 *  they register per-client handlers that the worker thread uses. */
+			[[nodiscard]] bool shouldOffload(const Request &) const;
 			void handleWebSocketMessage(Client &, std::string_view);
+			void handleAccess(Client &, const Request &, std::chrono::system_clock::time_point received, std::chrono::steady_clock::duration elapsed);
 			/** Doesn't send a close packet to the client; that should be done by the caller. */
 			void closeWebSocket(Client &);
 			void send400(Client &);
@@ -119,8 +190,27 @@ namespace Algiz::HTTP {
 			void cleanWebSocketCloseHandlers();
 			void registerWebSocketMessageHandler(const Client &, const WeakMessageHandlerPtr &);
 			void registerWebSocketCloseHandler(const Client &, const WeakCloseHandlerPtr &);
+			/** Subscribes a WebSocket client to a topic. Subscribing again replaces the backpressure policy. The limit is
+			 *  the number of bytes that can be waiting in the client's output buffer before the policy applies. */
+			void subscribe(const Client &, const std::string &topic,
+			               Algiz::Server::Backpressure = Algiz::Server::Backpressure::Disconnect,
+			               size_t limit = DEFAULT_SUBSCRIBER_LIMIT);
+			/** Returns false if the client wasn't subscribed to the topic. */
+			bool unsubscribe(const Client &, const std::string &topic);
+			/** Called automatically when a WebSocket connection closes. */
+			void unsubscribeAll(const Client &);
+			/** Unsubscribes every client from a topic. */
+			void removeTopic(const std::string &topic);
+			/** Sends a message to every subscriber of a topic. The frame is encoded once and appended to each subscriber's
+			 *  output by reference. It's never compressed, even for clients that negotiated permessage-deflate. Safe to
+			 *  call from any thread. Returns the number of subscribers it was sent to. */
+			size_t publish(const std::string &topic, std::string_view message, bool is_binary = false);
+			[[nodiscard]] size_t getSubscriberCount(const std::string &topic);
 
 			auto lockConfigs() { return std::unique_lock(configsMutex); }
+			auto lockTopics() { return std::unique_lock(topicsMutex); }
+			auto lockFileChangeHandlers() { return std::unique_lock(fileChangeHandlersMutex); }
+			auto lockWebSocketHandlers() { return std::unique_lock(webSocketHandlersMutex); }
 
 			template <typename T, typename N>
 			T & getOption(const N &name) {
@@ -181,6 +271,9 @@ namespace Algiz::HTTP {
 				return std::nullopt;
 			}
 
+		protected:
+			std::vector<const void *> getHandlerPointers() const override;
+
 		private:
 			void addConfig(const std::filesystem::path &);
 			static decltype(configs) crawlConfigs(const std::filesystem::path &base);
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+
+struct z_stream_s;
+
+namespace Algiz::HTTP {
+	/** Implements the permessage-deflate WebSocket extension (RFC 7692) for one connection. The zlib streams come from
+	 *  a process-wide pool and go back to it once the connection is done with them, so connections don't each pay for
+	 *  zlib's allocations. A stream without context takeover is only held while a message is being processed. */
+	class WebSocketDeflate {
+		public:
+			/** The server's preferences, set with the "webSocketDeflate" option. */
+			struct Config {
+				bool enabled = false;
+				/** The largest window the server will compress with. zlib can't produce raw deflate data with a window
+				 *  of 8 bits, so this is at least 9. */
+				int serverMaxWindowBits = 15;
+				/** The largest window the server asks clients to compress with. */
+				int clientMaxWindowBits = 15;
+				bool serverNoContextTakeover = false;
+				bool clientNoContextTakeover = false;
+				/** Messages smaller than this many bytes are sent uncompressed. */
+				size_t threshold = 128;
+				int level = 6;
+				int memLevel = 8;
+			};
+
+			/** The parameters agreed upon in a handshake. */
+			struct Parameters {
+				int serverMaxWindowBits = 15;
+				int clientMaxWindowBits = 15;
+				bool serverNoContextTakeover = false;
+				bool clientNoContextTakeover = false;
+				/** Whether the window sizes have to be spelled out in the response. */
+				bool sendServerMaxWindowBits = false;
+				bool sendClientMaxWindowBits = false;
+
+				/** Renders the parameters as the value of a Sec-WebSocket-Extensions response header. */
+				[[nodiscard]] std::string toString() const;
+			};
+
+			/** Picks the first acceptable permessage-deflate offer in the value of a Sec-WebSocket-Extensions request
+			 *  header. Returns nothing if there isn't one. */
+			static std::optional<Parameters> negotiate(std::string_view header, const Config &);
+
+			WebSocketDeflate(const Config &, const Parameters &);
+			WebSocketDeflate(const WebSocketDeflate &) = delete;
+			WebSocketDeflate(WebSocketDeflate &&) = delete;
+
+			~WebSocketDeflate();
+
+			WebSocketDeflate & operator=(const WebSocketDeflate &) = delete;
+			WebSocketDeflate & operator=(WebSocketDeflate &&) = delete;
+
+			/** Returns whether a message of the given size is worth compressing. */
+			[[nodiscard]] bool shouldCompress(size_t size) const { return threshold <= size; }
+
+			/** Compresses a message into `out`, without the empty block that ends each message on the wire. Throws
+			 *  std::runtime_error on failure. Not thread-safe. */
+			void compress(std::string_view, std::string &out);
+
+			/** Decompresses a message into `out`. Returns false if the data is corrupt or would inflate to more than
+			 *  `max_size` bytes. Not thread-safe. */
+			bool decompress(std::string_view, std::string &out, size_t max_size);
+
+		private:
+			Parameters parameters;
+			size_t threshold;
+			int level;
+			int memLevel;
+			/** Held for the life of the connection if context takeover is in effect for that direction. */
+			z_stream_s *deflater = nullptr;
+			z_stream_s *inflater = nullptr;
+
+			z_stream_s * getDeflater();
+			z_stream_s * getInflater();
+			/** Returns streams that don't carry context between messages to the pool. */
+			void finishDeflating(z_stream_s *);
+			void finishInflating(z_stream_s *);
+	};
+}
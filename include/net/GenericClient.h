@@ -3,6 +3,8 @@
 #include <cstddef>
 #include <string>
 
+struct evbuffer;
+
 namespace Algiz {
 	struct GenericClient {
 		int id = -1;
@@ -11,6 +13,9 @@ namespace Algiz {
 		size_t maxLineSize = -1;
 		/** If nonzero, don't read more than this many bytes at a time. The amount read will be subtracted from this. */
 		size_t maxRead = 0;
+		/** If set, handleBuffer is given the connection's input buffer instead of handleInput being given copies of its
+		 *  contents. Lets a client parse and remove exactly what it needs without copying anything twice. */
+		bool bufferMode = false;
 
 		GenericClient() = delete;
 		GenericClient(const GenericClient &) = delete;
@@ -24,6 +29,9 @@ namespace Algiz {
 		GenericClient & operator=(GenericClient &&) = delete;
 
 		virtual void handleInput(std::string_view) = 0;
+		/** Called in buffer mode whenever input arrives. Whatever the client leaves in the buffer is still there the next
+		 *  time this is called. */
+		virtual void handleBuffer(evbuffer *) {}
 		virtual void onMaxLineSizeExceeded() {}
 		virtual std::string describe();
 	};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include <openssl/ocsp.h>
+#include <openssl/ssl.h>
+
+#include "threading/ThreadPool.h"
+#include "util/Metrics.h"
+
+namespace Algiz {
+	class EventLoop;
+
+	/** Staples OCSP responses to handshakes so that clients don't have to ask the certificate authority themselves.
+	 *  Responses are fetched on a thread of the stapler's own, checked and cached in memory and on disk on the event
+	 *  loop's thread, and refreshed well before they expire. The status callback only ever reads the cached response,
+	 *  so handshakes never wait on a responder. */
+	class OCSPStapler: public std::enable_shared_from_this<OCSPStapler> {
+		public:
+			struct Options {
+				/** Where responses are cached between runs. Empty to disable the disk cache. */
+				std::filesystem::path cacheDirectory = "certs";
+				/** If nonempty, requests go to this URL instead of the one in each certificate, e.g. to test with a local
+				 *  responder such as `openssl ocsp -port`. */
+				std::string responder;
+				/** How long a request to a responder can take. */
+				std::chrono::seconds timeout{10};
+			};
+
+			OCSPStapler(const Options &, EventLoop &, int port);
+			OCSPStapler(const OCSPStapler &) = delete;
+			OCSPStapler(OCSPStapler &&) = delete;
+
+			OCSPStapler & operator=(const OCSPStapler &) = delete;
+			OCSPStapler & operator=(OCSPStapler &&) = delete;
+
+			/** Starts stapling responses for a context's certificate. The name (a hostname, or empty for the default
+			 *  context) is used for logging and for the disk cache. Returns false if the context's certificate can't be
+			 *  checked with OCSP, e.g. because its issuer isn't in the chain. */
+			bool add(const std::string &name, SSL_CTX *);
+
+		private:
+			struct Entry;
+
+			/** A response as it's sent to clients. */
+			struct Staple {
+				std::string der;
+				/** Seconds since the epoch after which the response can't be used anymore. */
+				int64_t expiry;
+			};
+
+			Options options;
+			EventLoop &loop;
+
+			Counter &refreshSuccesses;
+			Counter &refreshFailures;
+			Counter &staplesSent;
+
+			/** Fetches responses so that a slow responder can't hold up the event loop. */
+			ThreadPool pool{1};
+
+			/** Schedules an entry's next refresh. */
+			void schedule(const std::shared_ptr<Entry> &, std::chrono::seconds delay);
+			/** Has the pool fetch a fresh response for an entry, then handles the result on the event loop's thread and
+			 *  schedules the next refresh. Called on the event loop's thread. */
+			void refresh(const std::shared_ptr<Entry> &);
+			/** Stores and caches a fetched response if it's valid. Returns how long to wait until the next refresh. */
+			std::chrono::seconds handleResponse(Entry &, const std::string &der);
+			/** Logs a failed refresh and returns how long to wait before trying again. */
+			std::chrono::seconds handleFailure(Entry &, std::string_view reason);
+			/** Returns the response's expiry and how soon it should be refreshed if it's usable for the entry. */
+			bool validate(Entry &, const std::string &der, int64_t &expiry, std::chrono::seconds &refresh_after) const;
+			std::filesystem::path getCachePath(const Entry &) const;
+
+			/** Sends a DER-encoded request to a responder and returns the DER-encoded response. Blocks until the
+			 *  responder answers or the timeout passes. Throws std::runtime_error on failure. */
+			static std::string fetch(const std::string &url, const std::string &request, std::chrono::seconds timeout);
+			static int getIndex();
+			static int statusCallback(SSL *, void *);
+	};
+}
@@ -1,15 +1,17 @@
 #pragma once
 
 #include "net/Server.h"
-#include "net/Certificates.h"
+#include "net/OCSPStapler.h"
+#include "net/TLSSessions.h"
 #include "threading/Lockable.h"
 
+#include <atomic>
 #include <functional>
 #include <map>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#include <memory>
 #include <set>
-#include <shared_mutex>
 #include <string>
 #include <sys/types.h>
 #include <unordered_map>
@@ -28,8 +30,9 @@ namespace Algiz {
 			SSLServer & operator=(SSLServer &&) = delete;
 
 		public:
+			/** The context every connection starts with. It has to be fully configured before the server runs, because
+			 *  new SSL objects are made from it without any locking. */
 			SSL_CTX *sslContext = nullptr;
-			std::mutex sslContextMutex;
 
 			/** Maps descriptors to SSL pointers. */
 			std::map<int, SSL *> ssls;
@@ -38,11 +41,38 @@ namespace Algiz {
 			/** Maps descriptors to mutexes that need to be locked when using an SSL object. */
 			std::map<int, std::mutex> sslMutexes;
 
-			std::unordered_map<std::string, Certificates> certificatesMap;
-			std::shared_mutex certificatesMutex;
+			/** Maps hostnames to fully prepared contexts that connections switch to during SNI. */
+			using HostContexts = std::unordered_map<std::string, std::shared_ptr<SSL_CTX>>;
+
+			/** Replaced wholesale whenever a certificate is added so that handshakes can read it without locking. */
+			std::atomic<std::shared_ptr<const HostContexts>> hostContexts;
+			/** Serializes changes to hostContexts. */
+			std::mutex hostContextsMutex;
 
 			Lockable<std::function<void(const char *)>> requestCertificate;
 
+			/** Set by enableSessionResumption. */
+			std::shared_ptr<TLSSessions> sessions;
+
+			/** Lets clients resume earlier sessions instead of doing a full handshake every time they connect. */
+			void enableSessionResumption(const TLSSessions::Options &);
+
+			/** Set by enableOCSPStapling. */
+			std::shared_ptr<OCSPStapler> stapler;
+
+			/** Staples OCSP responses for the default certificate and every hostname's certificate, including ones
+			 *  added later. */
+			void enableOCSPStapling(const OCSPStapler::Options &);
+
+			/** Asks OpenSSL to hand encryption over to the kernel after each handshake. Connections for which the kernel
+			 *  takes over both directions are moved to a plain socket bufferevent, which lets files be sent with
+			 *  sendfile; the rest keep going through OpenSSL. Returns false if OpenSSL was built without kTLS. Must be
+			 *  called before the server runs. */
+			bool enableKernelTLS();
+
+			/** Prepares a context for a hostname and makes it available to new handshakes. Replaces any existing context
+			 *  for the hostname; connections already using the old one keep it until they close. Throws
+			 *  std::runtime_error if the certificate, chain or key can't be used. */
 			void addCertificate(std::string hostname, const std::string &certificate, const std::string &private_key, const std::string &rest_of_chain);
 
 			std::shared_ptr<Worker> makeWorker(size_t buffer_size, size_t id) override;
@@ -51,10 +81,30 @@ namespace Algiz {
 				public:
 					using Server::Worker::Worker;
 
-					void remove(bufferevent *) override;
+					void remove(Connection &) override;
 					void accept(int new_fd) override;
+
+					/** Moves a connection to a plain socket bufferevent if the kernel has taken over its encryption.
+					 *  Returns false (and leaves the connection alone) otherwise. */
+					bool offloadToKernel(Connection &, SSL *);
 			};
 
 			friend class Worker;
+
+		protected:
+			/** Unless the kernel is doing the encryption, files have to be encrypted in userspace, so they're streamed
+			 *  through a bounded window instead. */
+			bool canSendFilesDirectly(const Connection &connection) const override { return connection.kernelTLS; }
+
+			void onHandshake(Connection &) override;
+
+		private:
+			bool kernelTLS = false;
+			Counter *kernelTLSOffloaded = nullptr;
+			Counter *kernelTLSUnsupported = nullptr;
+
+			/** Makes a context for a hostname with the same protocol settings and session configuration as the base
+			 *  context. */
+			std::shared_ptr<SSL_CTX> makeHostContext(const std::string &certificate, const std::string &private_key, const std::string &rest_of_chain);
 	};
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <list>
 #include <map>
@@ -12,6 +14,7 @@
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
+#include <variant>
 #include <vector>
 
 #include <event2/bufferevent.h>
@@ -21,6 +24,10 @@
 #include <event2/event.h>
 
 #include "net/GenericClient.h"
+#include "net/SharedBuffer.h"
+#include "threading/SlabTable.h"
+#include "util/Metrics.h"
+#include "util/TimingWheel.h"
 
 namespace Algiz {
 	class Core;
@@ -30,8 +37,60 @@ namespace Algiz {
 	void conn_writecb(bufferevent *, void *);
 	void conn_eventcb(bufferevent *, short, void *);
 	void worker_acceptcb(evutil_socket_t, short, void *);
+	void worker_listener_cb(evconnlistener *, evutil_socket_t, sockaddr *, int socklen, void *);
+	void worker_taskcb(evutil_socket_t, short, void *);
+	void worker_tickcb(evutil_socket_t, short, void *);
 
 	class Server {
+		public:
+			/** Called when a client's output buffer has room for more data. A producer should append at most `budget`
+			 *  bytes to `chunk` and return false once it has nothing more to produce. */
+			using Producer = std::function<bool(std::string &chunk, size_t budget)>;
+			/** Work to be done on a worker's thread. */
+			using Task = std::move_only_function<void()>;
+			using TimerHandle = TimingWheel::Handle;
+
+			/** How often each worker advances its timing wheel. Timers fire within about this long of their deadlines. */
+			static constexpr std::chrono::milliseconds TIMER_RESOLUTION{100};
+
+			/** What a broadcast does for a recipient whose output has backed up past its limit. */
+			enum class Backpressure {
+				/** Queue the data anyway. */
+				Queue,
+				/** Skip the data for that recipient. */
+				Drop,
+				/** Drop the recipient's connection. */
+				Disconnect,
+			};
+
+			struct Recipient {
+				int client = -1;
+				Backpressure policy = Backpressure::Queue;
+				/** The number of bytes that can be waiting in the recipient's output buffer before its policy applies. */
+				size_t limit = 0;
+			};
+
+		protected:
+			/** A region of a file that hasn't been read into a client's output buffer yet. */
+			struct FileStream {
+				/** Owned by the FileStream. */
+				int descriptor = -1;
+				size_t offset = 0;
+				size_t remaining = 0;
+			};
+
+			/** Output that was serialized into an evbuffer ahead of time. */
+			using BufferPointer = std::unique_ptr<evbuffer, decltype(&evbuffer_free)>;
+
+			/** Data that has to wait until the streams queued before it have been flushed. */
+			using PendingOutput = std::variant<FileStream, std::string, Producer, BufferPointer>;
+
+			/** A recipient of a broadcast whose connection has already been looked up. */
+			struct Delivery;
+
+		public:
+			struct Connection;
+
 		protected:
 			class Worker: public std::enable_shared_from_this<Worker> {
 				public:
@@ -41,15 +100,13 @@ namespace Algiz {
 					event_base *base = nullptr;
 					size_t id;
 
-					/** Maps descriptors to read buffers. */
-					std::map<int, std::string> readBuffers;
-
-					std::unordered_set<bufferevent *> managedBufferEvents;
-
 					std::vector<int> acceptQueue;
 
 					std::unique_ptr<event, decltype(&event_free)> pipeIgnorer{nullptr, event_free};
 
+					/** The worker's own SO_REUSEPORT listener. Only used if Server::reusePort is set. */
+					std::unique_ptr<evconnlistener, decltype(&evconnlistener_free)> listener{nullptr, evconnlistener_free};
+
 					Worker(Server &server, size_t bufferSize, size_t id);
 
 					virtual ~Worker();
@@ -57,36 +114,120 @@ namespace Algiz {
 					void removeClient(int client);
 					void work(size_t id);
 					virtual void accept(int new_fd);
-					void handleWriteEmpty(bufferevent *);
-					void handleEOF(bufferevent *);
+					void handleWriteEmpty(Connection &);
+					void handleEOF(Connection &);
 					void stop();
 					void queueAccept(int new_fd);
+					/** Opens a listening socket with SO_REUSEPORT on the worker's event_base so the kernel can hand
+					 *  connections directly to this worker. */
+					void listen();
 					void queueClose(int client);
-					void queueClose(bufferevent *);
-					[[nodiscard]] auto lockReadBuffers() { return std::unique_lock(readMutex); }
+					void queueClose(Connection &);
+					/** Queues a task to run on the worker's thread after any tasks queued before it. Safe to call from any
+					 *  thread. */
+					void post(Task);
+					/** Like post, but leaves the task alone and returns false if the worker's event loop has already
+					 *  finished and would never run it. */
+					bool postIfRunning(Task &);
+					/** Runs the tasks that have been posted so far. Only called on the worker's thread. */
+					void runTasks();
+					/** Returns whether the calling thread is the one running this worker's event loop. */
+					[[nodiscard]] bool isCurrent() const;
+					/** Converts a duration to a number of timer ticks, rounding up. */
+					[[nodiscard]] static uint64_t toTicks(std::chrono::milliseconds);
 					[[nodiscard]] auto lockAcceptQueue() { return std::unique_lock(acceptQueueMutex); }
+					[[nodiscard]] auto lockTasks() { return std::unique_lock(tasksMutex); }
 
 					friend Server;
 					friend void conn_readcb(bufferevent *, void *);
 					friend void conn_writecb(bufferevent *, void *);
+					friend void conn_eventcb(bufferevent *, short, void *);
 					friend void worker_acceptcb(evutil_socket_t, short, void *);
+					friend void worker_listener_cb(evconnlistener *, evutil_socket_t, sockaddr *, int socklen, void *);
+					friend void worker_taskcb(evutil_socket_t, short, void *);
+					friend void worker_tickcb(evutil_socket_t, short, void *);
+
+				protected:
+					/** Claims a connection record for a newly accepted socket and attaches the worker's callbacks to its
+					 *  bufferevent. Returns the new client ID. */
+					int addConnection(int new_fd, bufferevent *, std::string_view ip);
+					/** Moves a connection to a new bufferevent for the same socket, carrying over any buffered input and
+					 *  output along with the watermarks and which directions are enabled. The old bufferevent is freed,
+					 *  so the caller has to make sure that freeing it won't close the socket. */
+					void replaceBufferEvent(Connection &, bufferevent *);
+					virtual void remove(Connection &);
 
 				private:
-					std::recursive_mutex readMutex;
+					/** The worker whose event loop is running on the current thread, if any. */
+					static thread_local const Worker *current;
+
 					std::recursive_mutex acceptQueueMutex;
-					std::recursive_mutex closeQueueMutex;
 
 					event *acceptEvent = nullptr;
 
-					std::unordered_set<bufferevent *> closeQueue;
+					/** Tasks posted from other threads. Lock tasksMutex before using. */
+					std::vector<Task> tasks;
+					/** Set once the worker's event loop has exited. Lock tasksMutex before using. */
+					bool finished = false;
+					std::mutex tasksMutex;
+					event *taskEvent = nullptr;
 
-					virtual void remove(bufferevent *);
-					void removeDescriptor(int);
-					void handleRead(bufferevent *);
+					/** Timers for the worker's connections. Only touched by the worker's thread. */
+					TimingWheel timers;
+					std::chrono::steady_clock::time_point timersEpoch;
+					event *tickEvent = nullptr;
 
-					[[nodiscard]] auto lockCloseQueue() { return std::unique_lock(closeQueueMutex); }
+					Gauge &connectionsGauge;
+					/** How long each call to handleRead takes. Its sum is how busy the worker has been with input. */
+					Histogram &readHistogram;
+					Counter &bytesInCounter;
+
+					void scheduleIdleCheck(Connection &, uint64_t delay);
+					/** Closes a connection if it has been idle for longer than its idle timeout. */
+					void checkIdle(int client_id);
+
+					void handleRead(Connection &);
+			};
+
+		public:
+			/** Everything the server knows about a single connection. Records are reused once a connection has been
+			 *  removed and every ConnectionRef to it has been dropped. */
+			struct Connection {
+				std::atomic_int id{-1};
+				int descriptor = -1;
+				bufferevent *bufferEvent = nullptr;
+				std::shared_ptr<Worker> worker;
+				std::unique_ptr<GenericClient> client;
+				/** Only touched by the connection's worker thread. */
+				std::string readBuffer;
+				/** Set if the connection should be closed once its output buffer is empty. */
+				std::atomic_bool closeQueued{false};
+				/** Set once removal has begun so that it only happens once. */
+				std::atomic_bool removing{false};
+				/** Output waiting to be pumped into the bufferevent. Lock pendingOutputsMutex before using. */
+				std::list<PendingOutput> pendingOutputs;
+				std::recursive_mutex pendingOutputsMutex;
+				/** Lets send() skip locking pendingOutputsMutex while nothing is being streamed. */
+				std::atomic_bool hasPendingOutput{false};
+				/** In seconds, or 0 for no timeout. This and the fields after it are only touched by the worker thread. */
+				size_t idleTimeout = 0;
+				/** The timer tick at which the client last sent anything. */
+				uint64_t lastActivity = 0;
+				TimerHandle idleTimer;
+				/** When the connection was accepted. */
+				std::chrono::steady_clock::time_point acceptedAt;
+				/** Set once the kernel has taken over the connection's TLS encryption. */
+				bool kernelTLS = false;
+
+				[[nodiscard]] auto lockPendingOutputs() { return std::unique_lock(pendingOutputsMutex); }
+
+				/** Frees the bufferevent and client and clears everything else for the record's next use. */
+				void reset();
 			};
 
+			using ConnectionRef = SlabTable<Connection>::Ref;
+
+		protected:
 			Core &core;
 			int af;
 			std::string ip;
@@ -103,6 +244,13 @@ namespace Algiz {
 
 			std::vector<std::shared_ptr<Worker>> workers;
 
+			Counter &acceptedCounter;
+			Counter &bytesOutCounter;
+			Counter &broadcastDroppedCounter;
+			Counter &broadcastDisconnectedCounter;
+			/** Set by servers whose connections start with a handshake, which ends with a BEV_EVENT_CONNECTED event. */
+			Histogram *handshakeHistogram = nullptr;
+
 			event_base *base = nullptr;
 			event *signalEvent = nullptr;
 
@@ -111,54 +259,75 @@ namespace Algiz {
 			sockaddr_in  name4{};
 			sockaddr_in6 name6{};
 
-			bool removeClient(int);
+			/** Returns whether file segments can be handed to the kernel as-is for a connection. Servers that have to
+			 *  transform data in userspace (e.g., to encrypt it) stream files through a bounded window instead. */
+			virtual bool canSendFilesDirectly(const Connection &) const { return true; }
 
-		public:
-			std::string id = "server";
+			/** Called on a connection's worker thread once the connection's handshake is done. */
+			virtual void onHandshake(Connection &) {}
 
-			/** Maps bufferevents to Workers. Lock workerMapMutex before using. */
-			std::map<bufferevent *, std::shared_ptr<Worker>> workerMap;
+			/** Moves as much pending output into a connection's output buffer as the stream window allows.
+			 *  Returns true if nothing remains pending for the connection. */
+			bool pump(Connection &);
 
-			/** Lock clientsMutex before using. l*/
-			int lastClient = -1;
+			/** Queues output for a connection behind anything already pending for it and tries to flush it. */
+			ssize_t enqueue(Connection &, PendingOutput &&);
 
-			/** Maps descriptors to client IDs. Lock clientsMutex before using. */
-			std::map<int, int> clients;
+			/** Appends broadcast data to the output of recipients that belong to the calling thread's worker. */
+			void deliver(std::vector<Delivery> &, const SharedBuffer::Ptr &);
 
-			/** Contains IDs that were previously used but are now available. Lock clientsMutex before using. */
-			std::unordered_set<int> freePool;
+		public:
+			std::string id = "server";
 
-			/** Maps client IDs to descriptors. Lock clientsMutex before using. */
-			std::map<int, int> descriptors;
+			/** All open connections, indexed by client ID. Lookups don't take any locks. */
+			SlabTable<Connection> connections;
 
-			/** Maps client IDs to client instances. Lock clientsMutex before using. */
-			std::map<int, std::unique_ptr<GenericClient>> allClients;
+			std::list<std::weak_ptr<std::function<bool(const std::string &ip, int fd)>>> ipFilters;
 
-			/** Maps descriptors to bufferevents. Lock descriptorsMutex before using. */
-			std::map<int, bufferevent *> bufferEvents;
+			/** If true, each worker accepts connections on its own SO_REUSEPORT socket instead of having them handed
+			 *  over from a single accept thread. Must be set before run() is called. */
+			bool reusePort = false;
 
-			/** Maps bufferevents to descriptors. Lock descriptorsMutex before using. */
-			std::map<bufferevent *, int> bufferEventDescriptors;
+			/** The number of seconds a connection can go without sending anything before it's closed. Connections that
+			 *  still have output to flush aren't considered idle. 0 disables the timeout. */
+			size_t idleTimeout = 0;
 
-			std::list<std::weak_ptr<std::function<bool(const std::string &ip, int fd)>>> ipFilters;
+			/** The number of bytes of a streamed file that will be buffered in memory at once for a single client. */
+			size_t streamWindow = 1 << 18;
 
-			std::recursive_mutex workerMapMutex;
-			std::recursive_mutex clientsMutex;
-			std::recursive_mutex descriptorsMutex;
+			/** Once a streaming client's output buffer drains below this many bytes, it's refilled up to streamWindow. */
+			size_t streamLowWatermark = 1 << 17;
 
 			void makeName();
 
+			/** Throws std::out_of_range if the client doesn't exist. */
 			int getDescriptor(int client);
-			bufferevent * getBufferEvent(int descriptor);
-
-			[[nodiscard]] auto lockWorkerMap() { return std::unique_lock(workerMapMutex); }
-			[[nodiscard]] auto lockDescriptors() { return std::unique_lock(descriptorsMutex); }
+			/** Returns an empty ConnectionRef if the client doesn't exist. */
+			ConnectionRef getConnection(int client);
+			/** Attaches a client instance to a connection. Returns false if the connection doesn't exist. */
+			bool setClient(int client_id, std::unique_ptr<GenericClient> &&);
+			/** Overrides idleTimeout for a single connection. 0 disables the timeout. */
+			bool setIdleTimeout(int client_id, size_t seconds);
+			/** Stops or resumes reading from a connection. Input that arrives meanwhile waits in the kernel. */
+			bool setReading(int client_id, bool reading);
+			/** Runs a task on a client's worker thread after a delay, unless the client is gone by then or the timer is
+			 *  cancelled. Must be called from the client's worker thread. Returns an empty handle if the client doesn't
+			 *  exist. */
+			TimerHandle schedule(int client_id, std::chrono::milliseconds delay, Task);
+			/** Must be called from the client's worker thread. Returns false if the timer already fired or was cancelled. */
+			bool cancel(int client_id, TimerHandle);
+			/** Runs a task on the thread of the worker that owns a connection. Returns false if the connection doesn't
+			 *  exist. Safe to call from any thread. */
+			bool post(int client_id, Task);
+			/** Like post(int, Task), but doesn't require the connection to be live. The caller should hold a
+			 *  ConnectionRef to it. */
+			void post(Connection &, Task);
 
 			/** (int client, std::string_view message) */
 			std::function<void(GenericClient &, std::string_view)> messageHandler;
-			/** clientsMutex will be locked while this is called. */
+			/** Called once when a connection is being removed, while its client can still be looked up. */
 			std::function<void(int)> closeHandler;
-			/** clientsMutex will be locked while this is called.
+			/** Called before a connection starts receiving events. It should call setClient.
 			 *  Arguments: (worker, client_id, ip) */
 			std::function<void(Worker &, int, std::string_view)> addClient;
 
@@ -172,18 +341,43 @@ namespace Algiz {
 			[[nodiscard]] inline int getPort() const { return port; }
 			void handleMessage(GenericClient &, std::string_view);
 			void mainLoop();
+
+			// The functions that act on a single client can be called from any thread. When they're called from a thread
+			// other than the one running the client's worker, the work is handed to that worker and done in the order it
+			// was requested, and they report success as long as the client existed.
+
 			ssize_t send(int client, std::string_view);
 			ssize_t send(int client, const std::string &);
+			/** Moves the contents of an evbuffer into a client's output without copying them. The evbuffer is left
+			 *  empty and still belongs to the caller. */
+			ssize_t send(int client, evbuffer *);
+			/** Appends the same bytes to many clients' output without copying them for each one. Recipients are grouped
+			 *  by worker, and each worker gets a single task for all of its recipients (or handles them right away if it's
+			 *  the calling thread's). Returns the number of recipients that still existed. */
+			size_t broadcast(const std::vector<Recipient> &, const SharedBuffer::Ptr &);
+			/** Sends a region of an open file to a client without copying it through userspace when possible. The
+			 *  descriptor is duplicated, so the caller retains ownership of it. Returns 0 on success or -1 on failure. */
+			ssize_t sendFile(int client, int file_descriptor, size_t offset, size_t length);
+			/** Streams a response that's generated incrementally. The producer is called from the client's worker thread
+			 *  whenever the output buffer drops below streamLowWatermark, so at most about streamWindow bytes are ever
+			 *  buffered for the client. Returns 0 on success or -1 on failure. */
+			ssize_t stream(int client, Producer);
+			/** Calls a client's producer again after it returned true without producing anything. Output only drains
+			 *  (and producers are only called) while something is buffered, so such a producer would otherwise stall. */
+			ssize_t resume(int client);
 			void run();
 			void stop();
 			virtual std::shared_ptr<Worker> makeWorker(size_t buffer_size, size_t id);
-			bool remove(bufferevent *);
+			bool remove(int client_id);
+			bool hasPendingOutput(Connection &);
+			/** Returns the number of bytes waiting in a connection's pending output, not counting its output buffer or
+			 *  whatever producers have yet to produce. */
+			size_t getPendingBytes(Connection &);
+			/** Discards any output still waiting to be streamed to a connection. */
+			void clearPendingOutput(Connection &);
 			bool close(int client_id);
 			bool close(GenericClient &);
 
-			[[nodiscard]] auto & getClients() { return allClients; }
-			[[nodiscard]] const auto & getClients() const { return allClients; }
-			[[nodiscard]] auto lockClients() { return std::unique_lock(clientsMutex); }
 			[[nodiscard]] auto & getCore() { return core; }
 
 			/** Given a buffer, this function returns {-1, *} if the message is still incomplete or the {i, l} if the
@@ -197,5 +391,8 @@ namespace Algiz {
 			friend void conn_writecb(bufferevent *, void *);
 			friend void conn_eventcb(bufferevent *, short, void *);
 			friend void worker_acceptcb(evutil_socket_t, short, void *);
+			friend void worker_listener_cb(evconnlistener *, evutil_socket_t, sockaddr *, int socklen, void *);
+			friend void worker_taskcb(evutil_socket_t, short, void *);
+			friend void worker_tickcb(evutil_socket_t, short, void *);
 	};
 }
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <event2/buffer.h>
+
+namespace Algiz {
+	/** Immutable bytes that can be appended to any number of evbuffers by reference instead of being copied into each
+	 *  one. The bytes are freed once every Ptr and every evbuffer has let go of them. */
+	class SharedBuffer {
+		private:
+			mutable std::atomic_size_t references{0};
+			const std::string data;
+
+			explicit SharedBuffer(std::string data_):
+				data(std::move(data_)) {}
+
+			void retain() const {
+				references.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			void release() const {
+				if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					delete this;
+				}
+			}
+
+			static void cleanup(const void *, size_t, void *extra) {
+				static_cast<const SharedBuffer *>(extra)->release();
+			}
+
+		public:
+			class Ptr {
+				private:
+					const SharedBuffer *buffer = nullptr;
+
+					explicit Ptr(const SharedBuffer *buffer_):
+						buffer(buffer_) {
+							buffer->retain();
+						}
+
+				public:
+					Ptr() = default;
+					Ptr(const Ptr &other):
+						buffer(other.buffer) {
+							if (buffer != nullptr) {
+								buffer->retain();
+							}
+						}
+
+					Ptr(Ptr &&other) noexcept:
+						buffer(std::exchange(other.buffer, nullptr)) {}
+
+					~Ptr() {
+						reset();
+					}
+
+					Ptr & operator=(Ptr other) noexcept {
+						std::swap(buffer, other.buffer);
+						return *this;
+					}
+
+					void reset() {
+						if (buffer != nullptr) {
+							std::exchange(buffer, nullptr)->release();
+						}
+					}
+
+					const SharedBuffer * operator->() const { return buffer; }
+					const SharedBuffer & operator*() const { return *buffer; }
+					explicit operator bool() const { return buffer != nullptr; }
+
+					friend SharedBuffer;
+			};
+
+			SharedBuffer(const SharedBuffer &) = delete;
+			SharedBuffer(SharedBuffer &&) = delete;
+
+			SharedBuffer & operator=(const SharedBuffer &) = delete;
+			SharedBuffer & operator=(SharedBuffer &&) = delete;
+
+			static Ptr make(std::string data) {
+				return Ptr(new SharedBuffer(std::move(data)));
+			}
+
+			[[nodiscard]] std::string_view view() const { return data; }
+			[[nodiscard]] size_t size() const { return data.size(); }
+
+			/** Appends the bytes to an evbuffer without copying them. Returns false on failure. */
+			bool appendTo(evbuffer *buffer) const {
+				retain();
+				if (evbuffer_add_reference(buffer, data.data(), data.size(), cleanup, const_cast<SharedBuffer *>(this)) != 0) {
+					release();
+					return false;
+				}
+				return true;
+			}
+	};
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <openssl/ssl.h>
+
+#include "util/Metrics.h"
+
+namespace Algiz {
+	class EventLoop;
+
+	/** Lets returning TLS clients skip the full handshake. Sessions are kept in a sharded in-process cache and,
+	 *  optionally, in a memory-mapped file that every process on the host can share. Session tickets are encrypted with
+	 *  keys that are replaced on a schedule; the previous keys are kept around so that outstanding tickets still work
+	 *  for a while. If the shared file is in use, the ticket keys live in it too, so a ticket issued by one process can
+	 *  be redeemed at another. */
+	class TLSSessions: public std::enable_shared_from_this<TLSSessions> {
+		public:
+			struct Options {
+				/** The number of sessions cached in memory. 0 disables the in-process cache. */
+				size_t cacheSize = 20480;
+				/** How long sessions and tickets can be resumed. */
+				std::chrono::seconds sessionTimeout{3600};
+				/** If nonempty, sessions and ticket keys are also kept in this file. */
+				std::string sharedCachePath;
+				/** The number of sessions that fit in the shared file. Only used when the file is created. */
+				size_t sharedCacheSlots = 16384;
+				bool tickets = true;
+				/** How often a new ticket key is made. Tickets can be redeemed for up to KEY_RING_SIZE times this long. */
+				std::chrono::seconds ticketKeyInterval{std::chrono::hours(12)};
+			};
+
+			/** How many ticket keys are kept, including the one currently used to issue tickets. */
+			static constexpr size_t KEY_RING_SIZE = 3;
+
+			struct TicketKey {
+				unsigned char name[16];
+				unsigned char aesKey[32];
+				unsigned char hmacKey[32];
+				/** Seconds since the epoch. */
+				int64_t createdAt;
+			};
+
+			TLSSessions(const Options &, int port);
+			TLSSessions(const TLSSessions &) = delete;
+			TLSSessions(TLSSessions &&) = delete;
+
+			~TLSSessions();
+
+			TLSSessions & operator=(const TLSSessions &) = delete;
+			TLSSessions & operator=(TLSSessions &&) = delete;
+
+			/** Configures a context to use this object for resumption. Every context a server switches between (e.g.,
+			 *  for SNI) needs this, and the object must outlive them all. */
+			void attach(SSL_CTX *);
+
+			/** Starts replacing ticket keys and purging expired sessions periodically. */
+			void start(EventLoop &);
+
+			/** Counts a finished handshake as either resumed or full. */
+			void recordHandshake(SSL *);
+
+		private:
+			class LocalCache;
+			class SharedStore;
+
+			/** Newest first. */
+			struct KeyRing {
+				std::vector<TicketKey> keys;
+				~KeyRing();
+			};
+
+			Options options;
+			std::unique_ptr<LocalCache> localCache;
+			std::unique_ptr<SharedStore> sharedStore;
+			std::atomic<std::shared_ptr<const KeyRing>> keyRing;
+
+			Counter &resumedHandshakes;
+			Counter &fullHandshakes;
+			Counter &cacheHits;
+			Counter &sharedCacheHits;
+			Counter &cacheMisses;
+			Counter &ticketsIssued;
+			Counter &ticketsAccepted;
+			Counter &ticketsRenewed;
+			Counter &ticketsRejected;
+			Gauge &cacheEntries;
+
+			/** Makes a new ticket key if the newest one is older than the rotation interval. With a shared file, this
+			 *  also picks up keys made by other processes. */
+			void refreshTicketKeys();
+			/** Refreshes the ticket keys and purges expired sessions every so often. */
+			void scheduleTick(EventLoop &);
+
+			static TLSSessions * get(SSL *);
+			static int getIndex();
+
+			static int newSessionCallback(SSL *, SSL_SESSION *);
+			static SSL_SESSION * getSessionCallback(SSL *, const unsigned char *id, int id_length, int *copy);
+			static void removeSessionCallback(SSL_CTX *, SSL_SESSION *);
+			static int ticketKeyCallback(SSL *, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *, EVP_MAC_CTX *, int encrypt);
+	};
+}
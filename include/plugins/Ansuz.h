@@ -34,9 +34,10 @@ namespace Algiz::Plugins {
 			/** Returns whether authentication succeeded. */
 			bool checkAuth(HTTP::Server &, HTTP::Client &, const HTTP::Request &);
 
-			static CancelableResult serve(HTTP::Server &, HTTP::Client &, std::string_view, const nlohmann::json & = {},
+			static CancelableResult serve(HTTP::Client &, std::string_view, const nlohmann::json & = {},
 			                              int code = 200, const char *mime = "text/html");
 
 			static CancelableResult serveIndex(HTTP::Server &, HTTP::Client &client);
+			static CancelableResult serveMetrics(HTTP::Client &client);
 	};
 }
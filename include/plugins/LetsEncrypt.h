@@ -1,5 +1,6 @@
 #pragma once
 
+#include "EventLoop.h"
 #include "http/Server.h"
 #include "net/SSLServer.h"
 #include "plugins/Plugin.h"
@@ -8,7 +9,9 @@
 
 #include "acme-lw.h"
 
+#include <chrono>
 #include <deque>
+#include <memory>
 #include <mutex>
 
 namespace Algiz::Plugins {
@@ -29,10 +32,42 @@ namespace Algiz::Plugins {
 			std::optional<decltype(SSLServer::requestCertificate)::Base> oldRequestCertificate;
 			std::optional<std::unordered_set<std::string>> whitelist;
 
+			/** What's known about issuing a certificate for a single hostname. */
+			struct Issuance {
+				/** Set while an order for the hostname is queued or in progress. */
+				bool inFlight = false;
+				/** Requests for the hostname are ignored until then. */
+				std::chrono::steady_clock::time_point retryAfter;
+				/** How long to wait after the next failure. */
+				std::chrono::seconds backoff{0};
+			};
+
+			/** Hostnames that have an order in flight or that recently failed or were refused. Lock issuancesMutex
+			 *  before using. */
+			std::unordered_map<std::string, Issuance> issuances;
+			std::mutex issuancesMutex;
+
+			/** Shared with scheduled renewal checks so that they can tell whether the plugin has been cleaned up. */
+			struct Lifeline {
+				std::mutex mutex;
+				bool alive = true;
+				EventLoop::Handle timer;
+			};
+
+			std::shared_ptr<Lifeline> lifeline = std::make_shared<Lifeline>();
+
 			Plugins::CancelableResult handle(const HTTP::Server::HandlerArgs &, bool not_disabled);
-			void issueCertificate(const std::string &host);
+			/** Queues an order for a hostname unless one is already in flight or the hostname is backing off. Safe to
+			 *  call from any thread, including during a handshake. */
+			void requestIssuance(const std::string &host);
+			/** Returns whether a certificate was issued and installed. */
+			bool issueCertificate(const std::string &host);
 			void finishCertificate(std::string_view host, acme_lw::Certificate);
 			void loadCache();
+			/** Requests new certificates for cached ones that expire soon. */
+			void renewExpiring();
+			/** Lock lifeline->mutex before calling. */
+			void scheduleRenewalCheck(EventLoop &, std::chrono::seconds delay);
 			std::shared_ptr<SSLServer> getSSLServer() const;
 
 			static std::unordered_map<std::string, std::string> challenges;
@@ -4,17 +4,25 @@
 #include "plugins/Plugin.h"
 #include "util/Util.h"
 
+#include <optional>
+
 namespace Algiz::HTTP {
 	class Client;
 	class Server;
 }
 
 namespace Algiz::Plugins {
+	/** Config keys:
+	 *  - "console": whether to print each request to the console (default: true)
+	 *  - "accessLog": path of an access log file to append to
+	 *  - "accessLogFormat": "combined" (default) for the Combined Log Format or "json" for one JSON object per line
+	 *  - "accessLogMaxBytes": rotate the access log before it grows past this many bytes (default: 0, never)
+	 *  - "accessLogKeep": how many rotated access logs to keep (default: 5) */
 	class Logger: public Plugin {
 		public:
 			[[nodiscard]] std::string getName()        const override { return "Logger"; }
-			[[nodiscard]] std::string getDescription() const override { return "Prints accesses to the console."; }
-			[[nodiscard]] std::string getVersion()     const override { return "0.0.1"; }
+			[[nodiscard]] std::string getDescription() const override { return "Prints accesses to the console and optionally writes an access log."; }
+			[[nodiscard]] std::string getVersion()     const override { return "0.1.0"; }
 
 			void postinit(PluginHost *) override;
 			void cleanup(PluginHost *) override;
@@ -22,7 +30,20 @@ namespace Algiz::Plugins {
 			std::shared_ptr<PluginHost::PreFn<HTTP::Server::HandlerArgs &>> handler =
 				std::make_shared<PluginHost::PreFn<HTTP::Server::HandlerArgs &>>(bind(*this, &Logger::handle));
 
+			HTTP::Server::AccessHandlerPtr accessHandler =
+				std::make_shared<HTTP::Server::AccessHandler>([this](const HTTP::Server::AccessArgs &args) { logAccess(args); });
+
 		private:
+			enum class Format {Combined, JSON};
+
+			bool console = true;
+			Format format = Format::Combined;
+			std::optional<size_t> accessSink;
+
 			Plugins::CancelableResult handle(const HTTP::Server::HandlerArgs &, bool not_disabled);
+			void logAccess(const HTTP::Server::AccessArgs &) const;
+
+			static std::string formatCombined(const HTTP::Server::AccessArgs &);
+			static std::string formatJSON(const HTTP::Server::AccessArgs &);
 	};
 }
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "http/Server.h"
+#include "plugins/Plugin.h"
+#include "util/Util.h"
+
+namespace Algiz::HTTP {
+	class Client;
+	class Server;
+}
+
+namespace Algiz::Plugins {
+	/** Config keys:
+	 *  - "path": where to serve metrics (default: "metrics")
+	 *  - "password": if present, scrapers have to authenticate as "metrics" with this password */
+	class Metrics: public Plugin {
+		public:
+			[[nodiscard]] std::string getName()        const override { return "Metrics"; }
+			[[nodiscard]] std::string getDescription() const override { return "Serves metrics in the Prometheus text format."; }
+			[[nodiscard]] std::string getVersion()     const override { return "0.0.1"; }
+
+			void postinit(PluginHost *) override;
+			void cleanup(PluginHost *) override;
+
+			std::shared_ptr<PluginHost::PreFn<HTTP::Server::HandlerArgs &>> handler =
+				std::make_shared<PluginHost::PreFn<HTTP::Server::HandlerArgs &>>(bind(*this, &Metrics::handle));
+
+		private:
+			Plugins::CancelableResult handle(HTTP::Server::HandlerArgs &, bool not_disabled);
+	};
+}
@@ -1,12 +1,17 @@
 #pragma once
 
+#include <chrono>
 #include <filesystem>
 #include <list>
 #include <map>
 #include <memory>
+#include <shared_mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "plugins/Plugin.h"
+#include "util/Metrics.h"
 #include "Log.h"
 
 namespace Algiz::Plugins {
@@ -48,14 +53,31 @@ namespace Algiz::Plugins {
 			 *  handler functions. */
 			template <typename T, typename C>
 			std::pair<bool, HandlerResult> beforeMulti(T &obj, const C &funcs, bool initial = true) {
-				bool should_pass = initial;
-				for (auto &func: funcs) {
-					if (func.expired()) {
-						WARN("beforeMulti: pointer is expired");
-						continue;
+				// The handlers are called without the lock held, since a handler may load or unload plugins itself.
+				std::vector<std::pair<decltype(funcs.begin()->lock()), Histogram *>> snapshot;
+				{
+					auto lock = lockHandlersShared();
+					for (auto &func: funcs) {
+						auto locked = func.lock();
+						if (!locked) {
+							WARN("beforeMulti: pointer is expired");
+							continue;
+						}
+						auto iter = handlerHistograms.find(locked.get());
+						snapshot.emplace_back(std::move(locked), iter == handlerHistograms.end()? nullptr : iter->second);
 					}
+				}
 
-					Plugins::CancelableResult result = (*func.lock())(obj, should_pass);
+				bool should_pass = initial;
+				for (auto &[locked, histogram]: snapshot) {
+					Plugins::CancelableResult result;
+					if (histogram != nullptr) {
+						const auto start = std::chrono::steady_clock::now();
+						result = (*locked)(obj, should_pass);
+						histogram->record(std::chrono::steady_clock::now() - start);
+					} else {
+						result = (*locked)(obj, should_pass);
+					}
 
 					if (result == Plugins::CancelableResult::Kill || result == Plugins::CancelableResult::Disable) {
 						should_pass = false;
@@ -85,10 +107,28 @@ namespace Algiz::Plugins {
 		private:
 			std::list<PluginTuple> plugins;
 
+			/** Maps pre-event handlers to histograms of how long they take, labeled with the names of the plugins that
+			 *  registered them. Like the handler lists, this is guarded by handlersMutex. */
+			std::unordered_map<const void *, Histogram *> handlerHistograms;
+			/** Guards the handler lists and handlerHistograms. Events take a shared lock to read them, and loading or
+			 *  unloading a plugin takes an exclusive one. */
+			mutable std::shared_mutex handlersMutex;
+
+			/** Attributes handlers that have appeared since a plugin's postinit was called to that plugin. Expects
+			 *  handlersMutex to be locked exclusively. */
+			void adoptHandlers(const Plugin &, const std::vector<const void *> &previous);
+
 		protected:
 			PluginHost() = default;
 
+			/** Returns the addresses of all currently registered pre-event handlers, so handlers can be attributed to
+			 *  the plugins that registered them. */
+			virtual std::vector<const void *> getHandlerPointers() const { return {}; }
+
 		public:
+			[[nodiscard]] auto lockHandlers() { return std::unique_lock(handlersMutex); }
+			[[nodiscard]] auto lockHandlersShared() const { return std::shared_lock(handlersMutex); }
+
 			PluginHost(const PluginHost &) = delete;
 			PluginHost(PluginHost &&) = delete;
 
@@ -128,6 +168,9 @@ namespace Algiz::Plugins {
 			/** Initializes all loaded plugins after client initialization. */
 			void postinitPlugins();
 
+			/** Initializes a single plugin after client initialization, e.g. one loaded at runtime. */
+			void postinitPlugin(Plugin &);
+
 			/** If a plugin was loaded from a given path, a pointer to its corresponding plugin object is returned. */
 			[[nodiscard]] std::shared_ptr<Plugins::Plugin> pluginForPath(const std::string &path) const;
 
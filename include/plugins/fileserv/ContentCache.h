@@ -0,0 +1,67 @@
+#pragma once
+
+#include <ctime>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <event2/buffer.h>
+
+namespace Algiz::Plugins {
+	/** Keeps complete responses for small files in memory. Each response is stored once and added to clients' output
+	 *  buffers by reference, so any number of connections can share it. Entries are evicted in LRU order to stay within
+	 *  a memory budget and dropped whenever the web root's watcher reports a change to them. */
+	class ContentCache {
+		public:
+			/** A response minus the headers that vary between requests (see HTTP::Client::writeDynamicHeaders). */
+			struct Content {
+				/** The status line and static headers followed immediately by the body. */
+				std::string data;
+				size_t headLength = 0;
+				/** The mtime of the file the body was read from. */
+				time_t modified = 0;
+
+				[[nodiscard]] std::string_view getHead() const { return std::string_view(data).substr(0, headLength); }
+				[[nodiscard]] std::string_view getBody() const { return std::string_view(data).substr(headLength); }
+			};
+
+			using ContentPtr = std::shared_ptr<const Content>;
+
+			ContentCache(size_t maxFileSize, size_t maxBytes);
+
+			void setLimits(size_t max_file_size, size_t max_bytes);
+			/** Files larger than this many bytes aren't cached. */
+			[[nodiscard]] size_t getMaxFileSize() const { return maxFileSize; }
+
+			/** Returns nullptr if the file isn't cached. */
+			ContentPtr find(const std::filesystem::path &);
+			void insert(const std::filesystem::path &, ContentPtr);
+			/** Drops the entry for the given path and every entry under it. */
+			void invalidate(const std::filesystem::path &);
+			void clear();
+
+			/** Adds part of a cached response to an evbuffer without copying it. The content is kept alive until the
+			 *  evbuffer is done with it. */
+			static void addReference(evbuffer *, const ContentPtr &, std::string_view piece);
+
+		private:
+			using LRU = std::list<std::pair<std::string, ContentPtr>>;
+
+			size_t maxFileSize;
+			size_t maxBytes;
+			size_t usedBytes = 0;
+			/** Most recently used entries are at the front. */
+			LRU lru;
+			std::unordered_map<std::string, LRU::iterator> entries;
+			std::mutex mutex;
+
+			/** Assumes the mutex is locked. */
+			void erase(LRU::iterator);
+			/** Assumes the mutex is locked. */
+			void makeSpace();
+	};
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <ctime>
+#include <sys/types.h>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace Algiz::Plugins {
+	/** Remembers which file a request path resolves to, along with the file's metadata and (within a budget) an open
+	 *  descriptor for it, so that hot files can be served without any metadata syscalls. Entries are evicted in LRU
+	 *  order and dropped whenever the web root's watcher reports a change that could affect them. */
+	class FileCache {
+		public:
+			struct Entry {
+				/** The path the request expanded to, before any default filename was appended. */
+				std::filesystem::path requestedPath;
+				/** The file that's served. */
+				std::filesystem::path path;
+				/** Owned by the entry. -1 if the descriptor budget was exhausted when the entry was made. */
+				int descriptor = -1;
+				size_t size = 0;
+				time_t modified = 0;
+				std::string mime;
+				std::string etag;
+
+				Entry() = default;
+				Entry(const Entry &) = delete;
+				Entry(Entry &&) = delete;
+				~Entry();
+
+				Entry & operator=(const Entry &) = delete;
+				Entry & operator=(Entry &&) = delete;
+			};
+
+			using EntryPtr = std::shared_ptr<const Entry>;
+
+			FileCache(size_t maxEntries, size_t maxDescriptors);
+
+			void setLimits(size_t max_entries, size_t max_descriptors);
+
+			/** Returns nullptr if the request path isn't cached. */
+			EntryPtr find(std::string_view request_path);
+			/** Opens and stats a resolved file and caches the result. Returns nullptr if the file can't be opened or
+			 *  isn't a regular file. */
+			EntryPtr insert(std::string_view request_path, std::filesystem::path requested_path, std::filesystem::path path);
+			/** Drops every entry that a change to the given path could have made stale. */
+			void invalidate(const std::filesystem::path &);
+			void clear();
+
+			/** Makes a strong ETag that changes whenever the file is replaced or modified. */
+			static std::string makeETag(ino_t inode, time_t modified, size_t size);
+
+		private:
+			struct StringHash {
+				using is_transparent = void;
+				size_t operator()(std::string_view string) const { return std::hash<std::string_view>{}(string); }
+			};
+
+			using LRU = std::list<std::pair<std::string, EntryPtr>>;
+
+			size_t maxEntries;
+			size_t maxDescriptors;
+			size_t openDescriptors = 0;
+			/** Most recently used entries are at the front. */
+			LRU lru;
+			std::unordered_map<std::string, LRU::iterator, StringHash, std::equal_to<>> entries;
+			std::mutex mutex;
+
+			/** Assumes the mutex is locked. */
+			void erase(LRU::iterator);
+			/** Assumes the mutex is locked. */
+			void makeSpace();
+	};
+}
@@ -2,18 +2,23 @@
 
 #include "http/Server.h"
 #include "nlohmann/json.hpp"
+#include "plugins/fileserv/ContentCache.h"
+#include "plugins/fileserv/FileCache.h"
 #include "plugins/fileserv/ModuleCache.h"
 #include "plugins/Plugin.h"
+#include "threading/ThreadPool.h"
 #include "util/Util.h"
 
 #include <filesystem>
 #include <generator>
+#include <mutex>
 #include <optional>
 #include <random>
 #include <set>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace Algiz::HTTP {
@@ -21,16 +26,17 @@ namespace Algiz::HTTP {
 }
 
 namespace Algiz::Plugins {
+	struct ServedFile;
+
 	class Fileserv: public Plugin {
 		public:
 			Fileserv();
 
-			/** Largest amount to read from a file at one time. */
-			size_t chunkSize = 1 << 20;
-
 			std::optional<std::set<std::string>> hostnames;
 			std::optional<std::filesystem::path> root;
 			bool enableModules = false;
+			/** Whether resolved files are cached. Only possible if the root is watched for changes. */
+			bool cacheFiles = false;
 
 			[[nodiscard]] std::string getName()        const override { return "HTTP Fileserv"; }
 			[[nodiscard]] std::string getDescription() const override { return "Serves files over HTTP."; }
@@ -48,8 +54,31 @@ namespace Algiz::Plugins {
 			std::shared_ptr<PluginHost::PreFn<HTTP::Server::HandlerArgs &>> postHandler =
 				std::make_shared<PluginHost::PreFn<HTTP::Server::HandlerArgs &>>(bind(*this, &Fileserv::handlePOST));
 
+			HTTP::Server::FileChangeHandlerPtr fileChangeHandler = std::make_shared<HTTP::Server::FileChangeHandler>(
+				[this](const std::filesystem::path &path) {
+					// A config change can turn modules on or off, which changes whether a cached file may be served as-is.
+					if (path.filename() == ".algiz") {
+						fileCache.clear();
+						contentCache.clear();
+						compressedCache.clear();
+					} else {
+						fileCache.invalidate(path);
+						contentCache.invalidate(path);
+						compressedCache.invalidate(path);
+					}
+				});
+
 		private:
 			mutable ModuleCache moduleCache;
+			mutable FileCache fileCache;
+			mutable ContentCache contentCache;
+			/** Responses compressed on the fly. Each is keyed by a path under the original file's path. */
+			mutable ContentCache compressedCache;
+			/** Compresses files that aren't in compressedCache yet so that requests don't wait on it. */
+			mutable ThreadPool compressionPool{2};
+			/** Keys of compressedCache entries that compressionPool is working on. Lock compressingMutex before using. */
+			mutable std::unordered_set<std::string> compressing;
+			mutable std::mutex compressingMutex;
 			mutable std::default_random_engine rng;
 
 			Plugins::CancelableResult handleGET(HTTP::Server::HandlerArgs &, bool not_disabled);
@@ -57,14 +86,34 @@ namespace Algiz::Plugins {
 
 			bool authFailed(HTTP::Server::HandlerArgs &, const std::filesystem::path &) const;
 			bool findPath(std::filesystem::path &) const;
-			void serveRange(HTTP::Server::HandlerArgs &, const std::filesystem::path &) const;
-			void serveFull(HTTP::Server::HandlerArgs &, const std::filesystem::path &) const;
+			/** Returns the cache entry for a request path if there is one and sets full_path to the path the request
+			 *  expanded to. Otherwise, expands the request path into full_path and returns nullptr. Returns false if the
+			 *  request path escapes the root. */
+			bool resolve(HTTP::Server &, std::string_view request_path, std::filesystem::path &full_path, FileCache::EntryPtr &) const;
+			/** Caches a found file unless it's going to be rendered or run instead of served as-is. */
+			FileCache::EntryPtr cache(HTTP::Server &, std::string_view request_path, const std::filesystem::path &requested_path, const std::filesystem::path &full_path) const;
+			void serveRange(HTTP::Server::HandlerArgs &, const std::filesystem::path &, const FileCache::EntryPtr &) const;
+			void serveFull(HTTP::Server::HandlerArgs &, const std::filesystem::path &, const FileCache::EntryPtr &) const;
+			void sendContent(HTTP::Server::HandlerArgs &, const ContentCache::ContentPtr &) const;
+			/** Sends a file with a content coding the client accepts, either from a precompressed sibling (if the
+			 *  directory's "precompressed" option is set) or by gzipping it. Returns false if the file should be sent
+			 *  as-is instead. */
+			bool serveCompressed(HTTP::Server::HandlerArgs &, const std::filesystem::path &, ServedFile &) const;
+			/** Gzips a file on compressionPool and caches the result under a key in compressedCache, unless that's
+			 *  already underway. */
+			void compressInBackground(const std::filesystem::path &, const std::filesystem::path &key, const ServedFile &, std::string etag, int level) const;
+			/** Evaluates the request's preconditions against a representation of a file. Sends a 304 or 412 and returns
+			 *  true if the representation itself shouldn't be sent. */
+			bool handlePreconditions(HTTP::Server::HandlerArgs &, const ServedFile &, std::string_view etag, bool vary) const;
+			bool servePrecompressed(HTTP::Server::HandlerArgs &, const std::filesystem::path &, const ServedFile &, std::string_view coding, std::string_view extension) const;
 			void serveModule(HTTP::Server::HandlerArgs &, const std::filesystem::path &) const;
 
 			std::vector<std::string> getDefaults() const;
 
 			bool shouldServeModule(HTTP::Server &, const std::filesystem::path &) const;
 			bool getModulesEnabled(HTTP::Server &, const std::filesystem::path &) const;
+
+			[[nodiscard]] auto lockCompressing() const { return std::unique_lock(compressingMutex); }
 			bool filter(HTTP::Server::HandlerArgs &, const std::filesystem::path &) const;
 	};
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "http/Server.h"
+#include "util/Metrics.h"
 
 #include <chrono>
 #include <filesystem>
@@ -33,6 +34,8 @@ namespace Algiz::Plugins {
 			};
 
 			size_t maxSize{};
+			Counter &hits;
+			Counter &misses;
 			std::shared_mutex cacheMutex;
 			std::unordered_map<std::filesystem::path, Item> cache;
 
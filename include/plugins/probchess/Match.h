@@ -59,6 +59,8 @@ namespace ProbChess {
 			virtual void sendAll(std::string_view);
 			virtual bool isReady() const = 0;
 			void sendSpectators(std::string_view);
+			/** The topic that the match's spectators are subscribed to. */
+			std::string spectatorTopic() const;
 			void sendBoard();
 			void invertTurn();
 			std::string capturedMessage(std::shared_ptr<Piece>);
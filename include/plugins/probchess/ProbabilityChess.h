@@ -50,13 +50,16 @@ namespace Algiz::Plugins {
 				std::make_shared<HTTP::Server::MessageHandler>(bind(*this, &ProbabilityChess::handleMessage));
 
 			void send(int client_id, std::string_view);
+			/** Sends a message to every connected client. */
 			void broadcast(std::string_view);
+			HTTP::Server & getServer() const { return dynamic_cast<HTTP::Server &>(*parent); }
 
 		private:
 			static constexpr const char *VALID_MATCH_CHARS = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ01234"
 				"56789_";
+			/** Every connected client is subscribed to this topic. */
+			static constexpr const char *LOBBY_TOPIC = "probchess";
 			std::unordered_set<int> connections;
-			std::unordered_set<HTTP::Client *> clients;
 
 			CancelableResult handleConnect(HTTP::Server::WebSocketConnectionArgs &, bool not_disabled);
 			CancelableResult handleMessage(HTTP::Server::WebSocketMessageArgs &, bool not_disabled);
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace Algiz {
+	/** A bounded single-producer, single-consumer ring of variable-length records. Neither side ever blocks or takes a
+	 *  lock: a push that doesn't fit fails instead of waiting for the consumer. */
+	class SPSCRing {
+		public:
+			/** The capacity is rounded up to a power of two. */
+			explicit SPSCRing(size_t capacity_):
+				capacity(std::bit_ceil(capacity_ < 64? 64 : capacity_)),
+				mask(capacity - 1),
+				data(std::make_unique<char[]>(capacity)) {}
+
+			SPSCRing(const SPSCRing &) = delete;
+			SPSCRing & operator=(const SPSCRing &) = delete;
+
+			/** Appends the concatenation of the given pieces as a single record. Producer only. Returns false if there
+			 *  isn't enough room. */
+			bool tryPush(std::initializer_list<std::string_view> pieces) {
+				uint32_t length = 0;
+				for (const std::string_view piece: pieces) {
+					length += uint32_t(piece.size());
+				}
+
+				const size_t head = writePosition.load(std::memory_order_relaxed);
+				const size_t needed = sizeof(length) + length;
+				if (capacity - (head - cachedReadPosition) < needed) {
+					cachedReadPosition = readPosition.load(std::memory_order_acquire);
+					if (capacity - (head - cachedReadPosition) < needed) {
+						return false;
+					}
+				}
+
+				size_t position = head;
+				copyIn(position, {reinterpret_cast<const char *>(&length), sizeof(length)});
+				position += sizeof(length);
+				for (const std::string_view piece: pieces) {
+					copyIn(position, piece);
+					position += piece.size();
+				}
+
+				writePosition.store(position, std::memory_order_release);
+				return true;
+			}
+
+			/** Replaces the contents of `out` with the next record. Consumer only. Returns false if the ring is empty. */
+			bool tryPop(std::string &out) {
+				const size_t tail = readPosition.load(std::memory_order_relaxed);
+				if (tail == writePosition.load(std::memory_order_acquire)) {
+					return false;
+				}
+
+				uint32_t length = 0;
+				copyOut(tail, reinterpret_cast<char *>(&length), sizeof(length));
+				out.resize(length);
+				copyOut(tail + sizeof(length), out.data(), length);
+				readPosition.store(tail + sizeof(length) + length, std::memory_order_release);
+				return true;
+			}
+
+			/** Can be called from either side, but it's only a snapshot. */
+			[[nodiscard]] bool empty() const {
+				return readPosition.load(std::memory_order_acquire) == writePosition.load(std::memory_order_acquire);
+			}
+
+			[[nodiscard]] size_t getCapacity() const { return capacity; }
+
+		private:
+			const size_t capacity;
+			const size_t mask;
+			std::unique_ptr<char[]> data;
+			/** Both positions only ever increase; they're reduced modulo the capacity when used as indices. */
+			alignas(64) std::atomic_size_t writePosition{0};
+			/** The producer's last look at readPosition, so it doesn't have to touch the consumer's cache line on every
+			 *  push. */
+			size_t cachedReadPosition = 0;
+			alignas(64) std::atomic_size_t readPosition{0};
+
+			void copyIn(size_t position, std::string_view bytes) {
+				const size_t offset = position & mask;
+				const size_t first = std::min(bytes.size(), capacity - offset);
+				std::memcpy(&data[offset], bytes.data(), first);
+				std::memcpy(&data[0], bytes.data() + first, bytes.size() - first);
+			}
+
+			void copyOut(size_t position, char *out, size_t size) const {
+				const size_t offset = position & mask;
+				const size_t first = std::min(size, capacity - offset);
+				std::memcpy(out, &data[offset], first);
+				std::memcpy(out + first, &data[0], size - first);
+			}
+	};
+}
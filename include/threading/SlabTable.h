@@ -0,0 +1,287 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace Algiz {
+	/** A table of records addressed by generation-tagged IDs. Lookups are lock-free; only inserting a record and
+	 *  returning its slot to the free list take a lock. Slots live in chunks that are never freed before the table is,
+	 *  so a record's address stays valid for the table's lifetime. A record is reset (via T::reset()) once it has been
+	 *  retired and the last Ref to it has been dropped, so it's safe to use a record through a Ref even while another
+	 *  thread retires it. A reclaimer can be set to have the reset happen somewhere other than the thread that dropped
+	 *  the last Ref. */
+	template <typename T>
+	class SlabTable {
+		public:
+			/** Resets a reclaimed record and returns its slot to the free list. */
+			using Finish = std::move_only_function<void()>;
+			/** Called with a record once it's ready to be reset. Has to call the Finish exactly once, on any thread. */
+			using Reclaimer = std::function<void(T &, Finish)>;
+
+			static constexpr int SLOT_BITS = 20;
+			static constexpr int GENERATION_BITS = 31 - SLOT_BITS;
+			static constexpr size_t CHUNK_SIZE = 1024;
+			static constexpr size_t MAX_SLOTS = size_t(1) << SLOT_BITS;
+
+		private:
+			/** The high 32 bits contain the slot's generation shifted left by one, with the lowest bit set if the slot is
+			 *  live. The low 32 bits count the Refs to the slot. */
+			struct Slot {
+				std::atomic_uint64_t state{0};
+				T value;
+			};
+
+			using Chunk = std::array<Slot, CHUNK_SIZE>;
+
+			std::array<std::atomic<Chunk *>, MAX_SLOTS / CHUNK_SIZE> chunks{};
+			std::atomic_size_t chunkCount{0};
+			std::vector<uint32_t> freeSlots;
+			std::mutex freeSlotsMutex;
+			std::atomic_size_t liveCount{0};
+			Reclaimer reclaimer;
+
+			static constexpr uint32_t getIndex(int id) {
+				return uint32_t(id) & ((uint32_t(1) << SLOT_BITS) - 1);
+			}
+
+			static constexpr uint32_t getGeneration(int id) {
+				return uint32_t(id) >> SLOT_BITS;
+			}
+
+			static constexpr uint32_t getTag(uint64_t state) {
+				return uint32_t(state >> 32);
+			}
+
+			static constexpr uint32_t getUsers(uint64_t state) {
+				return uint32_t(state);
+			}
+
+			static constexpr bool isTagLive(uint32_t tag) {
+				return (tag & 1) != 0;
+			}
+
+			static constexpr bool tagMatches(uint32_t tag, int id) {
+				return isTagLive(tag) && ((tag >> 1) & ((uint32_t(1) << GENERATION_BITS) - 1)) == getGeneration(id);
+			}
+
+			static constexpr int makeID(uint32_t index, uint32_t tag) {
+				return int((((tag >> 1) & ((uint32_t(1) << GENERATION_BITS) - 1)) << SLOT_BITS) | index);
+			}
+
+			Slot * getSlot(uint32_t index) const {
+				Chunk *chunk = chunks[index / CHUNK_SIZE].load(std::memory_order_acquire);
+				return chunk == nullptr? nullptr : &(*chunk)[index % CHUNK_SIZE];
+			}
+
+			void reclaim(uint32_t index, Slot &slot) {
+				if (reclaimer) {
+					reclaimer(slot.value, [this, index, &slot] { finishReclaim(index, slot); });
+				} else {
+					finishReclaim(index, slot);
+				}
+			}
+
+			void finishReclaim(uint32_t index, Slot &slot) {
+				slot.value.reset();
+				std::unique_lock lock(freeSlotsMutex);
+				freeSlots.push_back(index);
+			}
+
+			void release(uint32_t index, Slot &slot) {
+				const uint64_t previous = slot.state.fetch_sub(1, std::memory_order_acq_rel);
+				if (getUsers(previous) == 1 && !isTagLive(getTag(previous))) {
+					reclaim(index, slot);
+				}
+			}
+
+		public:
+			/** Keeps a record from being reset while it's held. */
+			class Ref {
+				private:
+					SlabTable *table = nullptr;
+					uint32_t index = 0;
+					Slot *slot = nullptr;
+					int id = -1;
+
+					Ref(SlabTable &table_, uint32_t index_, Slot &slot_, int id_):
+						table(&table_), index(index_), slot(&slot_), id(id_) {}
+
+				public:
+					Ref() = default;
+					Ref(const Ref &) = delete;
+					Ref(Ref &&other) noexcept:
+						table(other.table), index(other.index), slot(other.slot), id(other.id) {
+							other.slot = nullptr;
+						}
+
+					~Ref() {
+						reset();
+					}
+
+					Ref & operator=(const Ref &) = delete;
+					Ref & operator=(Ref &&other) noexcept {
+						if (this != &other) {
+							reset();
+							table = other.table;
+							index = other.index;
+							slot = std::exchange(other.slot, nullptr);
+							id = other.id;
+						}
+						return *this;
+					}
+
+					void reset() {
+						if (slot != nullptr) {
+							table->release(index, *slot);
+							slot = nullptr;
+						}
+					}
+
+					[[nodiscard]] int getID() const { return id; }
+					[[nodiscard]] T * get() const { return slot == nullptr? nullptr : &slot->value; }
+					T * operator->() const { return &slot->value; }
+					T & operator*() const { return slot->value; }
+					explicit operator bool() const { return slot != nullptr; }
+
+					friend SlabTable;
+			};
+
+			SlabTable() = default;
+			SlabTable(const SlabTable &) = delete;
+			SlabTable(SlabTable &&) = delete;
+
+			~SlabTable() {
+				for (auto &chunk: chunks) {
+					delete chunk.load();
+				}
+			}
+
+			SlabTable & operator=(const SlabTable &) = delete;
+			SlabTable & operator=(SlabTable &&) = delete;
+
+			/** Must be called before any records are inserted. */
+			void setReclaimer(Reclaimer new_reclaimer) {
+				reclaimer = std::move(new_reclaimer);
+			}
+
+			/** Claims a slot and marks it live. The returned Ref's ID is the new record's ID. */
+			Ref insert() {
+				uint32_t index;
+				{
+					std::unique_lock lock(freeSlotsMutex);
+					if (!freeSlots.empty()) {
+						index = freeSlots.back();
+						freeSlots.pop_back();
+					} else {
+						const size_t chunk_index = chunkCount.load(std::memory_order_relaxed);
+						if (chunks.size() <= chunk_index) {
+							throw std::length_error("SlabTable is full");
+						}
+						auto *chunk = new Chunk;
+						// Add the new chunk's slots to the free list in reverse so they're handed out in ascending order.
+						for (size_t i = CHUNK_SIZE; 1 < i; --i) {
+							freeSlots.push_back(uint32_t(chunk_index * CHUNK_SIZE + i - 1));
+						}
+						index = uint32_t(chunk_index * CHUNK_SIZE);
+						chunks[chunk_index].store(chunk, std::memory_order_release);
+						chunkCount.store(chunk_index + 1, std::memory_order_release);
+					}
+				}
+
+				Slot &slot = *getSlot(index);
+				// A free slot is dead and unreferenced, so its state is just its tag. Bump the generation and mark it live.
+				const uint32_t tag = (getTag(slot.state.load(std::memory_order_acquire)) | 1) + 2;
+				slot.state.store((uint64_t(tag) << 32) | 1, std::memory_order_release);
+				++liveCount;
+				return Ref(*this, index, slot, makeID(index, tag));
+			}
+
+			/** Returns a Ref to a live record, or an empty Ref if the ID is stale or invalid. */
+			Ref acquire(int id) {
+				if (id < 0) {
+					return {};
+				}
+
+				const uint32_t index = getIndex(id);
+				Slot *slot = getSlot(index);
+				if (slot == nullptr) {
+					return {};
+				}
+
+				uint64_t state = slot->state.load(std::memory_order_acquire);
+				do {
+					if (!tagMatches(getTag(state), id)) {
+						return {};
+					}
+				} while (!slot->state.compare_exchange_weak(state, state + 1, std::memory_order_acq_rel));
+
+				return Ref(*this, index, *slot, id);
+			}
+
+			/** Marks a record as dead. It's reset immediately if nothing holds a Ref to it or as soon as the last Ref is
+			 *  dropped otherwise. Returns false if the record was already dead. */
+			bool retire(int id) {
+				if (id < 0) {
+					return false;
+				}
+
+				const uint32_t index = getIndex(id);
+				Slot *slot = getSlot(index);
+				if (slot == nullptr) {
+					return false;
+				}
+
+				uint64_t state = slot->state.load(std::memory_order_acquire);
+				uint64_t new_state;
+				do {
+					if (!tagMatches(getTag(state), id)) {
+						return false;
+					}
+					new_state = state & ~(uint64_t(1) << 32);
+				} while (!slot->state.compare_exchange_weak(state, new_state, std::memory_order_acq_rel));
+
+				--liveCount;
+
+				if (getUsers(new_state) == 0) {
+					reclaim(index, *slot);
+				}
+
+				return true;
+			}
+
+			bool isLive(int id) const {
+				if (id < 0) {
+					return false;
+				}
+				const Slot *slot = getSlot(getIndex(id));
+				return slot != nullptr && tagMatches(getTag(slot->state.load(std::memory_order_acquire)), id);
+			}
+
+			/** Returns the IDs of all records that were live at some point during the call. */
+			std::vector<int> getLiveIDs() const {
+				std::vector<int> out;
+				const size_t count = chunkCount.load(std::memory_order_acquire);
+				for (size_t chunk_index = 0; chunk_index < count; ++chunk_index) {
+					for (size_t i = 0; i < CHUNK_SIZE; ++i) {
+						const auto index = uint32_t(chunk_index * CHUNK_SIZE + i);
+						const uint32_t tag = getTag(getSlot(index)->state.load(std::memory_order_acquire));
+						if (isTagLive(tag)) {
+							out.push_back(makeID(index, tag));
+						}
+					}
+				}
+				return out;
+			}
+
+			size_t size() const {
+				return liveCount.load(std::memory_order_relaxed);
+			}
+	};
+}
@@ -1,44 +1,92 @@
 #pragma once
 
-#include "threading/MTQueue.h"
+#include "threading/WorkStealingDeque.h"
 
 #include <atomic>
-#include <cassert>
-#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <functional>
+#include <future>
+#include <memory>
 #include <mutex>
+#include <stdexcept>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
 namespace Algiz {
+	/** A work-stealing thread pool. Each thread has its own lock-free deque: jobs submitted from a pool thread go onto
+	 *  that thread's deque, and jobs submitted from elsewhere go onto a shared injection queue. Idle threads steal from
+	 *  the others before parking, and parked threads are only woken when there's work for them. */
 	class ThreadPool {
 		public:
 			using Function = std::function<void(ThreadPool &, size_t)>;
+			/** Called with the index of the thread that runs it. */
+			using Task = std::move_only_function<void(size_t)>;
 
 			ThreadPool(size_t size);
+			ThreadPool(const ThreadPool &) = delete;
+			ThreadPool(ThreadPool &&) = delete;
 
 			~ThreadPool();
 
+			ThreadPool & operator=(const ThreadPool &) = delete;
+			ThreadPool & operator=(ThreadPool &&) = delete;
+
 			inline bool isActive() const { return active; }
 			inline auto getSize() const { return size; }
 
 			void start();
+			/** Stops the pool and waits for its threads to finish their current jobs. Jobs that haven't started are
+			 *  discarded, which breaks the promises of any futures waiting on them. */
 			void join();
 			void detach();
 			/** Returns true if the pool is active and added the job, or false if the pool is inactive. */
-			bool add(const Function &);
+			bool add(Function);
+			/** Like add, but for move-only jobs. */
+			bool post(Task);
+
+			/** Queues a job and returns a future for its result. Throws std::runtime_error if the pool is inactive. */
+			template <typename F>
+			auto submit(F &&function) -> std::future<std::invoke_result_t<std::decay_t<F>>> {
+				using Result = std::invoke_result_t<std::decay_t<F>>;
+				std::packaged_task<Result()> task(std::forward<F>(function));
+				auto future = task.get_future();
+				if (!post([task = std::move(task)](size_t) mutable { task(); })) {
+					throw std::runtime_error("Can't submit to an inactive thread pool");
+				}
+				return future;
+			}
 
+			/** Returns the number of jobs that haven't started yet. */
 			size_t jobCount() const;
 
+			/** Returns whether the calling thread belongs to this pool. */
+			bool isPoolThread() const;
+
 		protected:
+			struct Worker {
+				WorkStealingDeque<Task> deque;
+			};
+
 			const size_t size;
-			MTQueue<Function> workQueue;
-			std::condition_variable workCV;
-			std::mutex workMutex;
+			std::vector<std::unique_ptr<Worker>> workers;
 			std::vector<std::thread> pool;
+			/** Jobs submitted from outside the pool. Lock injectedMutex before using. */
+			std::deque<Task *> injected;
+			std::mutex injectedMutex;
+			std::atomic_size_t pending = 0;
+			std::atomic_size_t sleepers = 0;
+			/** Bumped and notified to wake parked threads. */
+			std::atomic_uint32_t wakeups = 0;
 			std::atomic_bool active = false;
 			std::atomic_bool joining = false;
-			std::atomic_bool newJobReady = false;
-			std::atomic_size_t jobsDone = 0;
+
+			void work(size_t index);
+			Task * findTask(size_t index);
+			void wake(bool all = false);
+			void stop(bool join_threads);
+			/** Destroys every job that hasn't started. Only safe once the threads are gone. */
+			void discardPending();
 	};
 }
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace Algiz {
+	/** A Chase-Lev work-stealing deque of pointers. Only the owning thread may push and pop, which it does at the bottom
+	 *  without taking any locks. Any thread may steal from the top. Grown buffers are kept until the deque is destroyed,
+	 *  since a thief might still be reading from one. Based on "Correct and Efficient Work-Stealing for Weak Memory
+	 *  Models" (Lê et al., 2013). */
+	template <typename T>
+	class WorkStealingDeque {
+		private:
+			class Buffer {
+				public:
+					const int64_t capacity;
+
+					explicit Buffer(int64_t capacity_):
+						capacity(capacity_),
+						mask(capacity_ - 1),
+						slots(std::make_unique<std::atomic<T *>[]>(capacity_)) {}
+
+					T * get(int64_t index) const {
+						return slots[index & mask].load(std::memory_order_relaxed);
+					}
+
+					void put(int64_t index, T *item) {
+						slots[index & mask].store(item, std::memory_order_relaxed);
+					}
+
+				private:
+					const int64_t mask;
+					std::unique_ptr<std::atomic<T *>[]> slots;
+			};
+
+			alignas(64) std::atomic<int64_t> top{0};
+			alignas(64) std::atomic<int64_t> bottom{0};
+			std::atomic<Buffer *> buffer;
+			/** Every buffer the deque has used, including the current one. Only touched by the owner. */
+			std::vector<std::unique_ptr<Buffer>> buffers;
+
+			Buffer * grow(Buffer *old, int64_t top_index, int64_t bottom_index) {
+				auto &grown = buffers.emplace_back(std::make_unique<Buffer>(old->capacity * 2));
+				for (int64_t i = top_index; i < bottom_index; ++i) {
+					grown->put(i, old->get(i));
+				}
+				buffer.store(grown.get(), std::memory_order_release);
+				return grown.get();
+			}
+
+		public:
+			/** The capacity has to be a power of two. */
+			explicit WorkStealingDeque(int64_t capacity = 256) {
+				buffer.store(buffers.emplace_back(std::make_unique<Buffer>(capacity)).get(), std::memory_order_relaxed);
+			}
+
+			WorkStealingDeque(const WorkStealingDeque &) = delete;
+			WorkStealingDeque(WorkStealingDeque &&) = delete;
+
+			WorkStealingDeque & operator=(const WorkStealingDeque &) = delete;
+			WorkStealingDeque & operator=(WorkStealingDeque &&) = delete;
+
+			/** Owner only. */
+			void push(T *item) {
+				const int64_t bottom_index = bottom.load(std::memory_order_relaxed);
+				const int64_t top_index = top.load(std::memory_order_acquire);
+				Buffer *current = buffer.load(std::memory_order_relaxed);
+
+				if (current->capacity - 1 < bottom_index - top_index) {
+					current = grow(current, top_index, bottom_index);
+				}
+
+				current->put(bottom_index, item);
+				std::atomic_thread_fence(std::memory_order_release);
+				bottom.store(bottom_index + 1, std::memory_order_relaxed);
+			}
+
+			/** Owner only. Takes the most recently pushed item. Returns nullptr if the deque is empty. */
+			T * pop() {
+				const int64_t bottom_index = bottom.load(std::memory_order_relaxed) - 1;
+				Buffer *current = buffer.load(std::memory_order_relaxed);
+				bottom.store(bottom_index, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				int64_t top_index = top.load(std::memory_order_relaxed);
+
+				if (bottom_index < top_index) {
+					bottom.store(bottom_index + 1, std::memory_order_relaxed);
+					return nullptr;
+				}
+
+				T *item = current->get(bottom_index);
+
+				if (top_index == bottom_index) {
+					// This is the last item, so a thief might be going for it too.
+					if (!top.compare_exchange_strong(top_index, top_index + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+						item = nullptr;
+					}
+					bottom.store(bottom_index + 1, std::memory_order_relaxed);
+				}
+
+				return item;
+			}
+
+			/** Any thread. Takes the least recently pushed item. Returns nullptr if the deque is empty or if another
+			 *  thread won the race for the item. */
+			T * steal() {
+				int64_t top_index = top.load(std::memory_order_acquire);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				const int64_t bottom_index = bottom.load(std::memory_order_acquire);
+
+				if (bottom_index <= top_index) {
+					return nullptr;
+				}
+
+				T *item = buffer.load(std::memory_order_acquire)->get(top_index);
+				if (!top.compare_exchange_strong(top_index, top_index + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+					return nullptr;
+				}
+
+				return item;
+			}
+
+			/** Approximate when called by anything other than the owner. */
+			bool empty() const {
+				return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+			}
+	};
+}
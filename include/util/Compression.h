@@ -0,0 +1,9 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace Algiz {
+	/** Compresses data into the gzip format. Throws std::runtime_error on failure. */
+	std::string gzip(std::string_view, int level = 6);
+}
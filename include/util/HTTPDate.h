@@ -0,0 +1,19 @@
+#pragma once
+
+#include <ctime>
+#include <optional>
+#include <string_view>
+
+namespace Algiz {
+	/** Formats a time as an IMF-fixdate (e.g., "Sun, 06 Nov 1994 08:49:37 GMT") without going through strftime. The
+	 *  result is cached per thread, so formatting the same second twice in a row is free. The returned view stays valid
+	 *  until the next call to formatHTTPDate on the same thread. */
+	std::string_view formatHTTPDate(time_t);
+
+	/** Returns the current time as an IMF-fixdate. It's formatted at most once per second per thread. The returned view
+	 *  stays valid until the next call to getHTTPDate on the same thread. */
+	std::string_view getHTTPDate();
+
+	/** Parses an HTTP date in any of the three formats RFC 9110 requires recipients to accept. */
+	std::optional<time_t> parseHTTPDate(std::string_view);
+}
@@ -5,6 +5,8 @@
 
 namespace Algiz {
 	std::string getMIME(const std::string &extension);
+	/** Returns whether content of a given MIME type is likely to shrink when compressed. */
+	bool isCompressible(std::string_view mime);
 
 	extern std::map<std::string, std::string> mimeTypes;
 }
\ No newline at end of file
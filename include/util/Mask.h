@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Algiz {
+	/** XORs data in place with a repeating four-byte WebSocket masking key. The key is given in wire order (as copied
+	 *  straight out of a frame header), and `offset` is the position within the key of the first byte, which lets a
+	 *  payload be unmasked in pieces as it arrives. Works 32 bytes at a time with AVX2 or 16 with SSE2 where they're
+	 *  available. */
+	void applyMask(char *data, size_t size, uint32_t key, size_t offset = 0);
+}
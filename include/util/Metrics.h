@@ -0,0 +1,177 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Algiz {
+	/** Metrics are updated from many threads at once, so the hot ones are split into shards that sit on separate cache
+	 *  lines. Each thread always updates the same shard, and readers add the shards together. */
+	constexpr size_t METRIC_SHARDS = 16;
+
+	/** Returns the shard the calling thread should update. */
+	size_t getMetricShard();
+
+	/** A monotonically increasing count. */
+	class Counter {
+		private:
+			struct alignas(64) Shard {
+				std::atomic_uint64_t value{0};
+			};
+
+			std::array<Shard, METRIC_SHARDS> shards;
+
+		public:
+			void add(uint64_t amount = 1) {
+				shards[getMetricShard()].value.fetch_add(amount, std::memory_order_relaxed);
+			}
+
+			[[nodiscard]] uint64_t get() const;
+	};
+
+	/** A value that can go up and down. Gauges are updated far less often than counters, so they aren't sharded. */
+	class Gauge {
+		private:
+			std::atomic_int64_t value{0};
+
+		public:
+			void add(int64_t amount = 1) { value.fetch_add(amount, std::memory_order_relaxed); }
+			void sub(int64_t amount = 1) { value.fetch_sub(amount, std::memory_order_relaxed); }
+			void set(int64_t new_value) { value.store(new_value, std::memory_order_relaxed); }
+			[[nodiscard]] int64_t get() const { return value.load(std::memory_order_relaxed); }
+	};
+
+	/** A log-linear histogram of durations in nanoseconds, in the style of HdrHistogram. Each power of two is split into
+	 *  SUB_BUCKETS buckets, so a recorded value is known to within 1/SUB_BUCKETS of itself. Recording is a couple of
+	 *  relaxed atomic increments. */
+	class Histogram {
+		public:
+			static constexpr int SUB_BUCKET_BITS = 3;
+			static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BUCKET_BITS;
+			static constexpr size_t BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+			struct Snapshot {
+				std::array<uint64_t, BUCKETS> counts{};
+				uint64_t count = 0;
+				/** In nanoseconds. */
+				uint64_t sum = 0;
+
+				/** Returns an upper bound in nanoseconds for the given quantile (between 0 and 1), or 0 if nothing has
+				 *  been recorded. */
+				[[nodiscard]] uint64_t getQuantile(double) const;
+				/** Returns how many recorded values are at most `bound` nanoseconds, give or take a bucket. */
+				[[nodiscard]] uint64_t countBelow(uint64_t bound) const;
+			};
+
+			Histogram();
+
+			void record(uint64_t nanoseconds) {
+				Shard &shard = shards[getMetricShard()];
+				shard.counts[getBucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+				shard.sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+			}
+
+			template <typename R, typename P>
+			void record(std::chrono::duration<R, P> duration) {
+				const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+				record(nanoseconds < 0? uint64_t(0) : uint64_t(nanoseconds));
+			}
+
+			[[nodiscard]] Snapshot snapshot() const;
+
+			static constexpr size_t getBucket(uint64_t value) {
+				if (value < SUB_BUCKETS) {
+					return size_t(value);
+				}
+				const int exponent = std::bit_width(value) - 1;
+				const size_t sub_bucket = size_t(value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+				return size_t(exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub_bucket;
+			}
+
+			/** Returns the largest value that falls into a bucket. */
+			static constexpr uint64_t getUpperBound(size_t bucket) {
+				if (bucket < SUB_BUCKETS) {
+					return bucket;
+				}
+				const int shift = int(bucket / SUB_BUCKETS) - 1;
+				const uint64_t lower = uint64_t(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+				return lower + ((uint64_t(1) << shift) - 1);
+			}
+
+		private:
+			struct alignas(64) Shard {
+				std::array<std::atomic_uint64_t, BUCKETS> counts{};
+				std::atomic_uint64_t sum{0};
+			};
+
+			std::unique_ptr<Shard[]> shards;
+	};
+
+	/** Keeps track of every metric by name and labels. Metrics are never removed, so references to them stay valid
+	 *  for the life of the process. Look metrics up once and keep the reference; lookups take a lock. */
+	class MetricsRegistry {
+		public:
+			enum class Type {Counter, Gauge, Histogram};
+
+			using Labels = std::vector<std::pair<std::string, std::string>>;
+
+			struct Series {
+				Labels labels;
+				/** The value of a counter or gauge. */
+				double value = 0;
+				/** Only set for histograms. */
+				std::shared_ptr<Histogram::Snapshot> histogram;
+			};
+
+			struct Family {
+				std::string name;
+				std::string help;
+				Type type;
+				std::vector<Series> series;
+			};
+
+			/** Returns the counter with the given name and labels, creating it if necessary. Throws std::invalid_argument
+			 *  if the name is already used by a metric of a different type. */
+			Counter & counter(const std::string &name, const std::string &help, const Labels & = {});
+			Gauge & gauge(const std::string &name, const std::string &help, const Labels & = {});
+			Histogram & histogram(const std::string &name, const std::string &help, const Labels & = {});
+
+			/** Returns the current values of every metric, sorted by name. */
+			[[nodiscard]] std::vector<Family> collect();
+
+			/** Renders every metric in the Prometheus text exposition format. Histograms are reported in seconds, with
+			 *  a bucket per power of two from about a microsecond to about a minute. */
+			[[nodiscard]] std::string renderPrometheus();
+
+			/** Renders labels as {name="value",...}, or as an empty string if there aren't any. */
+			static std::string renderLabels(const Labels &);
+
+		private:
+			struct Entry {
+				std::string help;
+				Type type;
+				/** Keyed by rendered labels. */
+				std::map<std::string, std::pair<Labels, std::unique_ptr<Counter>>> counters;
+				std::map<std::string, std::pair<Labels, std::unique_ptr<Gauge>>> gauges;
+				std::map<std::string, std::pair<Labels, std::unique_ptr<Histogram>>> histograms;
+			};
+
+			std::map<std::string, Entry> entries;
+			std::mutex entriesMutex;
+
+			Entry & getEntry(const std::string &name, const std::string &help, Type);
+
+			[[nodiscard]] auto lockEntries() { return std::unique_lock(entriesMutex); }
+	};
+
+	extern MetricsRegistry metrics;
+}
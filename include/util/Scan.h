@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+namespace Algiz {
+	/** Returns the index of the first occurrence of a byte at or after `start`, or std::string_view::npos if there isn't
+	 *  one. Scans 16 bytes at a time with SSE2 where it's available. */
+	size_t findByte(std::string_view, char needle, size_t start = 0);
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace Algiz {
+	/** A hierarchical timing wheel. Time is measured in ticks, and the owner decides how long a tick is and advances the
+	 *  wheel as time passes. Scheduling and cancelling are O(1), and timers far in the future are only touched a handful
+	 *  of times as they cascade down toward the innermost wheel. Not threadsafe. */
+	class TimingWheel {
+		public:
+			using Callback = std::move_only_function<void()>;
+
+			/** Identifies a scheduled timer. A handle goes stale once its timer has fired or been cancelled, so it's
+			 *  always safe to cancel with an old handle. */
+			class Handle {
+				private:
+					uint32_t index = 0;
+					/** 0 for empty handles. */
+					uint32_t generation = 0;
+
+					Handle(uint32_t index_, uint32_t generation_): index(index_), generation(generation_) {}
+
+				public:
+					Handle() = default;
+
+					explicit operator bool() const { return generation != 0; }
+					bool operator==(const Handle &) const = default;
+
+					friend TimingWheel;
+			};
+
+			static constexpr int LEVELS = 4;
+			static constexpr int SLOT_BITS = 8;
+			static constexpr size_t SLOTS = size_t(1) << SLOT_BITS;
+
+			/** Schedules a callback to be collected after at least `delay` ticks. A delay of 0 is treated as 1. */
+			Handle schedule(uint64_t delay, Callback);
+			/** Schedules a callback to be collected once the wheel reaches a given tick, or on the next tick if it's
+			 *  already there. */
+			Handle scheduleAt(uint64_t tick, Callback);
+			/** Returns false if the timer already fired or was cancelled. */
+			bool cancel(Handle);
+			[[nodiscard]] bool isPending(Handle) const;
+
+			/** Moves the wheel forward and appends the callbacks of every timer that came due to `expired`. The callbacks
+			 *  aren't run here so that they're free to schedule and cancel timers themselves. */
+			void advance(uint64_t ticks, std::vector<Callback> &expired);
+			/** Advances the wheel until it reaches a given tick. Does nothing if it's already there. Stretches with
+			 *  nothing due are skipped over rather than stepped through. */
+			void advanceTo(uint64_t tick, std::vector<Callback> &expired);
+			/** Returns the first tick after the current one at which a timer could come due or have to be moved down
+			 *  to an inner wheel, or UINT64_MAX if nothing is scheduled. Nothing happens between now and then, so the
+			 *  owner can sleep until that tick. */
+			[[nodiscard]] uint64_t nextExpiry() const;
+
+			[[nodiscard]] uint64_t getNow() const { return now; }
+			[[nodiscard]] size_t size() const { return count; }
+			[[nodiscard]] bool empty() const { return count == 0; }
+
+		private:
+			static constexpr uint32_t NONE = UINT32_MAX;
+
+			struct Timer {
+				uint64_t deadline = 0;
+				uint32_t previous = NONE;
+				uint32_t next = NONE;
+				/** Odd while the timer is scheduled. Bumped whenever it stops being scheduled to invalidate handles. */
+				uint32_t generation = 0;
+				/** The index into `slots` of the list the timer is in. */
+				uint32_t slot = NONE;
+				Callback callback;
+			};
+
+			uint64_t now = 0;
+			size_t count = 0;
+			std::vector<Timer> timers;
+			std::vector<uint32_t> freeTimers;
+			std::array<uint32_t, LEVELS * SLOTS> slots = makeEmptySlots();
+
+			static constexpr std::array<uint32_t, LEVELS * SLOTS> makeEmptySlots() {
+				std::array<uint32_t, LEVELS * SLOTS> out{};
+				out.fill(NONE);
+				return out;
+			}
+
+			/** Puts a timer in the list for its deadline relative to the current tick. */
+			void link(uint32_t index);
+			void unlink(uint32_t index);
+			void release(uint32_t index);
+			/** Moves every timer in a slot of an outer wheel to where it belongs now. */
+			void cascade(int level);
+			void tick(std::vector<Callback> &expired);
+	};
+}
@@ -15,6 +15,7 @@
 		<div id="links">
 			<a href="/" id="home">ᚺᛖᛁᛗ</a>
 			<a href="/ansuz/load" id="load">ᛚᛟᚨᛞ</a>
+			<a href="/ansuz/metrics" id="metrics">ᛗᛖᛏᚱᛁᚲᛊ</a>
 		</div>
 		<main class="container">
 			{% if length(plugins) == 0 %}
@@ -0,0 +1,38 @@
+<!doctype html>
+<html>
+	<head>
+		<title>Ansuz</title>
+		<meta charset="utf-8" />
+		<meta http-equiv="refresh" content="10" />
+		<link rel="stylesheet" href="https://cdn.jsdelivr.net/npm/bootstrap@5.1.3/dist/css/bootstrap.min.css" integrity="sha384-1BmE4kWBq78iYhFldvKuhfTAU6auU8tT94WrHftjDbrCEXSU1oBoqyl2QvZ6jIW3" crossorigin="anonymous">
+		<style>
+			{{css}}
+		</style>
+	</head>
+	<body>
+		<header><a href="/ansuz">ᚨᚾᛊᚢᛉ</a></header>
+		<div id="links">
+			<a href="/" id="home">ᚺᛖᛁᛗ</a>
+			<a href="/ansuz/load" id="load">ᛚᛟᚨᛞ</a>
+			<a href="/ansuz/metrics" id="metrics">ᛗᛖᛏᚱᛁᚲᛊ</a>
+		</div>
+		<main class="container">
+			<table class="table text-white">
+				<thead>
+					<th scope="col">Metric</th>
+					<th scope="col">Labels</th>
+					<th scope="col">Value</th>
+				</thead>
+				<tbody>
+				{% for metric in metrics %}
+					<tr>
+						<td title="{{metric.1}}">{{metric.0}}</td>
+						<td><code>{{metric.2}}</code></td>
+						<td>{{metric.3}}</td>
+					</tr>
+				{% endfor %}
+				</tbody>
+			</table>
+		</main>
+	</body>
+</html>
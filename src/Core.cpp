@@ -1,4 +1,5 @@
 #include <sys/socket.h>
+#include <iostream>
 
 #include "Core.h"
 #include "Log.h"
@@ -15,6 +16,21 @@ namespace Algiz {
 			throw std::runtime_error("Server argument to makeHTTP must not be null");
 		}
 
+		server->idleTimeout = suboptions.value("idleTimeout", DEFAULT_IDLE_TIMEOUT);
+
+		if (auto iter = suboptions.find("reusePort"); iter != suboptions.end()) {
+			server->reusePort = *iter;
+		}
+
+		if (auto iter = suboptions.find("streamWindow"); iter != suboptions.end()) {
+			server->streamWindow = *iter;
+		}
+
+		server->streamLowWatermark = server->streamWindow / 2;
+		if (auto iter = suboptions.find("streamLowWatermark"); iter != suboptions.end()) {
+			server->streamLowWatermark = std::min(iter->get<size_t>(), server->streamWindow);
+		}
+
 		auto *http = new HTTP::Server(std::move(server), suboptions);
 
 		try {
@@ -53,11 +69,58 @@ namespace Algiz {
 		return http;
 	}
 
+	static TLSSessions::Options getTLSSessionOptions(const nlohmann::json &suboptions) {
+		TLSSessions::Options options;
+		options.cacheSize = suboptions.value("cacheSize", options.cacheSize);
+		options.sessionTimeout = std::chrono::seconds(suboptions.value("sessionTimeout", options.sessionTimeout.count()));
+		options.sharedCachePath = suboptions.value("sharedCachePath", options.sharedCachePath);
+		options.sharedCacheSlots = suboptions.value("sharedCacheSlots", options.sharedCacheSlots);
+		options.tickets = suboptions.value("tickets", options.tickets);
+		options.ticketKeyInterval = std::chrono::seconds(suboptions.value("ticketKeyInterval", options.ticketKeyInterval.count()));
+
+		if (options.sessionTimeout.count() <= 0) {
+			throw std::invalid_argument("tlsSessions.sessionTimeout must be positive");
+		}
+
+		if (options.ticketKeyInterval.count() <= 0) {
+			throw std::invalid_argument("tlsSessions.ticketKeyInterval must be positive");
+		}
+
+		return options;
+	}
+
+	static OCSPStapler::Options getOCSPOptions(const nlohmann::json &suboptions) {
+		OCSPStapler::Options options;
+		if (!suboptions.is_object()) {
+			return options;
+		}
+
+		options.cacheDirectory = suboptions.value("cacheDirectory", options.cacheDirectory.string());
+		options.responder = suboptions.value("responder", options.responder);
+		options.timeout = std::chrono::seconds(suboptions.value("timeout", options.timeout.count()));
+
+		if (options.timeout.count() <= 0) {
+			throw std::invalid_argument("ocsp.timeout must be positive");
+		}
+
+		return options;
+	}
+
+	Core::~Core() {
+		if (eventLoop.isRunning()) {
+			eventLoop.stop();
+		}
+	}
+
 	void Core::run(nlohmann::json &json) {
 		if (!servers.empty()) {
 			throw std::runtime_error("Can't run: servers already present");
 		}
 
+		if (!eventLoop.isRunning()) {
+			eventLoop.start();
+		}
+
 		servers.reserve(2);
 
 		std::cerr << braille;
@@ -91,6 +154,15 @@ namespace Algiz {
 			const size_t threads = suboptions.contains("threads")? suboptions.at("threads").get<size_t>() : DEFAULT_THREAD_COUNT;
 			auto server = std::make_unique<SSLServer>(*this, af, ip, port, cert, key, chain, threads, 1024);
 			server->id = "https";
+			if (auto iter = suboptions.find("tlsSessions"); iter != suboptions.end() && iter->value("enabled", true)) {
+				server->enableSessionResumption(getTLSSessionOptions(*iter));
+			}
+			if (auto iter = suboptions.find("ocsp"); iter != suboptions.end() && (iter->is_object()? iter->value("enabled", true) : iter->get<bool>())) {
+				server->enableOCSPStapling(getOCSPOptions(*iter));
+			}
+			if (suboptions.value("kernelTLS", false) && !server->enableKernelTLS()) {
+				WARN("Kernel TLS was requested, but OpenSSL was built without it.");
+			}
 			servers.emplace_back(makeHTTP(std::move(server), suboptions));
 		}
 
@@ -1,7 +1,11 @@
 #include "EventLoop.h"
 
+#include <stdexcept>
+#include <vector>
+
 namespace Algiz {
-	EventLoop::EventLoop() = default;
+	EventLoop::EventLoop():
+		epoch(std::chrono::steady_clock::now()) {}
 
 	void EventLoop::start() {
 		if (running) {
@@ -18,66 +22,90 @@ namespace Algiz {
 			throw std::runtime_error("Event loop not running");
 		}
 
-		stopping = true;
+		{
+			std::unique_lock lock{mutex};
+			stopping = true;
+		}
 		cv.notify_all();
 		thread.join();
 		running = false;
 	}
 
-	bool EventLoop::schedule(std::chrono::system_clock::time_point point, Action action) {
+	EventLoop::Handle EventLoop::schedule(std::chrono::system_clock::time_point point, Action action) {
 		if (stopping || !running) {
-			return false;
+			return {};
 		}
 
-		std::unique_lock lock{actionsMutex};
-		actions.emplace(point, std::move(action));
-		cv.notify_all();
-		return true;
+		// The wheel runs on the steady clock so that adjustments to the system clock don't disturb it.
+		const auto steady_point = std::chrono::steady_clock::now() + (point - std::chrono::system_clock::now());
+		const uint64_t tick = getTick(steady_point);
+
+		Handle handle;
+		bool wake = false;
+		{
+			std::unique_lock lock{mutex};
+			if (wheel.empty()) {
+				// Nothing is pending, so the loop might be asleep and the wheel might be behind the clock.
+				std::vector<TimingWheel::Callback> none;
+				wheel.advanceTo(getTick(std::chrono::steady_clock::now()), none);
+			}
+			handle = wheel.scheduleAt(tick, std::move(action));
+			// The loop only needs waking if it plans to sleep past the new action.
+			if (tick < wakeTick) {
+				wakeTick = tick;
+				wake = true;
+			}
+		}
+
+		if (wake) {
+			cv.notify_all();
+		}
+
+		return handle;
+	}
+
+	bool EventLoop::cancel(Handle handle) {
+		std::unique_lock lock{mutex};
+		return wheel.cancel(handle);
+	}
+
+	uint64_t EventLoop::getTick(std::chrono::steady_clock::time_point point) const {
+		if (point <= epoch) {
+			return 0;
+		}
+
+		return uint64_t((point - epoch + RESOLUTION - std::chrono::nanoseconds(1)) / RESOLUTION);
 	}
 
 	void EventLoop::loop() {
-		while (running && !stopping) {
-			std::unique_lock lock{actionsMutex};
+		std::vector<TimingWheel::Callback> expired;
+		std::unique_lock lock{mutex};
 
-			if (actions.empty()) {
-				lock.unlock();
-				awaitNewAction();
+		while (!stopping) {
+			if (wheel.empty()) {
+				wakeTick = std::numeric_limits<uint64_t>::max();
+				cv.wait(lock, [this] { return stopping || !wheel.empty(); });
 				continue;
 			}
 
-			auto iter = actions.begin();
-			std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
-
-			// If the action isn't ready yet, wait for it.
-			if (now < iter->first) {
-				awaitNextAction(iter->first);
-				if (stopping) {
-					break;
-				}
+			// Sleep straight through the ticks where nothing is due. schedule() lowers wakeTick and wakes the loop if
+			// something earlier comes in meanwhile.
+			const uint64_t planned = wakeTick = wheel.nextExpiry();
+			if (cv.wait_until(lock, epoch + RESOLUTION * planned, [this, planned] { return stopping || wakeTick < planned; })) {
+				continue;
 			}
 
-			auto moved_action = std::move(iter->second);
-			actions.erase(iter);
+			wheel.advanceTo(uint64_t((std::chrono::steady_clock::now() - epoch) / RESOLUTION), expired);
 
-			// Briefly release the lock in case the called action needs to schedule more actions.
-			lock.unlock();
-			moved_action();
+			if (!expired.empty()) {
+				// Release the lock while running the actions in case they need to schedule more actions.
+				lock.unlock();
+				for (auto &action: expired) {
+					action();
+				}
+				expired.clear();
+				lock.lock();
+			}
 		}
 	}
-
-	void EventLoop::awaitNewAction() {
-		std::unique_lock cv_lock{cvMutex};
-		cv.wait(cv_lock, [&] {
-			std::unique_lock actions_lock{actionsMutex};
-			return stopping || !actions.empty();
-		});
-	}
-
-	void EventLoop::awaitNextAction(std::chrono::system_clock::time_point point) {
-		std::unique_lock cv_lock{cvMutex};
-		cv.wait_for(cv_lock, point - std::chrono::system_clock::now(), [&] {
-			std::unique_lock actions_lock{actionsMutex};
-			return stopping || point <= std::chrono::system_clock::now();
-		});
-	}
 }
@@ -1,10 +1,356 @@
 #include "Log.h"
+#include "threading/SPSCRing.h"
 #include "util/Util.h"
 
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
 namespace Algiz {
 	Logger log;
 
+	namespace {
+		struct RecordHeader {
+			LogLevel level;
+			uint16_t sink;
+			int64_t second;
+		};
+
+		/** The most records written per pass, so that a busy thread can't starve the others. */
+		constexpr size_t MAX_BATCH = 1024;
+		constexpr std::chrono::milliseconds IDLE_WAIT{50};
+
+		struct LevelStyle {
+			std::string_view consolePrefix;
+			std::string_view consoleSuffix;
+			std::string_view plainTag;
+		};
+
+		constexpr std::array<LevelStyle, 6> levelStyles{{
+			{"\e[22;2m]\e[22m (\e[22;1;34mi\e[22;39m)\e[2m ::\e[22m ",  "\n",        " (i) "},
+			{"\e[22;2m]\e[22m (\e[22;1;33m!\e[22;39m)\e[2m ::\e[22m ",  "\n",        " (!) "},
+			{"\e[22;2m]\e[22m (\e[22;1;31m!\e[22;39m)\e[2m ::\e[22m ",  "\n",        " (E) "},
+			{"\e[22;2m]\e[22m (\e[22;1;35m_\e[22;39m)\e[2m :: ",        "\e[22m\n",  " (_) "},
+			{"\e[22;2m]\e[22m (\e[22;1;32m🗸\e[22;39m)\e[2m :: ",       "\e[22m\n",  " (+) "},
+			{"",                                                        "\n",        ""},
+		}};
+
+		/** Writes every byte described by a list of iovecs, retrying after partial writes and interruptions. */
+		bool writeAll(int descriptor, iovec *vectors, size_t count) {
+			while (0 < count) {
+				const ssize_t written = ::writev(descriptor, vectors, int(std::min<size_t>(count, IOV_MAX)));
+				if (written < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					return false;
+				}
+
+				size_t remaining = size_t(written);
+				while (0 < count && vectors->iov_len <= remaining) {
+					remaining -= vectors->iov_len;
+					++vectors;
+					--count;
+				}
+
+				if (0 < count) {
+					vectors->iov_base = static_cast<char *>(vectors->iov_base) + remaining;
+					vectors->iov_len -= remaining;
+				}
+			}
+
+			return true;
+		}
+	}
+
+	Logger::Logger() {
+		auto console = std::make_unique<Sink>();
+		console->descriptor = STDERR_FILENO;
+		sinks.emplace_back(std::move(console));
+		thread = std::thread(&Logger::loop, this);
+	}
+
+	Logger::~Logger() {
+		{
+			std::unique_lock lock(wakeMutex);
+			stopping = true;
+		}
+		wakeCV.notify_all();
+		thread.join();
+
+		for (size_t i = 1; i < sinks.size(); ++i) {
+			if (sinks[i] && sinks[i]->descriptor != -1) {
+				::close(sinks[i]->descriptor);
+			}
+		}
+	}
+
+	std::ostringstream & Logger::getStream() {
+		thread_local std::ostringstream stream;
+		return stream;
+	}
+
+	void Logger::submit(LogLevel level, std::ostringstream &stream) {
+		// Taking the string out and putting it back keeps its capacity around for the thread's next message.
+		std::string text = std::move(stream).str();
+		write(CONSOLE, level, text);
+		text.clear();
+		stream.str(std::move(text));
+	}
+
+	void Logger::write(size_t sink, LogLevel level, std::string_view text) {
+		RecordHeader header{level, uint16_t(sink), std::chrono::duration_cast<std::chrono::seconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count()};
+
+		SPSCRing &ring = getRing();
+		const std::string_view header_view(reinterpret_cast<const char *>(&header), sizeof(header));
+		if (ring.getCapacity() / 2 < text.size()) {
+			text = text.substr(0, ring.getCapacity() / 2);
+		}
+
+		if (!ring.tryPush({header_view, text})) {
+			++dropped;
+			return;
+		}
+
+		if (sleeping.load(std::memory_order_relaxed)) {
+			wakeCV.notify_one();
+		}
+	}
+
+	size_t Logger::openFile(const std::filesystem::path &path, size_t max_bytes, size_t keep) {
+		const int descriptor = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (descriptor == -1) {
+			throw std::runtime_error("Couldn't open log file " + path.string() + ": " + std::strerror(errno));
+		}
+
+		struct stat status {};
+		const size_t size = ::fstat(descriptor, &status) == 0? size_t(status.st_size) : 0;
+
+		auto sink = std::make_unique<Sink>(descriptor, path, max_bytes, keep, size, false);
+		std::unique_lock lock(sinksMutex);
+		sinks.emplace_back(std::move(sink));
+		return sinks.size() - 1;
+	}
+
+	void Logger::closeFile(size_t sink) {
+		if (sink == CONSOLE) {
+			return;
+		}
+
+		std::unique_lock lock(sinksMutex);
+		if (sink < sinks.size() && sinks[sink]) {
+			sinks[sink]->closing = true;
+		}
+	}
+
+	void Logger::flush() {
+		std::unique_lock lock(wakeMutex);
+		const uint64_t ticket = ++flushRequested;
+		wakeCV.notify_all();
+		flushCV.wait(lock, [&] { return ticket <= flushCompleted || stopping; });
+	}
+
 	std::string Logger::getTimestamp() {
 		return formatTime("%H:%M:%S");
 	}
+
+	SPSCRing & Logger::getRing() {
+		thread_local std::shared_ptr<SPSCRing> ring = [this] {
+			auto new_ring = std::make_shared<SPSCRing>(RING_SIZE);
+			std::unique_lock lock(ringsMutex);
+			rings.push_back(new_ring);
+			return new_ring;
+		}();
+		return *ring;
+	}
+
+	void Logger::loop() {
+		for (;;) {
+			uint64_t flush_ticket;
+			{
+				std::unique_lock lock(wakeMutex);
+				flush_ticket = flushRequested;
+			}
+
+			bool exhausted = false;
+			const size_t written = drain(exhausted);
+
+			std::unique_lock lock(wakeMutex);
+
+			if (exhausted && flushCompleted < flush_ticket) {
+				flushCompleted = flush_ticket;
+				flushCV.notify_all();
+			}
+
+			if (stopping) {
+				lock.unlock();
+				while (drain(exhausted) != 0 || !exhausted);
+				lock.lock();
+				flushCompleted = flushRequested;
+				flushCV.notify_all();
+				return;
+			}
+
+			if (exhausted && written == 0 && flushRequested == flushCompleted) {
+				sleeping = true;
+				wakeCV.wait_for(lock, IDLE_WAIT);
+				sleeping = false;
+			}
+		}
+	}
+
+	size_t Logger::drain(bool &exhausted) {
+		std::vector<std::shared_ptr<SPSCRing>> current;
+		{
+			std::unique_lock lock(ringsMutex);
+			// Forget the rings of threads that have exited once they're empty.
+			std::erase_if(rings, [](const auto &ring) { return ring.use_count() == 1 && ring->empty(); });
+			current = rings;
+		}
+
+		size_t count = 0;
+		exhausted = true;
+
+		for (const auto &ring: current) {
+			size_t taken = 0;
+			for (; taken < MAX_BATCH; ++taken) {
+				if (records.size() <= count) {
+					records.emplace_back();
+				}
+				if (!ring->tryPop(records[count])) {
+					break;
+				}
+				++count;
+			}
+			if (taken == MAX_BATCH) {
+				exhausted = false;
+			}
+		}
+
+		if (const size_t dropped_now = dropped.load(); dropped_now != droppedReported) {
+			const size_t difference = dropped_now - droppedReported;
+			droppedReported = dropped_now;
+			RecordHeader header{LogLevel::Warn, uint16_t(CONSOLE), std::chrono::duration_cast<std::chrono::seconds>(
+				std::chrono::system_clock::now().time_since_epoch()).count()};
+			if (records.size() <= count) {
+				records.emplace_back();
+			}
+			records[count].assign(reinterpret_cast<const char *>(&header), sizeof(header));
+			records[count] += std::to_string(difference) + " log message" + (difference == 1? " was" : "s were") + " dropped";
+			++count;
+		}
+
+		// The iovecs point into these, so they have to stay put until everything is written.
+		timestamps.resize(std::max(timestamps.size(), count));
+		for (size_t i = 0; i < count; ++i) {
+			RecordHeader header;
+			std::memcpy(&header, records[i].data(), sizeof(header));
+			timestamps[i] = formatTimestamp(header.second);
+		}
+
+		std::unique_lock sinks_lock(sinksMutex);
+		std::vector<iovec> vectors;
+		vectors.reserve(count * 5);
+
+		for (size_t sink_id = 0; sink_id < sinks.size(); ++sink_id) {
+			Sink *sink = sinks[sink_id].get();
+			if (sink == nullptr) {
+				continue;
+			}
+
+			vectors.clear();
+			size_t bytes = 0;
+			auto add = [&](std::string_view piece) {
+				vectors.push_back({const_cast<char *>(piece.data()), piece.size()});
+				bytes += piece.size();
+			};
+
+			for (size_t i = 0; i < count; ++i) {
+				RecordHeader header;
+				std::memcpy(&header, records[i].data(), sizeof(header));
+				if (header.sink != sink_id) {
+					continue;
+				}
+
+				const std::string_view text = std::string_view(records[i]).substr(sizeof(header));
+				const LevelStyle &style = levelStyles.at(size_t(header.level));
+
+				if (header.level == LogLevel::Raw) {
+					add(text);
+				} else if (sink_id == CONSOLE) {
+					add("\e[2m[\e[1m");
+					add({timestamps[i].data(), timestamps[i].size()});
+					add(style.consolePrefix);
+					add(text);
+					add(style.consoleSuffix);
+					continue;
+				} else {
+					add("[");
+					add({timestamps[i].data(), timestamps[i].size()});
+					add("]");
+					add(style.plainTag);
+					add(text);
+				}
+				add("\n");
+			}
+
+			if (!vectors.empty() && sink->descriptor != -1) {
+				if (sink->maxBytes != 0 && sink->size != 0 && sink->maxBytes < sink->size + bytes) {
+					rotate(*sink);
+				}
+				if (sink->descriptor != -1 && writeAll(sink->descriptor, vectors.data(), vectors.size())) {
+					sink->size += bytes;
+				}
+			}
+
+			if (sink->closing && exhausted && sink_id != CONSOLE) {
+				::close(sink->descriptor);
+				sinks[sink_id].reset();
+			}
+		}
+
+		return count;
+	}
+
+	const std::array<char, 8> & Logger::formatTimestamp(int64_t second) {
+		if (second != cachedSecond) {
+			cachedSecond = second;
+			const time_t time = time_t(second);
+			tm local {};
+			localtime_r(&time, &local);
+			char buffer[9];
+			std::strftime(buffer, sizeof(buffer), "%H:%M:%S", &local);
+			std::memcpy(cachedTimestamp.data(), buffer, cachedTimestamp.size());
+		}
+
+		return cachedTimestamp;
+	}
+
+	void Logger::rotate(Sink &sink) {
+		::close(sink.descriptor);
+		sink.descriptor = -1;
+
+		const std::string base = sink.path.string();
+		std::error_code error;
+
+		if (sink.keep == 0) {
+			std::filesystem::remove(sink.path, error);
+		} else {
+			std::filesystem::remove(base + '.' + std::to_string(sink.keep), error);
+			for (size_t i = sink.keep; 1 < i; --i) {
+				std::filesystem::rename(base + '.' + std::to_string(i - 1), base + '.' + std::to_string(i), error);
+			}
+			std::filesystem::rename(sink.path, base + ".1", error);
+		}
+
+		sink.descriptor = ::open(sink.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		sink.size = 0;
+	}
 }
@@ -1,4 +1,5 @@
 #include <dlfcn.h>
+#include <algorithm>
 #include <filesystem>
 
 #include "plugins/PluginHost.h"
@@ -11,8 +12,18 @@ namespace Algiz::Plugins {
 		if (iter == plugins.end()) {
 			throw std::runtime_error("Couldn't find plugin tuple for path " + path);
 		}
-		plugin->cleanup(this);
-		plugin.reset();
+		{
+			auto lock = lockHandlers();
+			plugin->cleanup(this);
+			plugin.reset();
+
+			// A new handler could be allocated where an old one was, so forget handlers that are gone.
+			const auto remaining = getHandlerPointers();
+			std::erase_if(handlerHistograms, [&](const auto &pair) {
+				return std::find(remaining.begin(), remaining.end(), pair.first) == remaining.end();
+			});
+		}
+
 		plugins.erase(iter);
 		dlclose(handle);
 	}
@@ -113,7 +124,23 @@ namespace Algiz::Plugins {
 
 	void PluginHost::postinitPlugins() {
 		for (auto &[path, plugin, handle]: plugins) {
-			plugin->postinit(this);
+			postinitPlugin(*plugin);
+		}
+	}
+
+	void PluginHost::postinitPlugin(Plugin &plugin) {
+		auto lock = lockHandlers();
+		const auto previous = getHandlerPointers();
+		plugin.postinit(this);
+		adoptHandlers(plugin, previous);
+	}
+
+	void PluginHost::adoptHandlers(const Plugin &plugin, const std::vector<const void *> &previous) {
+		for (const void *handler: getHandlerPointers()) {
+			if (!handlerHistograms.contains(handler) && std::find(previous.begin(), previous.end(), handler) == previous.end()) {
+				handlerHistograms.emplace(handler, &metrics.histogram("algiz_plugin_handler_seconds",
+					"Time spent in plugins' event handlers.", {{"plugin", plugin.getName()}}));
+			}
 		}
 	}
 
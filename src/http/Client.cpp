@@ -1,14 +1,36 @@
 #include <bit>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <memory>
 
 #include "Log.h"
+#include "error/BadRequest.h"
+#include "error/NotImplemented.h"
 #include "error/ParseError.h"
 #include "error/UnsupportedMethod.h"
 #include "http/Client.h"
 #include "http/Response.h"
 #include "http/Server.h"
+#include "util/Defer.h"
+#include "util/HTTPDate.h"
+#include "util/Mask.h"
 #include "util/Util.h"
 
 namespace Algiz::HTTP {
+	namespace {
+		/** Past this, a message buffer's memory is released after the message has been handled. */
+		constexpr size_t MAX_RETAINED_PACKET_CAPACITY = 1 << 20;
+
+		/** Empties a message buffer. Don't hold on to a huge buffer just because the client once sent a huge message. */
+		void releasePacket(std::string &packet) {
+			packet.clear();
+			if (MAX_RETAINED_PACKET_CAPACITY < packet.capacity()) {
+				std::string().swap(packet);
+			}
+		}
+	}
+
 	void Client::send(std::string_view message) {
 		server.server->send(id, message);
 	}
@@ -17,167 +39,356 @@ namespace Algiz::HTTP {
 		server.server->send(id, message);
 	}
 
+	void Client::send(Response response) {
+		prepare(response);
+		noteResponse(response.code, headersOnly? 0 : response.contentView().size());
+		std::unique_ptr<evbuffer, decltype(&evbuffer_free)> buffer(evbuffer_new(), evbuffer_free);
+		if (headersOnly) {
+			// The Content-Length still describes the body a GET would have gotten.
+			response.writeHead(buffer.get());
+		} else {
+			std::move(response).serialize(buffer.get());
+		}
+		server.server->send(id, buffer.get());
+	}
+
+	void Client::sendHead(Response &response) {
+		prepare(response);
+		size_t bytes = 0;
+		if (!headersOnly) {
+			if (auto iter = response.headers.find("content-length"); iter != response.headers.end()) {
+				std::from_chars(iter->second.data(), iter->second.data() + iter->second.size(), bytes);
+			}
+		}
+		noteResponse(response.code, bytes);
+		std::unique_ptr<evbuffer, decltype(&evbuffer_free)> buffer(evbuffer_new(), evbuffer_free);
+		response.writeHead(buffer.get());
+		server.server->send(id, buffer.get());
+	}
+
+	void Client::noteResponse(int status, size_t bytes) {
+		responseStatus = status;
+		responseBytes = bytes;
+	}
+
+	Response & Client::prepare(Response &response) const {
+		// Switching protocols sets its own Connection header.
+		if (response.code == 101) {
+			return response;
+		}
+
+		if (!keepAlive) {
+			return response.setClose(true);
+		}
+
+		response.setClose(false);
+		if (legacyVersion) {
+			response["connection"] = "keep-alive";
+		}
+
+		return response;
+	}
+
+	void Client::writeDynamicHeaders(evbuffer *output) const {
+		auto add = [output](std::string_view piece) {
+			evbuffer_add(output, piece.data(), piece.size());
+		};
+
+		add("Date: ");
+		add(getHTTPDate());
+
+		// Matches what prepare() does to a full response.
+		if (!keepAlive) {
+			add("\r\nConnection: close\r\n\r\n");
+		} else if (legacyVersion) {
+			add("\r\nConnection: keep-alive\r\n\r\n");
+		} else {
+			add("\r\n\r\n");
+		}
+	}
+
+	void Client::stream(Algiz::Server::Producer producer) {
+		if (headersOnly) {
+			return;
+		}
+		server.server->stream(id, std::move(producer));
+	}
+
 	void Client::close() {
 		if (!keepAlive)
 			server.server->close(id);
 	}
 
-#define CHECKSIZE(n) do { if (message_size < (n)) { if (!has_leftover) leftoverMessage = message; return; } } while (false)
-
 	void Client::handleInput(std::string_view message_in) {
 		if (isWebSocket) {
-			const bool has_leftover = !leftoverMessage.empty();
-			if (has_leftover)
-				leftoverMessage += message_in;
-			std::string_view message = has_leftover? leftoverMessage : message_in;
-			const size_t message_size = message.size();
-
-			if (awaitingWebSocketHeader) {
-				CHECKSIZE(2);
-
-				const uint8_t byte1 = message[0];
-				const bool fin = ((byte1 >> 7) & 1) == 1;
-				lastFin = fin;
-				const uint8_t opcode = byte1 & 0xf;
-				const uint8_t byte2 = message[1];
-				const bool use_mask = ((byte2 >> 7) & 1) == 1;
-				uint64_t payload_length = byte2 & 0x7f;
-
-				size_t mask_index = 2;
-
-				if (payload_length == 126) {
-					CHECKSIZE(4);
-					payload_length = (uint64_t(uint8_t(message[2])) << 8) | uint8_t(message[3]);
-					mask_index += 2;
-				} else if (payload_length == 127) {
-					CHECKSIZE(10);
-					std::memcpy(&payload_length, &message[2], sizeof(payload_length));
-					if (std::endian::native == std::endian::little)
-						payload_length = __builtin_bswap64(payload_length);
-					mask_index += 8;
-				}
+			// Frames that arrived in the same read as the handshake. handleBuffer is called right after this and puts
+			// them back in front of the rest of the input.
+			leftoverMessage += message_in;
+		} else {
+			if (busy) {
+				deferredInput += message_in;
+				return;
+			}
 
-				if (!use_mask || maxWebSocketPacketLength < payload_length) {
-					server.send400(*this);
-					removeSelf();
-					return;
-				}
+			std::string_view remaining = message_in;
+			try {
+				// A single read can contain several pipelined requests. They're handled in order.
+				while (!remaining.empty()) {
+					bool done = false;
+					remaining.remove_prefix(request.feed(remaining, done));
+					if (!done) {
+						break;
+					}
 
-				CHECKSIZE(mask_index + 4);
-				std::memcpy(&webSocketMask, &message[mask_index], sizeof(webSocketMask));
-				if (std::endian::native == std::endian::little)
-					webSocketMask = __builtin_bswap32(webSocketMask);
+					cancelHeaderTimer();
+					updateKeepAlive();
 
-				const uint64_t payload_length_here = std::min(payload_length, uint64_t(message_size - mask_index - 4));
-				remainingBytesInPacket = payload_length - payload_length_here;
-				packet.reserve(payload_length);
-				maskOffset = 0;
+					if (offloadRequest()) {
+						// Pipelined requests have to wait their turn so that responses go out in order.
+						deferredInput.assign(remaining);
+						return;
+					}
 
-				// There must be a more efficient way than doing this byte by byte.
-				for (uint64_t i = 0; i < payload_length_here; ++i) {
-					packet += char(message[i + mask_index + 4] ^ uint8_t(webSocketMask >> (8 * (3 - maskOffset))));
-					maskOffset = (maskOffset + 1) % 4;
-				}
+					handleRequest();
+					request.reset();
 
-				if (opcode == 9) {
-					if (payload_length <= 125)
-						sendWebSocket(packet, true, 10);
-					else // Pings cannot have a payload greater than 125 bytes in length.
-						closeWebSocket();
-				} else {
-					const uint64_t end = payload_length_here + mask_index + 4;
-					if (end < message_size) {
-						awaitingWebSocketHeader = true;
-						leftoverMessage = message.substr(end);
-						if (fin) {
-							remainingBytesInPacket = 0;
-							server.handleWebSocketMessage(*this, packet);
-						} else
-							closeWebSocket();
-						packet.clear();
-					} else {
-						if (end == message_size && remainingBytesInPacket == 0) {
-							awaitingWebSocketHeader = true;
-							if (fin)
-								server.handleWebSocketMessage(*this, packet);
-							else
-								closeWebSocket();
-							packet.clear();
-						} else
-							awaitingWebSocketHeader = false;
-						leftoverMessage.clear();
+					if (isWebSocket) {
+						// Anything after the handshake is WebSocket data.
+						leftoverMessage.assign(remaining);
+						return;
 					}
-				}
-			} else {
-				const uint64_t payload_length_here = std::min(remainingBytesInPacket, uint64_t(message_size));
 
-				for (uint64_t i = 0; i < payload_length_here; ++i) {
-					packet += char(message[i] ^ uint8_t(webSocketMask >> (8 * (3 - maskOffset))));
-					maskOffset = (maskOffset + 1) % 4;
+					if (!keepAlive) {
+						// Nothing after a request that ends the connection will be answered.
+						return;
+					}
 				}
 
-				if (remainingBytesInPacket < message_size) {
-					leftoverMessage = message.substr(payload_length_here);
-					remainingBytesInPacket = 0;
-				} else
-					remainingBytesInPacket -= payload_length_here;
-
-				if (remainingBytesInPacket == 0) {
-					awaitingWebSocketHeader = true;
-					if (lastFin) {
-						server.handleWebSocketMessage(*this, packet);
-						packet.clear();
-					}
+				if (request.isReadingHead()) {
+					startHeaderTimer();
 				}
-			}
-		} else {
-			try {
-				const auto result = request.handleLine(message_in);
-				if (result == Request::HandleResult::DisableLineMode)
-					lineMode = false;
-				else if (result == Request::HandleResult::Done)
-					handleRequest();
 			} catch (const UnsupportedMethod &) {
+				keepAlive = false;
 				server.send400(*this);
 				removeSelf();
+			} catch (const BadRequest &) {
+				keepAlive = false;
+				server.send400(*this);
+				removeSelf();
+			} catch (const NotImplemented &) {
+				keepAlive = false;
+				send(Response(501, "Not Implemented"));
+				removeSelf();
+			}
+		}
+	}
+
+	void Client::handleBuffer(evbuffer *input) {
+		awaitingPong = false;
+
+		if (!leftoverMessage.empty()) {
+			if (evbuffer_prepend(input, leftoverMessage.data(), leftoverMessage.size()) != 0) {
+				throw std::runtime_error("Couldn't return leftover WebSocket data to input buffer");
+			}
+			leftoverMessage.clear();
+		}
+
+		for (;;) {
+			if (awaitingWebSocketHeader && !readFrameHeader(input)) {
+				return;
+			}
+
+			// The frame's payload goes straight from the input buffer to its place at the end of the message, where
+			// it's unmasked in place.
+			std::string &target = inControlFrame? controlPacket : packet;
+			const size_t to_read = std::min<uint64_t>(frameRemaining, evbuffer_get_length(input));
+			if (0 < to_read) {
+				char *destination = target.data() + target.size() - frameRemaining;
+				if (evbuffer_remove(input, destination, to_read) != ev_ssize_t(to_read)) {
+					throw std::runtime_error("Couldn't read WebSocket payload from input buffer");
+				}
+				applyMask(destination, to_read, webSocketMask, maskOffset);
+				maskOffset = (maskOffset + to_read) % 4;
+				frameRemaining -= to_read;
+			}
+
+			if (frameRemaining != 0) {
+				return;
+			}
+
+			awaitingWebSocketHeader = true;
+			if (!finishFrame()) {
+				return;
+			}
+		}
+	}
+
+	bool Client::readFrameHeader(evbuffer *input) {
+		uint8_t header[14];
+		const ev_ssize_t copied = evbuffer_copyout(input, header, sizeof(header));
+		if (copied < 2) {
+			return false;
+		}
+
+		const bool fin = (header[0] & 0x80) != 0;
+		const uint8_t reserved = header[0] & 0x70;
+		const uint8_t opcode = header[0] & 0xf;
+		const bool use_mask = (header[1] & 0x80) != 0;
+		uint64_t payload_length = header[1] & 0x7f;
+		size_t header_size = 2;
+
+		if (payload_length == 126) {
+			header_size += 2;
+		} else if (payload_length == 127) {
+			header_size += 8;
+		}
+
+		// Clients always mask their frames.
+		header_size += 4;
+
+		if (copied < ev_ssize_t(header_size)) {
+			return false;
+		}
+
+		if (payload_length == 126) {
+			payload_length = (uint64_t(header[2]) << 8) | header[3];
+		} else if (payload_length == 127) {
+			payload_length = 0;
+			for (size_t i = 2; i < 10; ++i) {
+				payload_length = (payload_length << 8) | header[i];
+			}
+		}
+
+		const bool is_control = (opcode & 8) != 0;
+		// RSV1 marks a compressed message. It's only allowed on the first frame of a data message.
+		const bool compressed = reserved == 0x40;
+		bool valid = use_mask && (reserved == 0 || (compressed && webSocketDeflate && !is_control && opcode != 0));
+
+		if (is_control) {
+			// Control frames can come in the middle of a fragmented message, but they can't be fragmented themselves.
+			valid = valid && fin && payload_length <= 125 && opcode <= 10;
+		} else if (opcode == 0) {
+			valid = valid && assemblingMessage;
+		} else {
+			valid = valid && !assemblingMessage && opcode <= 2;
+		}
+
+		if (!valid || (!is_control && maxWebSocketPacketLength - packet.size() < payload_length)) {
+			closeWebSocket();
+			return false;
+		}
+
+		evbuffer_drain(input, header_size);
+		std::memcpy(&webSocketMask, header + header_size - 4, sizeof(webSocketMask));
+		maskOffset = 0;
+		frameRemaining = payload_length;
+		frameOpcode = opcode;
+		frameFin = fin;
+		inControlFrame = is_control;
+
+		if (is_control) {
+			controlPacket.resize(payload_length);
+		} else {
+			if (opcode != 0) {
+				packetOpcode = opcode;
+				packetCompressed = compressed;
+				assemblingMessage = true;
+			}
+			packet.resize(packet.size() + payload_length);
+		}
+
+		awaitingWebSocketHeader = false;
+		return true;
+	}
+
+	bool Client::finishFrame() {
+		if (inControlFrame) {
+			switch (frameOpcode) {
+				case 8:
+					// Echo the status code, if there is one, and hang up.
+					sendWebSocket(std::string_view(controlPacket).substr(0, 2), true, 8);
+					server.closeWebSocket(*this);
+					return false;
+				case 9:
+					sendWebSocket(controlPacket, true, 10);
+					return true;
+				default:
+					// Pongs only matter as a sign of life, which handleBuffer already took note of.
+					return true;
+			}
+		}
+
+		if (!frameFin) {
+			return true;
+		}
+
+		assemblingMessage = false;
+
+		if (packetCompressed) {
+			if (!webSocketDeflate->decompress(packet, inflatedPacket, maxWebSocketPacketLength)) {
+				closeWebSocket();
+				return false;
 			}
+			deliverPacket(inflatedPacket);
+			releasePacket(inflatedPacket);
+		} else {
+			deliverPacket(packet);
 		}
+
+		releasePacket(packet);
+		return true;
 	}
 
 	void Client::sendWebSocket(std::string_view message, bool is_binary, uint8_t opcode_override) {
-		const size_t message_size = message.size();
 		const uint8_t opcode = opcode_override != 255? opcode_override : (is_binary? 2 : 1);
 
-		std::string header;
-		header.reserve(10);
+		// Control frames are never compressed.
+		if (webSocketDeflate && (opcode == 1 || opcode == 2) && webSocketDeflate->shouldCompress(message.size())) {
+			thread_local std::string compressed;
+			auto lock = lockDeflate();
+			webSocketDeflate->compress(message, compressed);
+			// The client decompresses messages in the order they arrive, so they have to be queued in the order they
+			// were compressed.
+			sendFrame(0x40 | opcode, compressed);
+			releasePacket(compressed);
+			return;
+		}
 
-		header += uint8_t(1 << 7) | opcode;
+		sendFrame(opcode, message);
+	}
 
-		uint8_t byte2 = 0 << 7;
+	void Client::sendFrame(uint8_t first_byte, std::string_view message) {
+		uint8_t header[MAX_FRAME_HEADER_SIZE];
+		const size_t header_size = encodeFrameHeader(header, first_byte, message.size());
 
-		if (message_size <= 125) {
-			byte2 |= message_size;
-			header += byte2;
-		} else if (message_size < 65536) {
-			byte2 |= 126;
-			header += byte2;
-			header += uint8_t((message_size >> 8) & 0xff);
-			header += uint8_t((message_size >> 0) & 0xff);
-		} else {
-			byte2 |= 127;
-			header += byte2;
-			header += uint8_t((message_size >> 56) & 0xff);
-			header += uint8_t((message_size >> 48) & 0xff);
-			header += uint8_t((message_size >> 40) & 0xff);
-			header += uint8_t((message_size >> 32) & 0xff);
-			header += uint8_t((message_size >> 24) & 0xff);
-			header += uint8_t((message_size >> 16) & 0xff);
-			header += uint8_t((message_size >>  8) & 0xff);
-			header += uint8_t((message_size >>  0) & 0xff);
+		// Send the header and payload together so they can't be separated by output from another thread.
+		std::unique_ptr<evbuffer, decltype(&evbuffer_free)> buffer(evbuffer_new(), evbuffer_free);
+		evbuffer_expand(buffer.get(), header_size + message.size());
+		evbuffer_add(buffer.get(), header, header_size);
+		evbuffer_add(buffer.get(), message.data(), message.size());
+		server.server->send(id, buffer.get());
+	}
+
+	size_t Client::encodeFrameHeader(uint8_t (&header)[MAX_FRAME_HEADER_SIZE], uint8_t first_byte, size_t payload_size) {
+		header[0] = uint8_t(1 << 7) | first_byte;
+
+		if (payload_size <= 125) {
+			header[1] = uint8_t(payload_size);
+			return 2;
+		}
+
+		if (payload_size < 65536) {
+			header[1] = 126;
+			header[2] = uint8_t((payload_size >> 8) & 0xff);
+			header[3] = uint8_t((payload_size >> 0) & 0xff);
+			return 4;
 		}
 
-		send(header);
-		send(message);
+		header[1] = 127;
+		for (size_t i = 0; i < 8; ++i) {
+			header[2 + i] = uint8_t((payload_size >> (8 * (7 - i))) & 0xff);
+		}
+		return 10;
 	}
 
 	void Client::closeWebSocket() {
@@ -185,17 +396,175 @@ namespace Algiz::HTTP {
 		server.closeWebSocket(*this);
 	}
 
+	void Client::updateKeepAlive() {
+		const std::string connection = toLower(request.getHeader("connection"));
+		legacyVersion = request.version == "HTTP/1.0";
+
+		if (legacyVersion) {
+			keepAlive = connection.find("keep-alive") != std::string::npos;
+		} else {
+			keepAlive = connection.find("close") == std::string::npos;
+		}
+
+		const size_t max_requests = server.maxRequestsPerConnection;
+		if (max_requests != 0 && max_requests <= ++requestCount) {
+			keepAlive = false;
+		}
+	}
+
 	void Client::handleRequest() {
+		const auto received = std::chrono::system_clock::now();
+		const auto start = std::chrono::steady_clock::now();
+		noteResponse(0, 0);
+
 		switch (request.method) {
 			case Request::Method::GET:
 				server.handleGET(*this, request);
 				break;
+			case Request::Method::HEAD: {
+				headersOnly = true;
+				Defer reset{[this] { headersOnly = false; }};
+				server.handleGET(*this, request);
+				break;
+			}
 			case Request::Method::POST:
 				server.handlePOST(*this, request);
 				break;
 			default:
 				throw ParseError("Invalid method: " + std::to_string(int(request.method)));
 		}
+
+		const auto elapsed = std::chrono::steady_clock::now() - start;
+		server.requestHistograms[size_t(request.method)]->record(elapsed);
+
+		server.handleAccess(*this, request, received, elapsed);
+	}
+
+	bool Client::offloadRequest() {
+		if (!server.shouldOffload(request)) {
+			return false;
+		}
+
+		// Holding a reference keeps the connection record (and therefore this client) from being reset while the
+		// request is being handled, even if the connection is closed meanwhile.
+		auto connection = server.server->getConnection(id);
+		if (!connection) {
+			return false;
+		}
+
+		busy = true;
+		server.server->setReading(id, false);
+
+		server.handlerPool->post([this, connection = std::move(connection)](size_t) mutable {
+			try {
+				handleRequest();
+			} catch (const ParseError &) {
+				keepAlive = false;
+				server.send400(*this);
+				server.server->close(id);
+			} catch (const std::exception &err) {
+				ERROR(err.what());
+				keepAlive = false;
+				server.server->remove(id);
+			}
+
+			// Everything the handlers sent was queued on the worker before this, so it goes out first.
+			auto &record = *connection;
+			server.server->post(record, [this, connection = std::move(connection)] {
+				if (!connection->removing) {
+					finishOffloadedRequest();
+				}
+			});
+		});
+
+		return true;
+	}
+
+	void Client::finishOffloadedRequest() {
+		busy = false;
+		request.reset();
+
+		if (!keepAlive) {
+			// Nothing after a request that ends the connection will be answered.
+			deferredInput.clear();
+			return;
+		}
+
+		server.server->setReading(id, true);
+
+		if (!deferredInput.empty()) {
+			std::string input = std::move(deferredInput);
+			deferredInput.clear();
+			server.server->handleMessage(*this, input);
+		}
+	}
+
+	void Client::startHeaderTimer() {
+		const size_t timeout = server.headerTimeout;
+		if (timeout == 0 || headerTimer) {
+			return;
+		}
+
+		headerTimer = server.server->schedule(id, std::chrono::seconds(timeout), [this] {
+			onHeaderTimeout();
+		});
+	}
+
+	void Client::cancelHeaderTimer() {
+		if (headerTimer) {
+			server.server->cancel(id, headerTimer);
+			headerTimer = {};
+		}
+	}
+
+	void Client::onHeaderTimeout() {
+		headerTimer = {};
+
+		if (busy || !request.isReadingHead()) {
+			return;
+		}
+
+		keepAlive = false;
+		server.server->setReading(id, false);
+		send(Response(408, "Request Timeout"));
+		removeSelf();
+	}
+
+	void Client::startPinging() {
+		if (!pingTimer) {
+			schedulePing();
+		}
+	}
+
+	void Client::schedulePing() {
+		if (const size_t interval = server.webSocketPingInterval; interval != 0) {
+			pingTimer = server.server->schedule(id, std::chrono::seconds(interval), [this] {
+				ping();
+			});
+		}
+	}
+
+	void Client::ping() {
+		pingTimer = {};
+
+		if (!isWebSocket) {
+			return;
+		}
+
+		if (awaitingPong) {
+			// Nothing came back since the last ping, so the peer is presumably gone. Removing the connection still
+			// notifies the WebSocket close handlers.
+			server.server->remove(id);
+			return;
+		}
+
+		awaitingPong = true;
+		sendWebSocket({}, true, 9);
+		schedulePing();
+	}
+
+	void Client::deliverPacket(std::string_view message) {
+		server.handleWebSocketMessage(*this, message);
 	}
 
 	void Client::onMaxLineSizeExceeded() {
@@ -210,5 +579,5 @@ namespace Algiz::HTTP {
 		return server.server->id + ":" + std::to_string(id);
 	}
 
-	std::unordered_set<std::string> Client::supportedMethods {"GET"};
+	std::unordered_set<std::string> Client::supportedMethods {"GET", "HEAD"};
 }
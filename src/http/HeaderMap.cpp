@@ -0,0 +1,94 @@
+#include <stdexcept>
+
+#include "http/HeaderMap.h"
+
+namespace Algiz::HTTP {
+	HeaderMap::Header HeaderMap::resolve(const Entry &entry) const {
+		const std::string &value_source = entry.isMerged? merged : raw;
+		return {
+			std::string_view(raw).substr(entry.nameOffset, entry.nameLength),
+			std::string_view(value_source).substr(entry.valueOffset, entry.valueLength),
+		};
+	}
+
+	size_t HeaderMap::append(std::string_view bytes) {
+		const size_t offset = raw.size();
+		raw.append(bytes);
+		return offset;
+	}
+
+	void HeaderMap::add(size_t name_offset, size_t name_length, size_t value_offset, size_t value_length) {
+		for (size_t i = name_offset, end = name_offset + name_length; i < end; ++i) {
+			if ('A' <= raw[i] && raw[i] <= 'Z') {
+				raw[i] += 'a' - 'A';
+			}
+		}
+
+		const std::string_view name = std::string_view(raw).substr(name_offset, name_length);
+
+		for (Entry &entry: entries) {
+			if (resolve(entry).first != name) {
+				continue;
+			}
+
+			const std::string_view old_value = resolve(entry).second;
+			const std::string_view new_value = std::string_view(raw).substr(value_offset, value_length);
+
+			if (old_value.empty()) {
+				entry.valueOffset = value_offset;
+				entry.valueLength = value_length;
+				entry.isMerged = false;
+				return;
+			}
+
+			// The old value might already be in `merged`, so copy it out before appending to `merged`.
+			const std::string combined = std::string(old_value) + ' ' + std::string(new_value);
+			entry.valueOffset = merged.size();
+			entry.valueLength = combined.size();
+			entry.isMerged = true;
+			merged += combined;
+			return;
+		}
+
+		entries.push_back({uint32_t(name_offset), uint32_t(name_length), uint32_t(value_offset), uint32_t(value_length), false});
+	}
+
+	void HeaderMap::add(std::string_view name, std::string_view value) {
+		const size_t name_offset = append(name);
+		const size_t value_offset = append(value);
+		add(name_offset, name.size(), value_offset, value.size());
+	}
+
+	HeaderMap::const_iterator HeaderMap::find(std::string_view name) const {
+		for (size_t i = 0; i < entries.size(); ++i) {
+			const Entry &entry = entries[i];
+			if (entry.nameLength == name.size() && std::string_view(raw).substr(entry.nameOffset, entry.nameLength) == name) {
+				return {*this, i};
+			}
+		}
+
+		return end();
+	}
+
+	std::string_view HeaderMap::at(std::string_view name) const {
+		if (auto iter = find(name); iter != end()) {
+			return iter->second;
+		}
+
+		throw std::out_of_range("No such header: " + std::string(name));
+	}
+
+	std::string_view HeaderMap::get(std::string_view name) const {
+		if (auto iter = find(name); iter != end()) {
+			return iter->second;
+		}
+
+		return {};
+	}
+
+	void HeaderMap::clear() {
+		raw.clear();
+		merged.clear();
+		entries.clear();
+	}
+}
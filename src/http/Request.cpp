@@ -1,131 +1,195 @@
 #include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <optional>
 
+#include "error/BadRequest.h"
+#include "error/NotImplemented.h"
 #include "error/ParseError.h"
 #include "error/UnsupportedMethod.h"
 #include "http/Client.h"
 #include "http/Request.h"
 #include "http/Server.h"
 #include "util/Base64.h"
+#include "util/HTTPDate.h"
+#include "util/Scan.h"
 #include "util/Util.h"
 
 #include "Log.h"
 #include "Options.h"
 
 namespace Algiz::HTTP {
-	Request::HandleResult Request::handleLine(std::string_view line) {
-		if (mode != Mode::Content) {
-			if (!line.empty() && line.back() == '\n')
-				line.remove_suffix(1);
-			if (!line.empty() && line.back() == '\r')
-				line.remove_suffix(1);
+	Request & Request::operator=(Request &&other) {
+		mode = other.mode;
+		contentLength = other.contentLength;
+		lengthRemaining = other.lengthRemaining;
+		lineStart = other.lineStart;
+		hasContentLength = other.hasContentLength;
+		hasTransferEncoding = other.hasTransferEncoding;
+		method = other.method;
+		path = std::move(other.path);
+		version = std::move(other.version);
+		content = std::move(other.content);
+		charset = std::move(other.charset);
+		headers = std::move(other.headers);
+		parameters = std::move(other.parameters);
+		postParameters = std::move(other.postParameters);
+		ranges = std::move(other.ranges);
+		suffixLength = other.suffixLength;
+		return *this;
+	}
+
+	size_t Request::feed(std::string_view data, bool &done) {
+		done = false;
+		size_t consumed = 0;
+
+		while (mode != Mode::Content) {
+			const size_t newline = findByte(data, '\n', consumed);
+
+			if (newline == std::string_view::npos) {
+				// Keep the partial line in the head buffer until the rest of it arrives.
+				headers.append(data.substr(consumed));
+				if (HEAD_MAX < headers.getRaw().size()) {
+					throw ParseError("Request head too large");
+				}
+				return data.size();
+			}
+
+			headers.append(data.substr(consumed, newline + 1 - consumed));
+			consumed = newline + 1;
+
+			if (HEAD_MAX < headers.getRaw().size()) {
+				throw ParseError("Request head too large");
+			}
+
+			const std::string_view raw = headers.getRaw();
+			const size_t line_start = lineStart;
+			size_t line_end = raw.size() - 1;
+			lineStart = raw.size();
+
+			if (line_start < line_end && raw[line_end - 1] == '\r') {
+				--line_end;
+			}
+
+			if (parseLine(line_start, line_end - line_start)) {
+				if (lengthRemaining == 0) {
+					done = true;
+					return consumed;
+				}
+
+				mode = Mode::Content;
+				content.reserve(contentLength);
+			}
 		}
 
-		if (line.empty() && mode == Mode::Headers) {
-			mode = Mode::Content;
-			if (headers.contains("content-length")) {
-				client.maxRead = contentLength;
-				return HandleResult::DisableLineMode;
+		const size_t to_take = std::min(lengthRemaining, data.size() - consumed);
+		content.append(data.substr(consumed, to_take));
+		consumed += to_take;
+		lengthRemaining -= to_take;
+
+		if (lengthRemaining == 0) {
+			if (method == Method::POST) {
+				absorbPOST();
 			}
-			return HandleResult::Done;
+			done = true;
 		}
 
-		switch (mode) {
-			case Mode::Method: {
-				const size_t first_space = line.find(' ');
+		return consumed;
+	}
 
-				if (first_space == std::string_view::npos)
-					throw ParseError("Bad method line: can't determine method");
+	bool Request::parseLine(size_t offset, size_t length) {
+		std::string_view line = headers.getRaw().substr(offset, length);
 
-				const std::string_view method_view = line.substr(0, first_space);
+		if (mode == Mode::Method) {
+			// Stray blank lines between pipelined requests are allowed.
+			if (line.empty()) {
+				return false;
+			}
 
-				if (method_view == "GET") {
-					method = Method::GET;
-				} else if (method_view == "HEAD") {
-					method = Method::HEAD;
-				} else if (method_view == "PUT") {
-					method = Method::PUT;
-				} else if (method_view == "POST") {
-					method = Method::POST;
-				} else {
-					throw UnsupportedMethod(std::string(method_view));
-				}
+			const size_t first_space = findByte(line, ' ');
+
+			if (first_space == std::string_view::npos)
+				throw ParseError("Bad method line: can't determine method");
 
-				line = line.substr(first_space + 1);
-				const size_t next_space = line.find(' ');
-				if (next_space == std::string_view::npos)
-					throw ParseError("Bad method line: can't determine path");
-				auto full_path = line.substr(0, next_space);
-				path = getPath(full_path);
-				parameters = getParameters(full_path);
-				version = line.substr(next_space + 1);
-				if (version != "HTTP/1.1" && version != "HTTP/1.0")
-					throw ParseError("Invalid HTTP version: " + version);
-				mode = Mode::Headers;
-				break;
+			const std::string_view method_view = line.substr(0, first_space);
+
+			if (method_view == "GET") {
+				method = Method::GET;
+			} else if (method_view == "HEAD") {
+				method = Method::HEAD;
+			} else if (method_view == "PUT") {
+				method = Method::PUT;
+			} else if (method_view == "POST") {
+				method = Method::POST;
+			} else {
+				throw UnsupportedMethod(std::string(method_view));
 			}
 
-			case Mode::Headers: {
-				const size_t separator = line.find(": ");
-				if (separator == std::string_view::npos)
-					throw ParseError("Invalid HTTP header: no separator");
-				std::string_view header_name = line.substr(0, separator);
-				std::string_view header_content = line.substr(separator + 2);
-				std::string header_name_string = toLower(header_name);
-
-				if (headers.contains(header_name_string)) {
-					if (headers[header_name_string].empty()) {
-						headers[header_name_string] = header_content;
-					} else {
-						headers[header_name_string] += " ";
-						headers[header_name_string] += header_content;
-					}
-				} else {
-					headers.emplace(header_name_string, header_content);
-				}
+			line = line.substr(first_space + 1);
+			const size_t next_space = findByte(line, ' ');
+			if (next_space == std::string_view::npos)
+				throw ParseError("Bad method line: can't determine path");
+			auto full_path = line.substr(0, next_space);
+			path = getPath(full_path);
+			parameters = getParameters(full_path);
+			const std::string_view version_view = line.substr(next_space + 1);
+			if (version_view != "HTTP/1.1" && version_view != "HTTP/1.0")
+				throw ParseError("Invalid HTTP version: " + std::string(version_view));
+			version = version_view;
+			mode = Mode::Headers;
+			return false;
+		}
 
-				if (header_name == "Content-Length") {
-					try {
-						lengthRemaining = contentLength = parseUlong(header_content);
-						if (method == Method::POST) {
-							const auto post_max_opt = client.server.getOption<size_t>(path, "postMax");
-							const size_t post_max = post_max_opt? *post_max_opt : POST_MAX;
-							if (post_max < lengthRemaining)
-								throw ParseError("POST length too long: " + std::to_string(lengthRemaining));
-						}
-					} catch (const std::invalid_argument &err) {
-						throw ParseError(err.what());
-					}
-				} else if (header_name == "Range") {
-					parseRange(header_content);
-				} else if (header_name == "Connection") {
-					client.keepAlive = header_content != "close";
-				}
-				break;
+		if (line.empty()) {
+			if (hasTransferEncoding) {
+				// A message with both is a classic way to smuggle a request past a proxy that frames it differently.
+				if (hasContentLength)
+					throw BadRequest("Request has both Transfer-Encoding and Content-Length");
+				throw NotImplemented("Transfer-Encoding isn't supported");
 			}
+			return true;
+		}
 
-			case Mode::Content: {
-				if (lengthRemaining < line.size()) {
-					content += line.substr(lengthRemaining);
-					lengthRemaining = 0;
-				} else if (lengthRemaining == line.size()) {
-					content += line;
-					lengthRemaining = 0;
-				}
+		const size_t colon = findByte(line, ':');
+		if (colon == std::string_view::npos || colon == 0)
+			throw ParseError("Invalid HTTP header: no separator");
 
-				if (lengthRemaining == 0) {
-					if (method == Method::POST)
-						absorbPOST();
-					mode = Mode::Method;
-					return HandleResult::Done;
-				}
+		size_t value_start = colon + 1;
+		while (value_start < line.size() && (line[value_start] == ' ' || line[value_start] == '\t')) {
+			++value_start;
+		}
 
-				content += line;
-				lengthRemaining -= line.size();
-				break;
+		size_t value_end = line.size();
+		while (value_start < value_end && (line[value_end - 1] == ' ' || line[value_end - 1] == '\t')) {
+			--value_end;
+		}
+
+		headers.add(offset, colon, offset + value_start, value_end - value_start);
+
+		// The name has been lowercased in place by now.
+		const std::string_view header_name = headers.getRaw().substr(offset, colon);
+		const std::string_view header_content = line.substr(value_start, value_end - value_start);
+
+		if (header_name == "content-length") {
+			hasContentLength = true;
+			try {
+				lengthRemaining = contentLength = parseUlong(header_content);
+				if (method == Method::POST) {
+					const auto post_max_opt = client.server.getOption<size_t>(path, "postMax");
+					const size_t post_max = post_max_opt? *post_max_opt : POST_MAX;
+					if (post_max < lengthRemaining)
+						throw ParseError("POST length too long: " + std::to_string(lengthRemaining));
+				}
+			} catch (const std::invalid_argument &err) {
+				throw ParseError(err.what());
 			}
+		} else if (header_name == "transfer-encoding") {
+			hasTransferEncoding = true;
+		} else if (header_name == "range") {
+			parseRange(header_content);
 		}
 
-		return HandleResult::Continue;
+		return false;
 	}
 
 	void Request::parseRange(std::string_view content) {
@@ -277,12 +341,184 @@ namespace Algiz::HTTP {
 		return AuthenticationResult::Success;
 	}
 
-	std::string_view Request::getHeader(const std::string &name) const {
-		if (auto iter = headers.find(name); iter != headers.end()) {
-			return iter->second;
+	std::string_view Request::getHeader(std::string_view name) const {
+		return headers.get(name);
+	}
+
+	PreconditionResult Request::evaluatePreconditions(std::string_view etag, time_t modified) const {
+		if (auto iter = headers.find("if-match"); iter != headers.end()) {
+			if (!matchesETag(iter->second, etag, false)) {
+				return PreconditionResult::Failed;
+			}
+		} else if (auto iter = headers.find("if-unmodified-since"); iter != headers.end()) {
+			if (auto date = parseHTTPDate(iter->second); date && *date < modified) {
+				return PreconditionResult::Failed;
+			}
+		}
+
+		const bool safe = method == Method::GET || method == Method::HEAD;
+
+		if (auto iter = headers.find("if-none-match"); iter != headers.end()) {
+			if (matchesETag(iter->second, etag, true)) {
+				return safe? PreconditionResult::NotModified : PreconditionResult::Failed;
+			}
+		} else if (safe) {
+			if (auto iter = headers.find("if-modified-since"); iter != headers.end()) {
+				if (auto date = parseHTTPDate(iter->second); date && modified <= *date) {
+					return PreconditionResult::NotModified;
+				}
+			}
+		}
+
+		return PreconditionResult::Passed;
+	}
+
+	bool Request::ifRangeMatches(std::string_view etag, time_t modified) const {
+		const auto iter = headers.find("if-range");
+		if (iter == headers.end()) {
+			return true;
+		}
+
+		const std::string_view value = iter->second;
+
+		if (value.starts_with('"') || value.starts_with("W/")) {
+			return matchesETag(value, etag, false);
+		}
+
+		// A date only validates the range if it's exactly the representation's modification time.
+		auto date = parseHTTPDate(value);
+		return date && *date == modified;
+	}
+
+	bool Request::matchesETag(std::string_view field, std::string_view etag, bool weak) {
+		auto is_weak = [](std::string_view tag) {
+			return tag.starts_with("W/");
+		};
+
+		const bool etag_weak = is_weak(etag);
+		if (etag_weak) {
+			if (!weak) {
+				return false;
+			}
+			etag.remove_prefix(2);
+		}
+
+		while (!field.empty()) {
+			const char front = field.front();
+			if (front == ' ' || front == '\t' || front == ',') {
+				field.remove_prefix(1);
+				continue;
+			}
+
+			if (front == '*') {
+				return true;
+			}
+
+			const bool candidate_weak = is_weak(field);
+			if (candidate_weak) {
+				field.remove_prefix(2);
+			}
+
+			if (field.empty() || field.front() != '"') {
+				// Malformed. Don't match anything after it.
+				return false;
+			}
+
+			const size_t closing = field.find('"', 1);
+			if (closing == std::string_view::npos) {
+				return false;
+			}
+
+			const std::string_view candidate = field.substr(0, closing + 1);
+			field.remove_prefix(closing + 1);
+
+			if (candidate == etag && (weak || !candidate_weak)) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	double Request::getEncodingQuality(std::string_view coding) const {
+		const auto iter = headers.find("accept-encoding");
+		if (iter == headers.end()) {
+			return coding == "identity"? 1. : 0.;
 		}
 
-		return {};
+		auto trim = [](std::string_view view) {
+			while (!view.empty() && (view.front() == ' ' || view.front() == '\t')) {
+				view.remove_prefix(1);
+			}
+			while (!view.empty() && (view.back() == ' ' || view.back() == '\t')) {
+				view.remove_suffix(1);
+			}
+			return view;
+		};
+
+		auto equal = [](std::string_view left, std::string_view right) {
+			return std::ranges::equal(left, right, [](char a, char b) {
+				return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b));
+			});
+		};
+
+		std::optional<double> wildcard;
+		std::string_view remaining = iter->second;
+
+		while (!remaining.empty()) {
+			const size_t comma = remaining.find(',');
+			std::string_view element = remaining.substr(0, comma);
+			remaining = comma == std::string_view::npos? std::string_view() : remaining.substr(comma + 1);
+
+			double quality = 1.;
+			const size_t semicolon = element.find(';');
+			if (semicolon != std::string_view::npos) {
+				std::string_view parameter = trim(element.substr(semicolon + 1));
+				if (parameter.size() < 2 || (parameter[0] != 'q' && parameter[0] != 'Q') || parameter[1] != '=') {
+					continue;
+				}
+				parameter.remove_prefix(2);
+				if (std::from_chars(parameter.data(), parameter.data() + parameter.size(), quality).ec != std::errc()) {
+					continue;
+				}
+			}
+
+			element = trim(element.substr(0, semicolon));
+
+			if (equal(element, coding)) {
+				return quality;
+			}
+
+			if (element == "*") {
+				wildcard = quality;
+			}
+		}
+
+		if (wildcard) {
+			return *wildcard;
+		}
+
+		// Identity is acceptable unless it's been explicitly ruled out.
+		return coding == "identity"? 1. : 0.;
+	}
+
+	void Request::reset() {
+		mode = Mode::Method;
+		contentLength = 0;
+		lengthRemaining = 0;
+		lineStart = 0;
+		hasContentLength = false;
+		hasTransferEncoding = false;
+		method = Method::Invalid;
+		path.clear();
+		version.clear();
+		content.clear();
+		charset.clear();
+		headers.clear();
+		parameters.clear();
+		postParameters.clear();
+		ranges.clear();
+		suffixLength = 0;
 	}
 
 	std::string Request::pathWithParameters() const {
@@ -1,14 +1,114 @@
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <new>
+
 #include "http/Response.h"
+#include "util/HTTPDate.h"
 #include "util/Util.h"
 
 namespace Algiz::HTTP {
-	std::string Response::generate500() {
-		const static std::string_view body = "Internal Server Error";
-		return std::format(
-			"HTTP/1.1 500 Internal Server Error\r\nContent-Type: text/html; charset=UTF-8\r\n"
-			"Content-Length: {}\r\n"
-			"Connection: close\r\n"
-			"\r\n{}", body.size(), body);
+	namespace {
+		/** Bodies at least this large are added to evbuffers by reference rather than copied. */
+		constexpr size_t REFERENCE_THRESHOLD = 4096;
+
+		struct Status {
+			int code;
+			std::string_view line;
+		};
+
+#define STATUS(code, description) Status{code, "HTTP/1.1 " #code " " description "\r\n"}
+		constexpr Status statuses[] {
+			STATUS(100, "Continue"),
+			STATUS(101, "Switching Protocols"),
+			STATUS(102, "Processing"),
+			STATUS(103, "Early Hints"),
+			STATUS(200, "OK"),
+			STATUS(201, "Created"),
+			STATUS(202, "Accepted"),
+			STATUS(203, "Non-Authoritative Information"),
+			STATUS(204, "No Content"),
+			STATUS(205, "Reset Content"),
+			STATUS(206, "Partial Content"),
+			STATUS(207, "Multi-Status"),
+			STATUS(208, "Already Reported"),
+			STATUS(226, "IM Used"),
+			STATUS(300, "Multiple Choices"),
+			STATUS(301, "Moved Permanently"),
+			STATUS(302, "Found"),
+			STATUS(303, "See Other"),
+			STATUS(304, "Not Modified"),
+			STATUS(305, "Use Proxy"),
+			STATUS(306, "Switch Proxy"),
+			STATUS(307, "Temporary Redirect"),
+			STATUS(308, "Permanent Redirect"),
+			STATUS(400, "Bad Request"),
+			STATUS(401, "Unauthorized"),
+			STATUS(402, "Payment Required"),
+			STATUS(403, "Forbidden"),
+			STATUS(404, "Not Found"),
+			STATUS(405, "Method Not Allowed"),
+			STATUS(406, "Not Acceptable"),
+			STATUS(407, "Proxy Authentication Required"),
+			STATUS(408, "Request Timeout"),
+			STATUS(409, "Conflict"),
+			STATUS(410, "Gone"),
+			STATUS(411, "Length Required"),
+			STATUS(412, "Precondition Failed"),
+			STATUS(413, "Payload Too Large"),
+			STATUS(414, "URI Too Long"),
+			STATUS(415, "Unsupported Media Type"),
+			STATUS(416, "Range Not Satisfiable"),
+			STATUS(417, "Expectation Failed"),
+			STATUS(418, "I'm a teapot"),
+			STATUS(421, "Misdirected Request"),
+			STATUS(422, "Unprocessable Entity"),
+			STATUS(423, "Locked"),
+			STATUS(424, "Failed Dependency"),
+			STATUS(425, "Too Early"),
+			STATUS(426, "Upgrade Required"),
+			STATUS(428, "Precondition Required"),
+			STATUS(429, "Too Many Requests"),
+			STATUS(431, "Request Header Fields Too Large"),
+			STATUS(451, "Unavailable For Legal Reasons"),
+			STATUS(500, "Internal Server Error"),
+			STATUS(501, "Not Implemented"),
+			STATUS(502, "Bad Gateway"),
+			STATUS(503, "Service Unavailable"),
+			STATUS(504, "Gateway Timeout"),
+			STATUS(505, "HTTP Version Not Supported"),
+			STATUS(506, "Variant Also Negotiates"),
+			STATUS(507, "Insufficient Storage"),
+			STATUS(508, "Loop Detected"),
+			STATUS(510, "Not Extended"),
+			STATUS(511, "Network Authentication Required"),
+		};
+#undef STATUS
+
+		constexpr auto statusLines = [] {
+			std::array<std::string_view, 600> out{};
+			for (const auto &[code, line]: statuses) {
+				out[code] = line;
+			}
+			return out;
+		}();
+
+		struct CountingSink {
+			size_t size = 0;
+
+			void operator()(std::string_view piece) {
+				size += piece.size();
+			}
+		};
+
+		struct CopyingSink {
+			char *cursor;
+
+			void operator()(std::string_view piece) {
+				std::memcpy(cursor, piece.data(), piece.size());
+				cursor += piece.size();
+			}
+		};
 	}
 
 	Response::Response(int code, std::string content, std::string_view mime):
@@ -69,6 +169,11 @@ namespace Algiz::HTTP {
 		return *this;
 	}
 
+	Response & Response::setNoContentLength(bool value) {
+		noContentLength = value;
+		return *this;
+	}
+
 	Response & Response::setAcceptRanges(bool value) {
 		if (value) {
 			headers["accept-ranges"] = "bytes";
@@ -79,7 +184,7 @@ namespace Algiz::HTTP {
 	}
 
 	Response & Response::setLastModified(time_t when) {
-		headers["last-modified"] = formatTime("%a, %-d %b %Y %T %Z", when);
+		headers["last-modified"] = formatHTTPDate(when);
 		return *this;
 	}
 
@@ -98,105 +203,149 @@ namespace Algiz::HTTP {
 		return headers.at(header_name);
 	}
 
-	Response::operator std::string() const {
-		if (std::holds_alternative<std::string>(content)) {
-			return noContent() + std::get<std::string>(content);
+	std::string_view Response::getStatusLine(int code) {
+		if (code < 0 || statusLines.size() <= size_t(code)) {
+			return {};
 		}
+		return statusLines[code];
+	}
 
-		std::string no_content = noContent();
-		no_content += std::get<std::string_view>(content);
-		return no_content;
+	bool Response::hasValidCode() const {
+		return !getStatusLine(code).empty();
 	}
 
-	std::string Response::noContent() const {
-		if (!codeDescriptions.contains(code)) {
-			return generate500();
-		}
+	Response Response::generate500() {
+		return Response(500, "Internal Server Error").setCharset("UTF-8").setClose();
+	}
 
-		std::string out;
-		const size_t content_size = std::holds_alternative<std::string>(content)? std::get<std::string>(content).size() : std::get<std::string_view>(content).size();
-		out.reserve(content_size + 1024);
-		out = std::format("HTTP/1.1 {} {}\r\n", code, codeDescriptions.at(code));
+	template <typename Fn>
+	void Response::emitHead(Fn &&append, bool complete) const {
+		append(getStatusLine(code));
 
 		if (!noContentType && !headers.contains("content-type")) {
-			out += std::format("Content-Type: {}{}\r\n", mime, charset.empty()? "" : "; charset=" + charset);
+			append("Content-Type: ");
+			append(mime);
+			if (!charset.empty()) {
+				append("; charset=");
+				append(charset);
+			}
+			append("\r\n");
+		}
+
+		// Informational, 204 and 304 responses never have a body to describe.
+		const bool bodiless = code < 200 || code == 204 || code == 304;
+
+		if (!bodiless && !noContentLength && !headers.contains("content-length")) {
+			char digits[24];
+			const auto result = std::to_chars(digits, digits + sizeof(digits), contentView().size());
+			append("Content-Length: ");
+			append(std::string_view(digits, result.ptr - digits));
+			append("\r\n");
 		}
 
-		if (!headers.contains("content-length")) {
-			out += std::format("Content-Length: {}\r\n", content_size);
+		if (complete && !headers.contains("date")) {
+			append("Date: ");
+			append(getHTTPDate());
+			append("\r\n");
 		}
 
 		for (const auto &[header, value]: headers) {
-			out += std::format("{}: {}\r\n", header, value);
+			if (!complete && (header == "date" || header == "connection")) {
+				continue;
+			}
+			append(header);
+			append(": ");
+			append(value);
+			append("\r\n");
 		}
 
-		out += "\r\n";
+		if (complete) {
+			append("\r\n");
+		}
+	}
+
+	void Response::writeHead(evbuffer *output) const {
+		if (!hasValidCode()) {
+			generate500().writeHead(output);
+			return;
+		}
+
+		CountingSink counter;
+		emitHead(counter);
+
+		evbuffer_iovec vec;
+		if (evbuffer_reserve_space(output, counter.size, &vec, 1) != 1) {
+			throw std::bad_alloc();
+		}
+
+		emitHead(CopyingSink{static_cast<char *>(vec.iov_base)});
+		vec.iov_len = counter.size;
+		evbuffer_commit_space(output, &vec, 1);
+	}
+
+	void Response::serialize(evbuffer *output) && {
+		if (!hasValidCode()) {
+			generate500().serialize(output);
+			return;
+		}
+
+		writeHead(output);
+
+		if (auto *string = std::get_if<std::string>(&content); string != nullptr && REFERENCE_THRESHOLD <= string->size()) {
+			auto *owned = new std::string(std::move(*string));
+			const auto cleanup = [](const void *, size_t, void *extra) {
+				delete static_cast<std::string *>(extra);
+			};
+			if (evbuffer_add_reference(output, owned->data(), owned->size(), cleanup, owned) != 0) {
+				evbuffer_add(output, owned->data(), owned->size());
+				delete owned;
+			}
+			return;
+		}
+
+		const std::string_view view = contentView();
+		evbuffer_add(output, view.data(), view.size());
+	}
+
+	Response::operator std::string() const {
+		if (!hasValidCode()) {
+			return generate500();
+		}
+
+		std::string out = noContent();
+		out += contentView();
 		return out;
 	}
 
-	std::map<int, std::string> Response::codeDescriptions {
-		{100, "Continue"},
-		{101, "Switching Protocols"},
-		{102, "Processing"},
-		{103, "Early Hints"},
-		{200, "OK"},
-		{201, "Created"},
-		{202, "Accepted"},
-		{203, "Non-Authoritative Information"},
-		{204, "No Content"},
-		{205, "Reset Content"},
-		{206, "Partial Content"},
-		{207, "Multi-Status"},
-		{208, "Already Reported"},
-		{226, "IM Used"},
-		{300, "Multiple Choices"},
-		{301, "Moved Permanently"},
-		{302, "Found"},
-		{303, "See Other"},
-		{304, "Not Modified"},
-		{305, "Use Proxy"},
-		{306, "Switch Proxy"},
-		{307, "Temporary Redirect"},
-		{308, "Permanent Redirect"},
-		{400, "Bad Request"},
-		{401, "Unauthorized"},
-		{402, "Payment Required"},
-		{403, "Forbidden"},
-		{404, "Not Found"},
-		{405, "Method Not Allowed"},
-		{406, "Not Acceptable"},
-		{407, "Proxy Authentication Required"},
-		{408, "Request Timeout"},
-		{409, "Conflict"},
-		{410, "Gone"},
-		{411, "Length Required"},
-		{412, "Precondition Failed"},
-		{413, "Payload Too Large"},
-		{414, "URI Too Long"},
-		{415, "Unsupported Media Type"},
-		{416, "Range Not Satisfiable"},
-		{417, "Expectation Failed"},
-		{418, "I'm a teapot"},
-		{421, "Misdirected Request"},
-		{422, "Unprocessable Entity"},
-		{423, "Locked"},
-		{424, "Failed Dependency"},
-		{425, "Too Early"},
-		{426, "Upgrade Required"},
-		{428, "Precondition Required"},
-		{429, "Too Many Requests"},
-		{431, "Request Header Fields Too Large"},
-		{451, "Unavailable For Legal Reasons"},
-		{500, "Internal Server Error"},
-		{501, "Not Implemented"},
-		{502, "Bad Gateway"},
-		{503, "Service Unavailable"},
-		{504, "Gateway Timeout"},
-		{505, "HTTP Version Not Supported"},
-		{506, "Variant Also Negotiates"},
-		{507, "Insufficient Storage"},
-		{508, "Loop Detected"},
-		{510, "Not Extended"},
-		{511, "Network Authentication Required"},
-	};
+	std::string Response::noContent() const {
+		if (!hasValidCode()) {
+			return generate500().noContent();
+		}
+
+		CountingSink counter;
+		emitHead(counter);
+
+		std::string out;
+		out.reserve(counter.size + contentView().size());
+		emitHead([&out](std::string_view piece) {
+			out += piece;
+		});
+		return out;
+	}
+
+	std::string Response::staticHead() const {
+		if (!hasValidCode()) {
+			return generate500().staticHead();
+		}
+
+		CountingSink counter;
+		emitHead(counter, false);
+
+		std::string out;
+		out.reserve(counter.size);
+		emitHead([&out](std::string_view piece) {
+			out += piece;
+		}, false);
+		return out;
+	}
 }
@@ -1,9 +1,12 @@
+#include <algorithm>
 #include <cctype>
+#include <format>
 
 #include "http/Client.h"
 #include "http/Response.h"
 #include "http/Server.h"
 #include "util/Base64.h"
+#include "util/Defer.h"
 #include "util/FS.h"
 #include "util/MIME.h"
 #include "util/SHA1.h"
@@ -20,13 +23,61 @@ namespace Algiz::HTTP {
 		webRoot(getWebRoot(options.contains("root")? options.at("root") : "")) {
 			server->addClient = [this](auto &, int new_client, std::string_view ip) {
 				auto http_client = std::make_unique<Client>(*this, new_client, ip);
-				server->getClients().try_emplace(new_client, std::move(http_client));
+				server->setClient(new_client, std::move(http_client));
 			};
 
 			server->closeHandler = [this](int client_id) {
-				closeWebSocket(dynamic_cast<Client &>(*server->getClients().at(client_id)));
+				if (auto connection = server->getConnection(client_id); connection && connection->client) {
+					closeWebSocket(dynamic_cast<Client &>(*connection->client));
+				}
 			};
 
+			if (auto iter = options.find("maxRequestsPerConnection"); iter != options.end()) {
+				maxRequestsPerConnection = *iter;
+			}
+
+			if (auto iter = options.find("headerTimeout"); iter != options.end()) {
+				headerTimeout = *iter;
+			}
+
+			if (auto iter = options.find("webSocketPingInterval"); iter != options.end()) {
+				webSocketPingInterval = *iter;
+			}
+
+			if (auto iter = options.find("webSocketDeflate"); iter != options.end()) {
+				if (iter->is_boolean()) {
+					webSocketDeflate.enabled = *iter;
+				} else {
+					auto &deflate = webSocketDeflate;
+					deflate.enabled                 = iter->value("enabled", true);
+					deflate.serverMaxWindowBits     = iter->value("serverMaxWindowBits", deflate.serverMaxWindowBits);
+					deflate.clientMaxWindowBits     = iter->value("clientMaxWindowBits", deflate.clientMaxWindowBits);
+					deflate.serverNoContextTakeover = iter->value("serverNoContextTakeover", deflate.serverNoContextTakeover);
+					deflate.clientNoContextTakeover = iter->value("clientNoContextTakeover", deflate.clientNoContextTakeover);
+					deflate.threshold               = iter->value("threshold", deflate.threshold);
+					deflate.level                   = iter->value("level", deflate.level);
+					deflate.memLevel                = iter->value("memLevel", deflate.memLevel);
+
+					if (deflate.serverMaxWindowBits < 9 || 15 < deflate.serverMaxWindowBits) {
+						throw std::invalid_argument("webSocketDeflate.serverMaxWindowBits must be between 9 and 15");
+					}
+
+					if (deflate.clientMaxWindowBits < 8 || 15 < deflate.clientMaxWindowBits) {
+						throw std::invalid_argument("webSocketDeflate.clientMaxWindowBits must be between 8 and 15");
+					}
+				}
+			}
+
+			for (const auto method: {Request::Method::Invalid, Request::Method::GET, Request::Method::HEAD, Request::Method::PUT, Request::Method::POST}) {
+				requestHistograms[size_t(method)] = &metrics.histogram("algiz_http_request_seconds", "Time spent handling HTTP requests.",
+					{{"port", std::to_string(server->getPort())}, {"method", std::format("{}", method)}});
+			}
+
+			if (const size_t handler_threads = options.value("handlerThreads", size_t(0)); handler_threads != 0) {
+				handlerPool = std::make_unique<ThreadPool>(handler_threads);
+				handlerPool->start();
+			}
+
 			auto crawled = crawlConfigs(webRoot);
 			{
 				auto lock = lockConfigs();
@@ -39,6 +90,15 @@ namespace Algiz::HTTP {
 				if (path.filename() == ".algiz") {
 					addConfig(path);
 				}
+
+				auto lock = lockFileChangeHandlers();
+				std::erase_if(fileChangeHandlers, [&path](const WeakFileChangeHandlerPtr &weak) {
+					if (auto handler = weak.lock()) {
+						(*handler)(path);
+						return false;
+					}
+					return true;
+				});
 			};
 
 			watcherThread = std::thread([this] {
@@ -62,6 +122,10 @@ namespace Algiz::HTTP {
 		}
 
 	Server::~Server() {
+		// Handlers belong to plugins, so they have to be finished before the plugins go away.
+		if (handlerPool) {
+			handlerPool->join();
+		}
 		unloadPlugins();
 		dying = true;
 		watcher->stop();
@@ -85,112 +149,163 @@ namespace Algiz::HTTP {
 		server->stop();
 	}
 
-	void Server::handleGET(Client &client, const Request &request) {
+	bool Server::isWebSocketUpgrade(const Request &request) {
+		if (request.isHead()) {
+			return false;
+		}
+
+		const std::string_view connection = request.headers.get("connection");
+		if (connection != "Upgrade" && connection != "keep-alive, Upgrade") {
+			return false;
+		}
+
+		return request.headers.get("upgrade") == "websocket";
+	}
+
+	bool Server::shouldOffload(const Request &request) const {
+		if (!handlerPool) {
+			return false;
+		}
+
+		switch (request.method) {
+			case Request::Method::GET:
+			case Request::Method::HEAD:
+				return !isWebSocketUpgrade(request);
+			case Request::Method::POST:
+				return true;
+			default:
+				return false;
+		}
+	}
+
+	void Server::handleGET(Client &client, Request &request) {
 		if (!validatePath(request.path)) {
-			server->send(client.id, Response(403, "Invalid path."));
+			client.send(Response(403, "Invalid path."));
 			server->close(client.id);
 			return;
 		}
 
-		if (auto iter = request.headers.find("connection"); iter != request.headers.end()) {
-			const auto &header = iter->second;
-			if (header == "Upgrade" || header == "keep-alive, Upgrade") {
-				if (request.headers.contains("upgrade") && request.headers.at("upgrade") == "websocket") {
-					bool failed = !request.headers.contains("sec-websocket-key")
-					           || !request.headers.contains("sec-websocket-version")
-					           ||  request.headers.at("sec-websocket-key").size() != 24;
+		if (isWebSocketUpgrade(request)) {
+			bool failed = !request.headers.contains("sec-websocket-key")
+			           || !request.headers.contains("sec-websocket-version")
+			           ||  request.headers.at("sec-websocket-key").size() != 24;
 
-					if (failed) {
-						send400(client);
-						return;
-					}
+			if (failed) {
+				send400(client);
+				return;
+			}
 
-					StringVector protocols;
+			StringVector protocols;
 
-					if (request.headers.contains("sec-websocket-protocol")) {
-						protocols = split(request.headers.at("sec-websocket-protocol"), " ");
-					}
+			if (request.headers.contains("sec-websocket-protocol")) {
+				protocols = split(request.headers.at("sec-websocket-protocol"), " ");
+			}
 
-					WebSocketConnectionArgs args {
-						*this, client, Request(request), getParts(request.path), std::move(protocols)
-					};
-					client.isWebSocket = true;
-					client.webSocketPath = args.parts;
-					client.lineMode = false;
+			WebSocketConnectionArgs args {
+				*this, client, Request(request), getParts(request.path), std::move(protocols)
+			};
+			client.isWebSocket = true;
+			client.webSocketPath = args.parts;
+			client.lineMode = false;
+			client.bufferMode = true;
 
 #ifdef CATCH_WEBSOCKET
-					try {
+			try {
 #endif
-						auto [should_pass, result] = beforeMulti(args, webSocketConnectionHandlers);
-						if (result == Plugins::HandlerResult::Pass) {
-							server->send(client.id, Response(501, "Unhandled request"));
-							server->close(client.id);
-						} else {
-							Response response(101, "");
-							response["upgrade"] = "websocket";
-							response["connection"] = "Upgrade";
-							response["sec-websocket-accept"] = base64Encode(sha1(request.headers.at("sec-websocket-key")
-								+ "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
-
-							if (!args.acceptedProtocol.empty()) {
-								response["sec-websocket-protocol"] = args.acceptedProtocol;
-							}
-
-							server->send(client.id, response);
+				auto [should_pass, result] = beforeMulti(args, webSocketConnectionHandlers);
+				if (result == Plugins::HandlerResult::Pass) {
+					client.send(Response(501, "Unhandled request"));
+					server->close(client.id);
+				} else {
+					Response response(101, "");
+					response["upgrade"] = "websocket";
+					response["connection"] = "Upgrade";
+					response["sec-websocket-accept"] = base64Encode(sha1(std::string(request.headers.at("sec-websocket-key"))
+						+ "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+
+					if (!args.acceptedProtocol.empty()) {
+						response["sec-websocket-protocol"] = args.acceptedProtocol;
+					}
+
+					if (webSocketDeflate.enabled) {
+						if (auto parameters = WebSocketDeflate::negotiate(request.headers.get("sec-websocket-extensions"), webSocketDeflate)) {
+							response["sec-websocket-extensions"] = parameters->toString();
+							client.webSocketDeflate = std::make_unique<WebSocketDeflate>(webSocketDeflate, *parameters);
 						}
-#ifdef CATCH_WEBSOCKET
-					} catch (const std::exception &err) {
-						ERROR(err.what());
-						send500(client);
-						server->close(client.id);
 					}
-#endif
 
-					return;
+					client.send(std::move(response));
+					// WebSockets can legitimately stay quiet for a long time. Pings take care of dead peers instead.
+					server->setIdleTimeout(client.id, 0);
+					client.startPinging();
 				}
+#ifdef CATCH_WEBSOCKET
+			} catch (const std::exception &err) {
+				ERROR(err.what());
+				client.keepAlive = false;
+				send500(client);
+				server->close(client.id);
 			}
+#endif
+
+			return;
 		}
 
 #ifdef CATCH_WEBSOCKET
 		try {
 #endif
-			HandlerArgs args {*this, client, Request(request), getParts(request.path)};
+			StringVector parts = getParts(request.path);
+			HandlerArgs args {*this, client, std::move(request), std::move(parts)};
+			// The request is only lent to the handlers so that the client can reuse its buffers for the next request.
+			Defer restore{[&] { request = std::move(args.request); }};
 			auto [should_pass, result] = beforeMulti(args, getHandlers);
 			if (result == Plugins::HandlerResult::Pass) {
-				server->send(client.id, Response(501, "Unhandled request"));
+				client.send(Response(501, "Unhandled request"));
 				server->close(client.id);
 			}
 #ifdef CATCH_WEBSOCKET
 		} catch (const std::exception &err) {
 			ERROR(err.what());
+			client.keepAlive = false;
 			send500(client);
 			server->close(client.id);
 		}
 #endif
 	}
 
-	void Server::handlePOST(Client &client, const Request &request) {
+	void Server::handlePOST(Client &client, Request &request) {
 		if (!validatePath(request.path)) {
-			server->send(client.id, Response(403, "Invalid path."));
+			client.send(Response(403, "Invalid path."));
 			server->close(client.id);
 			return;
 		}
 
-		HandlerArgs args(*this, client, Request(request), getParts(request.path));
+		StringVector parts = getParts(request.path);
+		HandlerArgs args(*this, client, std::move(request), std::move(parts));
+		Defer restore{[&] { request = std::move(args.request); }};
 		auto [should_pass, result] = beforeMulti(args, postHandlers);
 		if (result == Plugins::HandlerResult::Pass) {
-			server->send(client.id, Response(501, "Unhandled request"));
+			client.send(Response(501, "Unhandled request"));
 			server->close(client.id);
 		}
 	}
 
 	void Server::handleWebSocketMessage(Client &client, std::string_view message) {
-		if (webSocketMessageHandlers.contains(client.id)) {
+		// Copied so that handlers can register more handlers (or other clients' workers can) while they run.
+		std::list<WeakMessageHandlerPtr> handlers;
+		{
+			auto lock = lockWebSocketHandlers();
+			if (auto iter = webSocketMessageHandlers.find(client.id); iter != webSocketMessageHandlers.end()) {
+				handlers = iter->second;
+			}
+		}
+
+		if (!handlers.empty()) {
 #ifdef CATCH_WEBSOCKET
 			try {
 #endif
 				WebSocketMessageArgs args {*this, client, message};
-				beforeMulti(args, webSocketMessageHandlers.at(client.id));
+				beforeMulti(args, handlers);
 #ifdef CATCH_WEBSOCKET
 			} catch (const std::exception &err) {
 				ERROR(err.what());
@@ -201,38 +316,82 @@ namespace Algiz::HTTP {
 		}
 	}
 
-	void Server::closeWebSocket(Client &client) {
-		if (webSocketCloseHandlers.contains(client.id)) {
-			for (auto &fnptr: webSocketCloseHandlers.at(client.id)) {
-				if (auto fn = fnptr.lock()) {
-					(*fn)(*this, client);
+	std::vector<const void *> Server::getHandlerPointers() const {
+		std::vector<const void *> out;
+		for (const auto *list: {&getHandlers, &postHandlers}) {
+			for (const auto &weak: *list) {
+				if (auto handler = weak.lock()) {
+					out.push_back(handler.get());
 				}
 			}
 		}
+		for (const auto &weak: webSocketConnectionHandlers) {
+			if (auto handler = weak.lock()) {
+				out.push_back(handler.get());
+			}
+		}
+		return out;
+	}
+
+	void Server::handleAccess(Client &client, const Request &request, std::chrono::system_clock::time_point received, std::chrono::steady_clock::duration elapsed) {
+		std::vector<AccessHandlerPtr> handlers;
+		{
+			auto lock = lockHandlersShared();
+			for (const auto &weak: accessHandlers) {
+				if (auto handler = weak.lock()) {
+					handlers.push_back(std::move(handler));
+				}
+			}
+		}
+
+		const AccessArgs args{*this, client, request, received, elapsed};
+		for (const auto &handler: handlers) {
+			(*handler)(args);
+		}
+	}
+
+	void Server::closeWebSocket(Client &client) {
+		// The client is done with its handlers, and a later client could be given the same ID.
+		std::list<WeakCloseHandlerPtr> handlers;
+		{
+			auto lock = lockWebSocketHandlers();
+			if (auto iter = webSocketCloseHandlers.find(client.id); iter != webSocketCloseHandlers.end()) {
+				handlers = std::move(iter->second);
+				webSocketCloseHandlers.erase(iter);
+			}
+			webSocketMessageHandlers.erase(client.id);
+		}
+
+		for (auto &fnptr: handlers) {
+			if (auto fn = fnptr.lock()) {
+				(*fn)(*this, client);
+			}
+		}
 
+		unsubscribeAll(client);
 		server->close(client.id);
 	}
 
 	void Server::send400(Client &client) {
-		server->send(client.id, Response(400, "Invalid request"));
+		client.send(Response(400, "Invalid request"));
 	}
 
 	void Server::send401(Client &client, std::string_view realm) {
 		Response response(401, "Unauthorized");
 		response["www-authenticate"] = "Basic realm=\"" + escapeQuotes(realm) + "\"";
-		server->send(client.id, response);
+		client.send(std::move(response));
 	}
 
 	void Server::send401(Client &client) {
-		server->send(client.id, Response(401, "Unauthorized"));
+		client.send(Response(401, "Unauthorized"));
 	}
 
 	void Server::send403(Client &client) {
-		server->send(client.id, Response(403, "Forbidden"));
+		client.send(Response(403, "Forbidden"));
 	}
 
 	void Server::send500(Client &client) {
-		server->send(client.id, Response(500, "Internal Server Error"));
+		client.send(Response(500, "Internal Server Error"));
 	}
 
 	std::vector<std::string> Server::getParts(std::string_view path) {
@@ -251,6 +410,7 @@ namespace Algiz::HTTP {
 	}
 
 	void Server::cleanWebSocketMessageHandlers() {
+		auto lock = lockWebSocketHandlers();
 		std::erase_if(webSocketMessageHandlers, [&](auto &pair) {
 			auto &[client_id, handlers] = pair;
 			while (PluginHost::erase(handlers, nullptr));
@@ -259,6 +419,7 @@ namespace Algiz::HTTP {
 	}
 
 	void Server::cleanWebSocketCloseHandlers() {
+		auto lock = lockWebSocketHandlers();
 		std::erase_if(webSocketCloseHandlers, [&](auto &pair) {
 			auto &[client_id, handlers] = pair;
 			while (PluginHost::erase(handlers, nullptr));
@@ -267,13 +428,147 @@ namespace Algiz::HTTP {
 	}
 
 	void Server::registerWebSocketMessageHandler(const Client &client, const WeakMessageHandlerPtr &handler) {
+		auto lock = lockWebSocketHandlers();
 		webSocketMessageHandlers[client.id].push_back(handler);
 	}
 
 	void Server::registerWebSocketCloseHandler(const Client &client, const WeakCloseHandlerPtr &handler) {
+		auto lock = lockWebSocketHandlers();
 		webSocketCloseHandlers[client.id].push_back(handler);
 	}
 
+	void Server::subscribe(const Client &client, const std::string &topic, Algiz::Server::Backpressure policy, size_t limit) {
+		auto lock = lockTopics();
+		auto &subscribers = topics[topic];
+		auto updated = subscribers? std::make_shared<Subscribers>(*subscribers) : std::make_shared<Subscribers>();
+
+		auto iter = std::find_if(updated->begin(), updated->end(), [&client](const auto &subscriber) {
+			return subscriber.client == client.id;
+		});
+
+		if (iter == updated->end()) {
+			updated->push_back({client.id, policy, limit});
+		} else {
+			iter->policy = policy;
+			iter->limit = limit;
+		}
+
+		subscribers = std::move(updated);
+		topicsByClient[client.id].insert(topic);
+	}
+
+	bool Server::unsubscribe(const Client &client, const std::string &topic) {
+		auto lock = lockTopics();
+		if (!removeSubscriber(client.id, topic)) {
+			return false;
+		}
+
+		if (auto iter = topicsByClient.find(client.id); iter != topicsByClient.end()) {
+			iter->second.erase(topic);
+			if (iter->second.empty()) {
+				topicsByClient.erase(iter);
+			}
+		}
+
+		return true;
+	}
+
+	void Server::unsubscribeAll(const Client &client) {
+		auto lock = lockTopics();
+		auto iter = topicsByClient.find(client.id);
+		if (iter == topicsByClient.end()) {
+			return;
+		}
+
+		for (const std::string &topic: iter->second) {
+			removeSubscriber(client.id, topic);
+		}
+
+		topicsByClient.erase(iter);
+	}
+
+	void Server::removeTopic(const std::string &topic) {
+		auto lock = lockTopics();
+		auto iter = topics.find(topic);
+		if (iter == topics.end()) {
+			return;
+		}
+
+		for (const auto &subscriber: *iter->second) {
+			if (auto client_iter = topicsByClient.find(subscriber.client); client_iter != topicsByClient.end()) {
+				client_iter->second.erase(topic);
+				if (client_iter->second.empty()) {
+					topicsByClient.erase(client_iter);
+				}
+			}
+		}
+
+		topics.erase(iter);
+	}
+
+	bool Server::removeSubscriber(int client_id, const std::string &topic) {
+		auto iter = topics.find(topic);
+		if (iter == topics.end()) {
+			return false;
+		}
+
+		const Subscribers &subscribers = *iter->second;
+		auto found = std::find_if(subscribers.begin(), subscribers.end(), [client_id](const auto &subscriber) {
+			return subscriber.client == client_id;
+		});
+
+		if (found == subscribers.end()) {
+			return false;
+		}
+
+		if (subscribers.size() == 1) {
+			topics.erase(iter);
+			return true;
+		}
+
+		auto updated = std::make_shared<Subscribers>();
+		updated->reserve(subscribers.size() - 1);
+		for (const auto &subscriber: subscribers) {
+			if (subscriber.client != client_id) {
+				updated->push_back(subscriber);
+			}
+		}
+		iter->second = std::move(updated);
+		return true;
+	}
+
+	size_t Server::publish(const std::string &topic, std::string_view message, bool is_binary) {
+		std::shared_ptr<const Subscribers> subscribers;
+		{
+			auto lock = lockTopics();
+			if (auto iter = topics.find(topic); iter != topics.end()) {
+				subscribers = iter->second;
+			}
+		}
+
+		if (!subscribers) {
+			return 0;
+		}
+
+		uint8_t header[Client::MAX_FRAME_HEADER_SIZE];
+		const size_t header_size = Client::encodeFrameHeader(header, is_binary? 2 : 1, message.size());
+
+		std::string frame;
+		frame.reserve(header_size + message.size());
+		frame.append(reinterpret_cast<const char *>(header), header_size);
+		frame.append(message);
+
+		return server->broadcast(*subscribers, SharedBuffer::make(std::move(frame)));
+	}
+
+	size_t Server::getSubscriberCount(const std::string &topic) {
+		auto lock = lockTopics();
+		if (auto iter = topics.find(topic); iter != topics.end()) {
+			return iter->second->size();
+		}
+		return 0;
+	}
+
 	decltype(Server::configs) Server::crawlConfigs(const std::filesystem::path &base) {
 		decltype(configs) out;
 		crawlConfigs(base, out);
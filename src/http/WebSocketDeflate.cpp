@@ -0,0 +1,414 @@
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+
+#include <zlib.h>
+
+#include "http/WebSocketDeflate.h"
+#include "util/Defer.h"
+#include "util/Util.h"
+
+namespace Algiz::HTTP {
+	namespace {
+		/** The number of idle streams kept for each combination of settings. */
+		constexpr size_t MAX_POOLED_STREAMS = 64;
+
+		/** Hands out initialized zlib streams and takes them back once they've been reset. */
+		class StreamPool {
+			private:
+				/** Whether the streams deflate, their window bits, their compression level and their memory level. */
+				using Key = std::tuple<bool, int, int, int>;
+
+				std::map<Key, std::vector<z_stream *>> streams;
+				std::mutex streamsMutex;
+
+				[[nodiscard]] auto lockStreams() { return std::unique_lock(streamsMutex); }
+
+				z_stream * take(const Key &key) {
+					auto lock = lockStreams();
+					auto iter = streams.find(key);
+					if (iter == streams.end() || iter->second.empty()) {
+						return nullptr;
+					}
+					z_stream *stream = iter->second.back();
+					iter->second.pop_back();
+					return stream;
+				}
+
+				/** Returns false if the pool is full. */
+				bool give(const Key &key, z_stream *stream) {
+					auto lock = lockStreams();
+					auto &pooled = streams[key];
+					if (MAX_POOLED_STREAMS <= pooled.size()) {
+						return false;
+					}
+					pooled.push_back(stream);
+					return true;
+				}
+
+			public:
+				StreamPool() = default;
+				StreamPool(const StreamPool &) = delete;
+				StreamPool(StreamPool &&) = delete;
+
+				~StreamPool() {
+					for (auto &[key, pooled]: streams) {
+						for (z_stream *stream: pooled) {
+							if (std::get<0>(key)) {
+								deflateEnd(stream);
+							} else {
+								inflateEnd(stream);
+							}
+							delete stream;
+						}
+					}
+				}
+
+				StreamPool & operator=(const StreamPool &) = delete;
+				StreamPool & operator=(StreamPool &&) = delete;
+
+				z_stream * acquireDeflater(int window_bits, int level, int mem_level) {
+					if (z_stream *stream = take({true, window_bits, level, mem_level})) {
+						return stream;
+					}
+
+					auto *stream = new z_stream{};
+					// Negative window bits produce raw deflate data without a zlib header or trailer.
+					if (deflateInit2(stream, level, Z_DEFLATED, -window_bits, mem_level, Z_DEFAULT_STRATEGY) != Z_OK) {
+						delete stream;
+						throw std::runtime_error("Couldn't initialize deflate");
+					}
+					return stream;
+				}
+
+				z_stream * acquireInflater(int window_bits) {
+					if (z_stream *stream = take({false, window_bits, 0, 0})) {
+						return stream;
+					}
+
+					auto *stream = new z_stream{};
+					if (inflateInit2(stream, -window_bits) != Z_OK) {
+						delete stream;
+						throw std::runtime_error("Couldn't initialize inflate");
+					}
+					return stream;
+				}
+
+				void releaseDeflater(z_stream *stream, int window_bits, int level, int mem_level) {
+					if (deflateReset(stream) != Z_OK || !give({true, window_bits, level, mem_level}, stream)) {
+						deflateEnd(stream);
+						delete stream;
+					}
+				}
+
+				void releaseInflater(z_stream *stream, int window_bits) {
+					if (inflateReset(stream) != Z_OK || !give({false, window_bits, 0, 0}, stream)) {
+						inflateEnd(stream);
+						delete stream;
+					}
+				}
+		};
+
+		StreamPool & getPool() {
+			static StreamPool pool;
+			return pool;
+		}
+
+		std::string_view trim(std::string_view view) {
+			while (!view.empty() && (view.front() == ' ' || view.front() == '\t')) {
+				view.remove_prefix(1);
+			}
+			while (!view.empty() && (view.back() == ' ' || view.back() == '\t')) {
+				view.remove_suffix(1);
+			}
+			return view;
+		}
+
+		/** Parses a window size parameter's value, which may be quoted. Returns 0 if it's invalid. */
+		int parseWindowBits(std::string_view value) {
+			if (2 <= value.size() && value.front() == '"' && value.back() == '"') {
+				value = value.substr(1, value.size() - 2);
+			}
+
+			int bits = 0;
+			const auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), bits);
+			if (error != std::errc() || end != value.data() + value.size() || bits < 8 || 15 < bits) {
+				return 0;
+			}
+			return bits;
+		}
+
+		/** Interprets a single offer, such as "permessage-deflate; client_max_window_bits". */
+		std::optional<WebSocketDeflate::Parameters> negotiateOffer(std::string_view offer, const WebSocketDeflate::Config &config) {
+			WebSocketDeflate::Parameters out;
+			bool first = true;
+			bool server_no_takeover = false;
+			bool client_no_takeover = false;
+			int server_bits = 0;
+			bool client_bits_offered = false;
+			int client_bits = 0;
+
+			for (const auto &piece: split(offer, ";", true)) {
+				const std::string_view part = trim(piece);
+
+				if (first) {
+					if (toLower(part) != "permessage-deflate") {
+						return std::nullopt;
+					}
+					first = false;
+					continue;
+				}
+
+				if (part.empty()) {
+					continue;
+				}
+
+				std::string_view name = part;
+				std::optional<std::string_view> value;
+				if (const size_t equals = part.find('='); equals != std::string_view::npos) {
+					name = trim(part.substr(0, equals));
+					value = trim(part.substr(equals + 1));
+				}
+
+				const std::string lower = toLower(name);
+
+				// Each parameter may appear at most once.
+				if (lower == "server_no_context_takeover") {
+					if (value || server_no_takeover) {
+						return std::nullopt;
+					}
+					server_no_takeover = true;
+				} else if (lower == "client_no_context_takeover") {
+					if (value || client_no_takeover) {
+						return std::nullopt;
+					}
+					client_no_takeover = true;
+				} else if (lower == "server_max_window_bits") {
+					if (!value || server_bits != 0 || (server_bits = parseWindowBits(*value)) == 0) {
+						return std::nullopt;
+					}
+				} else if (lower == "client_max_window_bits") {
+					if (client_bits_offered) {
+						return std::nullopt;
+					}
+					client_bits_offered = true;
+					if (value && (client_bits = parseWindowBits(*value)) == 0) {
+						return std::nullopt;
+					}
+				} else {
+					return std::nullopt;
+				}
+			}
+
+			if (first) {
+				return std::nullopt;
+			}
+
+			if (server_bits == 8) {
+				// zlib can't compress with a window this small. Declining the offer lets the client try its next one.
+				return std::nullopt;
+			}
+
+			out.serverMaxWindowBits = std::min(server_bits == 0? 15 : server_bits, config.serverMaxWindowBits);
+			// A smaller window than the client asked for is fine to use without saying so, but an explicit request
+			// has to be answered.
+			out.sendServerMaxWindowBits = server_bits != 0;
+			out.serverNoContextTakeover = server_no_takeover || config.serverNoContextTakeover;
+
+			// The client's window can only be limited if the client said it supports that.
+			if (client_bits_offered) {
+				out.clientMaxWindowBits = std::min(client_bits == 0? 15 : client_bits, config.clientMaxWindowBits);
+				out.sendClientMaxWindowBits = out.clientMaxWindowBits < 15;
+			}
+			out.clientNoContextTakeover = client_no_takeover || config.clientNoContextTakeover;
+
+			return out;
+		}
+
+		Bytef * toBytes(const char *data) {
+			return reinterpret_cast<Bytef *>(const_cast<char *>(data));
+		}
+	}
+
+	std::string WebSocketDeflate::Parameters::toString() const {
+		std::string out = "permessage-deflate";
+		if (serverNoContextTakeover) {
+			out += "; server_no_context_takeover";
+		}
+		if (clientNoContextTakeover) {
+			out += "; client_no_context_takeover";
+		}
+		if (sendServerMaxWindowBits) {
+			out += "; server_max_window_bits=" + std::to_string(serverMaxWindowBits);
+		}
+		if (sendClientMaxWindowBits) {
+			out += "; client_max_window_bits=" + std::to_string(clientMaxWindowBits);
+		}
+		return out;
+	}
+
+	std::optional<WebSocketDeflate::Parameters> WebSocketDeflate::negotiate(std::string_view header, const Config &config) {
+		for (const auto &offer: split(header, ",", true)) {
+			if (auto parameters = negotiateOffer(offer, config)) {
+				return parameters;
+			}
+		}
+		return std::nullopt;
+	}
+
+	WebSocketDeflate::WebSocketDeflate(const Config &config, const Parameters &parameters_):
+		parameters(parameters_), threshold(config.threshold), level(config.level), memLevel(config.memLevel) {}
+
+	WebSocketDeflate::~WebSocketDeflate() {
+		if (deflater != nullptr) {
+			getPool().releaseDeflater(deflater, parameters.serverMaxWindowBits, level, memLevel);
+		}
+		if (inflater != nullptr) {
+			getPool().releaseInflater(inflater, parameters.clientMaxWindowBits);
+		}
+	}
+
+	z_stream * WebSocketDeflate::getDeflater() {
+		if (deflater != nullptr) {
+			return deflater;
+		}
+		z_stream *stream = getPool().acquireDeflater(parameters.serverMaxWindowBits, level, memLevel);
+		if (!parameters.serverNoContextTakeover) {
+			deflater = stream;
+		}
+		return stream;
+	}
+
+	z_stream * WebSocketDeflate::getInflater() {
+		if (inflater != nullptr) {
+			return inflater;
+		}
+		z_stream *stream = getPool().acquireInflater(parameters.clientMaxWindowBits);
+		if (!parameters.clientNoContextTakeover) {
+			inflater = stream;
+		}
+		return stream;
+	}
+
+	void WebSocketDeflate::finishDeflating(z_stream *stream) {
+		if (stream != deflater) {
+			getPool().releaseDeflater(stream, parameters.serverMaxWindowBits, level, memLevel);
+		}
+	}
+
+	void WebSocketDeflate::finishInflating(z_stream *stream) {
+		if (stream != inflater) {
+			getPool().releaseInflater(stream, parameters.clientMaxWindowBits);
+		}
+	}
+
+	void WebSocketDeflate::compress(std::string_view input, std::string &out) {
+		if (UINT_MAX < input.size()) {
+			throw std::length_error("WebSocket message too large to compress");
+		}
+
+		z_stream *stream = getDeflater();
+		Defer finish{[this, stream] { finishDeflating(stream); }};
+
+		// A sync flush adds a few bytes, and incompressible data grows slightly.
+		out.resize(input.size() + input.size() / 16 + 64);
+		stream->next_in = toBytes(input.data());
+		stream->avail_in = uInt(input.size());
+		size_t produced = 0;
+
+		for (;;) {
+			stream->next_out = toBytes(out.data() + produced);
+			stream->avail_out = uInt(std::min<size_t>(out.size() - produced, UINT_MAX));
+			const int status = deflate(stream, Z_SYNC_FLUSH);
+			produced = size_t(reinterpret_cast<char *>(stream->next_out) - out.data());
+
+			if (status != Z_OK && status != Z_BUF_ERROR) {
+				throw std::runtime_error("Couldn't deflate WebSocket message");
+			}
+
+			// If there's room left over, everything has been flushed.
+			if (stream->avail_out != 0) {
+				break;
+			}
+
+			out.resize(out.size() * 2);
+		}
+
+		// A sync flush ends with an empty stored block. Its last four bytes are implied on the wire.
+		if (produced < 4) {
+			throw std::runtime_error("Deflated WebSocket message is too short");
+		}
+		out.resize(produced - 4);
+	}
+
+	bool WebSocketDeflate::decompress(std::string_view input, std::string &out, size_t max_size) {
+		static constexpr char TAIL[] = {'\x00', '\x00', '\xff', '\xff'};
+
+		if (UINT_MAX < input.size()) {
+			return false;
+		}
+
+		z_stream *stream = getInflater();
+		Defer finish{[this, stream] { finishInflating(stream); }};
+
+		// One extra byte of room shows whether the message is too large.
+		const size_t capacity = max_size + 1;
+		out.resize(std::min(capacity, std::max<size_t>(input.size() * 4, 1024)));
+		size_t produced = 0;
+		bool ended = false;
+
+		for (const std::string_view chunk: {input, std::string_view(TAIL, sizeof(TAIL))}) {
+			if (ended) {
+				break;
+			}
+
+			stream->next_in = toBytes(chunk.data());
+			stream->avail_in = uInt(chunk.size());
+
+			for (;;) {
+				if (produced == out.size()) {
+					if (capacity <= out.size()) {
+						return false;
+					}
+					out.resize(std::min(capacity, out.size() * 2));
+				}
+
+				stream->next_out = toBytes(out.data() + produced);
+				stream->avail_out = uInt(std::min<size_t>(out.size() - produced, UINT_MAX));
+				const int status = inflate(stream, Z_SYNC_FLUSH);
+				produced = size_t(reinterpret_cast<char *>(stream->next_out) - out.data());
+
+				if (status == Z_STREAM_END) {
+					// The client finished its deflate stream with a final block, so its next message starts a new one.
+					// Anything after the final block, including the implied tail, would be misread as the start of the
+					// next message's stream, so it's skipped.
+					if (inflateReset(stream) != Z_OK) {
+						return false;
+					}
+					ended = true;
+					break;
+				}
+
+				if (status != Z_OK && status != Z_BUF_ERROR) {
+					return false;
+				}
+
+				if (stream->avail_in == 0 && stream->avail_out != 0) {
+					break;
+				}
+			}
+		}
+
+		if (max_size < produced) {
+			return false;
+		}
+
+		out.resize(produced);
+		return true;
+	}
+}
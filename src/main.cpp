@@ -10,6 +10,7 @@
 
 #include "ApplicationServer.h"
 #include "Core.h"
+#include "Log.h"
 #include "http/Server.h"
 #include "net/Server.h"
 #include "util/FS.h"
@@ -28,6 +29,8 @@ int main(int argc, char **argv) {
 
 		if (1 < argc && strcmp(argv[1], "dbg") == 0) {
 			std::set_terminate(+[] {
+				// Get queued messages out before the backtrace so they're not lost and don't interleave with it.
+				Algiz::log.flush();
 				void *trace_elems[64];
 				int trace_elem_count = backtrace(trace_elems, sizeof(trace_elems) / sizeof(trace_elems[0]));
 				char **stack_syms = backtrace_symbols(trace_elems, trace_elem_count);
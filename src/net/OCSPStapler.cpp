@@ -0,0 +1,412 @@
+#include "EventLoop.h"
+#include "Log.h"
+#include "net/OCSPStapler.h"
+#include "util/Defer.h"
+#include "util/FS.h"
+
+#include <openssl/err.h>
+#include <openssl/http.h>
+#include <openssl/x509v3.h>
+
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <stdexcept>
+
+namespace Algiz {
+	namespace {
+		/** How far the responder's clock can be ahead of ours. */
+		constexpr long MAX_CLOCK_SKEW = 300;
+		/** How long a response without a nextUpdate time is used for. */
+		constexpr int64_t DEFAULT_LIFETIME = 3600;
+		/** Bounds on the time between refreshes, both after a success and after a failure. */
+		constexpr std::chrono::seconds MIN_REFRESH{60};
+		constexpr std::chrono::seconds MAX_BACKOFF{3600};
+		constexpr size_t MAX_RESPONSE_SIZE = 1 << 16;
+
+		template <typename T, void (*F)(T *)>
+		struct Deleter {
+			void operator()(T *pointer) const { F(pointer); }
+		};
+
+		template <typename T, void (*F)(T *)>
+		using Pointer = std::unique_ptr<T, Deleter<T, F>>;
+
+		void freeString(char *string) {
+			OPENSSL_free(string);
+		}
+
+		void freeCertificates(STACK_OF(X509) *certificates) {
+			sk_X509_free(certificates);
+		}
+
+		int64_t getNow() {
+			return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		}
+
+		int64_t toTimestamp(const ASN1_GENERALIZEDTIME *time) {
+			std::tm tm {};
+			if (ASN1_TIME_to_tm(time, &tm) != 1) {
+				return 0;
+			}
+			return int64_t(timegm(&tm));
+		}
+
+		std::string readAll(BIO *bio) {
+			std::string out;
+			char buffer[4096];
+			int count = 0;
+			while (0 < (count = BIO_read(bio, buffer, sizeof(buffer)))) {
+				out.append(buffer, size_t(count));
+			}
+			return out;
+		}
+	}
+
+	struct OCSPStapler::Entry {
+		std::string name;
+		/** The responder named by the certificate. */
+		std::string url;
+		X509 *certificate = nullptr;
+		X509 *issuer = nullptr;
+		OCSP_CERTID *id = nullptr;
+		Counter *staplesSent = nullptr;
+		std::atomic<std::shared_ptr<const Staple>> staple;
+		/** How long to wait after the next failure. Only touched by the event loop's thread. */
+		std::chrono::seconds backoff{0};
+
+		Entry() = default;
+		Entry(const Entry &) = delete;
+		Entry(Entry &&) = delete;
+
+		~Entry() {
+			OCSP_CERTID_free(id);
+			X509_free(issuer);
+			X509_free(certificate);
+		}
+
+		Entry & operator=(const Entry &) = delete;
+		Entry & operator=(Entry &&) = delete;
+	};
+
+	OCSPStapler::OCSPStapler(const Options &options_, EventLoop &loop_, int port):
+		options(options_),
+		loop(loop_),
+		refreshSuccesses(metrics.counter("algiz_ocsp_refreshes_total", "Attempts to fetch a fresh OCSP response.", {{"port", std::to_string(port)}, {"result", "success"}})),
+		refreshFailures(metrics.counter("algiz_ocsp_refreshes_total", "Attempts to fetch a fresh OCSP response.", {{"port", std::to_string(port)}, {"result", "failure"}})),
+		staplesSent(metrics.counter("algiz_ocsp_staples_total", "OCSP responses stapled to handshakes.", {{"port", std::to_string(port)}})) {
+			pool.start();
+		}
+
+	bool OCSPStapler::add(const std::string &name, SSL_CTX *context) {
+		X509 *certificate = SSL_CTX_get0_certificate(context);
+		if (certificate == nullptr) {
+			return false;
+		}
+
+		STACK_OF(X509) *chain = nullptr;
+		SSL_CTX_get0_chain_certs(context, &chain);
+
+		X509 *issuer = nullptr;
+		for (int i = 0; i < sk_X509_num(chain); ++i) {
+			if (X509_check_issued(sk_X509_value(chain, i), certificate) == X509_V_OK) {
+				issuer = sk_X509_value(chain, i);
+				break;
+			}
+		}
+
+		const std::string display_name = name.empty()? "the default certificate" : name;
+
+		if (issuer == nullptr) {
+			WARN("Can't staple OCSP responses for " << display_name << ": its issuer isn't in the chain");
+			return false;
+		}
+
+		auto entry = std::make_shared<Entry>();
+		entry->name = name;
+		entry->staplesSent = &staplesSent;
+
+		if (STACK_OF(OPENSSL_STRING) *urls = X509_get1_ocsp(certificate); urls != nullptr) {
+			if (0 < sk_OPENSSL_STRING_num(urls)) {
+				entry->url = sk_OPENSSL_STRING_value(urls, 0);
+			}
+			X509_email_free(urls);
+		}
+
+		if (entry->url.empty() && options.responder.empty()) {
+			INFO("Not stapling OCSP responses for " << display_name << ": it doesn't name a responder");
+			return false;
+		}
+
+		entry->id = OCSP_cert_to_id(nullptr, certificate, issuer);
+		if (entry->id == nullptr) {
+			ERR_clear_error();
+			return false;
+		}
+
+		X509_up_ref(certificate);
+		entry->certificate = certificate;
+		X509_up_ref(issuer);
+		entry->issuer = issuer;
+
+		// The context owns the entry from here on, so the entry lives exactly as long as something might staple it.
+		delete static_cast<std::shared_ptr<Entry> *>(SSL_CTX_get_ex_data(context, getIndex()));
+		SSL_CTX_set_ex_data(context, getIndex(), new std::shared_ptr<Entry>(entry));
+		SSL_CTX_set_tlsext_status_cb(context, statusCallback);
+
+		std::chrono::seconds delay{0};
+
+		if (const auto path = getCachePath(*entry); !path.empty() && std::filesystem::exists(path)) {
+			try {
+				const std::string der = readFile(path);
+				int64_t expiry = 0;
+				if (validate(*entry, der, expiry, delay)) {
+					entry->staple.store(std::make_shared<const Staple>(Staple{der, expiry}));
+				} else {
+					delay = {};
+				}
+			} catch (const std::exception &err) {
+				WARN("Couldn't read cached OCSP response for " << display_name << ": " << err.what());
+			}
+		}
+
+		schedule(entry, delay);
+		return true;
+	}
+
+	void OCSPStapler::schedule(const std::shared_ptr<Entry> &entry, std::chrono::seconds delay) {
+		loop.delay(delay, [weak_self = weak_from_this(), weak_entry = std::weak_ptr(entry)] {
+			auto self = weak_self.lock();
+			auto entry = weak_entry.lock();
+			if (self && entry) {
+				self->refresh(entry);
+			}
+		});
+	}
+
+	void OCSPStapler::refresh(const std::shared_ptr<Entry> &entry) {
+		Pointer<OCSP_REQUEST, OCSP_REQUEST_free> request(OCSP_REQUEST_new());
+		OCSP_CERTID *id = OCSP_CERTID_dup(entry->id);
+		if (!request || id == nullptr || OCSP_request_add0_id(request.get(), id) == nullptr) {
+			OCSP_CERTID_free(id);
+			schedule(entry, handleFailure(*entry, "couldn't build request"));
+			return;
+		}
+
+		unsigned char *encoded = nullptr;
+		const int length = i2d_OCSP_REQUEST(request.get(), &encoded);
+		if (length <= 0) {
+			schedule(entry, handleFailure(*entry, "couldn't encode request"));
+			return;
+		}
+		std::string request_der(reinterpret_cast<const char *>(encoded), size_t(length));
+		OPENSSL_free(encoded);
+
+		// The job only holds weak references so that the stapler is never destroyed on the pool's own thread.
+		const bool queued = pool.post([weak_self = weak_from_this(), weak_entry = std::weak_ptr(entry), &loop = loop,
+		                               url = options.responder.empty()? entry->url : options.responder,
+		                               request_der = std::move(request_der), timeout = options.timeout](size_t) {
+			std::string der;
+			std::string error;
+			try {
+				der = fetch(url, request_der, timeout);
+			} catch (const std::exception &err) {
+				error = err.what();
+			}
+
+			loop.delay(std::chrono::seconds{0}, [weak_self, weak_entry, der = std::move(der), error = std::move(error)] {
+				auto self = weak_self.lock();
+				auto entry = weak_entry.lock();
+				if (self && entry) {
+					self->schedule(entry, error.empty()? self->handleResponse(*entry, der) : self->handleFailure(*entry, error));
+				}
+			});
+		});
+
+		if (!queued) {
+			schedule(entry, handleFailure(*entry, "couldn't queue request"));
+		}
+	}
+
+	std::string OCSPStapler::fetch(const std::string &url, const std::string &request, std::chrono::seconds timeout) {
+		char *host = nullptr;
+		char *port = nullptr;
+		char *path = nullptr;
+		int use_ssl = 0;
+		if (OSSL_HTTP_parse_url(url.c_str(), &use_ssl, nullptr, &host, &port, nullptr, &path, nullptr, nullptr) != 1) {
+			throw std::runtime_error("invalid URL");
+		}
+
+		Pointer<char, freeString> host_pointer(host), port_pointer(port), path_pointer(path);
+
+		if (use_ssl != 0) {
+			// Responders are plain HTTP in practice, since their responses are signed anyway.
+			throw std::runtime_error("HTTPS responders aren't supported");
+		}
+
+		Pointer<BIO, BIO_free_all> request_body(BIO_new_mem_buf(request.data(), int(request.size())));
+		if (!request_body) {
+			throw std::runtime_error("couldn't buffer request");
+		}
+
+		Pointer<BIO, BIO_free_all> response_body(OSSL_HTTP_transfer(nullptr, host, port, path, 0, nullptr, nullptr, nullptr,
+			nullptr, nullptr, nullptr, 0, nullptr, "application/ocsp-request", request_body.get(), "application/ocsp-response",
+			1, MAX_RESPONSE_SIZE, int(timeout.count()), 0));
+		if (!response_body) {
+			ERR_clear_error();
+			throw std::runtime_error("request failed");
+		}
+
+		return readAll(response_body.get());
+	}
+
+	std::chrono::seconds OCSPStapler::handleResponse(Entry &entry, const std::string &der) {
+		int64_t expiry = 0;
+		std::chrono::seconds refresh_after{};
+		if (!validate(entry, der, expiry, refresh_after)) {
+			return handleFailure(entry, "invalid response");
+		}
+
+		entry.staple.store(std::make_shared<const Staple>(Staple{der, expiry}));
+		entry.backoff = {};
+		refreshSuccesses.add();
+
+		if (const auto cache_path = getCachePath(entry); !cache_path.empty()) {
+			try {
+				std::filesystem::create_directories(options.cacheDirectory);
+				// Written to the side and then moved into place so that a crash can't leave a partial response behind.
+				auto temporary = cache_path;
+				temporary += ".tmp";
+				std::ofstream stream(temporary, std::ios::binary);
+				stream << der;
+				stream.close();
+				if (!stream) {
+					std::error_code code;
+					std::filesystem::remove(temporary, code);
+					throw std::runtime_error("couldn't write " + temporary.string());
+				}
+				std::filesystem::rename(temporary, cache_path);
+			} catch (const std::exception &err) {
+				WARN("Couldn't cache OCSP response for " << (entry.name.empty()? "the default certificate" : entry.name) << ": " << err.what());
+			}
+		}
+
+		return refresh_after;
+	}
+
+	std::chrono::seconds OCSPStapler::handleFailure(Entry &entry, std::string_view reason) {
+		ERR_clear_error();
+		refreshFailures.add();
+		WARN("Couldn't refresh OCSP response for " << (entry.name.empty()? "the default certificate" : entry.name) << " from "
+			<< (options.responder.empty()? entry.url : options.responder) << ": " << reason);
+
+		// Rather than staple a response that has expired, staple nothing.
+		if (auto staple = entry.staple.load(); staple && staple->expiry <= getNow()) {
+			entry.staple.store(nullptr);
+		}
+
+		entry.backoff = std::clamp(entry.backoff * 2, MIN_REFRESH, MAX_BACKOFF);
+		return entry.backoff;
+	}
+
+	bool OCSPStapler::validate(Entry &entry, const std::string &der, int64_t &expiry, std::chrono::seconds &refresh_after) const {
+		Defer clear_errors{[] { ERR_clear_error(); }};
+
+		const auto *pointer = reinterpret_cast<const unsigned char *>(der.data());
+		Pointer<OCSP_RESPONSE, OCSP_RESPONSE_free> response(d2i_OCSP_RESPONSE(nullptr, &pointer, long(der.size())));
+		if (!response || OCSP_response_status(response.get()) != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+			return false;
+		}
+
+		Pointer<OCSP_BASICRESP, OCSP_BASICRESP_free> basic(OCSP_response_get1_basic(response.get()));
+		if (!basic) {
+			return false;
+		}
+
+		// The issuer is the only trust anchor: the response has to be signed by it or by a responder it delegated to.
+		Pointer<X509_STORE, X509_STORE_free> store(X509_STORE_new());
+		Pointer<STACK_OF(X509), freeCertificates> certificates(sk_X509_new_null());
+		if (!store || !certificates || X509_STORE_add_cert(store.get(), entry.issuer) != 1 || sk_X509_push(certificates.get(), entry.issuer) <= 0) {
+			return false;
+		}
+		X509_STORE_set_flags(store.get(), X509_V_FLAG_PARTIAL_CHAIN);
+
+		if (OCSP_basic_verify(basic.get(), certificates.get(), store.get(), 0) != 1) {
+			return false;
+		}
+
+		int status = 0;
+		int reason = 0;
+		ASN1_GENERALIZEDTIME *revoked_at = nullptr;
+		ASN1_GENERALIZEDTIME *this_update = nullptr;
+		ASN1_GENERALIZEDTIME *next_update = nullptr;
+		if (OCSP_resp_find_status(basic.get(), entry.id, &status, &reason, &revoked_at, &this_update, &next_update) != 1) {
+			return false;
+		}
+
+		// A revoked status is worth stapling too, but an unknown one tells the client nothing.
+		if (status == V_OCSP_CERTSTATUS_UNKNOWN || OCSP_check_validity(this_update, next_update, MAX_CLOCK_SKEW, -1) != 1) {
+			return false;
+		}
+
+		const int64_t now = getNow();
+		const int64_t issued = toTimestamp(this_update);
+		expiry = next_update == nullptr? std::max(issued, now) + DEFAULT_LIFETIME : toTimestamp(next_update);
+		if (expiry <= now) {
+			return false;
+		}
+
+		// Refreshing halfway through the validity period leaves plenty of room for retries if the responder is down.
+		const int64_t start = std::min(issued, now);
+		refresh_after = std::max(MIN_REFRESH, std::chrono::seconds(start + (expiry - start) / 2 - now));
+		return true;
+	}
+
+	std::filesystem::path OCSPStapler::getCachePath(const Entry &entry) const {
+		if (options.cacheDirectory.empty()) {
+			return {};
+		}
+
+		if (entry.name.empty()) {
+			return options.cacheDirectory / "_default.ocsp";
+		}
+
+		// Hostnames come from clients in some cases, so anything that could escape the directory is refused.
+		if (entry.name.contains('/') || entry.name.front() == '.') {
+			return {};
+		}
+
+		return options.cacheDirectory / (entry.name + ".ocsp");
+	}
+
+	int OCSPStapler::getIndex() {
+		static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, +[](void *, void *pointer, CRYPTO_EX_DATA *, int, long, void *) {
+			delete static_cast<std::shared_ptr<Entry> *>(pointer);
+		});
+		return index;
+	}
+
+	int OCSPStapler::statusCallback(SSL *ssl, void *) {
+		// During SNI, this is the context for the requested hostname rather than the default one.
+		const auto *holder = static_cast<std::shared_ptr<Entry> *>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), getIndex()));
+		if (holder == nullptr) {
+			return SSL_TLSEXT_ERR_NOACK;
+		}
+
+		const Entry &entry = **holder;
+		const auto staple = entry.staple.load();
+		if (!staple || staple->expiry <= getNow()) {
+			return SSL_TLSEXT_ERR_NOACK;
+		}
+
+		// OpenSSL frees the response once it's sent.
+		auto *copy = static_cast<unsigned char *>(OPENSSL_memdup(staple->der.data(), staple->der.size()));
+		if (copy == nullptr || SSL_set_tlsext_status_ocsp_resp(ssl, copy, long(staple->der.size())) != 1) {
+			OPENSSL_free(copy);
+			return SSL_TLSEXT_ERR_NOACK;
+		}
+
+		entry.staplesSent->add();
+		return SSL_TLSEXT_ERR_OK;
+	}
+}
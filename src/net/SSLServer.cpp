@@ -1,3 +1,4 @@
+#include "Core.h"
 #include "http/Client.h"
 #include "net/NetError.h"
 #include "net/SSLServer.h"
@@ -21,7 +22,10 @@
 namespace Algiz {
 	SSLServer::SSLServer(Core &core, int af, std::string ip, uint16_t port, const std::string &cert, const std::string &key, const std::string &chain, size_t threadCount, size_t chunkSize):
 		Server(core, af, ip, port, threadCount, chunkSize),
-		sslContext(SSL_CTX_new(TLS_server_method())) {
+		sslContext(SSL_CTX_new(TLS_server_method())),
+		hostContexts(std::make_shared<const HostContexts>()) {
+			handshakeHistogram = &metrics.histogram("algiz_tls_handshake_seconds", "Time from accepting a connection to finishing its TLS handshake.", {{"port", std::to_string(port)}});
+
 			Defer cleanup{[&] {
 				ERR_print_errors_fp(stderr);
 				SSL_CTX_free(sslContext);
@@ -52,26 +56,13 @@ namespace Algiz {
 				}
 
 				auto *server = reinterpret_cast<SSLServer *>(arg);
-				std::shared_lock lock{server->certificatesMutex};
-
-				if (auto iter = server->certificatesMap.find(servername); iter != server->certificatesMap.end()) {
-					const auto &[certificate, private_key, chain] = iter->second;
-
-					if (SSL_use_certificate(ssl, certificate) != 1) {
-						ERROR("Failed to set certificate for hostname " << servername);
-						return SSL_TLSEXT_ERR_ALERT_FATAL;
-					}
+				const auto contexts = server->hostContexts.load(std::memory_order_acquire);
 
-					for (size_t i = 0; X509 *intermediate: chain) {
-						++i;
-						if (SSL_add1_chain_cert(ssl, intermediate) != 1) {
-							ERROR("Failed to add intermediate " << i << " for hostname " << servername);
-							return SSL_TLSEXT_ERR_ALERT_FATAL;
-						}
-					}
-
-					if (SSL_use_PrivateKey(ssl, private_key) != 1) {
-						ERROR("Failed to set private key for hostname " << servername);
+				if (auto iter = contexts->find(servername); iter != contexts->end()) {
+					// The SSL object takes its own reference to the context, so it's fine if the context is replaced
+					// in the meantime.
+					if (SSL_set_SSL_CTX(ssl, iter->second.get()) == nullptr) {
+						ERROR("Failed to switch context for hostname " << servername);
 						return SSL_TLSEXT_ERR_ALERT_FATAL;
 					}
 				} else {
@@ -96,39 +87,47 @@ namespace Algiz {
 		}
 	}
 
-	void SSLServer::Worker::remove(bufferevent *buffer_event) {
-		int descriptor = -1;
-		{
-			auto descriptors_lock = server.lockDescriptors();
-			descriptor = server.bufferEventDescriptors.at(buffer_event);
-			server.bufferEventDescriptors.erase(buffer_event);
-			server.bufferEvents.erase(descriptor);
+	void SSLServer::Worker::remove(Connection &connection) {
+		// Sometimes this is called during ~Server after ~SSLServer, in which case the dynamic_cast will return nullptr.
+		if (auto *ssl_server = dynamic_cast<SSLServer *>(&server); ssl_server != nullptr && !connection.removing) {
+			auto ssls_lock = std::unique_lock(ssl_server->sslsMutex);
+			ssl_server->ssls.erase(connection.descriptor);
 		}
-		{
-			auto client_lock = server.lockClients();
-			const int client_id = server.clients.at(descriptor);
-			if (server.closeHandler) {
-				server.closeHandler(client_id);
-			}
-			server.allClients.erase(client_id);
-			server.freePool.insert(client_id);
-			server.descriptors.erase(client_id);
-			server.clients.erase(descriptor);
+		Server::Worker::remove(connection);
+	}
+
+	bool SSLServer::Worker::offloadToKernel(Connection &connection, SSL *ssl) {
+		BIO *wbio = SSL_get_wbio(ssl);
+		BIO *rbio = SSL_get_rbio(ssl);
+
+		// Whether the kernel takes over depends on its version and on the negotiated protocol and cipher. If it only
+		// took over sending, input would still have to be decrypted by OpenSSL, so the connection has to stay put.
+		// The same goes for data that OpenSSL has read or written but not yet passed along.
+		if (wbio == nullptr || rbio == nullptr || !BIO_get_ktls_send(wbio) || !BIO_get_ktls_recv(rbio) || SSL_has_pending(ssl) == 1 || SSL_want(ssl) != SSL_NOTHING) {
+			return false;
 		}
-		{
-			auto read_lock = lockReadBuffers();
-			readBuffers.erase(descriptor);
+
+		bufferevent *buffer_event = bufferevent_socket_new(base, connection.descriptor, BEV_OPT_CLOSE_ON_FREE);
+		if (buffer_event == nullptr) {
+			return false;
 		}
-		{
-			auto worker_lock = server.lockWorkerMap();
-			server.workerMap.erase(buffer_event);
+
+		// The old bufferevent closes whatever descriptor its BIO has when it's freed, but the socket lives on in the new
+		// one. The BIO only forgets the descriptor; the kernel's TLS state stays with the socket.
+		BIO_set_fd(wbio, -1, BIO_NOCLOSE);
+		if (rbio != wbio) {
+			BIO_set_fd(rbio, -1, BIO_NOCLOSE);
 		}
-		// Sometimes this is called during ~Server after ~SSLServer, in which case the dynamic_cast will return nullptr.
-		if (auto *ssl_server = dynamic_cast<SSLServer *>(&server)) {
-			auto ssls_lock = std::unique_lock(ssl_server->sslsMutex);
-			ssl_server->ssls.erase(descriptor);
+
+		{
+			auto &ssl_server = dynamic_cast<SSLServer &>(server);
+			auto lock = std::unique_lock(ssl_server.sslsMutex);
+			ssl_server.ssls.erase(connection.descriptor);
 		}
-		bufferevent_free(buffer_event);
+
+		replaceBufferEvent(connection, buffer_event);
+		connection.kernelTLS = true;
+		return true;
 	}
 
 	void SSLServer::Worker::accept(int new_fd) {
@@ -161,32 +160,12 @@ namespace Algiz {
 			}
 		}
 
-		SSL *ssl = nullptr;
-
-		{
-			auto context_lock = std::unique_lock(ssl_server.sslContextMutex);
-			ssl = SSL_new(ssl_server.sslContext);
-		}
+		SSL *ssl = SSL_new(ssl_server.sslContext);
 
 		if (ssl == nullptr) {
 			throw std::runtime_error("ssl is null");
 		}
 
-		int new_client = -1;
-
-		{
-			auto lock = server.lockClients();
-			if (!server.freePool.empty()) {
-				new_client = *server.freePool.begin();
-				server.freePool.erase(new_client);
-			} else {
-				new_client = ++server.lastClient;
-			}
-			server.descriptors.emplace(new_client, new_fd);
-			server.clients.erase(new_fd);
-			server.clients.emplace(new_fd, new_client);
-		}
-
 		evutil_make_socket_nonblocking(new_fd);
 
 		bufferevent *buffer_event = bufferevent_openssl_socket_new(base, new_fd, ssl, BUFFEREVENT_SSL_ACCEPTING,
@@ -197,42 +176,103 @@ namespace Algiz {
 			throw std::runtime_error("buffer_event is null");
 		}
 
-		{
-			auto lock = server.lockDescriptors();
-			if (server.bufferEvents.contains(new_fd)) {
-				throw std::runtime_error(std::format("File descriptor {} already has a bufferevent struct", new_fd));
-			}
-			server.bufferEvents.emplace(new_fd, buffer_event);
-			server.bufferEventDescriptors.emplace(buffer_event, new_fd);
-		}
-
 		{
 			auto lock = std::unique_lock(ssl_server.sslsMutex);
 			ssl_server.ssls.emplace(new_fd, ssl);
 			ssl_server.sslMutexes.try_emplace(new_fd);
 		}
 
+		addConnection(new_fd, buffer_event, ip);
+	}
+
+	void SSLServer::enableSessionResumption(const TLSSessions::Options &options) {
+		auto new_sessions = std::make_shared<TLSSessions>(options, port);
+		new_sessions->attach(sslContext);
+
 		{
-			auto lock = server.lockWorkerMap();
-			server.workerMap.emplace(buffer_event, shared_from_this());
+			auto lock = std::unique_lock(hostContextsMutex);
+			for (const auto &[hostname, context]: *hostContexts.load()) {
+				new_sessions->attach(context.get());
+			}
+			sessions = new_sessions;
+		}
+
+		new_sessions->start(core.getEventLoop());
+	}
+
+	void SSLServer::enableOCSPStapling(const OCSPStapler::Options &options) {
+		auto new_stapler = std::make_shared<OCSPStapler>(options, core.getEventLoop(), port);
+		new_stapler->add("", sslContext);
+
+		auto lock = std::unique_lock(hostContextsMutex);
+		for (const auto &[hostname, context]: *hostContexts.load()) {
+			new_stapler->add(hostname, context.get());
 		}
+		stapler = std::move(new_stapler);
+	}
+
+	bool SSLServer::enableKernelTLS() {
+#ifdef OPENSSL_NO_KTLS
+		return false;
+#else
+		SSL_CTX_set_options(sslContext, SSL_OP_ENABLE_KTLS);
+		kernelTLS = true;
+		kernelTLSOffloaded = &metrics.counter("algiz_tls_kernel_offload_total", "Handshakes after which the kernel did or didn't take over encryption.", {{"port", std::to_string(port)}, {"result", "offloaded"}});
+		kernelTLSUnsupported = &metrics.counter("algiz_tls_kernel_offload_total", "Handshakes after which the kernel did or didn't take over encryption.", {{"port", std::to_string(port)}, {"result", "unsupported"}});
+		return true;
+#endif
+	}
 
-		if (server.addClient) {
-			auto lock = server.lockClients();
-			server.addClient(*this, new_client, ip);
+	void SSLServer::onHandshake(Connection &connection) {
+		SSL *ssl = bufferevent_openssl_get_ssl(connection.bufferEvent);
+		if (ssl == nullptr) {
+			return;
+		}
+
+		if (sessions) {
+			sessions->recordHandshake(ssl);
 		}
 
-		bufferevent_setcb(buffer_event, conn_readcb, conn_writecb, conn_eventcb, this);
-		bufferevent_enable(buffer_event, EV_READ | EV_WRITE);
+		if (kernelTLS) {
+			if (dynamic_cast<Worker &>(*connection.worker).offloadToKernel(connection, ssl)) {
+				kernelTLSOffloaded->add();
+			} else {
+				kernelTLSUnsupported->add();
+			}
+		}
 	}
 
 	void SSLServer::addCertificate(std::string hostname, const std::string &certificate, const std::string &private_key, const std::string &rest_of_chain) {
-		std::unique_lock lock{certificatesMutex};
+		// All the parsing and setup happens before the lock is taken.
+		std::shared_ptr<SSL_CTX> context = makeHostContext(certificate, private_key, rest_of_chain);
+
+		auto lock = std::unique_lock(hostContextsMutex);
+
+		if (sessions) {
+			sessions->attach(context.get());
+		}
+
+		if (stapler) {
+			stapler->add(hostname, context.get());
+		}
+
+		auto new_contexts = std::make_shared<HostContexts>(*hostContexts.load());
+		(*new_contexts)[std::move(hostname)] = std::move(context);
+		hostContexts.store(std::move(new_contexts), std::memory_order_release);
+	}
 
-		if (auto iter = certificatesMap.find(hostname); iter != certificatesMap.end()) {
-			certificatesMap.erase(iter);
+	std::shared_ptr<SSL_CTX> SSLServer::makeHostContext(const std::string &certificate, const std::string &private_key, const std::string &rest_of_chain) {
+		std::shared_ptr<SSL_CTX> context(SSL_CTX_new(TLS_server_method()), SSL_CTX_free);
+		if (!context) {
+			throw std::runtime_error("Couldn't create SSL context");
 		}
 
+		// Ciphers come from the SSL object, which inherits them from the base context when it's made, so only the
+		// protocol settings have to be copied.
+		SSL_CTX_set_options(context.get(), SSL_CTX_get_options(sslContext));
+		SSL_CTX_set_min_proto_version(context.get(), SSL_CTX_get_min_proto_version(sslContext));
+		SSL_CTX_set_max_proto_version(context.get(), SSL_CTX_get_max_proto_version(sslContext));
+
 		std::unique_ptr<BIO, decltype(&BIO_free)> bio(BIO_new(BIO_s_mem()), BIO_free);
 		if (bio == nullptr) {
 			throw std::runtime_error("Couldn't create BIO");
@@ -242,27 +282,43 @@ namespace Algiz {
 			throw std::runtime_error("Couldn't read certificate");
 		}
 
-		X509 *x509 = PEM_read_bio_X509(bio.get(), nullptr, nullptr, nullptr);
-
-		if (BIO_puts(bio.get(), rest_of_chain.c_str()) <= 0) {
-			throw std::runtime_error("Couldn't read rest of chain");
+		std::unique_ptr<X509, decltype(&X509_free)> x509(PEM_read_bio_X509(bio.get(), nullptr, nullptr, nullptr), X509_free);
+		if (x509 == nullptr || SSL_CTX_use_certificate(context.get(), x509.get()) != 1) {
+			throw std::runtime_error("Couldn't use certificate");
 		}
 
-		std::vector<X509 *> chain;
+		if (!rest_of_chain.empty()) {
+			if (BIO_puts(bio.get(), rest_of_chain.c_str()) <= 0) {
+				throw std::runtime_error("Couldn't read rest of chain");
+			}
 
-		X509 *intermediate = nullptr;
-		while ((intermediate = PEM_read_bio_X509(bio.get(), nullptr, nullptr, nullptr)) != nullptr) {
-			chain.push_back(intermediate);
+			X509 *intermediate = nullptr;
+			while ((intermediate = PEM_read_bio_X509(bio.get(), nullptr, nullptr, nullptr)) != nullptr) {
+				// On success, the context takes ownership of the intermediate.
+				if (SSL_CTX_add0_chain_cert(context.get(), intermediate) != 1) {
+					X509_free(intermediate);
+					throw std::runtime_error("Couldn't add intermediate certificate");
+				}
+			}
+
+			// Running out of certificates leaves an error in the queue.
+			ERR_clear_error();
 		}
 
 		if (BIO_puts(bio.get(), private_key.c_str()) <= 0) {
-			X509_free(x509);
 			throw std::runtime_error("Couldn't read private key");
 		}
 
-		EVP_PKEY *pkey = PEM_read_bio_PrivateKey(bio.get(), nullptr, nullptr, nullptr);
+		std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> pkey(PEM_read_bio_PrivateKey(bio.get(), nullptr, nullptr, nullptr), EVP_PKEY_free);
+		if (pkey == nullptr || SSL_CTX_use_PrivateKey(context.get(), pkey.get()) != 1) {
+			throw std::runtime_error("Couldn't use private key");
+		}
+
+		if (SSL_CTX_check_private_key(context.get()) != 1) {
+			throw std::runtime_error("Private key doesn't match certificate");
+		}
 
-		certificatesMap.try_emplace(std::move(hostname), x509, pkey, std::move(chain));
+		return context;
 	}
 
 	std::shared_ptr<Server::Worker> SSLServer::makeWorker(size_t buffer_size, size_t id) {
@@ -4,37 +4,81 @@
 #include "http/Client.h"
 #include "net/NetError.h"
 #include "net/Server.h"
+#include "util/Defer.h"
 
 #include <arpa/inet.h>
 #include <cerrno>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <fcntl.h>
 #include <format>
 #include <iostream>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <utility>
 
 namespace Algiz {
+	thread_local const Server::Worker *Server::Worker::current = nullptr;
+
+	namespace {
+		/** Closes a descriptor when destroyed, so that a task that never runs doesn't leak it. */
+		struct OwnedDescriptor {
+			int descriptor = -1;
+
+			explicit OwnedDescriptor(int descriptor_): descriptor(descriptor_) {}
+			OwnedDescriptor(OwnedDescriptor &&other) noexcept: descriptor(std::exchange(other.descriptor, -1)) {}
+			OwnedDescriptor(const OwnedDescriptor &) = delete;
+
+			~OwnedDescriptor() {
+				if (descriptor != -1) {
+					::close(descriptor);
+				}
+			}
+
+			OwnedDescriptor & operator=(const OwnedDescriptor &) = delete;
+			OwnedDescriptor & operator=(OwnedDescriptor &&) = delete;
+		};
+	}
+
 	Server::Server(Core &core, int af, std::string ip, uint16_t port, size_t threadCount, size_t chunkSize):
 		core(core),
 		af(af),
 		ip(std::move(ip)),
 		port(port),
 		chunkSize(chunkSize),
-		threadCount(threadCount) {
+		threadCount(threadCount),
+		acceptedCounter(metrics.counter("algiz_connections_accepted_total", "Connections accepted.", {{"port", std::to_string(port)}})),
+		bytesOutCounter(metrics.counter("algiz_sent_bytes_total", "Bytes queued for sending to clients.", {{"port", std::to_string(port)}})),
+		broadcastDroppedCounter(metrics.counter("algiz_broadcast_backpressure_total", "Broadcast recipients whose output was backed up.", {{"port", std::to_string(port)}, {"action", "drop"}})),
+		broadcastDisconnectedCounter(metrics.counter("algiz_broadcast_backpressure_total", "Broadcast recipients whose output was backed up.", {{"port", std::to_string(port)}, {"action", "disconnect"}})) {
 			if (threadCount < 1) {
 				throw std::invalid_argument("Cannot instantiate a Server with a thread count of zero");
 			}
+
+			// The last Ref to a connection can be dropped on any thread, but its bufferevent belongs to its worker's
+			// event loop, so the record is only reset there.
+			connections.setReclaimer([](Connection &connection, SlabTable<Connection>::Finish finish) {
+				Worker *worker = connection.worker.get();
+				if (worker == nullptr || worker->isCurrent() || !worker->postIfRunning(finish)) {
+					finish();
+				}
+			});
 		}
 
 	Server::~Server() {
-		while (!bufferEvents.empty()) {
-			remove(bufferEvents.begin()->second);
-		}
+		// Removal is normally posted to a connection's worker, but a worker whose loop has exited would never get to
+		// it. With the workers stopped, the connections can be removed right here instead. Whatever owned the close
+		// handler may already be gone, so it isn't told about these.
 		stop();
+		closeHandler = {};
+		for (const int client_id: connections.getLiveIDs()) {
+			if (auto connection = connections.acquire(client_id)) {
+				connection->worker->remove(*connection);
+			}
+		}
 	}
 
 	Server::Worker::Worker(Server &server, size_t bufferSize, size_t id):
@@ -42,7 +86,11 @@ namespace Algiz {
 		bufferSize(bufferSize),
 		buffer(std::make_unique<char[]>(bufferSize)),
 		base(event_base_new()),
-		id(id) {
+		id(id),
+		timersEpoch(std::chrono::steady_clock::now()),
+		connectionsGauge(metrics.gauge("algiz_worker_connections", "Open connections per worker.", {{"port", std::to_string(server.port)}, {"worker", std::to_string(id)}})),
+		readHistogram(metrics.histogram("algiz_worker_read_seconds", "Time spent handling input per read event.", {{"port", std::to_string(server.port)}, {"worker", std::to_string(id)}})),
+		bytesInCounter(metrics.counter("algiz_received_bytes_total", "Bytes received from clients.", {{"port", std::to_string(server.port)}, {"worker", std::to_string(id)}})) {
 			if (base == nullptr) {
 				throw std::runtime_error("Couldn't allocate a new event_base");
 			}
@@ -57,6 +105,22 @@ namespace Algiz {
 				throw std::runtime_error("Couldn't allocate acceptEvent");
 			}
 
+			taskEvent = event_new(base, -1, EV_PERSIST, &worker_taskcb, this);
+
+			if (taskEvent == nullptr || event_add(taskEvent, nullptr) < 0) {
+				throw std::runtime_error("Couldn't set up taskEvent");
+			}
+
+			tickEvent = event_new(base, -1, EV_PERSIST, &worker_tickcb, this);
+			const timeval tick_interval{
+				.tv_sec = time_t(TIMER_RESOLUTION.count() / 1000),
+				.tv_usec = suseconds_t(TIMER_RESOLUTION.count() % 1000 * 1000),
+			};
+
+			if (tickEvent == nullptr || event_add(tickEvent, &tick_interval) < 0) {
+				throw std::runtime_error("Couldn't set up tickEvent");
+			}
+
 			if (event_add(acceptEvent, nullptr) < 0) {
 				char error[64] = "?";
 				if (!strerror_r(errno, error, sizeof(error))) {
@@ -67,13 +131,126 @@ namespace Algiz {
 		}
 
 	Server::Worker::~Worker() {
+		listener.reset();
+		event_free(tickEvent);
+		event_free(taskEvent);
 		event_free(acceptEvent);
 		pipeIgnorer.reset();
 		event_base_free(base);
 	}
 
 	void Server::Worker::work(size_t) {
+		current = this;
 		event_base_loop(base, EVLOOP_NO_EXIT_ON_EMPTY);
+		{
+			auto lock = lockTasks();
+			finished = true;
+		}
+		// Tasks posted while the loop was winding down would otherwise never run, and they may hold connections open.
+		runTasks();
+		current = nullptr;
+	}
+
+	void Server::Worker::post(Task task) {
+		{
+			auto lock = lockTasks();
+			tasks.emplace_back(std::move(task));
+		}
+		event_active(taskEvent, 0, 0);
+	}
+
+	bool Server::Worker::postIfRunning(Task &task) {
+		{
+			auto lock = lockTasks();
+			if (finished) {
+				return false;
+			}
+			tasks.emplace_back(std::move(task));
+		}
+		event_active(taskEvent, 0, 0);
+		return true;
+	}
+
+	void Server::Worker::runTasks() {
+		std::vector<Task> to_run;
+		{
+			auto lock = lockTasks();
+			to_run.swap(tasks);
+		}
+		for (auto &task: to_run) {
+			try {
+				task();
+			} catch (const std::exception &err) {
+				ERROR("Worker task failed: " << err.what());
+			}
+		}
+	}
+
+	bool Server::Worker::isCurrent() const {
+		return current == this;
+	}
+
+	uint64_t Server::Worker::toTicks(std::chrono::milliseconds duration) {
+		if (duration.count() <= 0) {
+			return 0;
+		}
+		return uint64_t((duration + TIMER_RESOLUTION - std::chrono::milliseconds(1)) / TIMER_RESOLUTION);
+	}
+
+	void Server::Worker::scheduleIdleCheck(Connection &connection, uint64_t delay) {
+		const int client_id = connection.id;
+		connection.idleTimer = timers.schedule(delay, [this, client_id] {
+			checkIdle(client_id);
+		});
+	}
+
+	void Server::Worker::checkIdle(int client_id) {
+		auto connection = server.connections.acquire(client_id);
+		if (!connection || connection->removing) {
+			return;
+		}
+
+		connection->idleTimer = {};
+
+		const uint64_t timeout = toTicks(std::chrono::seconds(connection->idleTimeout));
+		if (timeout == 0) {
+			return;
+		}
+
+		const uint64_t now = timers.getNow();
+		const uint64_t idle = now - connection->lastActivity;
+
+		if (idle < timeout) {
+			// The client was heard from since the timer was set. Rather than rescheduling on every read, the timer is
+			// only pushed back when it fires.
+			scheduleIdleCheck(*connection, timeout - idle);
+			return;
+		}
+
+		// A client that's quietly receiving a large response isn't idle, and neither is one whose reading was paused
+		// while its request is being handled.
+		const bool paused = (bufferevent_get_enabled(connection->bufferEvent) & EV_READ) == 0;
+		if (paused || evbuffer_get_length(bufferevent_get_output(connection->bufferEvent)) != 0 || server.hasPendingOutput(*connection)) {
+			connection->lastActivity = now;
+			scheduleIdleCheck(*connection, timeout);
+			return;
+		}
+
+		remove(*connection);
+	}
+
+	void Server::Worker::listen() {
+		listener.reset(evconnlistener_new_bind(base, worker_listener_cb, this,
+			LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT | LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC, -1, server.name,
+			server.nameSize));
+
+		if (!listener) {
+			char error[64] = "?";
+			if (!strerror_r(errno, error, sizeof(error))) {
+				throw std::runtime_error(std::format("Couldn't initialize libevent listener for worker {} ({})", id, errno));
+			}
+			throw std::runtime_error(std::format("Couldn't initialize libevent listener for worker {} ({}): {}", id, errno, error));
+		}
 	}
 
 	void Server::Worker::stop() {
@@ -104,21 +281,144 @@ namespace Algiz {
 	}
 
 	int Server::getDescriptor(int client) {
-		int descriptor;
-		{
-			auto lock = lockClients();
-			descriptor = descriptors.at(client);
+		auto connection = connections.acquire(client);
+		if (!connection) {
+			throw std::out_of_range("No such client: " + std::to_string(client));
+		}
+		return connection->descriptor;
+	}
+
+	Server::ConnectionRef Server::getConnection(int client) {
+		return connections.acquire(client);
+	}
+
+	bool Server::setClient(int client_id, std::unique_ptr<GenericClient> &&client) {
+		auto connection = connections.acquire(client_id);
+		if (!connection) {
+			return false;
+		}
+		connection->client = std::move(client);
+		return true;
+	}
+
+	bool Server::setIdleTimeout(int client_id, size_t seconds) {
+		auto connection = connections.acquire(client_id);
+		if (!connection) {
+			return false;
+		}
+
+		auto &worker = *connection->worker;
+
+		if (!worker.isCurrent()) {
+			post(*connection, [this, client_id, seconds] { setIdleTimeout(client_id, seconds); });
+			return true;
+		}
+
+		worker.timers.cancel(connection->idleTimer);
+		connection->idleTimer = {};
+		connection->idleTimeout = seconds;
+		connection->lastActivity = worker.timers.getNow();
+
+		if (seconds != 0) {
+			worker.scheduleIdleCheck(*connection, Worker::toTicks(std::chrono::seconds(seconds)));
+		}
+
+		return true;
+	}
+
+	Server::TimerHandle Server::schedule(int client_id, std::chrono::milliseconds delay, Task task) {
+		auto connection = connections.acquire(client_id);
+		if (!connection) {
+			return {};
+		}
+
+		auto &worker = *connection->worker;
+		if (!worker.isCurrent()) {
+			throw std::runtime_error("Timers can only be scheduled from the client's worker thread");
+		}
+
+		return worker.timers.schedule(Worker::toTicks(delay), [this, client_id, task = std::move(task)]() mutable {
+			// The client might have disconnected while the timer was pending.
+			if (auto connection = connections.acquire(client_id); connection && !connection->removing) {
+				task();
+			}
+		});
+	}
+
+	bool Server::cancel(int client_id, TimerHandle handle) {
+		auto connection = connections.acquire(client_id);
+		if (!connection) {
+			return false;
 		}
-		return descriptor;
+
+		auto &worker = *connection->worker;
+		if (!worker.isCurrent()) {
+			throw std::runtime_error("Timers can only be cancelled from the client's worker thread");
+		}
+
+		return worker.timers.cancel(handle);
+	}
+
+	bool Server::setReading(int client_id, bool reading) {
+		auto connection = connections.acquire(client_id);
+		if (!connection) {
+			return false;
+		}
+
+		if (!connection->worker->isCurrent()) {
+			post(*connection, [this, client_id, reading] { setReading(client_id, reading); });
+			return true;
+		}
+
+		if (reading) {
+			return bufferevent_enable(connection->bufferEvent, EV_READ) == 0;
+		}
+
+		return bufferevent_disable(connection->bufferEvent, EV_READ) == 0;
+	}
+
+	bool Server::post(int client_id, Task task) {
+		auto connection = connections.acquire(client_id);
+		if (!connection) {
+			return false;
+		}
+		post(*connection, std::move(task));
+		return true;
 	}
 
-	bufferevent * Server::getBufferEvent(int descriptor) {
-		bufferevent *buffer_event;
+	void Server::post(Connection &connection, Task task) {
+		connection.worker->post(std::move(task));
+	}
+
+	void Server::Connection::reset() {
+		if (bufferEvent != nullptr) {
+			bufferevent_free(bufferEvent);
+			bufferEvent = nullptr;
+		}
+
 		{
-			auto lock = lockDescriptors();
-			buffer_event = bufferEvents.at(descriptor);
+			auto lock = lockPendingOutputs();
+			for (auto &pending: pendingOutputs) {
+				if (auto *stream = std::get_if<FileStream>(&pending)) {
+					::close(stream->descriptor);
+				}
+			}
+			pendingOutputs.clear();
+			hasPendingOutput = false;
 		}
-		return buffer_event;
+
+		client.reset();
+		idleTimeout = 0;
+		lastActivity = 0;
+		idleTimer = {};
+		// The worker is left in place so that a callback racing with removal can still reach the connection table.
+		readBuffer.clear();
+		readBuffer.shrink_to_fit();
+		descriptor = -1;
+		kernelTLS = false;
+		closeQueued = false;
+		removing = false;
+		id = -1;
 	}
 
 	void Server::handleMessage(GenericClient &client, std::string_view message) {
@@ -128,53 +428,416 @@ namespace Algiz {
 	}
 
 	ssize_t Server::send(int client, std::string_view message) {
-		try {
-			return bufferevent_write(getBufferEvent(getDescriptor(client)), message.begin(), message.size());
-		} catch (const std::out_of_range &err) {
+		auto connection = connections.acquire(client);
+		if (!connection) {
 			return -1;
 		}
+
+		if (!connection->worker->isCurrent()) {
+			post(*connection, [this, client, message = std::string(message)] { send(client, message); });
+			return 0;
+		}
+
+		if (connection->hasPendingOutput) {
+			// If something is still being streamed to the client, the message has to wait its turn.
+			auto lock = connection->lockPendingOutputs();
+			if (!connection->pendingOutputs.empty()) {
+				connection->pendingOutputs.emplace_back(std::string(message));
+				return 0;
+			}
+		}
+
+		bytesOutCounter.add(message.size());
+		return bufferevent_write(connection->bufferEvent, message.begin(), message.size());
 	}
 
 	ssize_t Server::send(int client, const std::string &message) {
 		return send(client, std::string_view(message));
 	}
 
-	void Server::Worker::removeClient(int client) {
-		remove(server.getBufferEvent(server.getDescriptor(client)));
+	ssize_t Server::send(int client, evbuffer *buffer) {
+		auto connection = connections.acquire(client);
+		if (!connection) {
+			return -1;
+		}
+
+		if (!connection->worker->isCurrent()) {
+			// Moving the chains over doesn't copy anything, and references and file segments come along as they are.
+			BufferPointer moved(evbuffer_new(), evbuffer_free);
+			if (!moved || evbuffer_add_buffer(moved.get(), buffer) != 0) {
+				return -1;
+			}
+			post(*connection, [this, client, moved = std::move(moved)] { send(client, moved.get()); });
+			return 0;
+		}
+
+		if (connection->hasPendingOutput) {
+			auto lock = connection->lockPendingOutputs();
+			if (!connection->pendingOutputs.empty()) {
+				BufferPointer pending(evbuffer_new(), evbuffer_free);
+				if (!pending || evbuffer_add_buffer(pending.get(), buffer) != 0) {
+					return -1;
+				}
+				connection->pendingOutputs.emplace_back(std::move(pending));
+				return 0;
+			}
+		}
+
+		bytesOutCounter.add(evbuffer_get_length(buffer));
+		return evbuffer_add_buffer(bufferevent_get_output(connection->bufferEvent), buffer);
 	}
 
-	void Server::Worker::remove(bufferevent *buffer_event) {
-		int descriptor = -1;
-		{
-			auto descriptors_lock = server.lockDescriptors();
-			descriptor = server.bufferEventDescriptors.at(buffer_event);
-			server.bufferEventDescriptors.erase(buffer_event);
-			server.bufferEvents.erase(descriptor);
+	struct Server::Delivery {
+		ConnectionRef connection;
+		Backpressure policy;
+		size_t limit;
+	};
+
+	size_t Server::broadcast(const std::vector<Recipient> &recipients, const SharedBuffer::Ptr &buffer) {
+		std::vector<std::vector<Delivery>> batches(threadCount);
+		size_t found = 0;
+
+		for (const Recipient &recipient: recipients) {
+			auto connection = connections.acquire(recipient.client);
+			if (!connection || connection->removing) {
+				continue;
+			}
+
+			const size_t worker_id = connection->worker->id;
+			if (batches.size() <= worker_id) {
+				batches.resize(worker_id + 1);
+			}
+			batches[worker_id].push_back({std::move(connection), recipient.policy, recipient.limit});
+			++found;
 		}
-		{
-			auto client_lock = server.lockClients();
-			const int client_id = server.clients.at(descriptor);
-			if (server.closeHandler) {
-				server.closeHandler(client_id);
+
+		for (auto &batch: batches) {
+			if (batch.empty()) {
+				continue;
+			}
+
+			Worker &worker = *batch.front().connection->worker;
+			if (worker.isCurrent()) {
+				deliver(batch, buffer);
+			} else {
+				// The batch's ConnectionRefs keep the records from being reused before the worker gets to them.
+				worker.post([this, batch = std::move(batch), buffer]() mutable {
+					deliver(batch, buffer);
+				});
 			}
-			server.allClients.erase(client_id);
-			server.freePool.insert(client_id);
-			server.descriptors.erase(client_id);
-			server.clients.erase(descriptor);
 		}
-		{
-			auto read_lock = lockReadBuffers();
-			readBuffers.erase(descriptor);
+
+		return found;
+	}
+
+	void Server::deliver(std::vector<Delivery> &batch, const SharedBuffer::Ptr &buffer) {
+		for (Delivery &delivery: batch) {
+			Connection &connection = *delivery.connection;
+			if (connection.removing || connection.bufferEvent == nullptr) {
+				continue;
+			}
+
+			evbuffer *output = bufferevent_get_output(connection.bufferEvent);
+
+			if (delivery.policy != Backpressure::Queue) {
+				// Output queued behind a stream is just as backed up as output in the buffer.
+				const size_t backlog = evbuffer_get_length(output) + getPendingBytes(connection);
+				if (delivery.limit < backlog) {
+					if (delivery.policy == Backpressure::Drop) {
+						broadcastDroppedCounter.add();
+					} else {
+						broadcastDisconnectedCounter.add();
+						connection.worker->remove(connection);
+					}
+					continue;
+				}
+			}
+
+			if (connection.hasPendingOutput) {
+				// The data has to wait behind whatever is being streamed, which send() takes care of.
+				BufferPointer pending(evbuffer_new(), evbuffer_free);
+				if (pending && buffer->appendTo(pending.get())) {
+					send(connection.id, pending.get());
+				}
+				continue;
+			}
+
+			if (buffer->appendTo(output)) {
+				bytesOutCounter.add(buffer->size());
+			}
+		}
+	}
+
+	ssize_t Server::sendFile(int client, int file_descriptor, size_t offset, size_t length) {
+		if (length == 0) {
+			return 0;
+		}
+
+		auto connection = connections.acquire(client);
+		if (!connection) {
+			return -1;
+		}
+
+		const int duplicate = fcntl(file_descriptor, F_DUPFD_CLOEXEC, 0);
+		if (duplicate == -1) {
+			WARN("Couldn't duplicate file descriptor " << file_descriptor << ": " << strerror(errno));
+			return -1;
+		}
+
+		if (!connection->worker->isCurrent()) {
+			// The caller may close its descriptor as soon as this returns, so hand over the duplicate instead.
+			post(*connection, [this, client, offset, length, owned = OwnedDescriptor(duplicate)] {
+				sendFile(client, owned.descriptor, offset, length);
+			});
+			return 0;
+		}
+
+		bytesOutCounter.add(length);
+
+		if (canSendFilesDirectly(*connection) && !hasPendingOutput(*connection)) {
+			// The segment owns the duplicate descriptor from here on. libevent will use sendfile when it flushes the
+			// segment to the socket, so the file's contents never pass through our buffers.
+			evbuffer_file_segment *segment = evbuffer_file_segment_new(duplicate, offset, length, EVBUF_FS_CLOSE_ON_FREE);
+			if (segment == nullptr) {
+				::close(duplicate);
+				return -1;
+			}
+
+			const int result = evbuffer_add_file_segment(bufferevent_get_output(connection->bufferEvent), segment, 0, length);
+			evbuffer_file_segment_free(segment);
+			return result;
+		}
+
+		return enqueue(*connection, FileStream{duplicate, offset, length});
+	}
+
+	ssize_t Server::stream(int client, Producer producer) {
+		if (!producer) {
+			return -1;
+		}
+
+		auto connection = connections.acquire(client);
+		if (!connection) {
+			return -1;
+		}
+
+		if (!connection->worker->isCurrent()) {
+			post(*connection, [this, client, producer = std::move(producer)]() mutable { stream(client, std::move(producer)); });
+			return 0;
+		}
+
+		return enqueue(*connection, std::move(producer));
+	}
+
+	ssize_t Server::resume(int client) {
+		auto connection = connections.acquire(client);
+		if (!connection) {
+			return -1;
 		}
+
+		if (!connection->worker->isCurrent()) {
+			post(*connection, [this, client] { resume(client); });
+			return 0;
+		}
+
+		try {
+			pump(*connection);
+		} catch (const std::exception &err) {
+			ERROR("Couldn't stream to client " << client << ": " << err.what());
+			close(client);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	ssize_t Server::enqueue(Connection &connection, PendingOutput &&pending) {
 		{
-			auto worker_lock = server.lockWorkerMap();
-			server.workerMap.erase(buffer_event);
+			auto lock = connection.lockPendingOutputs();
+			if (connection.pendingOutputs.empty()) {
+				connection.hasPendingOutput = true;
+				// Get notified once the buffer has drained far enough that it can be refilled without running dry.
+				bufferevent_setwatermark(connection.bufferEvent, EV_WRITE, streamLowWatermark, 0);
+			}
+			connection.pendingOutputs.emplace_back(std::move(pending));
+		}
+
+		try {
+			pump(connection);
+		} catch (const std::exception &err) {
+			ERROR("Couldn't stream to client " << connection.id << ": " << err.what());
+			close(connection.id);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	bool Server::pump(Connection &connection) {
+		if (!connection.hasPendingOutput) {
+			return true;
+		}
+
+		auto lock = connection.lockPendingOutputs();
+		auto &queue = connection.pendingOutputs;
+		evbuffer *output = bufferevent_get_output(connection.bufferEvent);
+		std::string chunk;
+
+		while (!queue.empty()) {
+			const size_t buffered = evbuffer_get_length(output);
+			if (streamWindow <= buffered) {
+				return false;
+			}
+
+			if (auto *message = std::get_if<std::string>(&queue.front())) {
+				evbuffer_add(output, message->data(), message->size());
+				queue.pop_front();
+				continue;
+			}
+
+			if (auto *pending_buffer = std::get_if<BufferPointer>(&queue.front())) {
+				evbuffer_add_buffer(output, pending_buffer->get());
+				queue.pop_front();
+				continue;
+			}
+
+			if (auto *slot = std::get_if<Producer>(&queue.front())) {
+				// The producer is caller code that may send to this client or even close it, so it runs without the lock.
+				// Its slot stays at the front, empty, to keep anything sent meanwhile queued behind it.
+				Producer producer = std::exchange(*slot, nullptr);
+				chunk.clear();
+				bool more;
+				lock.unlock();
+				try {
+					more = producer(chunk, streamWindow - buffered);
+				} catch (...) {
+					clearPendingOutput(connection);
+					throw;
+				}
+				lock.lock();
+
+				if (connection.removing || queue.empty() || !std::holds_alternative<Producer>(queue.front()) || std::get<Producer>(queue.front())) {
+					// The pending output was cleared while the producer ran.
+					return !connection.hasPendingOutput;
+				}
+
+				evbuffer_add(output, chunk.data(), chunk.size());
+				if (!more) {
+					queue.pop_front();
+					continue;
+				}
+
+				std::get<Producer>(queue.front()) = std::move(producer);
+				if (chunk.empty()) {
+					// The producer has nothing to offer right now. Let it try again the next time the buffer drains.
+					return false;
+				}
+				continue;
+			}
+
+			auto &stream = std::get<FileStream>(queue.front());
+			const size_t to_read = std::min(stream.remaining, streamWindow - buffered);
+
+			// Read straight into the output buffer's memory instead of going through an intermediate buffer.
+			evbuffer_iovec vector{};
+			if (evbuffer_reserve_space(output, ssize_t(to_read), &vector, 1) < 1) {
+				clearPendingOutput(connection);
+				throw std::runtime_error("Couldn't reserve space in output buffer");
+			}
+
+			const ssize_t bytes_read = pread(stream.descriptor, vector.iov_base, to_read, off_t(stream.offset));
+			if (bytes_read <= 0) {
+				const int error = bytes_read == 0? EIO : errno;
+				clearPendingOutput(connection);
+				throw NetError("Streaming file", error);
+			}
+
+			vector.iov_len = size_t(bytes_read);
+			evbuffer_commit_space(output, &vector, 1);
+			stream.offset += size_t(bytes_read);
+			stream.remaining -= size_t(bytes_read);
+
+			if (stream.remaining == 0) {
+				::close(stream.descriptor);
+				queue.pop_front();
+			}
+		}
+
+		connection.hasPendingOutput = false;
+		bufferevent_setwatermark(connection.bufferEvent, EV_WRITE, 0, 0);
+		return true;
+	}
+
+	bool Server::hasPendingOutput(Connection &connection) {
+		if (!connection.hasPendingOutput) {
+			return false;
+		}
+
+		auto lock = connection.lockPendingOutputs();
+		return !connection.pendingOutputs.empty();
+	}
+
+	size_t Server::getPendingBytes(Connection &connection) {
+		if (!connection.hasPendingOutput) {
+			return 0;
+		}
+
+		auto lock = connection.lockPendingOutputs();
+		size_t total = 0;
+
+		for (const auto &pending: connection.pendingOutputs) {
+			if (const auto *stream = std::get_if<FileStream>(&pending)) {
+				total += stream->remaining;
+			} else if (const auto *message = std::get_if<std::string>(&pending)) {
+				total += message->size();
+			} else if (const auto *pending_buffer = std::get_if<BufferPointer>(&pending)) {
+				total += evbuffer_get_length(pending_buffer->get());
+			}
+		}
+
+		return total;
+	}
+
+	void Server::clearPendingOutput(Connection &connection) {
+		auto lock = connection.lockPendingOutputs();
+
+		for (auto &pending: connection.pendingOutputs) {
+			if (auto *stream = std::get_if<FileStream>(&pending)) {
+				::close(stream->descriptor);
+			}
 		}
-		bufferevent_free(buffer_event);
+
+		connection.pendingOutputs.clear();
+		connection.hasPendingOutput = false;
 	}
 
-	void Server::Worker::removeDescriptor(int descriptor) {
-		remove(server.getBufferEvent(descriptor));
+	void Server::Worker::removeClient(int client) {
+		if (auto connection = server.connections.acquire(client)) {
+			remove(*connection);
+		}
+	}
+
+	void Server::Worker::remove(Connection &connection) {
+		const int client_id = connection.id;
+		// Keep the record from being reset until removal is finished, even if another thread retires it meanwhile.
+		auto ref = server.connections.acquire(client_id);
+		if (!ref || connection.removing.exchange(true)) {
+			return;
+		}
+
+		// No more callbacks should fire for this connection, even if the bufferevent outlives this function because
+		// another thread still holds a ConnectionRef.
+		bufferevent_setcb(connection.bufferEvent, nullptr, nullptr, nullptr, nullptr);
+		bufferevent_disable(connection.bufferEvent, EV_READ | EV_WRITE);
+		timers.cancel(connection.idleTimer);
+		connectionsGauge.sub();
+
+		if (server.closeHandler) {
+			server.closeHandler(client_id);
+		}
+
+		server.clearPendingOutput(connection);
+		server.connections.retire(client_id);
 	}
 
 	void Server::Worker::queueAccept(int new_fd) {
@@ -186,15 +849,16 @@ namespace Algiz {
 	}
 
 	void Server::Worker::queueClose(int client_id) {
-		queueClose(server.getBufferEvent(server.getDescriptor(client_id)));
+		if (auto connection = server.connections.acquire(client_id)) {
+			queueClose(*connection);
+		}
 	}
 
-	void Server::Worker::queueClose(bufferevent *buffer_event) {
-		if (evbuffer_get_length(bufferevent_get_output(buffer_event)) == 0) {
-			remove(buffer_event);
+	void Server::Worker::queueClose(Connection &connection) {
+		if (evbuffer_get_length(bufferevent_get_output(connection.bufferEvent)) == 0 && !server.hasPendingOutput(connection)) {
+			remove(connection);
 		} else {
-			auto lock = lockCloseQueue();
-			closeQueue.insert(buffer_event);
+			connection.closeQueued = true;
 		}
 	}
 
@@ -207,12 +871,17 @@ namespace Algiz {
 
 		makeName();
 
-		acceptThread = std::thread([this] {
-			mainLoop();
-		});
+		if (!reusePort) {
+			acceptThread = std::thread([this] {
+				mainLoop();
+			});
+		}
 
 		for (size_t i = 0; i < threadCount; ++i) {
 			workers.emplace_back(makeWorker(chunkSize, i));
+			if (reusePort) {
+				workers.back()->listen();
+			}
 			threads.emplace_back(std::thread([i, &worker = *workers.back()] {
 				worker.work(i);
 			}));
@@ -222,7 +891,9 @@ namespace Algiz {
 			thread.join();
 		}
 
-		acceptThread.join();
+		if (acceptThread.joinable()) {
+			acceptThread.join();
+		}
 		threads.clear();
 		workers.clear();
 	}
@@ -263,21 +934,60 @@ namespace Algiz {
 		event_base_free(base);
 	}
 
-	void Server::Worker::accept(int new_fd) {
-		int new_client = -1;
+	int Server::Worker::addConnection(int new_fd, bufferevent *buffer_event, std::string_view ip) {
+		auto connection = server.connections.insert();
+		const int new_client = connection.getID();
+		connection->id = new_client;
+		connection->descriptor = new_fd;
+		connection->bufferEvent = buffer_event;
+		connection->worker = shared_from_this();
+		connection->readBuffer.reserve(bufferSize);
+		connection->acceptedAt = std::chrono::steady_clock::now();
+		server.acceptedCounter.add();
+		connectionsGauge.add();
+
+		if (server.idleTimeout != 0) {
+			server.setIdleTimeout(new_client, server.idleTimeout);
+		}
 
-		{
-			auto lock = server.lockClients();
-			if (!server.freePool.empty()) {
-				new_client = *server.freePool.begin();
-				server.freePool.erase(new_client);
-			} else {
-				new_client = ++server.lastClient;
-			}
-			server.descriptors.emplace(new_client, new_fd);
-			server.clients[new_fd] = new_client;
+		if (server.addClient) {
+			server.addClient(*this, new_client, ip);
+		}
+
+		bufferevent_setcb(buffer_event, conn_readcb, conn_writecb, conn_eventcb, connection.get());
+		bufferevent_enable(buffer_event, EV_READ | EV_WRITE);
+		return new_client;
+	}
+
+	void Server::Worker::replaceBufferEvent(Connection &connection, bufferevent *buffer_event) {
+		bufferevent *old_event = connection.bufferEvent;
+		const short enabled = bufferevent_get_enabled(old_event);
+		bufferevent_setcb(old_event, nullptr, nullptr, nullptr, nullptr);
+		bufferevent_disable(old_event, EV_READ | EV_WRITE);
+
+		for (const short direction: {EV_READ, EV_WRITE}) {
+			size_t low = 0;
+			size_t high = 0;
+			bufferevent_getwatermark(old_event, direction, &low, &high);
+			bufferevent_setwatermark(buffer_event, direction, low, high);
 		}
 
+		evbuffer *input = bufferevent_get_input(buffer_event);
+		evbuffer_add_buffer(input, bufferevent_get_input(old_event));
+		evbuffer_add_buffer(bufferevent_get_output(buffer_event), bufferevent_get_output(old_event));
+		bufferevent_free(old_event);
+
+		connection.bufferEvent = buffer_event;
+		bufferevent_setcb(buffer_event, conn_readcb, conn_writecb, conn_eventcb, &connection);
+		bufferevent_enable(buffer_event, enabled);
+
+		// Input that was already read from the socket won't cause another read event.
+		if ((enabled & EV_READ) != 0 && evbuffer_get_length(input) != 0) {
+			bufferevent_trigger(buffer_event, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+		}
+	}
+
+	void Server::Worker::accept(int new_fd) {
 		evutil_make_socket_nonblocking(new_fd);
 		bufferevent *buffer_event = bufferevent_socket_new(base, new_fd, BEV_OPT_CLOSE_ON_FREE);
 
@@ -286,92 +996,61 @@ namespace Algiz {
 			throw std::runtime_error("buffer_event is null");
 		}
 
-		{
-			auto lock = server.lockDescriptors();
-			if (server.bufferEvents.contains(new_fd)) {
-				throw std::runtime_error("File descriptor " + std::to_string(new_fd) + " already has a bufferevent struct");
+		std::string ip;
+		sockaddr_in6 addr6 {};
+		socklen_t addr6_len = sizeof(addr6);
+		if (getpeername(new_fd, reinterpret_cast<sockaddr *>(&addr6), &addr6_len) == 0) {
+			char ip_buffer[INET6_ADDRSTRLEN];
+			if (inet_ntop(addr6.sin6_family, &addr6.sin6_addr, ip_buffer, sizeof(ip_buffer)) != nullptr) {
+				ip = ip_buffer;
+			} else {
+				WARN("inet_ntop failed: " << strerror(errno));
 			}
-			server.bufferEvents.emplace(new_fd, buffer_event);
-			server.bufferEventDescriptors.emplace(buffer_event, new_fd);
 		}
 
-		{
-			auto lock = server.lockWorkerMap();
-			server.workerMap.emplace(buffer_event, shared_from_this());
+		if (std::string_view(ip).substr(0, 7) == "::ffff:" && ip.find('.') != std::string::npos) {
+			ip.erase(0, 7);
 		}
 
-		bufferevent_setcb(buffer_event, conn_readcb, conn_writecb, conn_eventcb, this);
-		bufferevent_enable(buffer_event, EV_READ | EV_WRITE);
-
-		if (server.addClient) {
-			std::string ip;
-			sockaddr_in6 addr6 {};
-			socklen_t addr6_len = sizeof(addr6);
-			if (getpeername(new_fd, reinterpret_cast<sockaddr *>(&addr6), &addr6_len) == 0) {
-				char ip_buffer[INET6_ADDRSTRLEN];
-				if (inet_ntop(addr6.sin6_family, &addr6.sin6_addr, ip_buffer, sizeof(ip_buffer)) != nullptr) {
-					ip = ip_buffer;
-				} else {
-					WARN("inet_ntop failed: " << strerror(errno));
-				}
-			}
-
-			if (std::string_view(ip).substr(0, 7) == "::ffff:" && ip.find('.') != std::string::npos) {
-				ip.erase(0, 7);
-			}
-
-			auto lock = server.lockClients();
-			server.addClient(*this, new_client, ip);
-		}
+		addConnection(new_fd, buffer_event, ip);
 	}
 
-	void Server::Worker::handleWriteEmpty(bufferevent *buffer_event) {
-		bool contains = false;
-		{
-			auto lock = lockCloseQueue();
-			if ((contains = closeQueue.contains(buffer_event))) {
-				closeQueue.erase(buffer_event);
-			}
-		}
-
-		if (contains) {
-			remove(buffer_event);
+	void Server::Worker::handleWriteEmpty(Connection &connection) {
+		if (connection.closeQueued.exchange(false)) {
+			remove(connection);
 		}
 	}
 
-	void Server::Worker::handleEOF(bufferevent *buffer_event) {
-		remove(buffer_event);
+	void Server::Worker::handleEOF(Connection &connection) {
+		remove(connection);
 	}
 
-	void Server::Worker::handleRead(bufferevent *buffer_event) {
-		const int descriptor = bufferevent_getfd(buffer_event);
-		if (descriptor == -1)
-			throw std::runtime_error("descriptor is -1 in Worker::handleRead");
-
+	void Server::Worker::handleRead(Connection &connection) {
+		const int client_id = connection.id;
+		bufferevent *buffer_event = connection.bufferEvent;
 		evbuffer *input = bufferevent_get_input(buffer_event);
 
 		size_t readable = evbuffer_get_length(input);
 
-		try {
-			auto lock = lockReadBuffers();
-			std::string &str = readBuffers[descriptor];
-			str.reserve(bufferSize);
+		// Data that gets put back into the input buffer to be read again isn't counted twice.
+		size_t received = 0;
+		const auto start = std::chrono::steady_clock::now();
+		Defer record{[&] {
+			bytesInCounter.add(received);
+			readHistogram.record(std::chrono::steady_clock::now() - start);
+		}};
 
-			auto &clients = server.clients;
-			auto clients_lock = server.lockClients();
-			const int client_id = clients.at(descriptor);
+		try {
+			std::string &str = connection.readBuffer;
 
-			GenericClient *client_pointer;
-			try {
-				client_pointer = server.allClients.at(client_id).get();
-			} catch (const std::out_of_range &) {
+			if (!connection.client) {
 				// Seems the client isn't ready for reading yet.
 				ERROR("Client " << client_id << " doesn't have an instance yet");
 				return;
 			}
-			auto &client = *client_pointer;
+			auto &client = *connection.client;
 
-			while (0 < readable) {
+			while (0 < readable && !client.bufferMode) {
 				size_t to_read = std::min(bufferSize, readable);
 				const bool use_max_read = 0 < client.maxRead;
 
@@ -389,12 +1068,15 @@ namespace Algiz {
 					throw NetError("Reading", errno);
 				}
 
+				received += size_t(byte_count);
+
 				if (!client.lineMode) {
 					server.handleMessage(client, {buffer.get(), size_t(byte_count)});
 					str.clear();
 				} else if (client.maxLineSize < str.size() + size_t(byte_count)) {
 					client.onMaxLineSizeExceeded();
-					removeDescriptor(descriptor);
+					remove(connection);
+					return;
 				} else {
 					str.insert(str.size(), buffer.get(), size_t(byte_count));
 					bool done = false;
@@ -405,10 +1087,15 @@ namespace Algiz {
 					do {
 						if (index != -1) {
 							server.handleMessage(client, view.substr(0, index));
-							if (clients.contains(descriptor)) {
+							if (!connection.removing) {
 								view.remove_prefix(index + delimiter_size);
 								to_erase += index + delimiter_size;
-								std::tie(index, delimiter_size) = isMessageComplete(view);
+								if (client.lineMode) {
+									std::tie(index, delimiter_size) = isMessageComplete(view);
+								} else {
+									// The rest of the buffer (e.g., a request body) isn't made of lines anymore.
+									done = true;
+								}
 							} else {
 								done = true;
 							}
@@ -417,30 +1104,52 @@ namespace Algiz {
 						}
 					} while (!done);
 
+					if (connection.removing) {
+						return;
+					}
+
 					if (to_erase != 0) {
 						str.erase(0, to_erase);
 					}
-				}
 
-				if (!str.empty()) {
-					if (client.lineMode) {
-						throw ParseError("Text is left over in the buffer, but " + client.describe() + " is still in line mode");
+					if (!client.lineMode && !str.empty()) {
+						// Put whatever follows the last line back so it's read in raw mode, subject to maxRead. Anything
+						// after that (e.g., the next pipelined request) will be read as lines again.
+						if (evbuffer_prepend(input, str.data(), str.size()) != 0) {
+							throw std::runtime_error("Couldn't return unread data to input buffer");
+						}
+						received -= str.size();
+						str.clear();
 					}
-					server.handleMessage(client, str);
+				}
+
+				if (connection.removing) {
+					return;
 				}
 
 				readable = evbuffer_get_length(input);
 			}
+
+			// The client may have switched to buffer mode partway through the input, so this isn't an else branch.
+			if (client.bufferMode) {
+				const size_t before = evbuffer_get_length(input);
+				client.handleBuffer(input);
+				// The client might put back input it was handed before switching, which was counted already. The
+				// difference can be negative here, but the total can't.
+				received += before - evbuffer_get_length(input);
+			}
 		} catch (const ParseError &) {
-			remove(buffer_event);
+			remove(connection);
 		} catch (const std::runtime_error &err) {
 			ERROR(err.what());
-			remove(buffer_event);
+			remove(connection);
 		}
 	}
 
 	void Server::stop() {
-		event_base_loopbreak(base);
+		if (base != nullptr) {
+			event_base_loopbreak(base);
+		}
 		for (auto &worker: workers)
 			worker->stop();
 	}
@@ -449,48 +1158,29 @@ namespace Algiz {
 		return std::make_shared<Server::Worker>(*this, buffer_size, id);
 	}
 
-	bool Server::remove(bufferevent *buffer_event) {
-		std::shared_ptr<Worker> worker;
-		{
-			auto lock = lockWorkerMap();
-			if (!workerMap.contains(buffer_event)) {
-				return false;
-			}
-			worker = workerMap.at(buffer_event);
-		}
-		worker->remove(buffer_event);
-		return true;
-	}
-
-	bool Server::removeClient(int client) {
-		int descriptor = -1;
-		{
-			auto lock = lockClients();
-			descriptor = descriptors.at(client);
+	bool Server::remove(int client_id) {
+		auto connection = connections.acquire(client_id);
+		if (!connection) {
+			return false;
 		}
-
-		bufferevent *buffer_event = nullptr;
-		{
-			auto lock = lockDescriptors();
-			buffer_event = bufferEvents.at(descriptor);
+		if (!connection->worker->isCurrent()) {
+			post(*connection, [this, client_id] { remove(client_id); });
+			return true;
 		}
-
-		return remove(buffer_event);
+		connection->worker->remove(*connection);
+		return true;
 	}
 
 	bool Server::close(int client_id) {
-		bufferevent *buffer_event = nullptr;
-		try {
-			buffer_event = getBufferEvent(getDescriptor(client_id));
-		} catch (const std::out_of_range &) {
+		auto connection = connections.acquire(client_id);
+		if (!connection) {
 			return false;
 		}
-		std::shared_ptr<Worker> worker;
-		{
-			auto lock = lockWorkerMap();
-			worker = workerMap.at(buffer_event);
+		if (!connection->worker->isCurrent()) {
+			post(*connection, [this, client_id] { close(client_id); });
+			return true;
 		}
-		worker->queueClose(buffer_event);
+		connection->worker->queueClose(*connection);
 		return true;
 	}
 
@@ -509,23 +1199,62 @@ namespace Algiz {
 		server->threadCursor = (server->threadCursor + 1) % server->threadCount;
 	}
 
-	void conn_readcb(bufferevent *buffer_event, void *data) {
-		auto *worker = reinterpret_cast<Server::Worker *>(data);
-		worker->handleRead(buffer_event);
+	void worker_listener_cb(evconnlistener *, evutil_socket_t fd, sockaddr *, int, void *data) {
+		// The connection was accepted on the worker's own thread, so it can be set up right away.
+		reinterpret_cast<Server::Worker *>(data)->accept(fd);
+	}
+
+	void conn_readcb(bufferevent *, void *data) {
+		auto &connection = *reinterpret_cast<Server::Connection *>(data);
+		auto &worker = *connection.worker;
+		if (auto ref = worker.server.connections.acquire(connection.id)) {
+			connection.lastActivity = worker.timers.getNow();
+			worker.handleRead(connection);
+		}
 	}
 
 	void conn_writecb(bufferevent *buffer_event, void *data) {
+		auto &connection = *reinterpret_cast<Server::Connection *>(data);
+		auto &worker = *connection.worker;
+		auto ref = worker.server.connections.acquire(connection.id);
+		if (!ref) {
+			return;
+		}
+
+		try {
+			if (!worker.server.pump(connection)) {
+				return;
+			}
+		} catch (const std::exception &err) {
+			ERROR(err.what());
+			worker.remove(connection);
+			return;
+		}
+
 		if (evbuffer_get_length(bufferevent_get_output(buffer_event)) == 0) {
-			auto *worker = reinterpret_cast<Server::Worker *>(data);
-			worker->handleWriteEmpty(buffer_event);
+			worker.handleWriteEmpty(connection);
 		}
 	}
 
-	void conn_eventcb(bufferevent *buffer_event, short events, void *data) {
+	void conn_eventcb(bufferevent *, short events, void *data) {
+		auto &connection = *reinterpret_cast<Server::Connection *>(data);
+		auto &worker = *connection.worker;
+		auto ref = worker.server.connections.acquire(connection.id);
+		if (!ref) {
+			return;
+		}
+
+		if ((events & BEV_EVENT_CONNECTED) != 0) {
+			if (worker.server.handshakeHistogram != nullptr) {
+				worker.server.handshakeHistogram->record(std::chrono::steady_clock::now() - connection.acceptedAt);
+			}
+			worker.server.onHandshake(connection);
+		}
+
 		if ((events & BEV_EVENT_EOF) != 0) {
-			reinterpret_cast<Server::Worker *>(data)->handleEOF(buffer_event);
+			worker.handleEOF(connection);
 		} else if ((events & (BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT)) != 0) {
-			reinterpret_cast<Server::Worker *>(data)->server.remove(buffer_event);
+			worker.remove(connection);
 		}
 	}
 
@@ -538,4 +1267,22 @@ namespace Algiz {
 			worker->accept(descriptor);
 		}
 	}
+
+	void worker_taskcb(evutil_socket_t, short, void *data) {
+		reinterpret_cast<Server::Worker *>(data)->runTasks();
+	}
+
+	void worker_tickcb(evutil_socket_t, short, void *data) {
+		auto *worker = reinterpret_cast<Server::Worker *>(data);
+		const auto elapsed = std::chrono::steady_clock::now() - worker->timersEpoch;
+		std::vector<TimingWheel::Callback> expired;
+		worker->timers.advanceTo(uint64_t(elapsed / Server::TIMER_RESOLUTION), expired);
+		for (auto &callback: expired) {
+			try {
+				callback();
+			} catch (const std::exception &err) {
+				ERROR("Timer failed: " << err.what());
+			}
+		}
+	}
 }
@@ -0,0 +1,713 @@
+#include "EventLoop.h"
+#include "Log.h"
+#include "net/TLSSessions.h"
+#include "util/Defer.h"
+
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace Algiz {
+	namespace {
+		/** Shared by every context so that sessions survive a switch to another context during SNI. */
+		constexpr unsigned char SESSION_ID_CONTEXT[] = "algiz";
+
+		/** How often expired sessions are purged and shared ticket keys are checked for changes. */
+		constexpr std::chrono::seconds TICK_INTERVAL{60};
+
+		int64_t getNow() {
+			return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		}
+
+		std::string serialize(SSL_SESSION *session) {
+			const int length = i2d_SSL_SESSION(session, nullptr);
+			if (length <= 0) {
+				return {};
+			}
+			std::string out(size_t(length), '\0');
+			auto *pointer = reinterpret_cast<unsigned char *>(out.data());
+			i2d_SSL_SESSION(session, &pointer);
+			return out;
+		}
+
+		SSL_SESSION * deserialize(std::string_view der) {
+			const auto *pointer = reinterpret_cast<const unsigned char *>(der.data());
+			return d2i_SSL_SESSION(nullptr, &pointer, long(der.size()));
+		}
+
+		std::string_view getID(SSL_SESSION *session) {
+			unsigned int length = 0;
+			const unsigned char *id = SSL_SESSION_get_id(session, &length);
+			return {reinterpret_cast<const char *>(id), length};
+		}
+
+		int64_t getExpiry(SSL_SESSION *session) {
+			return int64_t(SSL_SESSION_get_time(session)) + SSL_SESSION_get_timeout(session);
+		}
+
+		TLSSessions::TicketKey makeTicketKey() {
+			TLSSessions::TicketKey key{};
+			if (RAND_bytes(key.name, sizeof(key.name)) != 1 || RAND_bytes(key.aesKey, sizeof(key.aesKey)) != 1 || RAND_bytes(key.hmacKey, sizeof(key.hmacKey)) != 1) {
+				throw std::runtime_error("Couldn't generate a session ticket key");
+			}
+			key.createdAt = getNow();
+			return key;
+		}
+
+		bool isStale(const TLSSessions::TicketKey &key, std::chrono::seconds interval) {
+			const int64_t now = getNow();
+			// A key from the future means the clock was turned back, so it's replaced too.
+			return now < key.createdAt || interval.count() <= now - key.createdAt;
+		}
+
+		MetricsRegistry::Labels makeLabels(int port, std::string name, std::string value) {
+			return {{"port", std::to_string(port)}, {std::move(name), std::move(value)}};
+		}
+
+		/** FNV-1a. Unlike std::hash, it's guaranteed to agree between processes built differently. */
+		uint64_t hashID(std::string_view id) {
+			uint64_t hash = 0xcbf29ce484222325;
+			for (const char ch: id) {
+				hash = (hash ^ uint8_t(ch)) * 0x100000001b3;
+			}
+			return hash;
+		}
+
+		/** Locks a spinlock that lives in shared memory. The lock word holds the pid of the process holding it, so that a
+		 *  lock left behind by a process that died while holding it can be taken over once spinning has gone on for a
+		 *  while. If the holder is still alive, it gives up instead of waiting forever. A takeover relies on every
+		 *  process that maps the file sharing a pid namespace. */
+		class SpinGuard {
+			private:
+				std::atomic_uint32_t &lock;
+				bool locked = false;
+				bool tookOver = false;
+
+			public:
+				explicit SpinGuard(std::atomic_uint32_t &lock_):
+					lock(lock_) {
+						const auto pid = uint32_t(getpid());
+						uint32_t expected = 0;
+
+						for (int attempt = 0; attempt < 4096; ++attempt) {
+							expected = 0;
+							if (lock.compare_exchange_weak(expected, pid, std::memory_order_acquire, std::memory_order_relaxed)) {
+								locked = true;
+								return;
+							}
+							if (attempt % 64 == 63) {
+								std::this_thread::yield();
+							}
+						}
+
+						// Another process might take over the same dead holder's lock first, in which case the exchange fails.
+						if (expected != 0 && kill(pid_t(expected), 0) == -1 && errno == ESRCH &&
+						    lock.compare_exchange_strong(expected, pid, std::memory_order_acquire, std::memory_order_relaxed)) {
+							locked = true;
+							tookOver = true;
+						}
+					}
+
+				SpinGuard(const SpinGuard &) = delete;
+				SpinGuard(SpinGuard &&) = delete;
+
+				~SpinGuard() {
+					if (locked) {
+						lock.store(0, std::memory_order_release);
+					}
+				}
+
+				SpinGuard & operator=(const SpinGuard &) = delete;
+				SpinGuard & operator=(SpinGuard &&) = delete;
+
+				explicit operator bool() const { return locked; }
+
+				/** Returns whether the lock was taken from a dead process, which might have left what it guards half
+				 *  written. */
+				[[nodiscard]] bool recovered() const { return tookOver; }
+		};
+
+		static_assert(std::atomic_uint32_t::is_always_lock_free, "Shared memory spinlocks need lock-free atomics");
+	}
+
+	/** Sessions in serialized form, split into shards that each have their own lock. When a shard is full, its oldest
+	 *  session is evicted. */
+	class TLSSessions::LocalCache {
+		public:
+			explicit LocalCache(size_t capacity):
+				perShard(std::max<size_t>(1, capacity / SHARDS)) {}
+
+			/** Returns the change in the number of cached sessions. */
+			int put(std::string_view id, std::string der, int64_t expiry) {
+				Shard &shard = getShard(id);
+				auto lock = shard.lock();
+				auto [iter, inserted] = shard.entries.try_emplace(std::string(id));
+				iter->second.der = std::move(der);
+				iter->second.expiry = expiry;
+
+				if (!inserted) {
+					return 0;
+				}
+
+				iter->second.position = shard.order.insert(shard.order.end(), iter->first);
+
+				if (perShard < shard.entries.size()) {
+					shard.entries.erase(shard.order.front());
+					shard.order.pop_front();
+					return 0;
+				}
+
+				return 1;
+			}
+
+			/** Returns an empty string if the session isn't cached or has expired. */
+			std::string get(std::string_view id, int64_t now) {
+				Shard &shard = getShard(id);
+				auto lock = shard.lock();
+				auto iter = shard.entries.find(std::string(id));
+				if (iter == shard.entries.end() || iter->second.expiry <= now) {
+					return {};
+				}
+				return iter->second.der;
+			}
+
+			/** Returns the change in the number of cached sessions. */
+			int remove(std::string_view id) {
+				Shard &shard = getShard(id);
+				auto lock = shard.lock();
+				auto iter = shard.entries.find(std::string(id));
+				if (iter == shard.entries.end()) {
+					return 0;
+				}
+				shard.order.erase(iter->second.position);
+				shard.entries.erase(iter);
+				return -1;
+			}
+
+			/** Returns the number of sessions removed. */
+			size_t purge(int64_t now) {
+				size_t removed = 0;
+				for (Shard &shard: shards) {
+					auto lock = shard.lock();
+					removed += std::erase_if(shard.entries, [&](const auto &pair) {
+						if (pair.second.expiry <= now) {
+							shard.order.erase(pair.second.position);
+							return true;
+						}
+						return false;
+					});
+				}
+				return removed;
+			}
+
+		private:
+			static constexpr size_t SHARDS = 16;
+
+			struct Entry {
+				std::string der;
+				int64_t expiry = 0;
+				std::list<std::string>::iterator position;
+			};
+
+			struct Shard {
+				std::mutex mutex;
+				std::unordered_map<std::string, Entry> entries;
+				/** Session IDs, oldest first. */
+				std::list<std::string> order;
+
+				[[nodiscard]] std::unique_lock<std::mutex> lock() { return std::unique_lock(mutex); }
+			};
+
+			size_t perShard;
+			std::array<Shard, SHARDS> shards;
+
+			Shard & getShard(std::string_view id) {
+				return shards[hashID(id) % SHARDS];
+			}
+	};
+
+	/** A fixed-size table of sessions in a memory-mapped file that any number of processes can map at once. A session
+	 *  goes in the slot its ID hashes to, replacing whatever was there. Each slot has its own spinlock. The file's header
+	 *  also holds the ticket keys. */
+	class TLSSessions::SharedStore {
+		public:
+			SharedStore(const std::string &path, size_t slot_count) {
+				const int descriptor = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+				if (descriptor == -1) {
+					throw std::runtime_error("Couldn't open TLS session cache " + path + ": " + strerror(errno));
+				}
+
+				// The mapping outlives the descriptor. Closing it also releases the flock.
+				Defer close_descriptor{[descriptor] { ::close(descriptor); }};
+
+				// Keeps other processes from mapping the file while it's being set up.
+				if (flock(descriptor, LOCK_EX) == -1) {
+					throw std::runtime_error("Couldn't lock TLS session cache " + path + ": " + strerror(errno));
+				}
+
+				struct stat info {};
+				if (fstat(descriptor, &info) == -1) {
+					throw std::runtime_error("Couldn't stat TLS session cache " + path + ": " + strerror(errno));
+				}
+
+				bool valid = false;
+				Layout existing {};
+				if (sizeof(Header) <= size_t(info.st_size) && pread(descriptor, &existing, sizeof(existing), 0) == ssize_t(sizeof(existing))) {
+					valid = existing.magic == MAGIC && existing.version == VERSION && existing.slotSize == sizeof(Slot)
+					     && size_t(info.st_size) == getMappingSize(existing.slotCount);
+				}
+
+				if (valid) {
+					if (existing.slotCount != slot_count) {
+						WARN("TLS session cache " << path << " has " << existing.slotCount << " slots, not " << slot_count << ". Using it as is.");
+					}
+					slot_count = existing.slotCount;
+				} else if (ftruncate(descriptor, 0) == -1 || ftruncate(descriptor, off_t(getMappingSize(slot_count))) == -1) {
+					throw std::runtime_error("Couldn't resize TLS session cache " + path + ": " + strerror(errno));
+				}
+
+				mappingSize = getMappingSize(slot_count);
+				mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+				if (mapping == MAP_FAILED) {
+					mapping = nullptr;
+					throw std::runtime_error("Couldn't map TLS session cache " + path + ": " + strerror(errno));
+				}
+
+				header = static_cast<Header *>(mapping);
+				slots = reinterpret_cast<Slot *>(static_cast<char *>(mapping) + HEADER_SIZE);
+				slotCount = slot_count;
+
+				if (!valid) {
+					// ftruncate filled the file with zeros, which is a valid empty table with unlocked slots.
+					header->layout.version = VERSION;
+					header->layout.slotSize = sizeof(Slot);
+					header->layout.slotCount = slot_count;
+					header->layout.magic = MAGIC;
+				}
+			}
+
+			SharedStore(const SharedStore &) = delete;
+			SharedStore(SharedStore &&) = delete;
+
+			~SharedStore() {
+				if (mapping != nullptr) {
+					munmap(mapping, mappingSize);
+				}
+			}
+
+			SharedStore & operator=(const SharedStore &) = delete;
+			SharedStore & operator=(SharedStore &&) = delete;
+
+			void put(std::string_view id, std::string_view der, int64_t expiry) {
+				if (sizeof(Slot::id) < id.size() || MAX_DATA_LENGTH < der.size()) {
+					return;
+				}
+
+				Slot &slot = getSlot(id);
+				SpinGuard guard(slot.lock);
+				if (!guard) {
+					return;
+				}
+
+				slot.idLength = uint32_t(id.size());
+				slot.dataLength = uint32_t(der.size());
+				slot.expiry = expiry;
+				std::memcpy(slot.id, id.data(), id.size());
+				std::memcpy(slot.data, der.data(), der.size());
+			}
+
+			/** Returns an empty string if the session isn't stored or has expired. */
+			std::string get(std::string_view id, int64_t now) {
+				if (sizeof(Slot::id) < id.size()) {
+					return {};
+				}
+
+				Slot &slot = getSlot(id);
+				SpinGuard guard(slot.lock);
+				if (guard.recovered()) {
+					clear(slot);
+				}
+
+				if (!guard || !matches(slot, id) || slot.expiry <= now || MAX_DATA_LENGTH < slot.dataLength) {
+					return {};
+				}
+
+				return {reinterpret_cast<const char *>(slot.data), slot.dataLength};
+			}
+
+			void remove(std::string_view id) {
+				if (sizeof(Slot::id) < id.size()) {
+					return;
+				}
+
+				Slot &slot = getSlot(id);
+				SpinGuard guard(slot.lock);
+				if (guard && (guard.recovered() || matches(slot, id))) {
+					clear(slot);
+				}
+			}
+
+			/** Returns the ticket keys, newest first, after adding a new one if the newest is older than `interval`.
+			 *  Returns nothing if the keys couldn't be locked. */
+			std::optional<std::vector<TicketKey>> syncKeys(std::chrono::seconds interval) {
+				SpinGuard guard(header->keysLock);
+				if (!guard) {
+					return std::nullopt;
+				}
+
+				if (guard.recovered()) {
+					// The keys might have been half rotated. Starting over costs outstanding tickets a full handshake.
+					header->keyCount = 0;
+				}
+
+				if (header->keyCount == 0 || isStale(header->keys[0], interval)) {
+					std::memmove(&header->keys[1], &header->keys[0], sizeof(TicketKey) * (KEY_RING_SIZE - 1));
+					header->keys[0] = makeTicketKey();
+					header->keyCount = std::min<uint32_t>(header->keyCount + 1, KEY_RING_SIZE);
+				}
+
+				return std::vector<TicketKey>(header->keys, header->keys + std::min<uint32_t>(header->keyCount, KEY_RING_SIZE));
+			}
+
+		private:
+			static constexpr uint64_t MAGIC = 0x314e5353'7a69676c;
+			/** Version 2 stores the holder's pid in the lock words instead of 1. */
+			static constexpr uint32_t VERSION = 2;
+			static constexpr size_t HEADER_SIZE = 4096;
+			static constexpr size_t SLOT_SIZE = 2048;
+			static constexpr size_t MAX_DATA_LENGTH = SLOT_SIZE - 64;
+
+			/** The part of the header that describes the file's layout. */
+			struct Layout {
+				uint64_t magic;
+				uint32_t version;
+				uint32_t slotSize;
+				uint64_t slotCount;
+			};
+
+			struct Header {
+				Layout layout;
+				std::atomic_uint32_t keysLock;
+				uint32_t keyCount;
+				TicketKey keys[KEY_RING_SIZE];
+			};
+
+			struct alignas(64) Slot {
+				std::atomic_uint32_t lock;
+				uint32_t idLength;
+				uint32_t dataLength;
+				int64_t expiry;
+				unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+				unsigned char data[MAX_DATA_LENGTH];
+			};
+
+			static_assert(sizeof(Header) <= HEADER_SIZE);
+			static_assert(sizeof(Slot) == SLOT_SIZE);
+
+			void *mapping = nullptr;
+			size_t mappingSize = 0;
+			Header *header = nullptr;
+			Slot *slots = nullptr;
+			size_t slotCount = 0;
+
+			static size_t getMappingSize(size_t slot_count) {
+				return HEADER_SIZE + slot_count * SLOT_SIZE;
+			}
+
+			Slot & getSlot(std::string_view id) {
+				return slots[hashID(id) % slotCount];
+			}
+
+			static bool matches(const Slot &slot, std::string_view id) {
+				return slot.idLength == id.size() && std::memcmp(slot.id, id.data(), id.size()) == 0;
+			}
+
+			static void clear(Slot &slot) {
+				slot.idLength = 0;
+				slot.dataLength = 0;
+			}
+	};
+
+	TLSSessions::KeyRing::~KeyRing() {
+		for (TicketKey &key: keys) {
+			OPENSSL_cleanse(&key, sizeof(key));
+		}
+	}
+
+	TLSSessions::TLSSessions(const Options &options_, int port):
+		options(options_),
+		resumedHandshakes(metrics.counter("algiz_tls_handshakes_total", "Finished TLS handshakes.", makeLabels(port, "resumed", "true"))),
+		fullHandshakes(metrics.counter("algiz_tls_handshakes_total", "Finished TLS handshakes.", makeLabels(port, "resumed", "false"))),
+		cacheHits(metrics.counter("algiz_tls_session_cache_lookups_total", "TLS session cache lookups.", makeLabels(port, "result", "hit"))),
+		sharedCacheHits(metrics.counter("algiz_tls_session_cache_lookups_total", "TLS session cache lookups.", makeLabels(port, "result", "shared_hit"))),
+		cacheMisses(metrics.counter("algiz_tls_session_cache_lookups_total", "TLS session cache lookups.", makeLabels(port, "result", "miss"))),
+		ticketsIssued(metrics.counter("algiz_tls_session_tickets_total", "TLS session tickets issued and redeemed.", makeLabels(port, "result", "issued"))),
+		ticketsAccepted(metrics.counter("algiz_tls_session_tickets_total", "TLS session tickets issued and redeemed.", makeLabels(port, "result", "accepted"))),
+		ticketsRenewed(metrics.counter("algiz_tls_session_tickets_total", "TLS session tickets issued and redeemed.", makeLabels(port, "result", "renewed"))),
+		ticketsRejected(metrics.counter("algiz_tls_session_tickets_total", "TLS session tickets issued and redeemed.", makeLabels(port, "result", "rejected"))),
+		cacheEntries(metrics.gauge("algiz_tls_session_cache_entries", "TLS sessions cached in memory.", {{"port", std::to_string(port)}})) {
+			if (options.cacheSize != 0) {
+				localCache = std::make_unique<LocalCache>(options.cacheSize);
+			}
+
+			if (!options.sharedCachePath.empty()) {
+				sharedStore = std::make_unique<SharedStore>(options.sharedCachePath, options.sharedCacheSlots);
+			}
+
+			refreshTicketKeys();
+		}
+
+	TLSSessions::~TLSSessions() = default;
+
+	void TLSSessions::attach(SSL_CTX *context) {
+		SSL_CTX_set_ex_data(context, getIndex(), this);
+		SSL_CTX_set_session_id_context(context, SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+		SSL_CTX_set_timeout(context, long(options.sessionTimeout.count()));
+
+		if (localCache || sharedStore) {
+			// OpenSSL's own cache is a single list behind a single lock, so it's bypassed entirely.
+			SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL | SSL_SESS_CACHE_NO_AUTO_CLEAR);
+			SSL_CTX_sess_set_new_cb(context, newSessionCallback);
+			SSL_CTX_sess_set_get_cb(context, getSessionCallback);
+			SSL_CTX_sess_set_remove_cb(context, removeSessionCallback);
+		} else {
+			SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+		}
+
+		if (options.tickets) {
+			SSL_CTX_set_tlsext_ticket_key_evp_cb(context, ticketKeyCallback);
+		} else {
+			SSL_CTX_set_options(context, SSL_OP_NO_TICKET);
+		}
+	}
+
+	void TLSSessions::start(EventLoop &loop) {
+		scheduleTick(loop);
+	}
+
+	void TLSSessions::recordHandshake(SSL *ssl) {
+		if (SSL_session_reused(ssl) == 1) {
+			resumedHandshakes.add();
+		} else {
+			fullHandshakes.add();
+		}
+	}
+
+	void TLSSessions::refreshTicketKeys() {
+		if (!options.tickets) {
+			return;
+		}
+
+		if (sharedStore) {
+			if (auto keys = sharedStore->syncKeys(options.ticketKeyInterval)) {
+				auto ring = std::make_shared<KeyRing>();
+				ring->keys = std::move(*keys);
+				keyRing.store(std::move(ring));
+				return;
+			}
+			WARN("Couldn't lock the shared TLS ticket keys. Rotating them locally instead.");
+		}
+
+		auto current = keyRing.load();
+		if (current && !current->keys.empty() && !isStale(current->keys.front(), options.ticketKeyInterval)) {
+			return;
+		}
+
+		auto ring = std::make_shared<KeyRing>();
+		ring->keys.push_back(makeTicketKey());
+		if (current) {
+			for (size_t i = 0; i < current->keys.size() && ring->keys.size() < KEY_RING_SIZE; ++i) {
+				ring->keys.push_back(current->keys[i]);
+			}
+		}
+		keyRing.store(std::move(ring));
+	}
+
+	void TLSSessions::scheduleTick(EventLoop &loop) {
+		const auto period = std::min(options.ticketKeyInterval, TICK_INTERVAL);
+		loop.delay(period, [weak = weak_from_this(), &loop] {
+			auto self = weak.lock();
+			if (!self) {
+				return;
+			}
+
+			try {
+				self->refreshTicketKeys();
+			} catch (const std::exception &err) {
+				ERROR("Couldn't refresh TLS ticket keys: " << err.what());
+			}
+
+			if (self->localCache) {
+				self->cacheEntries.sub(int64_t(self->localCache->purge(getNow())));
+			}
+
+			self->scheduleTick(loop);
+		});
+	}
+
+	TLSSessions * TLSSessions::get(SSL *ssl) {
+		return static_cast<TLSSessions *>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), getIndex()));
+	}
+
+	int TLSSessions::getIndex() {
+		static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+		return index;
+	}
+
+	int TLSSessions::newSessionCallback(SSL *ssl, SSL_SESSION *session) {
+		TLSSessions *self = get(ssl);
+		if (self == nullptr) {
+			return 0;
+		}
+
+		std::string der = serialize(session);
+		if (der.empty()) {
+			return 0;
+		}
+
+		const std::string_view id = getID(session);
+		const int64_t expiry = getExpiry(session);
+
+		if (self->sharedStore) {
+			self->sharedStore->put(id, der, expiry);
+		}
+
+		if (self->localCache) {
+			self->cacheEntries.add(self->localCache->put(id, std::move(der), expiry));
+		}
+
+		// Returning 0 tells OpenSSL that no reference to the session was kept.
+		return 0;
+	}
+
+	SSL_SESSION * TLSSessions::getSessionCallback(SSL *ssl, const unsigned char *id, int id_length, int *copy) {
+		// The returned session is freshly deserialized, so OpenSSL can take ownership of it as is.
+		*copy = 0;
+
+		TLSSessions *self = get(ssl);
+		if (self == nullptr || id_length <= 0) {
+			return nullptr;
+		}
+
+		const std::string_view key(reinterpret_cast<const char *>(id), size_t(id_length));
+		const int64_t now = getNow();
+
+		if (self->localCache) {
+			if (const std::string der = self->localCache->get(key, now); !der.empty()) {
+				if (SSL_SESSION *session = deserialize(der)) {
+					self->cacheHits.add();
+					return session;
+				}
+			}
+		}
+
+		if (self->sharedStore) {
+			if (std::string der = self->sharedStore->get(key, now); !der.empty()) {
+				if (SSL_SESSION *session = deserialize(der)) {
+					self->sharedCacheHits.add();
+					if (self->localCache) {
+						self->cacheEntries.add(self->localCache->put(key, std::move(der), getExpiry(session)));
+					}
+					return session;
+				}
+			}
+		}
+
+		self->cacheMisses.add();
+		return nullptr;
+	}
+
+	void TLSSessions::removeSessionCallback(SSL_CTX *context, SSL_SESSION *session) {
+		auto *self = static_cast<TLSSessions *>(SSL_CTX_get_ex_data(context, getIndex()));
+		if (self == nullptr) {
+			return;
+		}
+
+		const std::string_view id = getID(session);
+
+		if (self->sharedStore) {
+			self->sharedStore->remove(id);
+		}
+
+		if (self->localCache) {
+			self->cacheEntries.add(self->localCache->remove(id));
+		}
+	}
+
+	int TLSSessions::ticketKeyCallback(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *cipher_context, EVP_MAC_CTX *mac_context, int encrypt) {
+		TLSSessions *self = get(ssl);
+		if (self == nullptr) {
+			return 0;
+		}
+
+		const auto ring = self->keyRing.load();
+		if (!ring || ring->keys.empty()) {
+			return 0;
+		}
+
+		auto set_mac_key = [mac_context](const TicketKey &key) {
+			OSSL_PARAM params[] {
+				OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, const_cast<unsigned char *>(key.hmacKey), sizeof(key.hmacKey)),
+				OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char *>("SHA256"), 0),
+				OSSL_PARAM_construct_end(),
+			};
+			return EVP_MAC_CTX_set_params(mac_context, params) == 1;
+		};
+
+		if (encrypt == 1) {
+			const TicketKey &key = ring->keys.front();
+			if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1) {
+				return -1;
+			}
+			std::memcpy(key_name, key.name, sizeof(key.name));
+			if (!set_mac_key(key) || EVP_EncryptInit_ex(cipher_context, EVP_aes_256_cbc(), nullptr, key.aesKey, iv) != 1) {
+				return -1;
+			}
+			self->ticketsIssued.add();
+			return 1;
+		}
+
+		for (size_t i = 0; i < ring->keys.size(); ++i) {
+			const TicketKey &key = ring->keys[i];
+			if (std::memcmp(key_name, key.name, sizeof(key.name)) != 0) {
+				continue;
+			}
+
+			if (!set_mac_key(key) || EVP_DecryptInit_ex(cipher_context, EVP_aes_256_cbc(), nullptr, key.aesKey, iv) != 1) {
+				return -1;
+			}
+
+			if (i == 0) {
+				self->ticketsAccepted.add();
+				return 1;
+			}
+
+			// The ticket is still good, but the client should get a new one made with the current key.
+			self->ticketsRenewed.add();
+			return 2;
+		}
+
+		// Unknown or retired key, so fall back to a full handshake.
+		self->ticketsRejected.add();
+		return 0;
+	}
+}
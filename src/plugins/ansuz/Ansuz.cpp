@@ -5,9 +5,11 @@
 #include "ansuz_resources.h"
 #include "util/FS.h"
 #include "util/MIME.h"
+#include "util/Metrics.h"
 #include "util/Util.h"
 
 #include <inja/inja.hpp>
+#include <format>
 #include "Log.h"
 
 // #define EXTERNAL_RESOURCES
@@ -61,7 +63,11 @@ namespace Algiz::Plugins {
 								plugins.emplace_back(escapeHTML(filename), escapeURL(filename));
 							}
 						}
-						return serve(http, client, RESOURCE(load, "load.t"), {CSS, {"plugins", std::move(plugins)}});
+						return serve(client, RESOURCE(load, "load.t"), {CSS, {"plugins", std::move(plugins)}});
+					}
+
+					if (parts[1] == "metrics") {
+						return serveMetrics(client);
 					}
 				} else if (parts.size() == 3) {
 					if (parts[1] == "unload") {
@@ -69,26 +75,26 @@ namespace Algiz::Plugins {
 						const auto canonical = std::filesystem::canonical("plugin/" + to_unload);
 						auto *tuple = http.getPlugin(canonical);
 						if (tuple == nullptr) {
-							return serve(http, client, MESSAGE, {CSS, {"message", "Plugin " + escapeHTML(to_unload) + " not loaded."}});
+							return serve(client, MESSAGE, {CSS, {"message", "Plugin " + escapeHTML(to_unload) + " not loaded."}});
 						}
 						http.unloadPlugin(*tuple);
-						return serve(http, client, RESOURCE(unloaded, "unloaded.t"), {CSS, {"plugin", escapeHTML(to_unload)}});
+						return serve(client, RESOURCE(unloaded, "unloaded.t"), {CSS, {"plugin", escapeHTML(to_unload)}});
 					} else if (parts[1] == "edit") {
 						const auto &to_edit = parts[2];
 						const auto canonical = std::filesystem::canonical("plugin/" + to_edit);
 						auto *tuple = http.getPlugin(canonical);
 						if (tuple == nullptr) {
-							return serve(http, client, MESSAGE, {CSS, {"message", "Plugin " + escapeHTML(to_edit) + " not loaded."}});
+							return serve(client, MESSAGE, {CSS, {"message", "Plugin " + escapeHTML(to_edit) + " not loaded."}});
 						}
-						return serve(http, client, RESOURCE(edit_config, "edit_config.t"), {CSS,
+						return serve(client, RESOURCE(edit_config, "edit_config.t"), {CSS,
 							{"config", std::get<1>(*tuple)->getConfig().dump()},
 							{"pluginName", escapeHTML(escapeQuotes(canonical.string()))}
 						});
 					}
 				}
 
-				http.server->send(client.id, HTTP::Response(404, "Invalid path").setMIME("text/plain"));
-				http.server->close(client.id);
+				client.send(HTTP::Response(404, "Invalid path").setMIME("text/plain"));
+				client.close();
 				return CancelableResult::Approve;
 			} catch (const inja::RenderError &err) {
 				ERROR(err.what());
@@ -114,40 +120,40 @@ namespace Algiz::Plugins {
 				if (parts[1] == "load") {
 					const auto &post = request.postParameters;
 					if (!post.contains("pluginName") || !post.contains("pluginConfig")) {
-						return serve(http, client, MESSAGE, {CSS, {"message", "Invalid request."}}, 400);
+						return serve(client, MESSAGE, {CSS, {"message", "Invalid request."}}, 400);
 					}
 					const auto &name = post.at("pluginName");
 					std::filesystem::path path(name);
 					if (http.hasPlugin(path)) {
-						return serve(http, client, MESSAGE, {CSS, {"message", "Plugin already loaded."}}, 404);
+						return serve(client, MESSAGE, {CSS, {"message", "Plugin already loaded."}}, 404);
 					}
 					const auto json = nlohmann::json::parse(post.at("pluginConfig"));
 					auto result = http.loadPlugin(path);
 					auto &plugin = std::get<1>(result);
 					plugin->setConfig(std::move(json));
-					plugin->postinit(&http);
-					return serve(http, client, MESSAGE, {CSS, {"message", "Plugin loaded. <pre>" + escapeHTML(json.dump()) + "</pre>"}});
+					http.postinitPlugin(*plugin);
+					return serve(client, MESSAGE, {CSS, {"message", "Plugin loaded. <pre>" + escapeHTML(json.dump()) + "</pre>"}});
 				} else if (parts[1] == "edit") {
 					const auto &post = request.postParameters;
 					if (!post.contains("pluginName") || !post.contains("pluginConfig")) {
-						return serve(http, client, MESSAGE, {CSS, {"message", "Invalid request."}}, 400);
+						return serve(client, MESSAGE, {CSS, {"message", "Invalid request."}}, 400);
 					}
 					const auto json = nlohmann::json::parse(post.at("pluginConfig"));
 					const auto &name = post.at("pluginName");
 					auto path = std::filesystem::canonical(name);
 					if (!http.hasPlugin(path)) {
-						return serve(http, client, MESSAGE, {CSS, {"message", "Plugin not loaded."}}, 404);
+						return serve(client, MESSAGE, {CSS, {"message", "Plugin not loaded."}}, 404);
 					}
 					auto *tuple = http.getPlugin(path);
 					if (!tuple) {
-						return serve(http, client, MESSAGE, {CSS, {"message", "Couldn't get plugin."}}, 500);
+						return serve(client, MESSAGE, {CSS, {"message", "Couldn't get plugin."}}, 500);
 					}
 					std::get<1>(*tuple)->setConfig(json);
-					return serve(http, client, MESSAGE, {CSS, {"message", "Configuration updated."}});
+					return serve(client, MESSAGE, {CSS, {"message", "Configuration updated."}});
 				}
 			} catch (const std::exception &err) {
 				ERROR(err.what());
-				return serve(http, client, MESSAGE, {CSS, {"message", escapeHTML(err.what())}}, 500);
+				return serve(client, MESSAGE, {CSS, {"message", escapeHTML(err.what())}}, 500);
 			}
 		}
 
@@ -156,7 +162,7 @@ namespace Algiz::Plugins {
 
 	bool Ansuz::checkAuth(HTTP::Server &server, HTTP::Client &client, const HTTP::Request &request) {
 		if (!config.contains("password") || !config.at("password").is_string()) {
-			serve(server, client, MESSAGE, {CSS, {"message", "Ansuz needs a password in its configuration."}});
+			serve(client, MESSAGE, {CSS, {"message", "Ansuz needs a password in its configuration."}});
 			return false;
 		}
 
@@ -167,23 +173,67 @@ namespace Algiz::Plugins {
 		}
 
 		if (auth != HTTP::AuthenticationResult::Success) {
-			serve(server, client, MESSAGE, {CSS, {"message", "Bad authentication."}}, 401);
+			serve(client, MESSAGE, {CSS, {"message", "Bad authentication."}}, 401);
 			return false;
 		}
 
 		return true;
 	}
 
-	CancelableResult Ansuz::serve(HTTP::Server &http, HTTP::Client &client, std::string_view content, const nlohmann::json &json, int code, const char *mime) {
+	CancelableResult Ansuz::serve(HTTP::Client &client, std::string_view content, const nlohmann::json &json, int code, const char *mime) {
 		if (json.empty()) {
-			http.server->send(client.id, HTTP::Response(code, content).setMIME(mime));
+			client.send(HTTP::Response(code, content).setMIME(mime));
 		} else {
-			http.server->send(client.id, HTTP::Response(code, inja::render(content, json)).setMIME(mime));
+			client.send(HTTP::Response(code, inja::render(content, json)).setMIME(mime));
 		}
-		http.server->close(client.id);
+		client.close();
 		return CancelableResult::Approve;
 	}
 
+	CancelableResult Ansuz::serveMetrics(HTTP::Client &client) {
+		const auto format_duration = [](uint64_t nanoseconds) {
+			if (nanoseconds < 1'000) {
+				return std::to_string(nanoseconds) + " ns";
+			}
+			if (nanoseconds < 1'000'000) {
+				return std::format("{:.1f} µs", double(nanoseconds) / 1e3);
+			}
+			if (nanoseconds < 1'000'000'000) {
+				return std::format("{:.1f} ms", double(nanoseconds) / 1e6);
+			}
+			return std::format("{:.2f} s", double(nanoseconds) / 1e9);
+		};
+
+		std::vector<std::vector<std::string>> rows;
+
+		for (const auto &family: metrics.collect()) {
+			for (const auto &series: family.series) {
+				std::string value;
+				if (series.histogram) {
+					const auto &snapshot = *series.histogram;
+					if (snapshot.count == 0) {
+						value = "no samples";
+					} else {
+						value = std::format("{} samples, mean {}, p50 {}, p90 {}, p99 {}", snapshot.count,
+							format_duration(snapshot.sum / snapshot.count), format_duration(snapshot.getQuantile(0.5)),
+							format_duration(snapshot.getQuantile(0.9)), format_duration(snapshot.getQuantile(0.99)));
+					}
+				} else {
+					value = std::format("{}", series.value);
+				}
+
+				rows.push_back({
+					escapeHTML(family.name),
+					escapeHTML(family.help),
+					escapeHTML(MetricsRegistry::renderLabels(series.labels)),
+					escapeHTML(value),
+				});
+			}
+		}
+
+		return serve(client, RESOURCE(metrics, "metrics.t"), {CSS, {"metrics", std::move(rows)}});
+	}
+
 	CancelableResult Ansuz::serveIndex(HTTP::Server &http, HTTP::Client &client) {
 		const auto plugins = map(http.getPlugins(), [](const auto &tuple) {
 			const auto &plugin = std::get<1>(tuple);
@@ -200,8 +250,8 @@ namespace Algiz::Plugins {
 			{"plugins", plugins}
 		};
 
-		http.server->send(client.id, HTTP::Response(200, inja::render(RESOURCE(index, "index.t"), json)));
-		http.server->close(client.id);
+		client.send(HTTP::Response(200, inja::render(RESOURCE(index, "index.t"), json)));
+		client.close();
 		return CancelableResult::Approve;
 	}
 }
@@ -7,3 +7,4 @@ bin2c ansuz_message < "$base/message.t" | tail -n +2 >> "$2"
 bin2c ansuz_unloaded < "$base/unloaded.t" | tail -n +2 >> "$2"
 bin2c ansuz_load < "$base/load.t" | tail -n +2 >> "$2"
 bin2c ansuz_edit_config < "$base/edit_config.t" | tail -n +2 >> "$2"
+bin2c ansuz_metrics < "$base/metrics.t" | tail -n +2 >> "$2"
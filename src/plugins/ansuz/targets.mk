@@ -7,7 +7,7 @@ ansuz_clean:
 	rm -f include/plugins/ansuz/resources.h
 
 include/plugins/ansuz/resources.h: res/ansuz/index.t res/ansuz/style.css res/ansuz/message.t res/ansuz/unloaded.t \
-res/ansuz/load.t res/ansuz/edit_config.t
+res/ansuz/load.t res/ansuz/edit_config.t res/ansuz/metrics.t
 	echo "#include <cstdlib>" > $@
 	bin2c ansuz_index < res/ansuz/index.t | tail -n +2 >> $@
 	bin2c ansuz_css < res/ansuz/style.css | tail -n +2 >> $@
@@ -15,3 +15,4 @@ res/ansuz/load.t res/ansuz/edit_config.t
 	bin2c ansuz_unloaded < res/ansuz/unloaded.t | tail -n +2 >> $@
 	bin2c ansuz_load < res/ansuz/load.t | tail -n +2 >> $@
 	bin2c ansuz_edit_config < res/ansuz/edit_config.t | tail -n +2 >> $@
+	bin2c ansuz_metrics < res/ansuz/metrics.t | tail -n +2 >> $@
@@ -48,8 +48,8 @@ namespace Algiz::Plugins {
 				return CancelableResult::Pass;
 			}
 
-			http.server->send(client.id, HTTP::Response(200, out).setMIME("text/plain"));
-			http.server->close(client.id);
+			client.send(HTTP::Response(200, out).setMIME("text/plain"));
+			client.close();
 			return CancelableResult::Approve;
 		}
 
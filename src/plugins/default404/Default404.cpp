@@ -41,8 +41,8 @@ namespace Algiz::Plugins {
 			response.content = std::string("404 Not Found");
 		}
 
-		http.server->send(client.id, response);
-		http.server->close(client.id);
+		client.send(std::move(response));
+		client.close();
 		return CancelableResult::Approve;
 	}
 }
@@ -0,0 +1,88 @@
+#include "plugins/fileserv/ContentCache.h"
+#include "util/FS.h"
+
+namespace Algiz::Plugins {
+	ContentCache::ContentCache(size_t maxFileSize, size_t maxBytes):
+		maxFileSize(maxFileSize),
+		maxBytes(maxBytes) {}
+
+	void ContentCache::setLimits(size_t max_file_size, size_t max_bytes) {
+		std::unique_lock lock{mutex};
+		maxFileSize = max_file_size;
+		maxBytes = max_bytes;
+		makeSpace();
+	}
+
+	ContentCache::ContentPtr ContentCache::find(const std::filesystem::path &path) {
+		std::unique_lock lock{mutex};
+
+		if (auto iter = entries.find(path.native()); iter != entries.end()) {
+			lru.splice(lru.begin(), lru, iter->second);
+			return iter->second->second;
+		}
+
+		return nullptr;
+	}
+
+	void ContentCache::insert(const std::filesystem::path &path, ContentPtr content) {
+		std::unique_lock lock{mutex};
+
+		if (maxBytes < content->data.size()) {
+			return;
+		}
+
+		if (auto iter = entries.find(path.native()); iter != entries.end()) {
+			erase(iter->second);
+		}
+
+		usedBytes += content->data.size();
+		lru.emplace_front(path.native(), std::move(content));
+		entries.emplace(lru.front().first, lru.begin());
+		makeSpace();
+	}
+
+	void ContentCache::invalidate(const std::filesystem::path &changed) {
+		std::unique_lock lock{mutex};
+
+		for (auto iter = lru.begin(); iter != lru.end();) {
+			if (isSubpath(changed, iter->first)) {
+				auto next = std::next(iter);
+				erase(iter);
+				iter = next;
+			} else {
+				++iter;
+			}
+		}
+	}
+
+	void ContentCache::clear() {
+		std::unique_lock lock{mutex};
+		entries.clear();
+		lru.clear();
+		usedBytes = 0;
+	}
+
+	void ContentCache::addReference(evbuffer *output, const ContentPtr &content, std::string_view piece) {
+		auto *owner = new ContentPtr(content);
+		const auto cleanup = [](const void *, size_t, void *extra) {
+			delete static_cast<ContentPtr *>(extra);
+		};
+
+		if (evbuffer_add_reference(output, piece.data(), piece.size(), cleanup, owner) != 0) {
+			delete owner;
+			evbuffer_add(output, piece.data(), piece.size());
+		}
+	}
+
+	void ContentCache::erase(LRU::iterator iter) {
+		usedBytes -= iter->second->data.size();
+		entries.erase(iter->first);
+		lru.erase(iter);
+	}
+
+	void ContentCache::makeSpace() {
+		while (maxBytes < usedBytes && !lru.empty()) {
+			erase(std::prev(lru.end()));
+		}
+	}
+}
@@ -0,0 +1,127 @@
+#include "plugins/fileserv/FileCache.h"
+#include "util/FS.h"
+#include "util/MIME.h"
+
+#include <fcntl.h>
+#include <format>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+namespace Algiz::Plugins {
+	FileCache::Entry::~Entry() {
+		if (descriptor != -1) {
+			::close(descriptor);
+		}
+	}
+
+	FileCache::FileCache(size_t maxEntries, size_t maxDescriptors):
+		maxEntries(maxEntries),
+		maxDescriptors(maxDescriptors) {}
+
+	void FileCache::setLimits(size_t max_entries, size_t max_descriptors) {
+		std::unique_lock lock{mutex};
+		maxEntries = max_entries;
+		maxDescriptors = max_descriptors;
+		makeSpace();
+	}
+
+	FileCache::EntryPtr FileCache::find(std::string_view request_path) {
+		std::unique_lock lock{mutex};
+
+		if (auto iter = entries.find(request_path); iter != entries.end()) {
+			lru.splice(lru.begin(), lru, iter->second);
+			return iter->second->second;
+		}
+
+		return nullptr;
+	}
+
+	FileCache::EntryPtr FileCache::insert(std::string_view request_path, std::filesystem::path requested_path, std::filesystem::path path) {
+		if (maxEntries == 0) {
+			return nullptr;
+		}
+
+		const int descriptor = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (descriptor == -1) {
+			return nullptr;
+		}
+
+		auto entry = std::make_shared<Entry>();
+		// From here on, the entry's destructor closes the descriptor.
+		entry->descriptor = descriptor;
+
+		struct stat info{};
+		if (fstat(descriptor, &info) != 0 || !S_ISREG(info.st_mode)) {
+			return nullptr;
+		}
+
+		entry->requestedPath = std::move(requested_path);
+		entry->path = std::move(path);
+		entry->size = info.st_size;
+		entry->modified = info.st_mtime;
+		entry->mime = getMIME(entry->path.extension());
+		entry->etag = makeETag(info.st_ino, entry->modified, entry->size);
+
+		std::unique_lock lock{mutex};
+
+		if (auto iter = entries.find(request_path); iter != entries.end()) {
+			erase(iter->second);
+		}
+
+		if (maxDescriptors <= openDescriptors) {
+			// Keep the metadata but not the descriptor. Serving the file will cost an open() but nothing else.
+			::close(std::exchange(entry->descriptor, -1));
+		} else {
+			++openDescriptors;
+		}
+
+		lru.emplace_front(std::string(request_path), entry);
+		entries.emplace(lru.front().first, lru.begin());
+		makeSpace();
+		return entry;
+	}
+
+	void FileCache::invalidate(const std::filesystem::path &changed) {
+		std::unique_lock lock{mutex};
+
+		for (auto iter = lru.begin(); iter != lru.end();) {
+			const Entry &entry = *iter->second;
+			// Something inside the directory an entry resolved through may have appeared or disappeared, which could
+			// change which default file a directory request resolves to.
+			const bool resolved_default = entry.requestedPath != entry.path && changed.parent_path() == entry.path.parent_path();
+			if (isSubpath(changed, entry.path) || resolved_default) {
+				auto next = std::next(iter);
+				erase(iter);
+				iter = next;
+			} else {
+				++iter;
+			}
+		}
+	}
+
+	void FileCache::clear() {
+		std::unique_lock lock{mutex};
+		entries.clear();
+		lru.clear();
+		openDescriptors = 0;
+	}
+
+	std::string FileCache::makeETag(ino_t inode, time_t modified, size_t size) {
+		return std::format("\"{:x}-{:x}-{:x}\"", inode, modified, size);
+	}
+
+	void FileCache::erase(LRU::iterator iter) {
+		if (iter->second->descriptor != -1) {
+			--openDescriptors;
+		}
+		entries.erase(iter->first);
+		lru.erase(iter);
+	}
+
+	void FileCache::makeSpace() {
+		while (maxEntries < lru.size()) {
+			erase(std::prev(lru.end()));
+		}
+	}
+}
@@ -3,6 +3,7 @@
 #include "http/Response.h"
 #include "http/Server.h"
 #include "plugins/fileserv/Fileserv.h"
+#include "util/Compression.h"
 #include "util/FS.h"
 #include "util/MIME.h"
 #include "util/Shell.h"
@@ -11,7 +12,10 @@
 #include "util/Util.h"
 
 #include <dlfcn.h>
+#include <fcntl.h>
 #include <inja/inja.hpp>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace {
 	using FilterFunction = bool (*)(Algiz::HTTP::Server::HandlerArgs &, const std::filesystem::path &);
@@ -76,8 +80,143 @@ namespace {
 }
 
 namespace Algiz::Plugins {
+	/** A file that's about to be served. Its descriptor is either borrowed from a cache entry or owned. */
+	struct ServedFile {
+		int descriptor = -1;
+		bool owned = false;
+		size_t size = 0;
+		time_t modified = 0;
+		std::string mime;
+		std::string etag;
+		/** The directory's cacheControl option. Empty if it isn't set. */
+		std::string cacheControl;
+
+		ServedFile() = default;
+		ServedFile(const ServedFile &) = delete;
+
+		~ServedFile() {
+			if (owned) {
+				::close(descriptor);
+			}
+		}
+
+		ServedFile & operator=(const ServedFile &) = delete;
+
+		/** Opens the file unless a descriptor was already borrowed or opened. */
+		bool open(const std::filesystem::path &path) {
+			if (descriptor != -1) {
+				return true;
+			}
+
+			descriptor = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			owned = descriptor != -1;
+			return owned;
+		}
+
+		/** Reads the whole file into a buffer of at least `size` bytes. */
+		bool read(char *out) const {
+			size_t offset = 0;
+			while (offset < size) {
+				const ssize_t bytes_read = pread(descriptor, out + offset, size - offset, off_t(offset));
+				if (bytes_read <= 0) {
+					return false;
+				}
+				offset += size_t(bytes_read);
+			}
+			return true;
+		}
+	};
+
+	namespace {
+		constexpr size_t DEFAULT_CACHE_ENTRIES = 4096;
+		constexpr size_t DEFAULT_CACHE_DESCRIPTORS = 256;
+		constexpr size_t DEFAULT_SMALL_FILE_LIMIT = 16 << 10;
+		constexpr size_t DEFAULT_CONTENT_CACHE_BYTES = 32 << 20;
+		constexpr size_t DEFAULT_COMPRESS_MAX_SIZE = 4 << 20;
+		constexpr size_t DEFAULT_COMPRESSION_CACHE_BYTES = 32 << 20;
+		constexpr int DEFAULT_COMPRESSION_LEVEL = 6;
+		/** Files smaller than this aren't worth compressing on the fly. */
+		constexpr size_t MIN_COMPRESS_SIZE = 256;
+
+		struct Coding {
+			std::string_view name;
+			std::string_view extension;
+		};
+
+		/** Codings that can be served from precompressed siblings, from best compression to worst. */
+		constexpr Coding PRECOMPRESSED_CODINGS[] {{"br", ".br"}, {"zstd", ".zst"}, {"gzip", ".gz"}};
+
+		/** Fills in a file's metadata. A cache entry's metadata and descriptor are used if possible so that no syscalls
+		 *  are needed; otherwise, the file is stat'd. Either way, ServedFile::open has to be called before reading. */
+		bool describeFile(const std::filesystem::path &path, const FileCache::EntryPtr &cached, ServedFile &file) {
+			if (cached) {
+				file.size = cached->size;
+				file.modified = cached->modified;
+				file.mime = cached->mime;
+				file.etag = cached->etag;
+				file.descriptor = cached->descriptor;
+				return true;
+			}
+
+			struct stat info{};
+			if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+				return false;
+			}
+
+			file.size = info.st_size;
+			file.modified = info.st_mtime;
+			file.mime = getMIME(path.extension());
+			file.etag = FileCache::makeETag(info.st_ino, file.modified, file.size);
+			return true;
+		}
+
+		/** Returns a distinct ETag for an encoded representation of a file. Encodings done on the fly get weak ETags
+		 *  since they're only semantically equivalent to each other across compressor versions. */
+		std::string getVariantETag(std::string_view etag, std::string_view coding, bool weak) {
+			etag.remove_suffix(1);
+			return std::format("{}{}-{}\"", weak? "W/" : "", etag, coding);
+		}
+
+		/** Sets the headers that a 304 has to repeat from the 200 it stands in for. */
+		void addValidators(HTTP::Response &response, const ServedFile &file, std::string_view etag, bool vary) {
+			response["etag"] = etag;
+			if (!file.cacheControl.empty()) {
+				response["cache-control"] = file.cacheControl;
+			}
+			if (vary) {
+				response["vary"] = "accept-encoding";
+			}
+		}
+
+		HTTP::Response makeFullResponse(const ServedFile &file) {
+			HTTP::Response response(200, "");
+			response.setLastModified(file.modified).setAcceptRanges().setMIME(file.mime);
+			response["content-length"] = std::to_string(file.size);
+			addValidators(response, file, file.etag, isCompressible(file.mime));
+			return response;
+		}
+
+		/** Reads a whole file into a cacheable response. Returns nullptr if it can't be read in full. */
+		ContentCache::ContentPtr loadContent(const ServedFile &file) {
+			auto content = std::make_shared<ContentCache::Content>();
+			content->data = makeFullResponse(file).staticHead();
+			content->headLength = content->data.size();
+			content->modified = file.modified;
+			content->data.resize(content->headLength + file.size);
+
+			if (!file.read(content->data.data() + content->headLength)) {
+				return nullptr;
+			}
+
+			return content;
+		}
+	}
+
 	Fileserv::Fileserv():
 		moduleCache(64),
+		fileCache(DEFAULT_CACHE_ENTRIES, DEFAULT_CACHE_DESCRIPTORS),
+		contentCache(DEFAULT_SMALL_FILE_LIMIT, DEFAULT_CONTENT_CACHE_BYTES),
+		compressedCache(DEFAULT_COMPRESS_MAX_SIZE, DEFAULT_COMPRESSION_CACHE_BYTES),
 		rng(std::random_device{}()) {}
 
 	void Fileserv::postinit(PluginHost *host) {
@@ -97,11 +236,32 @@ namespace Algiz::Plugins {
 		if (auto iter = config.find("enableModules"); iter != config.end()) {
 			enableModules = *iter;
 		}
+
+		fileCache.setLimits(config.value("cacheEntries", DEFAULT_CACHE_ENTRIES), config.value("cacheDescriptors", DEFAULT_CACHE_DESCRIPTORS));
+		contentCache.setLimits(config.value("smallFileLimit", DEFAULT_SMALL_FILE_LIMIT), config.value("contentCacheBytes", DEFAULT_CONTENT_CACHE_BYTES));
+		compressedCache.setLimits(config.value("compressMaxSize", DEFAULT_COMPRESS_MAX_SIZE), config.value("compressionCacheBytes", DEFAULT_COMPRESSION_CACHE_BYTES));
+		compressionPool.start();
+
+		// Cached entries would go stale without notice if the root weren't watched.
+		cacheFiles = !root || isSubpath(http.webRoot, *root);
+		if (cacheFiles) {
+			auto lock = http.lockFileChangeHandlers();
+			http.fileChangeHandlers.emplace_back(fileChangeHandler);
+		}
 	}
 
 	void Fileserv::cleanup(PluginHost *host) {
-		PluginHost::erase(dynamic_cast<HTTP::Server &>(*host).getHandlers, getHandler);
-		PluginHost::erase(dynamic_cast<HTTP::Server &>(*host).postHandlers, postHandler);
+		auto &http = dynamic_cast<HTTP::Server &>(*host);
+		PluginHost::erase(http.getHandlers, getHandler);
+		PluginHost::erase(http.postHandlers, postHandler);
+		{
+			auto lock = http.lockFileChangeHandlers();
+			PluginHost::erase(http.fileChangeHandlers, fileChangeHandler);
+		}
+		compressionPool.join();
+		fileCache.clear();
+		contentCache.clear();
+		compressedCache.clear();
 	}
 
 	const std::filesystem::path & Fileserv::getRoot(const HTTP::Server &server) const {
@@ -115,7 +275,7 @@ namespace Algiz::Plugins {
 	bool Fileserv::hostMatches(const HTTP::Request &request) const {
 		if (hostnames) {
 			if (auto iter = request.headers.find("host"); iter != request.headers.end()) {
-				return hostnames->contains(iter->second);
+				return hostnames->contains(std::string(iter->second));
 			}
 			return false;
 		}
@@ -127,6 +287,36 @@ namespace Algiz::Plugins {
 		return (std::filesystem::canonical(web_root) / ("./" + unescape(request_path, true))).lexically_normal();
 	}
 
+	bool Fileserv::resolve(HTTP::Server &http, std::string_view request_path, std::filesystem::path &full_path, FileCache::EntryPtr &cached) const {
+		if (cacheFiles && (cached = fileCache.find(request_path))) {
+			full_path = cached->requestedPath;
+			return true;
+		}
+
+		const std::filesystem::path &web_root = getRoot(http);
+
+		full_path = expand(web_root, request_path);
+
+		if (std::filesystem::is_directory(full_path)) {
+			full_path /= "";
+		}
+
+		if (!isSubpath(web_root, full_path)) {
+			ERROR("Not subpath of " << web_root << ": " << full_path);
+			return false;
+		}
+
+		return true;
+	}
+
+	FileCache::EntryPtr Fileserv::cache(HTTP::Server &http, std::string_view request_path, const std::filesystem::path &requested_path, const std::filesystem::path &full_path) const {
+		if (!cacheFiles || full_path.extension() == ".t" || shouldServeModule(http, full_path)) {
+			return nullptr;
+		}
+
+		return fileCache.insert(request_path, requested_path, full_path);
+	}
+
 	CancelableResult Fileserv::handleGET(HTTP::Server::HandlerArgs &args, bool not_disabled) {
 		if (!not_disabled) {
 			return CancelableResult::Pass;
@@ -138,16 +328,10 @@ namespace Algiz::Plugins {
 			return CancelableResult::Pass;
 		}
 
-		const std::filesystem::path &web_root = getRoot(http);
+		std::filesystem::path full_path;
+		FileCache::EntryPtr cached;
 
-		std::filesystem::path full_path = expand(web_root, request.path);
-
-		if (std::filesystem::is_directory(full_path)) {
-			full_path /= "";
-		}
-
-		if (!isSubpath(web_root, full_path)) {
-			ERROR("Not subpath of " << web_root << ": " << full_path);
+		if (!resolve(http, request.path, full_path, cached)) {
 			return CancelableResult::Pass;
 		}
 
@@ -163,21 +347,35 @@ namespace Algiz::Plugins {
 			return CancelableResult::Kill;
 		}
 
-		if (!findPath(full_path)) {
-			return CancelableResult::Pass;
+		if (cached) {
+			full_path = cached->path;
+		} else {
+			std::filesystem::path requested_path = full_path;
+			if (!findPath(full_path)) {
+				return CancelableResult::Pass;
+			}
+			cached = cache(http, request.path, requested_path, full_path);
 		}
 
 		try {
 			const auto extension = full_path.extension();
 
 			if (extension == ".t") {
-				http.server->send(client.id, HTTP::Response(200, renderTemplate(readFile(full_path))).setMIME("text/html"));
+				if (request.isHead()) {
+					// Rendering a template just to measure it is exactly the work a HEAD request is meant to avoid, so
+					// the length is left out.
+					HTTP::Response response(200, "");
+					response.setMIME("text/html").setNoContentLength();
+					client.sendHead(response);
+				} else {
+					client.send(HTTP::Response(200, renderTemplate(readFile(full_path))).setMIME("text/html"));
+				}
 			} else if (shouldServeModule(http, full_path)) {
 				serveModule(args, full_path);
 			} else if (!request.hackRanges() && (!request.ranges.empty() || request.suffixLength != 0)) {
-				serveRange(args, full_path);
+				serveRange(args, full_path, cached);
 			} else {
-				serveFull(args, full_path);
+				serveFull(args, full_path, cached);
 			}
 
 			client.close();
@@ -200,16 +398,10 @@ namespace Algiz::Plugins {
 			return CancelableResult::Pass;
 		}
 
-		const std::filesystem::path &web_root = getRoot(http);
-
-		auto full_path = expand(web_root, request.path);
-
-		if (std::filesystem::is_directory(full_path)) {
-			full_path /= "";
-		}
+		std::filesystem::path full_path;
+		FileCache::EntryPtr cached;
 
-		if (!isSubpath(web_root, full_path)) {
-			ERROR("Not subpath of " << web_root << ": " << full_path);
+		if (!resolve(http, request.path, full_path, cached)) {
 			return CancelableResult::Pass;
 		}
 
@@ -224,22 +416,28 @@ namespace Algiz::Plugins {
 			return CancelableResult::Kill;
 		}
 
-		if (!findPath(full_path)) {
-			return CancelableResult::Pass;
+		if (cached) {
+			full_path = cached->path;
+		} else {
+			std::filesystem::path requested_path = full_path;
+			if (!findPath(full_path)) {
+				return CancelableResult::Pass;
+			}
+			cached = cache(http, request.path, requested_path, full_path);
 		}
 
 		try {
 			const auto extension = full_path.extension();
 			if (extension == ".t") {
-				http.server->send(client.id, HTTP::Response(200, renderTemplate(readFile(full_path), {
+				client.send(HTTP::Response(200, renderTemplate(readFile(full_path), {
 					{"post", nlohmann::json(request.postParameters).dump()}
 				})).setMIME("text/html"));
 			} else if (shouldServeModule(http, full_path)) {
 				serveModule(args, full_path);
 			} else if (!request.hackRanges() && (!request.ranges.empty() || request.suffixLength != 0)) {
-				serveRange(args, full_path);
+				serveRange(args, full_path, cached);
 			} else {
-				serveFull(args, full_path);
+				serveFull(args, full_path, cached);
 			}
 			client.close();
 			return CancelableResult::Approve;
@@ -301,20 +499,32 @@ namespace Algiz::Plugins {
 		return false;
 	}
 
-	void Fileserv::serveRange(HTTP::Server::HandlerArgs &args, const std::filesystem::path &full_path) const {
+	void Fileserv::serveRange(HTTP::Server::HandlerArgs &args, const std::filesystem::path &full_path, const FileCache::EntryPtr &cached) const {
 		auto &[http, client, request, parts] = args;
-		const size_t filesize = std::filesystem::file_size(full_path);
-		if (!request.valid(filesize)) {
-			http.send400(client);
+
+		ServedFile file;
+		// HEAD requests don't need the file to be opened.
+		if (!describeFile(full_path, cached, file) || (!request.isHead() && !file.open(full_path))) {
+			http.send403(client);
 			return;
 		}
 
-		std::ifstream stream;
-		stream.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-		stream.open(full_path);
-		stream.exceptions(std::ifstream::goodbit);
-		if (!stream.is_open()) {
-			http.send403(client);
+		file.cacheControl = http.getOption<std::string>(full_path, "cacheControl").value_or("");
+
+		if (handlePreconditions(args, file, file.etag, isCompressible(file.mime))) {
+			return;
+		}
+
+		if (!request.ifRangeMatches(file.etag, file.modified)) {
+			// The client's copy is outdated, so it needs the whole thing.
+			serveFull(args, full_path, cached);
+			return;
+		}
+
+		const int descriptor = file.descriptor;
+		const size_t filesize = file.size;
+		if (!request.valid(filesize)) {
+			http.send400(client);
 			return;
 		}
 
@@ -327,107 +537,322 @@ namespace Algiz::Plugins {
 		}
 
 		response.setAcceptRanges();
-		response["content-length"] = std::to_string(length);
-		response.setLastModified(lastWritten(full_path));
+		response.setLastModified(file.modified);
+		addValidators(response, file, file.etag, isCompressible(file.mime));
 
 		char boundary_bytes[]{"--________________"};
 		std::string_view boundary{boundary_bytes, sizeof(boundary_bytes) - 1};
 
 		assert(!request.ranges.empty());
 		const bool multi = request.ranges.size() > 1;
+		const std::string &mime = file.mime;
 
-		std::string &content_type = response["content-type"];
-		const std::string old_content_type = content_type;
+		// Each part of a multipart response has its own headers. They count toward the Content-Length, which has to
+		// be exact for the connection to be reused afterwards.
+		std::vector<std::string> part_headers;
+
+		auto add_part = [&](size_t start, size_t end) {
+			if (multi) {
+				length += part_headers.emplace_back(std::format("\r\n{}\r\nContent-Type: {}\r\nContent-Range: bytes {}-{}/{}\r\n\r\n", boundary, mime, start, end, filesize)).size();
+			}
+		};
 
 		if (multi) {
 			std::uniform_int_distribution<char> distribution('a', 'z');
 			for (size_t i = 2; i < boundary.size(); ++i) {
 				boundary_bytes[i] = distribution(rng);
 			}
-			content_type += std::format("; boundary={}", boundary.substr(2));
-		 } else {
+			response.setMIME(std::format("multipart/byteranges; boundary={}", boundary.substr(2)));
+		} else {
 			auto [start, end] = request.ranges[0];
+			response.setMIME(mime);
 			response["content-range"] = std::format("bytes {}-{}/{}", start, end, filesize);
-		 }
+		}
+
+		for (const auto &[start, end]: request.ranges) {
+			add_part(start, end);
+		}
+
+		if (request.suffixLength != 0) {
+			add_part(filesize - request.suffixLength, filesize - 1);
+		}
 
-		auto send_start = [&](size_t start, size_t end) {
+		const std::string closing = multi? std::format("\r\n{}--\r\n", boundary) : std::string();
+		length += closing.size();
+
+		response["content-length"] = std::to_string(length);
+		client.sendHead(response);
+
+		if (request.isHead()) {
+			return;
+		}
+
+		size_t part = 0;
+
+		auto send_start = [&] {
 			if (multi) {
-				http.server->send(client.id, std::format("{}\r\nContent-Type: {}\r\nContent-Range: {}-{}/{}\r\n\r\n", boundary, old_content_type, start, end, filesize));
+				http.server->send(client.id, part_headers.at(part++));
 			}
 		};
 
-		http.server->send(client.id, response.noContent());
+		for (const auto &[start, end]: request.ranges) {
+			send_start();
+			http.server->sendFile(client.id, descriptor, start, end - start + 1);
+		}
 
-		std::unique_ptr<char[]> buffer;
-		size_t old_buffer_length = 0;
+		if (request.suffixLength != 0) {
+			send_start();
+			http.server->sendFile(client.id, descriptor, filesize - request.suffixLength, request.suffixLength);
+		}
 
-		for (const auto &[start, end]: request.ranges) {
-			send_start(start, end);
+		if (multi) {
+			http.server->send(client.id, closing);
+		}
+	}
 
-			size_t remaining = end - start + 1;
-			stream.seekg(start, std::ios::beg);
+	void Fileserv::serveFull(HTTP::Server::HandlerArgs &args, const std::filesystem::path &full_path, const FileCache::EntryPtr &cached) const {
+		auto &[http, client, request, parts] = args;
+
+		ServedFile file;
+		if (!describeFile(full_path, cached, file)) {
+			http.send403(client);
+			return;
+		}
+
+		file.cacheControl = http.getOption<std::string>(full_path, "cacheControl").value_or("");
+
+		if (serveCompressed(args, full_path, file)) {
+			return;
+		}
 
-			if (size_t buffer_length = std::min(chunkSize, remaining); !buffer || old_buffer_length != buffer_length) {
-				buffer = std::make_unique<char[]>(buffer_length);
-				old_buffer_length = buffer_length;
+		if (handlePreconditions(args, file, file.etag, isCompressible(file.mime))) {
+			return;
+		}
+
+		// Small files are only kept in memory if their metadata is cached too, since that's what tells us about
+		// changes without a stat.
+		const bool small = cached && file.size <= contentCache.getMaxFileSize();
+
+		if (small) {
+			if (auto content = contentCache.find(full_path); content && content->modified == file.modified) {
+				sendContent(args, content);
+				return;
 			}
+		}
+
+		if (request.isHead()) {
+			HTTP::Response response = makeFullResponse(file);
+			client.sendHead(response);
+			return;
+		}
+
+		if (!file.open(full_path)) {
+			http.send403(client);
+			return;
+		}
 
-			while (0 < remaining) {
-				const size_t to_read = std::min(chunkSize, remaining);
-				stream.read(buffer.get(), to_read);
-				http.server->send(client.id, std::string_view(buffer.get(), to_read));
-				remaining -= to_read;
+		if (small) {
+			if (auto content = loadContent(file)) {
+				contentCache.insert(full_path, content);
+				sendContent(args, content);
+				return;
 			}
 		}
 
-		if (request.suffixLength != 0) {
-			send_start(filesize - request.suffixLength, filesize - 1);
+		HTTP::Response response = makeFullResponse(file);
+		client.sendHead(response);
+		http.server->sendFile(client.id, file.descriptor, 0, file.size);
+	}
+
+	bool Fileserv::serveCompressed(HTTP::Server::HandlerArgs &args, const std::filesystem::path &full_path, ServedFile &file) const {
+		auto &[http, client, request, parts] = args;
+
+		if (!request.headers.contains("accept-encoding")) {
+			return false;
+		}
 
-			size_t remaining = request.suffixLength;
-			stream.seekg(filesize - request.suffixLength, std::ios::beg);
+		if (auto enabled = http.getOption<bool>(full_path, "compress"); enabled && !*enabled) {
+			return false;
+		}
 
-			buffer = std::make_unique<char[]>(std::min(chunkSize, remaining));
+		if (auto precompressed = http.getOption<bool>(full_path, "precompressed"); precompressed && *precompressed) {
+			// Try the codings the client likes best first. Ties go to the coding that compresses better.
+			std::array<std::pair<double, const Coding *>, std::size(PRECOMPRESSED_CODINGS)> ranked;
+			for (size_t i = 0; i < ranked.size(); ++i) {
+				ranked[i] = {request.getEncodingQuality(PRECOMPRESSED_CODINGS[i].name), &PRECOMPRESSED_CODINGS[i]};
+			}
+			std::ranges::stable_sort(ranked, std::greater<>{}, &std::pair<double, const Coding *>::first);
+
+			for (const auto &[quality, coding]: ranked) {
+				if (quality <= 0) {
+					break;
+				}
 
-			while (0 < remaining) {
-				const size_t to_read = std::min(chunkSize, remaining);
-				stream.read(buffer.get(), to_read);
-				http.server->send(client.id, std::string_view(buffer.get(), to_read));
-				remaining -= to_read;
+				if (servePrecompressed(args, full_path, file, coding->name, coding->extension)) {
+					return true;
+				}
 			}
 		}
 
-		if (multi) {
-			http.server->send(client.id, boundary);
-			http.server->send(client.id, std::string_view{"--"});
+		const double quality = request.getEncodingQuality("gzip");
+		if (quality <= 0 || quality < request.getEncodingQuality("identity") || !isCompressible(file.mime)) {
+			return false;
+		}
+
+		if (file.size < MIN_COMPRESS_SIZE || compressedCache.getMaxFileSize() < file.size) {
+			return false;
+		}
+
+		const std::string etag = getVariantETag(file.etag, "gzip", true);
+		if (handlePreconditions(args, file, etag, true)) {
+			return true;
+		}
+
+		const int level = std::clamp(http.getOption<int>(full_path, "compressionLevel").value_or(DEFAULT_COMPRESSION_LEVEL), 1, 9);
+		// Compressed variants are cached under a child of the file's path so that a change to the file drops them.
+		const std::filesystem::path key = full_path / std::format("gzip-{}", level);
+
+		auto content = compressedCache.find(key);
+
+		if (!content || content->modified != file.modified) {
+			// Compressing a large file can take a while, so it happens off the request's thread and the identity
+			// representation is sent until it's done. Compressing just to learn how long the result would be isn't
+			// worth it either, so HEAD requests don't start it.
+			if (!request.isHead()) {
+				compressInBackground(full_path, key, file, etag, level);
+			}
+			return false;
+		}
+
+		sendContent(args, content);
+		return true;
+	}
+
+	void Fileserv::compressInBackground(const std::filesystem::path &full_path, const std::filesystem::path &key, const ServedFile &file, std::string etag, int level) const {
+		{
+			auto lock = lockCompressing();
+			if (!compressing.insert(key.string()).second) {
+				return;
+			}
+		}
+
+		// The descriptor might be borrowed from the file cache, which could close it before the job runs.
+		auto copy = std::make_shared<ServedFile>();
+		copy->size = file.size;
+		copy->modified = file.modified;
+		copy->mime = file.mime;
+		copy->etag = file.etag;
+		copy->cacheControl = file.cacheControl;
+
+		const bool queued = compressionPool.add([this, full_path, key, copy = std::move(copy), etag = std::move(etag), level](ThreadPool &, size_t) {
+			// Anything thrown here would otherwise escape onto the pool thread. The file keeps being served uncompressed.
+			try {
+				ServedFile &file = *copy;
+				std::string body(file.size, '\0');
+
+				if (file.open(full_path) && file.read(body.data())) {
+					const std::string compressed = gzip(body, level);
+
+					HTTP::Response response(200, "");
+					response.setLastModified(file.modified).setMIME(file.mime);
+					response["content-length"] = std::to_string(compressed.size());
+					response["content-encoding"] = "gzip";
+					addValidators(response, file, etag, true);
+
+					auto content = std::make_shared<ContentCache::Content>();
+					content->data = response.staticHead();
+					content->headLength = content->data.size();
+					content->modified = file.modified;
+					content->data += compressed;
+					compressedCache.insert(key, std::move(content));
+				}
+			} catch (const std::exception &err) {
+				ERROR("Couldn't compress " << full_path << ": " << err.what());
+			}
+
+			auto lock = lockCompressing();
+			compressing.erase(key.string());
+		});
+
+		if (!queued) {
+			auto lock = lockCompressing();
+			compressing.erase(key.string());
 		}
 	}
 
-	void Fileserv::serveFull(HTTP::Server::HandlerArgs &args, const std::filesystem::path &full_path) const {
+	bool Fileserv::servePrecompressed(HTTP::Server::HandlerArgs &args, const std::filesystem::path &full_path, const ServedFile &file, std::string_view coding, std::string_view extension) const {
 		auto &[http, client, request, parts] = args;
-		std::ifstream stream;
-		stream.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-		stream.open(full_path);
-		stream.exceptions(std::ifstream::goodbit);
-		if (!stream.is_open()) {
-			http.send403(client);
-			return;
+
+		std::filesystem::path sibling_path = full_path;
+		sibling_path += extension;
+
+		FileCache::EntryPtr sibling_entry;
+
+		if (cacheFiles) {
+			// Request paths always start with a slash, so this can't collide with them.
+			const std::string key = "precompressed:" + sibling_path.string();
+			sibling_entry = fileCache.find(key);
+			if (!sibling_entry && !(sibling_entry = fileCache.insert(key, sibling_path, sibling_path))) {
+				return false;
+			}
+		}
+
+		ServedFile sibling;
+		if (!describeFile(sibling_path, sibling_entry, sibling) || (!request.isHead() && !sibling.open(sibling_path))) {
+			return false;
+		}
+
+		const std::string etag = getVariantETag(file.etag, coding, false);
+		if (handlePreconditions(args, file, etag, true)) {
+			return true;
 		}
 
-		std::string mime = getMIME(full_path.extension());
-		const size_t filesize = std::filesystem::file_size(full_path);
 		HTTP::Response response(200, "");
-		response.setLastModified(lastWritten(full_path)).setAcceptRanges().setMIME(std::move(mime));
-		response["content-length"] = std::to_string(filesize);
-		http.server->send(client.id, response.noContent());
-		size_t remaining = filesize;
-		stream.seekg(0, std::ios::beg);
-		auto buffer = std::make_unique<char[]>(std::min(chunkSize, remaining));
-		while (0 < remaining) {
-			const size_t to_read = std::min(chunkSize, remaining);
-			stream.read(buffer.get(), to_read);
-			http.server->send(client.id, std::string_view(buffer.get(), to_read));
-			remaining -= to_read;
+		response.setLastModified(sibling.modified).setMIME(file.mime);
+		response["content-length"] = std::to_string(sibling.size);
+		response["content-encoding"] = coding;
+		addValidators(response, file, etag, true);
+		client.sendHead(response);
+		if (!request.isHead()) {
+			http.server->sendFile(client.id, sibling.descriptor, 0, sibling.size);
+		}
+		return true;
+	}
+
+	bool Fileserv::handlePreconditions(HTTP::Server::HandlerArgs &args, const ServedFile &file, std::string_view etag, bool vary) const {
+		auto &[http, client, request, parts] = args;
+
+		switch (request.evaluatePreconditions(etag, file.modified)) {
+			case HTTP::PreconditionResult::Passed:
+				return false;
+
+			case HTTP::PreconditionResult::NotModified: {
+				HTTP::Response response(304, "");
+				response.setNoContentType().setLastModified(file.modified);
+				addValidators(response, file, etag, vary);
+				client.send(std::move(response));
+				return true;
+			}
+
+			case HTTP::PreconditionResult::Failed:
+				client.send(HTTP::Response(412, "Precondition Failed"));
+				return true;
+		}
+
+		return false;
+	}
+
+	void Fileserv::sendContent(HTTP::Server::HandlerArgs &args, const ContentCache::ContentPtr &content) const {
+		auto &[http, client, request, parts] = args;
+
+		std::unique_ptr<evbuffer, decltype(&evbuffer_free)> buffer(evbuffer_new(), evbuffer_free);
+		ContentCache::addReference(buffer.get(), content, content->getHead());
+		client.writeDynamicHeaders(buffer.get());
+		if (!request.isHead()) {
+			ContentCache::addReference(buffer.get(), content, content->getBody());
 		}
+		client.noteResponse(200, request.isHead()? 0 : content->getBody().size());
+		http.server->send(client.id, buffer.get());
 	}
 
 	void Fileserv::serveModule(HTTP::Server::HandlerArgs &args, const std::filesystem::path &full_path) const {
@@ -439,7 +864,7 @@ namespace Algiz::Plugins {
 			try {
 				compileObject(full_path, object, full_path.extension() == PREPROCESSED_EXTENSION, err_text);
 			} catch (...) {
-				args.server.server->send(args.client.id, HTTP::Response(500, err_text.value_or("Compilation failed"), "text/plain").setCharset("utf-8"));
+				args.client.send(HTTP::Response(500, err_text.value_or("Compilation failed"), "text/plain").setCharset("utf-8"));
 				return;
 			}
 		}
@@ -482,7 +907,7 @@ namespace Algiz::Plugins {
 
 		if (!doFilter(args, path, "algizAuthCheck", [&] { return !authFailed(args, path); })) {
 			return doFilter(args, path, "algizAuthCheckFailed", [&] {
-				http.server->send(client.id, HTTP::Response(401, "Unauthorized"));
+				client.send(HTTP::Response(401, "Unauthorized"));
 				return false;
 			});
 		}
@@ -501,7 +926,7 @@ namespace Algiz::Plugins {
 
 		if (!doFilter(args, path, "algizCompiledModuleCheck", std::move(module_filter))) {
 			return doFilter(args, path, "algizCompiledModuleCheckFailed", [&] {
-				http.server->send(client.id, HTTP::Response(401, "Nice try."));
+				client.send(HTTP::Response(401, "Nice try."));
 				return false;
 			});
 		}
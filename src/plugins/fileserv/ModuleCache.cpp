@@ -5,7 +5,9 @@
 
 namespace Algiz::Plugins {
 	ModuleCache::ModuleCache(size_t maxSize):
-		maxSize(maxSize) {}
+		maxSize(maxSize),
+		hits(metrics.counter("algiz_module_cache_lookups_total", "Lookups in Fileserv's module cache.", {{"result", "hit"}})),
+		misses(metrics.counter("algiz_module_cache_lookups_total", "Lookups in Fileserv's module cache.", {{"result", "miss"}})) {}
 
 	ModuleCache::~ModuleCache() {
 		std::unique_lock lock{cacheMutex};
@@ -18,6 +20,7 @@ namespace Algiz::Plugins {
 		{
 			std::shared_lock lock{cacheMutex};
 			if (auto iter = cache.find(path); iter != cache.end()) {
+				hits.add();
 				iter->second.lastUsed = std::chrono::system_clock::now();
 				return iter->second.pair();
 			}
@@ -26,10 +29,13 @@ namespace Algiz::Plugins {
 		std::unique_lock lock{cacheMutex};
 		// Might have appeared between unlocking and relocking.
 		if (auto iter = cache.find(path); iter != cache.end()) {
+			hits.add();
 			iter->second.lastUsed = std::chrono::system_clock::now();
 			return iter->second.pair();
 		}
 
+		misses.add();
+
 		if (cache.size() >= maxSize) {
 			makeSpace();
 		}
@@ -5,12 +5,38 @@
 #include "Core.h"
 #include "Log.h"
 
+#include <algorithm>
+#include <cctype>
 #include <fstream>
 
 namespace {
 	constexpr size_t MAX_CHALLENGES = 128;
 	const std::filesystem::path CERTS_PATH = "certs";
 
+	/** Bounds on how long to wait before retrying a hostname whose order failed. */
+	constexpr std::chrono::seconds MIN_BACKOFF{300};
+	constexpr std::chrono::seconds MAX_BACKOFF{std::chrono::hours(24)};
+	/** How long requests for a hostname that isn't allowed are ignored before it's checked (and logged) again. */
+	constexpr std::chrono::seconds REFUSAL_TIMEOUT{std::chrono::hours(1)};
+	/** Caps the number of hostnames remembered, since clients choose which ones get requested. */
+	constexpr size_t MAX_ISSUANCES = 4096;
+
+	/** How long before a cached certificate expires that a new one is ordered. */
+	constexpr std::chrono::seconds RENEW_BEFORE{std::chrono::days(30)};
+	constexpr std::chrono::seconds RENEWAL_CHECK_INTERVAL{std::chrono::hours(12)};
+	/** The first check waits a little so that it doesn't compete with startup. */
+	constexpr std::chrono::seconds FIRST_RENEWAL_CHECK{60};
+
+	bool isValidHostname(std::string_view host) {
+		if (host.empty() || 253 < host.size() || host.front() == '.' || host.back() == '.' || !host.contains('.')) {
+			return false;
+		}
+
+		return std::ranges::all_of(host, [](char ch) {
+			return std::isalnum(static_cast<unsigned char>(ch)) || ch == '-' || ch == '.';
+		});
+	}
+
 	void ensureDirectory() {
 		if (!std::filesystem::exists(CERTS_PATH)) {
 			std::filesystem::create_directory(CERTS_PATH);
@@ -53,17 +79,27 @@ namespace Algiz::Plugins {
 		if (auto ssl = std::dynamic_pointer_cast<SSLServer>(http.server)) {
 			loadCache();
 			oldRequestCertificate = ssl->requestCertificate.swap([this](const char *servername) {
-				pool.add([this, host = std::string(servername)](ThreadPool &, size_t) {
-					issueCertificate(host);
-				});
+				requestIssuance(servername);
 			});
 		}
 
 		pool.start();
+
+		if (getSSLServer()) {
+			auto lock = std::unique_lock(lifeline->mutex);
+			scheduleRenewalCheck(http.server->getCore().getEventLoop(), FIRST_RENEWAL_CHECK);
+		}
 	}
 
 	void LetsEncrypt::cleanup(PluginHost *host) {
-		PluginHost::erase(dynamic_cast<HTTP::Server &>(*host).getHandlers, handler);
+		auto &http = dynamic_cast<HTTP::Server &>(*host);
+		PluginHost::erase(http.getHandlers, handler);
+
+		{
+			auto lock = std::unique_lock(lifeline->mutex);
+			lifeline->alive = false;
+			http.server->getCore().getEventLoop().cancel(lifeline->timer);
+		}
 
 		if (oldRequestCertificate) {
 			if (auto ssl = getSSLServer()) {
@@ -113,11 +149,65 @@ namespace Algiz::Plugins {
 		return CancelableResult::Pass;
 	}
 
-	void LetsEncrypt::issueCertificate(const std::string &host) {
-		if (whitelist && !whitelist->contains(host)) {
+	void LetsEncrypt::requestIssuance(const std::string &host) {
+		const auto now = std::chrono::steady_clock::now();
+		auto lock = std::unique_lock(issuancesMutex);
+
+		if (auto iter = issuances.find(host); iter != issuances.end()) {
+			// Handshakes for a hostname tend to arrive in bursts, and they all share a single order.
+			if (iter->second.inFlight || now < iter->second.retryAfter) {
+				return;
+			}
+		}
+
+		if (MAX_ISSUANCES <= issuances.size()) {
+			std::erase_if(issuances, [now](const auto &pair) {
+				return !pair.second.inFlight && pair.second.retryAfter <= now;
+			});
+
+			if (MAX_ISSUANCES <= issuances.size()) {
+				WARN("Too many pending certificate requests; ignoring request for " << host);
+				return;
+			}
+		}
+
+		Issuance &issuance = issuances[host];
+
+		if (!isValidHostname(host) || (whitelist && !whitelist->contains(host))) {
+			WARN("Refusing to request certificate for " << host);
+			issuance.retryAfter = now + REFUSAL_TIMEOUT;
 			return;
 		}
 
+		issuance.inFlight = true;
+
+		const bool queued = pool.add([this, host](ThreadPool &, size_t) {
+			const bool issued = issueCertificate(host);
+
+			auto lock = std::unique_lock(issuancesMutex);
+			auto iter = issuances.find(host);
+			if (iter == issuances.end()) {
+				return;
+			}
+
+			if (issued) {
+				issuances.erase(iter);
+				return;
+			}
+
+			Issuance &issuance = iter->second;
+			issuance.inFlight = false;
+			issuance.backoff = std::clamp(issuance.backoff * 2, MIN_BACKOFF, MAX_BACKOFF);
+			issuance.retryAfter = std::chrono::steady_clock::now() + issuance.backoff;
+			INFO("Will retry certificate for " << host << " in " << issuance.backoff.count() << " seconds");
+		});
+
+		if (!queued) {
+			issuances.erase(host);
+		}
+	}
+
+	bool LetsEncrypt::issueCertificate(const std::string &host) {
 		try {
 			acme_lw::Certificate cert = acmeClient->issueCertificate({host}, [&](const std::string &domain, const std::string &key, const std::string &authorization) {
 				if (domain != host) {
@@ -142,9 +232,14 @@ namespace Algiz::Plugins {
 			}, acme_lw::AcmeClient::Challenge::HTTP);
 
 			finishCertificate(host, std::move(cert));
+			return true;
 		} catch (const acme_lw::AcmeException &error) {
 			WARN("Issuing certificate failed for " << host << ": " << error.what());
+		} catch (const std::exception &error) {
+			WARN("Issuing certificate failed for " << host << ": " << error.what());
 		}
+
+		return false;
 	}
 
 	void LetsEncrypt::finishCertificate(std::string_view host, acme_lw::Certificate certificate) {
@@ -173,13 +268,26 @@ namespace Algiz::Plugins {
 		ensureDirectory();
 		std::filesystem::path path = CERTS_PATH / host;
 		path += ".json";
-		std::ofstream(path) << nlohmann::json{
+		// Written to the side and then moved into place so that a renewal check never sees half a file.
+		std::filesystem::path temporary = path;
+		temporary += ".tmp";
+		std::ofstream stream(temporary);
+		stream << nlohmann::json{
 			{"expiry", certificate.getExpiry()},
 			{"hostname", host},
 			{"cert", first_cert},
 			{"privkey", certificate.privkey},
 			{"chain", rest_of_chain},
 		}.dump();
+		stream.close();
+		if (!stream) {
+			// The certificate is in use already; the old cache entry stays in place until a later write succeeds.
+			std::error_code code;
+			std::filesystem::remove(temporary, code);
+			WARN("Registered certificate for " << host << " but couldn't write " << temporary.string());
+			return;
+		}
+		std::filesystem::rename(temporary, path);
 		INFO("Registered and cached certificate for " << host);
 	}
 
@@ -210,6 +318,55 @@ namespace Algiz::Plugins {
 		}
 	}
 
+	void LetsEncrypt::renewExpiring() {
+		if (!std::filesystem::exists(CERTS_PATH)) {
+			return;
+		}
+
+		const time_t threshold = time(nullptr) + RENEW_BEFORE.count();
+
+		for (const std::filesystem::directory_entry &entry: std::filesystem::directory_iterator(CERTS_PATH)) {
+			const std::filesystem::path &path = entry.path();
+			if (path.extension() != ".json") {
+				continue;
+			}
+
+			try {
+				nlohmann::json json = nlohmann::json::parse(readFile(path));
+				const time_t expiry = json.at("expiry");
+				if (expiry <= threshold) {
+					std::string hostname = json.at("hostname");
+					INFO("Renewing certificate for " << hostname);
+					requestIssuance(hostname);
+				}
+			} catch (const std::exception &err) {
+				WARN("Couldn't check " << path << " for renewal: " << err.what());
+			}
+		}
+	}
+
+	void LetsEncrypt::scheduleRenewalCheck(EventLoop &loop, std::chrono::seconds delay) {
+		lifeline->timer = loop.delay(delay, [this, &loop, weak = std::weak_ptr(lifeline)] {
+			auto lifeline = weak.lock();
+			if (!lifeline) {
+				return;
+			}
+
+			auto lock = std::unique_lock(lifeline->mutex);
+			if (!lifeline->alive) {
+				return;
+			}
+
+			// Reading the cache and ordering certificates are too slow for the event loop's thread.
+			pool.add([this](ThreadPool &, size_t) {
+				renewExpiring();
+			});
+
+			// Still under the lock, so cleanup can't have started.
+			scheduleRenewalCheck(loop, RENEWAL_CHECK_INTERVAL);
+		});
+	}
+
 	std::shared_ptr<SSLServer> LetsEncrypt::getSSLServer() const {
 		return dynamic_cast<HTTP::Server &>(*parent).server->getCore().getSSLServer();
 	}
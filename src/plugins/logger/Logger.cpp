@@ -7,15 +7,95 @@
 #include "util/MIME.h"
 #include "util/Util.h"
 
+#include <nlohmann/json.hpp>
+
+#include <ctime>
+#include <format>
+
 namespace Algiz::Plugins {
+	namespace {
+		/** Escapes a field for a quoted string in the Combined Log Format the way Apache does. */
+		void appendQuoted(std::string &out, std::string_view field) {
+			out += '"';
+			for (const char ch: field) {
+				const auto byte = static_cast<uint8_t>(ch);
+				if (ch == '"' || ch == '\\') {
+					out += '\\';
+					out += ch;
+				} else if (byte < 0x20 || byte == 0x7f) {
+					out += "\\x";
+					out += charHex(byte);
+				} else {
+					out += ch;
+				}
+			}
+			out += '"';
+		}
+
+		/** Formats a time like "10/Oct/2000:13:55:36 -0700". The result is cached per thread for the current second. */
+		std::string_view formatCLFTime(std::chrono::system_clock::time_point time) {
+			thread_local time_t cached_second = -1;
+			thread_local std::array<char, 32> cached{};
+			thread_local size_t cached_length = 0;
+
+			const time_t second = std::chrono::system_clock::to_time_t(time);
+			if (second != cached_second) {
+				tm local{};
+				localtime_r(&second, &local);
+				cached_length = strftime(cached.data(), cached.size(), "%d/%b/%Y:%H:%M:%S %z", &local);
+				cached_second = second;
+			}
+
+			return {cached.data(), cached_length};
+		}
+
+		/** Formats a time like "2000-10-10T20:55:36.123Z". */
+		std::string formatISOTime(std::chrono::system_clock::time_point time) {
+			const time_t second = std::chrono::system_clock::to_time_t(time);
+			const auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count() % 1000;
+			tm utc{};
+			gmtime_r(&second, &utc);
+			std::array<char, 32> buffer{};
+			const size_t length = strftime(buffer.data(), buffer.size(), "%Y-%m-%dT%H:%M:%S", &utc);
+			return std::format("{}.{:03}Z", std::string_view(buffer.data(), length), millis);
+		}
+	}
+
 	void Logger::postinit(PluginHost *host) {
-		dynamic_cast<HTTP::Server &>(*(parent = host)).getHandlers.emplace_back(handler);
-		dynamic_cast<HTTP::Server &>(*(parent = host)).postHandlers.emplace_back(handler);
+		auto &http = dynamic_cast<HTTP::Server &>(*(parent = host));
+
+		console = config.value("console", true);
+
+		if (config.contains("accessLogFormat")) {
+			const std::string &format_name = config.at("accessLogFormat");
+			if (format_name == "json") {
+				format = Format::JSON;
+			} else if (format_name != "combined") {
+				throw std::invalid_argument("Invalid access log format: " + format_name);
+			}
+		}
+
+		if (config.contains("accessLog")) {
+			const std::string &path = config.at("accessLog");
+			accessSink = Algiz::log.openFile(path, config.value("accessLogMaxBytes", size_t(0)), config.value("accessLogKeep", size_t(5)));
+			http.accessHandlers.emplace_back(accessHandler);
+		}
+
+		if (console) {
+			http.getHandlers.emplace_back(handler);
+			http.postHandlers.emplace_back(handler);
+		}
 	}
 
 	void Logger::cleanup(PluginHost *host) {
-		PluginHost::erase(dynamic_cast<HTTP::Server &>(*host).getHandlers, handler);
-		PluginHost::erase(dynamic_cast<HTTP::Server &>(*host).postHandlers, handler);
+		auto &http = dynamic_cast<HTTP::Server &>(*host);
+		PluginHost::erase(http.getHandlers, handler);
+		PluginHost::erase(http.postHandlers, handler);
+		PluginHost::erase(http.accessHandlers, accessHandler);
+		if (accessSink) {
+			Algiz::log.closeFile(*accessSink);
+			accessSink.reset();
+		}
 	}
 
 	CancelableResult Logger::handle(const HTTP::Server::HandlerArgs &args, bool) {
@@ -44,6 +124,67 @@ namespace Algiz::Plugins {
 
 		return CancelableResult::Pass;
 	}
+
+	void Logger::logAccess(const HTTP::Server::AccessArgs &args) const {
+		if (!accessSink) {
+			return;
+		}
+
+		Algiz::log.write(*accessSink, LogLevel::Raw, format == Format::JSON? formatJSON(args) : formatCombined(args));
+	}
+
+	std::string Logger::formatCombined(const HTTP::Server::AccessArgs &args) {
+		const auto &[http, client, request, received, elapsed] = args;
+
+		std::string out;
+		out.reserve(256);
+		out += client.ip;
+		out += " - - [";
+		out += formatCLFTime(received);
+		out += "] ";
+		appendQuoted(out, std::format("{} {} {}", request.method, request.pathWithParameters(), request.version));
+		out += ' ';
+		out += client.responseStatus == 0? "-" : std::to_string(client.responseStatus);
+		out += ' ';
+		out += client.responseBytes == 0? "-" : std::to_string(client.responseBytes);
+		out += ' ';
+		const std::string_view referer = request.getHeader("referer");
+		appendQuoted(out, referer.empty()? "-" : referer);
+		out += ' ';
+		const std::string_view user_agent = request.getHeader("user-agent");
+		appendQuoted(out, user_agent.empty()? "-" : user_agent);
+		return out;
+	}
+
+	std::string Logger::formatJSON(const HTTP::Server::AccessArgs &args) {
+		const auto &[http, client, request, received, elapsed] = args;
+
+		nlohmann::json json{
+			{"time", formatISOTime(received)},
+			{"ip", client.ip},
+			{"method", std::format("{}", request.method)},
+			{"path", request.pathWithParameters()},
+			{"version", request.version},
+			{"status", client.responseStatus},
+			{"bytes", client.responseBytes},
+			{"micros", std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()},
+		};
+
+		static constexpr std::pair<const char *, std::string_view> headers[] {
+			{"host", "host"},
+			{"referer", "referer"},
+			{"userAgent", "user-agent"},
+		};
+
+		for (const auto &[key, header]: headers) {
+			if (const std::string_view value = request.getHeader(header); !value.empty()) {
+				json[key] = value;
+			}
+		}
+
+		// Paths and headers aren't guaranteed to be valid UTF-8.
+		return json.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+	}
 }
 
 extern "C" Algiz::Plugins::Plugin * make_plugin() {
@@ -0,0 +1,44 @@
+#include "http/Client.h"
+#include "http/Response.h"
+#include "http/Server.h"
+#include "plugins/Metrics.h"
+#include "util/Metrics.h"
+#include "util/Util.h"
+
+namespace Algiz::Plugins {
+	void Metrics::postinit(PluginHost *host) {
+		dynamic_cast<HTTP::Server &>(*(parent = host)).getHandlers.emplace_back(handler);
+	}
+
+	void Metrics::cleanup(PluginHost *host) {
+		PluginHost::erase(dynamic_cast<HTTP::Server &>(*host).getHandlers, handler);
+	}
+
+	CancelableResult Metrics::handle(HTTP::Server::HandlerArgs &args, bool not_disabled) {
+		if (!not_disabled) {
+			return CancelableResult::Pass;
+		}
+
+		auto &[http, client, request, parts] = args;
+
+		const std::string path = config.value("path", std::string("metrics"));
+		if (parts.size() != 1 || parts.front() != path) {
+			return CancelableResult::Pass;
+		}
+
+		if (config.contains("password")) {
+			const auto auth = request.checkAuthentication("metrics", config.at("password").get<std::string>());
+			if (auth != HTTP::AuthenticationResult::Success) {
+				http.send401(client, "Metrics");
+				return CancelableResult::Kill;
+			}
+		}
+
+		client.send(HTTP::Response(200, Algiz::metrics.renderPrometheus()).setMIME("text/plain; version=0.0.4").setCharset("utf-8"));
+		return CancelableResult::Approve;
+	}
+}
+
+extern "C" Algiz::Plugins::Plugin * make_plugin() {
+	return new Algiz::Plugins::Metrics;
+}
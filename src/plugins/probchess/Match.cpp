@@ -65,6 +65,7 @@ namespace ProbChess {
 
 		for (int spectator: spectators)
 			parent->matchesByClient.erase(spectator);
+		parent->getServer().removeTopic(spectatorTopic());
 
 		if (!hidden)
 			parent->broadcast(":RemoveMatch " + matchID);
@@ -277,8 +278,11 @@ namespace ProbChess {
 	}
 
 	void Match::sendSpectators(std::string_view message) {
-		for (int spectator: spectators)
-			parent->send(spectator, message);
+		parent->getServer().publish(spectatorTopic(), message);
+	}
+
+	std::string Match::spectatorTopic() const {
+		return "probchess/" + matchID + "/spectators";
 	}
 
 	void Match::sendBoard() {
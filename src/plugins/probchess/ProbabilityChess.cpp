@@ -41,7 +41,7 @@ namespace Algiz::Plugins {
 			args.server.registerWebSocketMessageHandler(args.client, std::weak_ptr(messageHandler));
 			args.server.registerWebSocketCloseHandler(args.client, std::weak_ptr(closeHandler));
 			connections.insert(args.client.id);
-			clients.insert(&args.client);
+			args.server.subscribe(args.client, LOBBY_TOPIC);
 			return CancelableResult::Approve;
 		}
 
@@ -182,7 +182,6 @@ namespace Algiz::Plugins {
 		const int id = client.id;
 		auto lock = lockClients();
 		connections.erase(id);
-		clients.erase(&client);
 		if (matchesByClient.contains(id)) {
 			matchesByClient.at(id)->disconnect(id);
 			matchesByClient.erase(id);
@@ -190,15 +189,14 @@ namespace Algiz::Plugins {
 	}
 
 	void ProbabilityChess::send(int client_id, std::string_view message) {
-		auto &server = dynamic_cast<HTTP::Server &>(*parent);
-		auto &client = dynamic_cast<HTTP::Client &>(*server.server->allClients.at(client_id));
-		client.sendWebSocket(message);
+		auto &server = getServer();
+		if (auto connection = server.server->getConnection(client_id); connection && connection->client) {
+			dynamic_cast<HTTP::Client &>(*connection->client).sendWebSocket(message);
+		}
 	}
 
 	void ProbabilityChess::broadcast(std::string_view message) {
-		auto lock = lockClients();
-		for (auto *client: clients)
-			client->sendWebSocket(message);
+		getServer().publish(LOBBY_TOPIC, message);
 	}
 
 	void ProbabilityChess::createMatch(HTTP::Client &client, const std::string &id, int column_count,
@@ -308,6 +306,7 @@ namespace Algiz::Plugins {
 		const char *as = "unknown";
 		if (as_spectator) {
 			match->spectators.push_back(client.id);
+			getServer().subscribe(client, match->spectatorTopic());
 			as = "spectator";
 		} else if (!match->host.has_value()) {
 			match->host = std::make_unique<ProbChess::HumanPlayer>(*this, match->hostColor,
@@ -357,6 +356,7 @@ namespace Algiz::Plugins {
 
 		auto match = matchesByClient.at(client.id);
 		INFO("Disconnecting " << client.describe() << " from match \e[33m" << match->matchID << "\e[39m.");
+		getServer().unsubscribe(client, match->spectatorTopic());
 		match->disconnect(client.id);
 		matchesByClient.erase(client.id);
 	}
@@ -1,13 +1,29 @@
 #include "threading/ThreadPool.h"
 
+#include <cassert>
+
 namespace Algiz {
+	namespace {
+		/** The pool the current thread belongs to, if any, and the thread's index within it. */
+		thread_local ThreadPool *currentPool = nullptr;
+		thread_local size_t currentIndex = 0;
+
+		/** How many times an idle thread looks for work before parking. */
+		constexpr int SPIN_ROUNDS = 64;
+	}
+
 	ThreadPool::ThreadPool(size_t size):
 		size(size) {
 			pool.reserve(size);
+			workers.reserve(size);
+			for (size_t i = 0; i < size; ++i) {
+				workers.emplace_back(std::make_unique<Worker>());
+			}
 		}
 
 	ThreadPool::~ThreadPool() {
 		join();
+		discardPending();
 	}
 
 	void ThreadPool::start() {
@@ -19,69 +35,152 @@ namespace Algiz {
 
 		for (size_t thread_index = 0; thread_index < size; ++thread_index) {
 			pool.emplace_back([this, thread_index] {
-				size_t last_jobs_done = jobsDone.load();
-				while (active) {
-					{
-						std::unique_lock lock(workMutex);
-						workCV.wait(lock, [this, &last_jobs_done] {
-							return joining.load() || newJobReady.load() || last_jobs_done < jobsDone;
-						});
-					}
-					if (joining) {
-						break;
-					}
-					if (auto job = workQueue.tryTake()) {
-						newJobReady = false;
-						assert(*job);
-						(*job)(*this, thread_index);
-						last_jobs_done = ++jobsDone;
-						// Issue when the thread pool contains only one worker?
-						workCV.notify_one();
-					} else {
-						last_jobs_done = jobsDone;
-					}
-				}
+				work(thread_index);
 			});
 		}
 	}
 
 	void ThreadPool::join() {
-		if (active.exchange(false) && !joining.exchange(true)) {
-			workQueue.clear();
-			workCV.notify_all();
-			for (std::thread &thread: pool) {
-				thread.join();
-			}
-			pool.clear();
-			joining = false;
-		}
+		stop(true);
 	}
 
 	void ThreadPool::detach() {
+		stop(false);
+	}
+
+	void ThreadPool::stop(bool join_threads) {
 		if (active.exchange(false) && !joining.exchange(true)) {
-			workQueue.clear();
-			workCV.notify_all();
+			wake(true);
 			for (std::thread &thread: pool) {
-				thread.detach();
+				if (join_threads) {
+					thread.join();
+				} else {
+					thread.detach();
+				}
 			}
 			pool.clear();
+			if (join_threads) {
+				discardPending();
+			}
 			joining = false;
 		}
 	}
 
-	bool ThreadPool::add(const Function &function) {
-		if (active) {
-			// TODO: race condition if active goes false during this block
-			workQueue.push(function);
-			newJobReady = true;
-			workCV.notify_one();
-			return true;
+	bool ThreadPool::add(Function function) {
+		return post([this, function = std::move(function)](size_t thread_index) {
+			function(*this, thread_index);
+		});
+	}
+
+	bool ThreadPool::post(Task task) {
+		if (!active) {
+			return false;
+		}
+
+		auto *item = new Task(std::move(task));
+		// Count the job before publishing it so that a thread that takes it right away can't push the count below zero.
+		++pending;
+
+		if (currentPool == this) {
+			workers[currentIndex]->deque.push(item);
+		} else {
+			std::unique_lock lock(injectedMutex);
+			injected.push_back(item);
 		}
 
-		return false;
+		if (0 < sleepers) {
+			wake();
+		}
+
+		return true;
 	}
 
 	size_t ThreadPool::jobCount() const {
-		return workQueue.size();
+		return pending;
+	}
+
+	bool ThreadPool::isPoolThread() const {
+		return currentPool == this;
+	}
+
+	void ThreadPool::work(size_t index) {
+		currentPool = this;
+		currentIndex = index;
+
+		int idle_rounds = 0;
+
+		while (active) {
+			if (Task *task = findTask(index)) {
+				--pending;
+				idle_rounds = 0;
+				std::unique_ptr<Task> owned(task);
+				(*owned)(index);
+				continue;
+			}
+
+			if (++idle_rounds < SPIN_ROUNDS) {
+				std::this_thread::yield();
+				continue;
+			}
+
+			// Read the wakeup counter before the final check for work so that a job posted after the check also
+			// changes the counter and keeps the wait from blocking.
+			const uint32_t wakeup = wakeups.load();
+			++sleepers;
+			if (pending == 0 && active) {
+				wakeups.wait(wakeup);
+			}
+			--sleepers;
+			idle_rounds = 0;
+		}
+
+		currentPool = nullptr;
+	}
+
+	ThreadPool::Task * ThreadPool::findTask(size_t index) {
+		if (Task *task = workers[index]->deque.pop()) {
+			return task;
+		}
+
+		{
+			std::unique_lock lock(injectedMutex);
+			if (!injected.empty()) {
+				Task *task = injected.front();
+				injected.pop_front();
+				return task;
+			}
+		}
+
+		for (size_t offset = 1; offset < size; ++offset) {
+			if (Task *task = workers[(index + offset) % size]->deque.steal()) {
+				return task;
+			}
+		}
+
+		return nullptr;
+	}
+
+	void ThreadPool::wake(bool all) {
+		++wakeups;
+		if (all) {
+			wakeups.notify_all();
+		} else {
+			wakeups.notify_one();
+		}
+	}
+
+	void ThreadPool::discardPending() {
+		for (auto &worker: workers) {
+			while (Task *task = worker->deque.pop()) {
+				delete task;
+			}
+		}
+
+		std::unique_lock lock(injectedMutex);
+		for (Task *task: injected) {
+			delete task;
+		}
+		injected.clear();
+		pending = 0;
 	}
 }
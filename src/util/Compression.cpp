@@ -0,0 +1,33 @@
+#include <stdexcept>
+
+#include <zlib.h>
+
+#include "util/Compression.h"
+
+namespace Algiz {
+	std::string gzip(std::string_view input, int level) {
+		z_stream stream{};
+		// Adding 16 to the window bits makes zlib write a gzip header and trailer instead of a zlib wrapper.
+		if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			throw std::runtime_error("Couldn't initialize deflate");
+		}
+
+		std::string output;
+		output.resize(deflateBound(&stream, input.size()));
+
+		stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+		stream.avail_in = uInt(input.size());
+		stream.next_out = reinterpret_cast<Bytef *>(output.data());
+		stream.avail_out = uInt(output.size());
+
+		const int status = deflate(&stream, Z_FINISH);
+		deflateEnd(&stream);
+
+		if (status != Z_STREAM_END) {
+			throw std::runtime_error("Couldn't deflate");
+		}
+
+		output.resize(stream.total_out);
+		return output;
+	}
+}
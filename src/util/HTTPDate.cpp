@@ -0,0 +1,80 @@
+#include <cstring>
+#include <string>
+
+#include "util/HTTPDate.h"
+
+namespace Algiz {
+	namespace {
+		constexpr size_t DATE_LENGTH = 29;
+
+		struct CachedDate {
+			time_t time = -1;
+			char text[DATE_LENGTH];
+		};
+
+		void writeTwoDigits(char *out, int value) {
+			out[0] = char('0' + value / 10);
+			out[1] = char('0' + value % 10);
+		}
+
+		void format(time_t time, char *out) {
+			static constexpr const char *days[] {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+			static constexpr const char *months[] {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+			tm parts;
+			gmtime_r(&time, &parts);
+			const int year = (parts.tm_year + 1900) % 10000;
+
+			std::memcpy(out, days[parts.tm_wday], 3);
+			std::memcpy(out + 3, ", ", 2);
+			writeTwoDigits(out + 5, parts.tm_mday);
+			out[7] = ' ';
+			std::memcpy(out + 8, months[parts.tm_mon], 3);
+			out[11] = ' ';
+			writeTwoDigits(out + 12, year / 100);
+			writeTwoDigits(out + 14, year % 100);
+			out[16] = ' ';
+			writeTwoDigits(out + 17, parts.tm_hour);
+			out[19] = ':';
+			writeTwoDigits(out + 20, parts.tm_min);
+			out[22] = ':';
+			writeTwoDigits(out + 23, parts.tm_sec);
+			std::memcpy(out + 25, " GMT", 4);
+		}
+
+		std::string_view cachedFormat(CachedDate &cache, time_t time) {
+			if (cache.time != time) {
+				format(time, cache.text);
+				cache.time = time;
+			}
+			return {cache.text, DATE_LENGTH};
+		}
+	}
+
+	std::string_view formatHTTPDate(time_t time) {
+		thread_local CachedDate cache;
+		return cachedFormat(cache, time);
+	}
+
+	std::string_view getHTTPDate() {
+		thread_local CachedDate cache;
+		return cachedFormat(cache, time(nullptr));
+	}
+
+	std::optional<time_t> parseHTTPDate(std::string_view text) {
+		// IMF-fixdate, then the obsolete RFC 850 and asctime formats.
+		static constexpr const char *formats[] {"%a, %d %b %Y %H:%M:%S GMT", "%A, %d-%b-%y %H:%M:%S GMT", "%a %b %e %H:%M:%S %Y"};
+
+		const std::string string(text);
+
+		for (const char *format: formats) {
+			tm parts{};
+			const char *end = strptime(string.c_str(), format, &parts);
+			if (end != nullptr && *end == '\0') {
+				return timegm(&parts);
+			}
+		}
+
+		return std::nullopt;
+	}
+}
@@ -9,6 +9,17 @@ namespace Algiz {
 		return "application/octet-stream";
 	}
 
+	bool isCompressible(std::string_view mime) {
+		if (mime.starts_with("text/")) {
+			return true;
+		}
+
+		return mime == "application/json" || mime == "application/ld+json" || mime == "application/xml"
+		    || mime == "application/xhtml+xml" || mime == "application/typescript" || mime == "application/x-sh"
+		    || mime == "application/wasm" || mime == "image/svg+xml" || mime == "image/vnd.microsoft.icon"
+		    || mime == "application/vnd.ms-fontobject" || mime.ends_with("+xml");
+	}
+
 	std::map<std::string, std::string> mimeTypes {
 		{".aac", "audio/aac"},
 		{".abw", "application/x-abiword"},
@@ -0,0 +1,86 @@
+#include <cstring>
+
+#include "util/Mask.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define ALGIZ_MASK_AVX2
+#endif
+
+namespace Algiz {
+	namespace {
+		/** Handles whatever the vectorized loops left over, eight bytes at a time and then one at a time. */
+		void applyMaskScalar(char *data, size_t size, uint32_t key, size_t i) {
+			uint64_t wide_key;
+			std::memcpy(&wide_key, &key, sizeof(key));
+			std::memcpy(reinterpret_cast<char *>(&wide_key) + sizeof(key), &key, sizeof(key));
+
+			for (; i + 8 <= size; i += 8) {
+				uint64_t block;
+				std::memcpy(&block, data + i, sizeof(block));
+				block ^= wide_key;
+				std::memcpy(data + i, &block, sizeof(block));
+			}
+
+			const auto *key_bytes = reinterpret_cast<const uint8_t *>(&key);
+			for (; i < size; ++i) {
+				data[i] = char(uint8_t(data[i]) ^ key_bytes[i % 4]);
+			}
+		}
+
+#ifdef ALGIZ_MASK_AVX2
+		__attribute__((target("avx2")))
+		size_t applyMaskAVX2(char *data, size_t size, uint32_t key) {
+			const __m256i pattern = _mm256_set1_epi32(int(key));
+			size_t i = 0;
+			for (; i + 32 <= size; i += 32) {
+				auto *address = reinterpret_cast<__m256i *>(data + i);
+				_mm256_storeu_si256(address, _mm256_xor_si256(_mm256_loadu_si256(address), pattern));
+			}
+			return i;
+		}
+
+		const bool hasAVX2 = [] {
+			// This runs during static initialization, possibly before libgcc has detected the CPU's features itself.
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx2") != 0;
+		}();
+#endif
+	}
+
+	void applyMask(char *data, size_t size, uint32_t key, size_t offset) {
+		// Rotate the key so that its first byte lines up with data[0]. After that, every vector and word starts at a
+		// multiple of four bytes and can use the key as is.
+		if (offset % 4 != 0) {
+			uint8_t bytes[4];
+			uint8_t rotated[4];
+			std::memcpy(bytes, &key, sizeof(key));
+			for (size_t j = 0; j < 4; ++j) {
+				rotated[j] = bytes[(offset + j) % 4];
+			}
+			std::memcpy(&key, rotated, sizeof(key));
+		}
+
+		size_t i = 0;
+
+#ifdef ALGIZ_MASK_AVX2
+		if (hasAVX2) {
+			i = applyMaskAVX2(data, size, key);
+		}
+#endif
+
+#ifdef __SSE2__
+		const __m128i pattern = _mm_set1_epi32(int(key));
+		for (; i + 16 <= size; i += 16) {
+			auto *address = reinterpret_cast<__m128i *>(data + i);
+			_mm_storeu_si128(address, _mm_xor_si128(_mm_loadu_si128(address), pattern));
+		}
+#endif
+
+		applyMaskScalar(data, size, key, i);
+	}
+}
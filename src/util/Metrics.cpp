@@ -0,0 +1,213 @@
+#include "util/Metrics.h"
+
+#include <format>
+#include <stdexcept>
+
+namespace Algiz {
+	MetricsRegistry metrics;
+
+	namespace {
+		std::atomic_size_t nextShard{0};
+
+		/** The smallest and largest powers of two (in nanoseconds) that Prometheus histogram buckets are reported at. */
+		constexpr int MIN_EXPORTED_EXPONENT = 10;
+		constexpr int MAX_EXPORTED_EXPONENT = 36;
+
+		void appendEscaped(std::string &out, std::string_view text, bool escape_quotes) {
+			for (const char ch: text) {
+				if (ch == '\\') {
+					out += "\\\\";
+				} else if (ch == '\n') {
+					out += "\\n";
+				} else if (ch == '"' && escape_quotes) {
+					out += "\\\"";
+				} else {
+					out += ch;
+				}
+			}
+		}
+
+		/** Adds a label to rendered labels, which may be empty. */
+		std::string withLabel(const std::string &rendered, std::string_view name, std::string_view value) {
+			std::string out = rendered.empty()? "{" : rendered.substr(0, rendered.size() - 1) + ',';
+			out += name;
+			out += "=\"";
+			appendEscaped(out, value, true);
+			out += "\"}";
+			return out;
+		}
+	}
+
+	size_t getMetricShard() {
+		thread_local const size_t shard = nextShard.fetch_add(1, std::memory_order_relaxed) % METRIC_SHARDS;
+		return shard;
+	}
+
+	uint64_t Counter::get() const {
+		uint64_t total = 0;
+		for (const auto &shard: shards) {
+			total += shard.value.load(std::memory_order_relaxed);
+		}
+		return total;
+	}
+
+	Histogram::Histogram():
+		shards(std::make_unique<Shard[]>(METRIC_SHARDS)) {}
+
+	Histogram::Snapshot Histogram::snapshot() const {
+		Snapshot out;
+		for (size_t i = 0; i < METRIC_SHARDS; ++i) {
+			const Shard &shard = shards[i];
+			for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+				const uint64_t count = shard.counts[bucket].load(std::memory_order_relaxed);
+				out.counts[bucket] += count;
+				out.count += count;
+			}
+			out.sum += shard.sum.load(std::memory_order_relaxed);
+		}
+		return out;
+	}
+
+	uint64_t Histogram::Snapshot::getQuantile(double quantile) const {
+		if (count == 0) {
+			return 0;
+		}
+
+		const auto target = std::max<uint64_t>(1, uint64_t(quantile * double(count) + 0.5));
+		uint64_t seen = 0;
+		for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+			seen += counts[bucket];
+			if (target <= seen) {
+				return getUpperBound(bucket);
+			}
+		}
+
+		return getUpperBound(BUCKETS - 1);
+	}
+
+	uint64_t Histogram::Snapshot::countBelow(uint64_t bound) const {
+		uint64_t total = 0;
+		for (size_t bucket = 0; bucket < BUCKETS && getUpperBound(bucket) <= bound; ++bucket) {
+			total += counts[bucket];
+		}
+		return total;
+	}
+
+	MetricsRegistry::Entry & MetricsRegistry::getEntry(const std::string &name, const std::string &help, Type type) {
+		auto [iter, inserted] = entries.try_emplace(name);
+		if (inserted) {
+			iter->second.help = help;
+			iter->second.type = type;
+		} else if (iter->second.type != type) {
+			throw std::invalid_argument("Metric " + name + " already exists with a different type");
+		}
+		return iter->second;
+	}
+
+	Counter & MetricsRegistry::counter(const std::string &name, const std::string &help, const Labels &labels) {
+		auto lock = lockEntries();
+		auto &slot = getEntry(name, help, Type::Counter).counters[renderLabels(labels)];
+		if (!slot.second) {
+			slot = {labels, std::make_unique<Counter>()};
+		}
+		return *slot.second;
+	}
+
+	Gauge & MetricsRegistry::gauge(const std::string &name, const std::string &help, const Labels &labels) {
+		auto lock = lockEntries();
+		auto &slot = getEntry(name, help, Type::Gauge).gauges[renderLabels(labels)];
+		if (!slot.second) {
+			slot = {labels, std::make_unique<Gauge>()};
+		}
+		return *slot.second;
+	}
+
+	Histogram & MetricsRegistry::histogram(const std::string &name, const std::string &help, const Labels &labels) {
+		auto lock = lockEntries();
+		auto &slot = getEntry(name, help, Type::Histogram).histograms[renderLabels(labels)];
+		if (!slot.second) {
+			slot = {labels, std::make_unique<Histogram>()};
+		}
+		return *slot.second;
+	}
+
+	std::vector<MetricsRegistry::Family> MetricsRegistry::collect() {
+		std::vector<Family> out;
+		auto lock = lockEntries();
+		out.reserve(entries.size());
+
+		for (const auto &[name, entry]: entries) {
+			Family &family = out.emplace_back(Family{name, entry.help, entry.type, {}});
+			for (const auto &[rendered, pair]: entry.counters) {
+				family.series.push_back({pair.first, double(pair.second->get()), nullptr});
+			}
+			for (const auto &[rendered, pair]: entry.gauges) {
+				family.series.push_back({pair.first, double(pair.second->get()), nullptr});
+			}
+			for (const auto &[rendered, pair]: entry.histograms) {
+				family.series.push_back({pair.first, 0, std::make_shared<Histogram::Snapshot>(pair.second->snapshot())});
+			}
+		}
+
+		return out;
+	}
+
+	std::string MetricsRegistry::renderPrometheus() {
+		std::string out;
+
+		for (const Family &family: collect()) {
+			out += "# HELP ";
+			out += family.name;
+			out += ' ';
+			appendEscaped(out, family.help, false);
+			out += "\n# TYPE ";
+			out += family.name;
+			switch (family.type) {
+				case Type::Counter:   out += " counter\n";   break;
+				case Type::Gauge:     out += " gauge\n";     break;
+				case Type::Histogram: out += " histogram\n"; break;
+			}
+
+			for (const Series &series: family.series) {
+				const std::string labels = renderLabels(series.labels);
+
+				if (!series.histogram) {
+					out += std::format("{}{} {}\n", family.name, labels, series.value);
+					continue;
+				}
+
+				const Histogram::Snapshot &snapshot = *series.histogram;
+				for (int exponent = MIN_EXPORTED_EXPONENT; exponent <= MAX_EXPORTED_EXPONENT; ++exponent) {
+					const uint64_t bound = uint64_t(1) << exponent;
+					out += std::format("{}_bucket{} {}\n", family.name, withLabel(labels, "le", std::format("{}", double(bound) / 1e9)), snapshot.countBelow(bound - 1));
+				}
+				out += std::format("{}_bucket{} {}\n", family.name, withLabel(labels, "le", "+Inf"), snapshot.count);
+				out += std::format("{}_sum{} {}\n", family.name, labels, double(snapshot.sum) / 1e9);
+				out += std::format("{}_count{} {}\n", family.name, labels, snapshot.count);
+			}
+		}
+
+		return out;
+	}
+
+	std::string MetricsRegistry::renderLabels(const Labels &labels) {
+		if (labels.empty()) {
+			return {};
+		}
+
+		std::string out = "{";
+		bool first = true;
+		for (const auto &[name, value]: labels) {
+			if (!first) {
+				out += ',';
+			}
+			first = false;
+			out += name;
+			out += "=\"";
+			appendEscaped(out, value, true);
+			out += '"';
+		}
+		out += '}';
+		return out;
+	}
+}
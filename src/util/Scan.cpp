@@ -0,0 +1,35 @@
+#include <cstring>
+
+#include "util/Scan.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace Algiz {
+	size_t findByte(std::string_view haystack, char needle, size_t start) {
+		const size_t size = haystack.size();
+		if (size <= start) {
+			return std::string_view::npos;
+		}
+
+		const char *data = haystack.data();
+		size_t i = start;
+
+#ifdef __SSE2__
+		const __m128i pattern = _mm_set1_epi8(needle);
+		for (; i + 16 <= size; i += 16) {
+			const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+			if (const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, pattern)); mask != 0) {
+				return i + __builtin_ctz(mask);
+			}
+		}
+#endif
+
+		if (const void *found = std::memchr(data + i, needle, size - i)) {
+			return static_cast<const char *>(found) - data;
+		}
+
+		return std::string_view::npos;
+	}
+}
@@ -0,0 +1,186 @@
+#include "util/TimingWheel.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace Algiz {
+	TimingWheel::Handle TimingWheel::schedule(uint64_t delay, Callback callback) {
+		if (delay == 0) {
+			delay = 1;
+		}
+
+		const uint64_t tick = delay < std::numeric_limits<uint64_t>::max() - now? now + delay : std::numeric_limits<uint64_t>::max();
+		return scheduleAt(tick, std::move(callback));
+	}
+
+	TimingWheel::Handle TimingWheel::scheduleAt(uint64_t tick, Callback callback) {
+		uint32_t index;
+		if (freeTimers.empty()) {
+			if (timers.size() == NONE) {
+				throw std::length_error("TimingWheel is full");
+			}
+			index = uint32_t(timers.size());
+			timers.emplace_back();
+		} else {
+			index = freeTimers.back();
+			freeTimers.pop_back();
+		}
+
+		Timer &timer = timers[index];
+		timer.deadline = now < tick? tick : now + 1;
+		timer.callback = std::move(callback);
+		// Generations are odd while a timer is scheduled and even otherwise, so a live handle is never empty.
+		++timer.generation;
+		link(index);
+		++count;
+		return {index, timer.generation};
+	}
+
+	bool TimingWheel::cancel(Handle handle) {
+		if (!isPending(handle)) {
+			return false;
+		}
+
+		unlink(handle.index);
+		release(handle.index);
+		return true;
+	}
+
+	bool TimingWheel::isPending(Handle handle) const {
+		return handle.generation != 0 && handle.index < timers.size() && timers[handle.index].generation == handle.generation;
+	}
+
+	void TimingWheel::advance(uint64_t ticks, std::vector<Callback> &expired) {
+		advanceTo(ticks < std::numeric_limits<uint64_t>::max() - now? now + ticks : std::numeric_limits<uint64_t>::max(), expired);
+	}
+
+	void TimingWheel::advanceTo(uint64_t target, std::vector<Callback> &expired) {
+		while (now < target) {
+			// Every slot before the next expiry is empty, so there's no need to visit each one on the way.
+			const uint64_t next = nextExpiry();
+			if (target < next) {
+				now = target;
+				return;
+			}
+			now = next - 1;
+			tick(expired);
+		}
+	}
+
+	uint64_t TimingWheel::nextExpiry() const {
+		if (count == 0) {
+			return std::numeric_limits<uint64_t>::max();
+		}
+
+		uint64_t out = std::numeric_limits<uint64_t>::max();
+
+		for (int level = 0; level < LEVELS; ++level) {
+			const int shift = SLOT_BITS * level;
+			const uint64_t position = now >> shift;
+
+			for (uint64_t offset = 1; offset <= SLOTS; ++offset) {
+				if (slots[level * SLOTS + ((position + offset) & (SLOTS - 1))] != NONE) {
+					// Timers in an outer wheel can't come due before their slot cascades, which happens when the wheel
+					// reaches the start of the slot's span.
+					out = std::min(out, (position + offset) << shift);
+					break;
+				}
+			}
+		}
+
+		return out;
+	}
+
+	void TimingWheel::link(uint32_t index) {
+		Timer &timer = timers[index];
+		const uint64_t delta = timer.deadline - now;
+
+		int level = 0;
+		while (level < LEVELS - 1 && (uint64_t(1) << (SLOT_BITS * (level + 1))) <= delta) {
+			++level;
+		}
+
+		uint64_t deadline = timer.deadline;
+		if ((uint64_t(1) << (SLOT_BITS * LEVELS)) <= delta) {
+			// Too far out for the outermost wheel. Park the timer in the last slot the wheel will reach before wrapping
+			// around; it'll be placed again when that slot cascades.
+			deadline = now + (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+		}
+
+		const uint32_t slot = uint32_t(level * SLOTS + ((deadline >> (SLOT_BITS * level)) & (SLOTS - 1)));
+		timer.slot = slot;
+		timer.previous = NONE;
+		timer.next = slots[slot];
+		if (timer.next != NONE) {
+			timers[timer.next].previous = index;
+		}
+		slots[slot] = index;
+	}
+
+	void TimingWheel::unlink(uint32_t index) {
+		Timer &timer = timers[index];
+
+		if (timer.previous != NONE) {
+			timers[timer.previous].next = timer.next;
+		} else {
+			slots[timer.slot] = timer.next;
+		}
+
+		if (timer.next != NONE) {
+			timers[timer.next].previous = timer.previous;
+		}
+
+		timer.previous = timer.next = timer.slot = NONE;
+	}
+
+	void TimingWheel::release(uint32_t index) {
+		Timer &timer = timers[index];
+		timer.callback = nullptr;
+		++timer.generation;
+		freeTimers.push_back(index);
+		--count;
+	}
+
+	void TimingWheel::cascade(int level) {
+		const uint32_t slot = uint32_t(level * SLOTS + ((now >> (SLOT_BITS * level)) & (SLOTS - 1)));
+		uint32_t index = slots[slot];
+		slots[slot] = NONE;
+
+		while (index != NONE) {
+			const uint32_t next = timers[index].next;
+			link(index);
+			index = next;
+		}
+	}
+
+	void TimingWheel::tick(std::vector<Callback> &expired) {
+		++now;
+
+		// Cascade from the outside in so that timers coming down from an outer wheel can keep falling through the inner
+		// ones in the same tick.
+		for (int level = LEVELS - 1; 0 < level; --level) {
+			if ((now & ((uint64_t(1) << (SLOT_BITS * level)) - 1)) == 0) {
+				cascade(level);
+			}
+		}
+
+		const uint32_t slot = uint32_t(now & (SLOTS - 1));
+		uint32_t index = slots[slot];
+		slots[slot] = NONE;
+
+		while (index != NONE) {
+			Timer &timer = timers[index];
+			const uint32_t next = timer.next;
+			if (now < timer.deadline) {
+				// Parked because its deadline was beyond the outermost wheel.
+				link(index);
+			} else {
+				timer.previous = timer.next = timer.slot = NONE;
+				expired.emplace_back(std::move(timer.callback));
+				release(index);
+			}
+			index = next;
+		}
+	}
+}